@@ -0,0 +1,130 @@
+#!/usr/bin/python
+#
+# notifysub.py:  Subscribe to a node's notification socket (-notifyport or
+# -notifysocket) and report event rates, dropped frames and latency.
+#
+# Copyright (c) 2017 The Neutron developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from __future__ import print_function
+import argparse
+import binascii
+import socket
+import struct
+import sys
+import time
+
+TOPICS = { 'hashblock' : 0x01, 'hashtx' : 0x02, 'rawblock' : 0x04, 'rawtx' : 0x08, 'wallettx' : 0x10 }
+TOPIC_NAMES = dict((v, k) for k, v in TOPICS.items())
+HEADER = struct.Struct('<IBQq')
+
+def recv_exact(sock, n):
+	chunks = []
+	while n > 0:
+		chunk = sock.recv(min(n, 1 << 20))
+		if not chunk:
+			raise EOFError('node closed the connection')
+		chunks.append(chunk)
+		n -= len(chunk)
+	return b''.join(chunks)
+
+def read_frame(sock):
+	size, topic, sequence, published = HEADER.unpack(recv_exact(sock, HEADER.size))
+	payload = recv_exact(sock, size - (HEADER.size - 4))
+	return topic, sequence, published, payload
+
+def describe(topic, payload):
+	# Hashes go out in serialized order; RPC shows them reversed
+	if topic in (TOPICS['hashblock'], TOPICS['hashtx']):
+		return binascii.hexlify(payload[::-1]).decode('ascii')
+	if topic == TOPICS['wallettx']:
+		change = { 0 : 'new', 1 : 'updated' }.get(ord(payload[32:33]), '?')
+		return binascii.hexlify(payload[:32][::-1]).decode('ascii') + ' ' + change
+	return '%d bytes' % len(payload)
+
+class TopicStats:
+	def __init__(self):
+		self.frames = 0
+		self.bytes = 0
+		self.dropped = 0
+		self.last = None
+		self.latencies = []
+
+	def record(self, sequence, size, latency):
+		if self.last is not None and sequence > self.last + 1:
+			self.dropped += sequence - self.last - 1
+		self.last = sequence
+		self.frames += 1
+		self.bytes += size
+		self.latencies.append(latency)
+
+def percentile(values, p):
+	if not values:
+		return 0.0
+	return values[min(len(values) - 1, int(len(values) * p))]
+
+def report(stats, elapsed):
+	for topic in sorted(stats):
+		s = stats[topic]
+		latencies = sorted(s.latencies)
+		print("%-9s %7d frames %9.1f/s %10d bytes %5d dropped  latency us: p50 %.0f  p90 %.0f  p99 %.0f  max %.0f" %
+		      (TOPIC_NAMES.get(topic, topic), s.frames, s.frames / elapsed if elapsed > 0 else 0.0, s.bytes, s.dropped,
+		       percentile(latencies, 0.50), percentile(latencies, 0.90),
+		       percentile(latencies, 0.99), latencies[-1] if latencies else 0.0))
+	sys.stdout.flush()
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser(description='Subscribe to the notification socket of a local node.')
+	parser.add_argument('--port', type=int, default=0,
+			    help='TCP port the node was given with -notifyport')
+	parser.add_argument('--socket', default='',
+			    help='Unix socket path the node was given with -notifysocket')
+	parser.add_argument('--topics', default=','.join(sorted(TOPICS)),
+			    help='comma separated topics (default: all of %s)' % ','.join(sorted(TOPICS)))
+	parser.add_argument('--count', type=int, default=0,
+			    help='stop after this many frames (default: 0, run until interrupted)')
+	parser.add_argument('--interval', type=float, default=10.0,
+			    help='seconds between reports (default: 10)')
+	parser.add_argument('--verbose', '-v', action='store_true',
+			    help='print every frame')
+	args = parser.parse_args()
+
+	mask = 0
+	for name in args.topics.split(','):
+		if name not in TOPICS:
+			parser.error('unknown topic %s' % name)
+		mask |= TOPICS[name]
+
+	if args.socket:
+		sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		sock.connect(args.socket)
+	elif args.port:
+		sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+		sock.connect(('127.0.0.1', args.port))
+	else:
+		parser.error('give --port or --socket')
+	sock.sendall(struct.pack('B', mask))
+
+	stats = {}
+	start = time.time()
+	last_report = start
+	received = 0
+	try:
+		while args.count == 0 or received < args.count:
+			topic, sequence, published, payload = read_frame(sock)
+			latency = time.time() * 1e6 - published
+			stats.setdefault(topic, TopicStats()).record(sequence, len(payload), latency)
+			received += 1
+			if args.verbose:
+				print("%-9s #%d %s  %.0fus" % (TOPIC_NAMES.get(topic, topic), sequence, describe(topic, payload), latency))
+			now = time.time()
+			if now - last_report >= args.interval:
+				report(stats, now - start)
+				last_report = now
+	except (KeyboardInterrupt, EOFError) as e:
+		if isinstance(e, EOFError):
+			print(e)
+	report(stats, time.time() - start)
@@ -0,0 +1,142 @@
+#!/usr/bin/python
+#
+# rpcbench.py:  Fire concurrent JSON-RPC calls at a local node and report
+# throughput and latency.
+#
+# Copyright (c) 2014 The Bitcoin developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from __future__ import print_function
+import argparse
+import base64
+import json
+import sys
+import threading
+import time
+
+try:
+	import httplib
+except ImportError:
+	import http.client as httplib
+
+class RPCClient:
+	def __init__(self, host, port, username, password, keepalive):
+		authpair = ("%s:%s" % (username, password)).encode('utf-8')
+		self.authhdr = "Basic %s" % (base64.b64encode(authpair).decode('ascii'))
+		self.host = host
+		self.port = port
+		self.keepalive = keepalive
+		self.conn = None
+
+	def call(self, method, params, batch=0):
+		if self.conn is None:
+			self.conn = httplib.HTTPConnection(self.host, self.port, timeout=60)
+		if batch > 0:
+			body = json.dumps([{ 'version' : '1.1', 'method' : method,
+					     'params' : params, 'id' : i } for i in range(batch)])
+		else:
+			body = json.dumps({ 'version' : '1.1', 'method' : method,
+					    'params' : params, 'id' : 1 })
+		headers = { 'Authorization' : self.authhdr,
+			    'Content-type' : 'application/json' }
+		if not self.keepalive:
+			headers['Connection'] = 'close'
+		try:
+			self.conn.request('POST', '/', body, headers)
+			resp = self.conn.getresponse()
+			resp.read()
+			status = resp.status
+			if not self.keepalive or resp.getheader('connection', '') == 'close':
+				self.close()
+		except Exception:
+			self.close()
+			raise
+		return status
+
+	def close(self):
+		if self.conn is not None:
+			self.conn.close()
+			self.conn = None
+
+class Stats:
+	def __init__(self):
+		self.lock = threading.Lock()
+		self.latencies = []
+		self.statuses = {}
+		self.errors = 0
+
+	def record(self, status, latency):
+		with self.lock:
+			self.latencies.append(latency)
+			self.statuses[status] = self.statuses.get(status, 0) + 1
+
+	def error(self):
+		with self.lock:
+			self.errors += 1
+
+def worker(args, params, count, stats):
+	client = RPCClient(args.host, args.port, args.user, args.password,
+			   not args.no_keepalive)
+	for i in range(count):
+		start = time.time()
+		try:
+			status = client.call(args.method, params, args.batch)
+		except Exception as e:
+			stats.error()
+			continue
+		stats.record(status, time.time() - start)
+	client.close()
+
+def percentile(values, p):
+	if not values:
+		return 0.0
+	return values[min(len(values) - 1, int(len(values) * p))]
+
+if __name__ == '__main__':
+	parser = argparse.ArgumentParser(description='Load-test the JSON-RPC server of a local node.')
+	parser.add_argument('--host', default='127.0.0.1')
+	parser.add_argument('--port', type=int, default=32000)
+	parser.add_argument('--user', default='')
+	parser.add_argument('--password', default='')
+	parser.add_argument('--clients', type=int, default=32,
+			    help='concurrent client connections (default: 32)')
+	parser.add_argument('--requests', type=int, default=100,
+			    help='calls made by each client (default: 100)')
+	parser.add_argument('--method', default='getblockcount')
+	parser.add_argument('--params', default='[]',
+			    help='JSON array of call parameters (default: [])')
+	parser.add_argument('--no-keepalive', action='store_true',
+			    help='open a new connection for every call')
+	parser.add_argument('--batch', type=int, default=0,
+			    help='send each call as a batch of this many copies (default: 0, no batching)')
+	args = parser.parse_args()
+
+	params = json.loads(args.params)
+	stats = Stats()
+	threads = [threading.Thread(target=worker, args=(args, params, args.requests, stats))
+		   for i in range(args.clients)]
+
+	start = time.time()
+	for t in threads:
+		t.start()
+	for t in threads:
+		t.join()
+	elapsed = time.time() - start
+
+	latencies = sorted(stats.latencies)
+	completed = len(latencies)
+	print("%d calls to %s from %d clients in %.2fs: %.1f calls/s" %
+	      (completed + stats.errors, args.method, args.clients, elapsed,
+	       completed / elapsed if elapsed > 0 else 0.0))
+	if args.batch > 0:
+		print("  batches of %d: %.1f batched calls/s" %
+		      (args.batch, completed * args.batch / elapsed if elapsed > 0 else 0.0))
+	for status in sorted(stats.statuses):
+		print("  HTTP %d: %d" % (status, stats.statuses[status]))
+	if stats.errors:
+		print("  connection errors: %d" % stats.errors)
+	print("latency ms: p50 %.2f  p90 %.2f  p99 %.2f  max %.2f" %
+	      (1000 * percentile(latencies, 0.50), 1000 * percentile(latencies, 0.90),
+	       1000 * percentile(latencies, 0.99), 1000 * (latencies[-1] if latencies else 0.0)))
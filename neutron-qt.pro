@@ -175,6 +175,8 @@ HEADERS += src/activemasternode.h \
     src/base58.h \
     src/bignum.h \
     src/bitcoinrpc.h \
+    src/blockencodings.h \
+    src/bloom.h \
     src/chainparams.h \
     src/checkpoints.h \
     src/clientversion.h \
@@ -184,11 +186,14 @@ HEADERS += src/activemasternode.h \
     src/darksend.h \
     src/db.h \
     src/init.h \
+    src/jsonwriter.h \
+    src/notifysocket.h \
     src/kernel.h \
     src/key.h \
     src/keystore.h \
     src/main.h \
     src/masternode.h \
+    src/merkleblock.h \
     src/miner.h \
     src/mruset.h \
     src/net.h \
@@ -199,6 +204,7 @@ HEADERS += src/activemasternode.h \
     src/protocol.h \
     src/random.h \
     src/scheduler.h \
+    src/prevector.h \
     src/script.h \
     src/scrypt.h \
     src/serialize.h \
@@ -277,6 +283,8 @@ SOURCES += src/activemasternode.cpp \
     src/addrman.cpp \
     src/alert.cpp \
     src/bitcoinrpc.cpp \
+    src/blockencodings.cpp \
+    src/bloom.cpp \
     src/chainparams.cpp \
     src/checkpoints.cpp \
     src/clientversion.cpp \
@@ -284,12 +292,15 @@ SOURCES += src/activemasternode.cpp \
     src/darksend.cpp \
     src/db.cpp \
     src/init.cpp \
+    src/jsonwriter.cpp \
+    src/notifysocket.cpp \
     src/kernel.cpp \
     src/key.cpp \
     src/keystore.cpp \
     src/main.cpp \
     src/masternode.cpp \
     src/masternodeconfig.cpp \
+    src/merkleblock.cpp \
     src/miner.cpp \
     src/net.cpp \
     src/netaddress.cpp \
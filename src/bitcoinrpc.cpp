@@ -24,6 +24,11 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/array.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
 #include <list>
 #include <unordered_map>
 
@@ -41,7 +46,14 @@ static std::string strRPCUserColonPass;
 
 const json_spirit::Object emptyobj;
 
-void ThreadRPCServer3(void* parg);
+class CRPCConnection;
+static void ExecuteRPCRequest(boost::shared_ptr<CRPCConnection> conn, const CHTTPRequest& req, int64_t nTimeQueued);
+static CRPCWorkQueue* pRPCWorkQueue = NULL;
+static int nRPCServerTimeout = DEFAULT_RPC_SERVER_TIMEOUT;
+static int nRPCMaxConnections = DEFAULT_RPC_MAX_CONNECTIONS;
+//! Seconds to wait at shutdown for replies already posted to be written
+static const int RPC_SHUTDOWN_DRAIN_TIMEOUT = 5;
+static int nRPCBatchParallel = DEFAULT_RPC_BATCH_PARALLEL;
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -366,6 +378,35 @@ UniValue stop(const UniValue& params, bool fHelp)
 }
 
 
+UniValue getrpcstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getrpcstats [reset]\n"
+            "Returns, for each command called so far, how often it ran, how long it took\n"
+            "and how long it waited for the chain and wallet locks (times in ms).\n"
+            "<reset> is true to clear the counters after reading them.");
+
+    std::map<std::string, CRPCCommandStats> mapStats = tableRPC.GetStats(params.size() > 0 && params[0].get_bool());
+
+    UniValue ret(UniValue::VOBJ);
+    for (std::map<std::string, CRPCCommandStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CRPCCommandStats& stats = it->second;
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("calls", stats.nCalls));
+        obj.push_back(Pair("locked", stats.nLockedCalls));
+        obj.push_back(Pair("contended", stats.nContended));
+        obj.push_back(Pair("lockwait", stats.nLockWaitMicros / 1000.0));
+        obj.push_back(Pair("maxlockwait", stats.nMaxLockWaitMicros / 1000.0));
+        obj.push_back(Pair("run", stats.nRunMicros / 1000.0));
+        obj.push_back(Pair("avgrun", stats.nCalls ? stats.nRunMicros / 1000.0 / stats.nCalls : 0.0));
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
+
+
 
 //
 // Call Table
@@ -373,112 +414,116 @@ UniValue stop(const UniValue& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      actor (function)         okSafeMode  unlocked
-  //  ------------------------  -----------------------  ----------  --------
+{ //  name                      actor (function)         okSafeMode  unlocked  streamer
+  //  ------------------------  -----------------------  ----------  --------  --------
     /* Overall control/query calls */
-    { "getinfo",                &getinfo,                true,       false },
-    { "help",                   &help,                   true,       true },
-    { "stop",                   &stop,                   true,       true },
+    { "getinfo",                &getinfo,                true,       false,    NULL },
+    { "help",                   &help,                   true,       true,     NULL },
+    { "stop",                   &stop,                   true,       true,     NULL },
+    { "getrpcstats",            &getrpcstats,            true,       true,     NULL },
 
     /* P2P networking */
-    { "addnode",                &addnode,                true,       false },
-    { "disconnectnode",         &disconnectnode,         true,       false },
-    { "getconnectioncount",     &getconnectioncount,     true,       false },
-    { "getpeerinfo",            &getpeerinfo,            true,       false },
-    { "setban",                 &setban,                 true,       false },
-    { "listbanned",             &listbanned,             true,       false },
-    { "clearbanned",            &clearbanned,            true,       false },
+    { "addnode",                &addnode,                true,       false,    NULL },
+    { "disconnectnode",         &disconnectnode,         true,       false,    NULL },
+    { "getconnectioncount",     &getconnectioncount,     true,       false,    NULL },
+    { "getpeerinfo",            &getpeerinfo,            true,       false,    NULL },
+    { "getnettotals",           &getnettotals,           true,       false,    NULL },
+    { "setban",                 &setban,                 true,       false,    NULL },
+    { "listbanned",             &listbanned,             true,       false,    NULL },
+    { "clearbanned",            &clearbanned,            true,       false,    NULL },
 
     /* Block chain and UTXO */
-    { "getbestblockhash",       &getbestblockhash,       true,       false },
-    { "getblockcount",          &getblockcount,          true,       false },
-    { "getblock",               &getblock,               true,       false },
-    { "getblockhash",           &getblockhash,           true,       false },
-    { "getdifficulty",          &getdifficulty,          true,       false },
-    { "getrawmempool",          &getrawmempool,          true,       false },
+    { "getbestblockhash",       &getbestblockhash,       true,       true,     NULL },
+    { "getblockcount",          &getblockcount,          true,       true,     NULL },
+    { "getblock",               &getblock,               true,       true,     &StreamBlock },
+    { "getblockhash",           &getblockhash,           true,       true,     NULL },
+    { "getdifficulty",          &getdifficulty,          true,       true,     NULL },
+    { "getrawmempool",          &getrawmempool,          true,       true,     &StreamRawMempool },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,       false },
-    { "getmininginfo",          &getmininginfo,          true,       false },
-    { "getstakinginfo",         &getstakinginfo,         true,       false },
-    { "submitblock",            &submitblock,            false,      false },
-    { "reservebalance",         &reservebalance,         false,      true },
+    { "getblocktemplate",       &getblocktemplate,       true,       false,    NULL },
+    { "getmininginfo",          &getmininginfo,          true,       false,    NULL },
+    { "getstakinginfo",         &getstakinginfo,         true,       true,     NULL },
+    { "submitblock",            &submitblock,            false,      false,    NULL },
+    { "reservebalance",         &reservebalance,         false,      true,     NULL },
 
     /* Coin generation */
-    { "setgenerate",            &setgenerate,            true,       false },
+    { "setgenerate",            &setgenerate,            true,       false,    NULL },
 
     /* Raw transactions */
-    { "createrawtransaction",   &createrawtransaction,   false,      false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,      false },
-    { "decodescript",           &decodescript,           false,      false },
-    { "getrawtransaction",      &getrawtransaction,      false,      false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,      false },
-    { "signrawtransaction",     &signrawtransaction,     false,      false },
+    { "createrawtransaction",   &createrawtransaction,   false,      false,    NULL },
+    { "decoderawtransaction",   &decoderawtransaction,   false,      true,     NULL },
+    { "decodescript",           &decodescript,           false,      true,     NULL },
+    { "getrawtransaction",      &getrawtransaction,      false,      true,     NULL },
+    { "sendrawtransaction",     &sendrawtransaction,     false,      false,    NULL },
+    { "signrawtransaction",     &signrawtransaction,     false,      false,    NULL },
 
     /* Address index */
-    // none yet
+    { "getaddressutxos",        &getaddressutxos,        true,       true,     NULL },
+    { "getaddressbalance",      &getaddressbalance,      true,       true,     NULL },
+    { "getaddresstxids",        &getaddresstxids,        true,       true,     NULL },
 
     /* Utility functions */
-    { "validateaddress",        &validateaddress,        true,       false },
-    { "verifymessage",          &verifymessage,          true,       false },
+    { "validateaddress",        &validateaddress,        true,       false,    NULL },
+    { "verifymessage",          &verifymessage,          true,       false,    NULL },
 
     /* Neutron features */
     // TODO: NTRN - Add masternodelist
-    { "masternode",             &masternode,             true,       true },
-    { "spork",                  &spork,                  true,       false },
-    { "getminingreport",         &getminingreport,       false,      false},
+    { "masternode",             &masternode,             true,       true,     NULL },
+    { "spork",                  &spork,                  true,       false,    NULL },
+    { "getminingreport",        &getminingreport,        false,      false,    NULL },
 
     /* Wallet */
-    { "addmultisigaddress",     &addmultisigaddress,     false,      false },
-    { "backupwallet",           &backupwallet,           true,       false },
-    { "dumpprivkey",            &dumpprivkey,            false,      false },
-    { "dumpwallet",             &dumpwallet,             true,       false },
-    { "encryptwallet",          &encryptwallet,          false,      false },
-    { "getaccountaddress",      &getaccountaddress,      true,       false },
-    { "getaccount",             &getaccount,             false,      false },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,       false },
-    { "getbalance",             &getbalance,             false,      false },
-    { "getnewaddress",          &getnewaddress,          true,       false },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,      false },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,      false },
-    { "gettransaction",         &gettransaction,         false,      false },
-    { "importprivkey",          &importprivkey,          false,      false },
-    { "importwallet",           &importwallet,           false,      false },
-    { "keypoolrefill",          &keypoolrefill,          true,       false },
-    { "listaccounts",           &listaccounts,           false,      false },
-    { "listaddressgroupings",   &listaddressgroupings,   false,      false },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,      false },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,      false },
-    { "listsinceblock",         &listsinceblock,         false,      false },
-    { "listtransactions",       &listtransactions,       false,      false },
-    { "listunspent",            &listunspent,            false,      false },
-    { "move",                   &movecmd,                false,      false },
-    { "sendfrom",               &sendfrom,               false,      false },
-    { "sendmany",               &sendmany,               false,      false },
-    { "sendtoaddress",          &sendtoaddress,          false,      false },
-    { "setaccount",             &setaccount,             true,       false },
-    { "settxfee",               &settxfee,               false,      false },
-    { "signmessage",            &signmessage,            false,      false },
-    { "walletlock",             &walletlock,             true,       false },
-    { "walletpassphrasechange", &walletpassphrasechange, false,      false },
-    { "walletpassphrase",       &walletpassphrase,       true,       false },
+    { "addmultisigaddress",     &addmultisigaddress,     false,      false,    NULL },
+    { "backupwallet",           &backupwallet,           true,       false,    NULL },
+    { "dumpprivkey",            &dumpprivkey,            false,      false,    NULL },
+    { "dumpwallet",             &dumpwallet,             true,       false,    NULL },
+    { "encryptwallet",          &encryptwallet,          false,      false,    NULL },
+    { "getaccountaddress",      &getaccountaddress,      true,       false,    NULL },
+    { "getaccount",             &getaccount,             false,      false,    NULL },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,       false,    NULL },
+    { "getbalance",             &getbalance,             false,      false,    NULL },
+    { "getnewaddress",          &getnewaddress,          true,       false,    NULL },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,      false,    NULL },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,      false,    NULL },
+    { "gettransaction",         &gettransaction,         false,      false,    NULL },
+    { "importprivkey",          &importprivkey,          false,      false,    NULL },
+    { "importwallet",           &importwallet,           false,      false,    NULL },
+    { "keypoolrefill",          &keypoolrefill,          true,       false,    NULL },
+    { "listaccounts",           &listaccounts,           false,      false,    NULL },
+    { "listaddressgroupings",   &listaddressgroupings,   false,      false,    &StreamAddressGroupings },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,      false,    NULL },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,      false,    NULL },
+    { "listsinceblock",         &listsinceblock,         false,      false,    NULL },
+    { "listtransactions",       &listtransactions,       false,      false,    &StreamListTransactions },
+    { "listunspent",            &listunspent,            false,      false,    &StreamListUnspent },
+    { "move",                   &movecmd,                false,      false,    NULL },
+    { "sendfrom",               &sendfrom,               false,      false,    NULL },
+    { "sendmany",               &sendmany,               false,      false,    NULL },
+    { "sendtoaddress",          &sendtoaddress,          false,      false,    NULL },
+    { "setaccount",             &setaccount,             true,       false,    NULL },
+    { "settxfee",               &settxfee,               false,      false,    NULL },
+    { "signmessage",            &signmessage,            false,      false,    NULL },
+    { "walletlock",             &walletlock,             true,       false,    NULL },
+    { "walletpassphrasechange", &walletpassphrasechange, false,      false,    NULL },
+    { "walletpassphrase",       &walletpassphrase,       true,       false,    NULL },
 
     // TODO: NTRN - still need to categorize
-    { "addredeemscript",        &addredeemscript,        false,      false },
-    { "checkwallet",            &checkwallet,            false,      true },
-    { "getblockbynumber",       &getblockbynumber,       false,      false },
-    { "getblockversionstats",   &getblockversionstats,   true,       false },
-    { "getcheckpoint",          &getcheckpoint,          true,       false },
-    { "gethashespersec",        &gethashespersec,        true,       false },
-    { "getnewpubkey",           &getnewpubkey,           true,       false },
-    { "getsubsidy",             &getsubsidy,             true,       false },
-    { "getwork",                &getwork,                true,       false },
-    { "getworkex",              &getworkex,              true,       false },
-    { "makekeypair",            &makekeypair,            false,      true },
-    { "repairwallet",           &repairwallet,           false,      true },
-    { "resendtx",               &resendtx,               false,      true },
-    { "sendalert",              &sendalert,              false,      false },
-    { "validatepubkey",         &validatepubkey,         true,       false },
+    { "addredeemscript",        &addredeemscript,        false,      false,    NULL },
+    { "checkwallet",            &checkwallet,            false,      true,     NULL },
+    { "getblockbynumber",       &getblockbynumber,       false,      true,     NULL },
+    { "getblockversionstats",   &getblockversionstats,   true,       false,    NULL },
+    { "getcheckpoint",          &getcheckpoint,          true,       false,    NULL },
+    { "gethashespersec",        &gethashespersec,        true,       false,    NULL },
+    { "getnewpubkey",           &getnewpubkey,           true,       false,    NULL },
+    { "getsubsidy",             &getsubsidy,             true,       false,    NULL },
+    { "getwork",                &getwork,                true,       false,    NULL },
+    { "getworkex",              &getworkex,              true,       false,    NULL },
+    { "makekeypair",            &makekeypair,            false,      true,     NULL },
+    { "repairwallet",           &repairwallet,           false,      true,     NULL },
+    { "resendtx",               &resendtx,               false,      true,     NULL },
+    { "sendalert",              &sendalert,              false,      false,    NULL },
+    { "validatepubkey",         &validatepubkey,         true,       false,    NULL },
 };
 
 CRPCTable::CRPCTable()
@@ -563,6 +608,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -582,6 +628,27 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         strMsg.c_str());
 }
 
+// Head of a reply whose body follows in chunks (RFC 7230 4.1)
+static string HTTPChunkedReplyHeader(bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 200 OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: application/json\r\n"
+            "Server: Neutron-json-rpc/%s\r\n"
+            "\r\n",
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        FormatFullVersion().c_str());
+}
+
+static string HTTPChunk(const string& strData)
+{
+    return strprintf("%x\r\n", strData.size()) + strData + "\r\n";
+}
+
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
 {
     string str;
@@ -637,7 +704,27 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (boost::iequals(mapHeadersRet["transfer-encoding"], "chunked"))
+    {
+        while (true)
+        {
+            string str;
+            std::getline(stream, str);
+            unsigned long nChunk = strtoul(str.c_str(), NULL, 16);
+            if (!stream || nChunk > MAX_SIZE || strMessageRet.size() + nChunk > MAX_SIZE)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            if (nChunk == 0)
+                break;
+            vector<char> vch(nChunk);
+            stream.read(&vch[0], nChunk);
+            strMessageRet.append(vch.begin(), vch.end());
+            std::getline(stream, str);  // the chunk's CRLF
+        }
+        // Trailers, if any
+        map<string, string> mapTrailers;
+        ReadHTTPHeader(stream, mapTrailers);
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -657,6 +744,74 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
     return nStatus;
 }
 
+int ParseHTTPRequest(std::string& strBuf, CHTTPRequest& req)
+{
+    // The head ends at the first empty line; clients may omit the \r
+    size_t nHeadEnd = strBuf.find("\r\n\r\n");
+    size_t nBodyStart = nHeadEnd == string::npos ? string::npos : nHeadEnd + 4;
+    size_t nBareEnd = strBuf.find("\n\n");
+    if (nBareEnd != string::npos && (nHeadEnd == string::npos || nBareEnd < nHeadEnd))
+    {
+        nHeadEnd = nBareEnd;
+        nBodyStart = nBareEnd + 2;
+    }
+    if (nHeadEnd == string::npos)
+        return strBuf.size() > MAX_RPC_HEADERS_SIZE ? HTTP_BAD_REQUEST : 0;
+    if (nHeadEnd > MAX_RPC_HEADERS_SIZE)
+        return HTTP_BAD_REQUEST;
+
+    vector<string> vLines;
+    string strHead = strBuf.substr(0, nHeadEnd);
+    boost::split(vLines, strHead, boost::is_any_of("\n"));
+
+    // Request line: method, URI and protocol version
+    vector<string> vWords;
+    boost::split(vWords, vLines[0], boost::is_any_of(" "));
+    if (vWords.size() < 2)
+        return HTTP_BAD_REQUEST;
+    int nProto = 0;
+    const char *ver = strstr(vLines[0].c_str(), "HTTP/1.");
+    if (ver != NULL)
+        nProto = atoi(ver+7);
+
+    map<string, string> mapHeaders;
+    int nLen = 0;
+    for (unsigned int i = 1; i < vLines.size(); i++)
+    {
+        const string& str = vLines[i];
+        string::size_type nColon = str.find(":");
+        if (nColon != string::npos)
+        {
+            string strHeader = str.substr(0, nColon);
+            boost::trim(strHeader);
+            boost::to_lower(strHeader);
+            string strValue = str.substr(nColon+1);
+            boost::trim(strValue);
+            mapHeaders[strHeader] = strValue;
+            if (strHeader == "content-length")
+                nLen = atoi(strValue.c_str());
+        }
+    }
+    if (nLen < 0 || nLen > (int)MAX_SIZE)
+        return HTTP_BAD_REQUEST;
+    if (strBuf.size() < nBodyStart + nLen)
+        return 0;
+
+    string sConHdr = mapHeaders["connection"];
+    if (sConHdr == "close")
+        req.fKeepAlive = false;
+    else if (sConHdr == "keep-alive")
+        req.fKeepAlive = true;
+    else
+        req.fKeepAlive = nProto >= 1;
+
+    req.nProto = nProto;
+    req.mapHeaders.swap(mapHeaders);
+    req.strBody = strBuf.substr(nBodyStart, nLen);
+    strBuf.erase(0, nBodyStart + nLen);
+    return HTTP_OK;
+}
+
 bool HTTPAuthorized(map<string, string>& mapHeaders)
 {
     string strAuth = mapHeaders["authorization"];
@@ -667,7 +822,7 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void JSONErrorReply(std::ostream& stream, const UniValue& objError, const UniValue& id)
+static string JSONErrorReply(const UniValue& objError, const UniValue& id)
 {
     // Send error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
@@ -675,7 +830,7 @@ void JSONErrorReply(std::ostream& stream, const UniValue& objError, const UniVal
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(NullUniValue, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, false);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -754,51 +909,276 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
+/**
+ * One RPC client connection, driven by the RPC thread's io_service. Requests
+ * are read without blocking and handed to the worker pool; the reply is
+ * written back from the io_service, after which a keep-alive connection
+ * waits for its next request. A client that takes longer than
+ * -rpcservertimeout to send a request is dropped; the timer runs from the
+ * first byte awaited to the last, however the request is split.
+ */
+class CRPCConnection : public boost::enable_shared_from_this<CRPCConnection>
 {
 public:
-    virtual ~AcceptedConnection() {}
+    CRPCConnection(asio::io_service& io_serviceIn, ssl::context &context, bool fUseSSLIn) :
+        sslStream(io_serviceIn, context),
+        io_service(io_serviceIn),
+        timer(io_serviceIn),
+        fUseSSL(fUseSSLIn),
+        fTimerArmed(false),
+        fDraining(false),
+        fWriting(false),
+        fReplyDone(false),
+        fKeepAlive(false)
+    {
+    }
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
+    asio::ssl::stream<ip::tcp::socket> sslStream;
+    ip::tcp::endpoint peer;
 
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
-{
-public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
-        sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+    std::string PeerAddress() const
     {
+        return peer.address().to_string();
     }
 
-    virtual std::iostream& stream()
+    void Start()
     {
-        return _stream;
+        if (!fUseSSL)
+        {
+            Read();
+            return;
+        }
+        StartTimer();
+        sslStream.async_handshake(ssl::stream_base::server,
+                boost::bind(&CRPCConnection::HandleHandshake, shared_from_this(),
+                    boost::asio::placeholders::error));
     }
 
-    virtual std::string peer_address_to_string() const
+    // Queue part of a reply, written out in order; fLast ends the reply.
+    // Only called from the io_service
+    void Send(const std::string& strData, bool fLast, bool fKeepAliveIn)
     {
-        return peer.address().to_string();
+        if (!sslStream.lowest_layer().is_open())
+            return;
+        vSend.push_back(strData);
+        if (fLast)
+        {
+            fReplyDone = true;
+            fKeepAlive = fKeepAliveIn;
+        }
+        if (!fWriting)
+            WriteNext();
     }
 
-    virtual void close()
+    // Send a whole reply; only called from the io_service
+    void Reply(const std::string& strReplyIn, bool fKeepAliveIn)
     {
-        _stream.close();
+        Send(strReplyIn, true, fKeepAliveIn);
     }
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
+    // Send a reply, or part of one, from a worker thread
+    void PostSend(const std::string& strData, bool fLast, bool fKeepAliveIn)
+    {
+        io_service.post(
+                boost::bind(&CRPCConnection::Send, shared_from_this(), strData, fLast, fKeepAliveIn));
+    }
+
+    void PostReply(const std::string& strReplyIn, bool fKeepAliveIn)
+    {
+        PostSend(strReplyIn, true, fKeepAliveIn);
+    }
+
+    // Send a closing reply from a worker thread after nDelayMs, without
+    // holding the worker for the wait
+    void PostDelayedReply(const std::string& strReplyIn, int nDelayMs)
+    {
+        io_service.post(boost::bind(&CRPCConnection::DelayReply, shared_from_this(), strReplyIn, nDelayMs));
+    }
+
+    // Drop the connection from a worker thread, as when a reply already
+    // under way can't be finished
+    void PostClose()
+    {
+        io_service.post(boost::bind(&CRPCConnection::Close, shared_from_this()));
+    }
+
+    // At shutdown, once no worker will post anything more: finish writing
+    // what is queued, then close. Only called from the io_service
+    void Drain()
+    {
+        fDraining = true;
+        if (!fWriting && vSend.empty())
+            Close();
+    }
 
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    asio::io_service& io_service;
+    asio::deadline_timer timer;
+    bool fUseSSL;
+    bool fTimerArmed;
+    bool fDraining;
+    std::string strBuf;
+    boost::array<char, 4096> buf;
+    std::string strReply;               // being written
+    std::deque<std::string> vSend;      // waiting to be written
+    bool fWriting;
+    bool fReplyDone;
+    bool fKeepAlive;
+
+    void StartTimer()
+    {
+        fTimerArmed = true;
+        timer.expires_from_now(posix_time::seconds(nRPCServerTimeout));
+        timer.async_wait(boost::bind(&CRPCConnection::HandleTimeout, shared_from_this(),
+                boost::asio::placeholders::error));
+    }
+
+    void HandleTimeout(const boost::system::error_code& error)
+    {
+        // The timer may have been re-armed since this wait was queued
+        if (error == asio::error::operation_aborted || timer.expires_at() > asio::deadline_timer::traits_type::now())
+            return;
+        LogPrint("rpc", "ThreadRPCServer timeout waiting for request from %s\n", PeerAddress());
+        Close();
+    }
+
+    void StopTimer()
+    {
+        boost::system::error_code ec;
+        timer.cancel(ec);
+        fTimerArmed = false;
+    }
+
+    void DelayReply(const std::string& strReplyIn, int nDelayMs)
+    {
+        timer.expires_from_now(posix_time::milliseconds(nDelayMs));
+        timer.async_wait(boost::bind(&CRPCConnection::HandleDelayedReply, shared_from_this(), strReplyIn,
+                boost::asio::placeholders::error));
+    }
+
+    void HandleDelayedReply(const std::string& strReplyIn, const boost::system::error_code& error)
+    {
+        if (error == asio::error::operation_aborted)
+            return;
+        Reply(strReplyIn, false);
+    }
+
+    void HandleHandshake(const boost::system::error_code& error)
+    {
+        if (error)
+        {
+            Close();
+            return;
+        }
+        Read();
+    }
+
+    void Read()
+    {
+        // Armed once per request, so trickling it in doesn't extend the timeout
+        if (!fTimerArmed)
+            StartTimer();
+        if (fUseSSL)
+            sslStream.async_read_some(asio::buffer(buf),
+                    boost::bind(&CRPCConnection::HandleRead, shared_from_this(),
+                        boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        else
+            sslStream.next_layer().async_read_some(asio::buffer(buf),
+                    boost::bind(&CRPCConnection::HandleRead, shared_from_this(),
+                        boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    }
+
+    void HandleRead(const boost::system::error_code& error, size_t nBytes)
+    {
+        if (error)
+        {
+            Close();
+            return;
+        }
+        strBuf.append(buf.data(), nBytes);
+        ProcessBuffer();
+    }
+
+    // Dispatch the next complete request, or read until there is one
+    void ProcessBuffer()
+    {
+        CHTTPRequest req;
+        int nStatus = ParseHTTPRequest(strBuf, req);
+        if (nStatus == 0)
+        {
+            Read();
+            return;
+        }
+
+        StopTimer();
+        if (nStatus != HTTP_OK)
+        {
+            Reply(HTTPReply(nStatus, "", false), false);
+            return;
+        }
+        if (!pRPCWorkQueue->Enqueue(boost::bind(&ExecuteRPCRequest, shared_from_this(), req, GetTimeMicros())))
+        {
+            LogPrintf("ThreadRPCServer work queue depth exceeded, rejecting request from %s\n", PeerAddress());
+            Reply(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", req.fKeepAlive), req.fKeepAlive);
+        }
+    }
+
+    void WriteNext()
+    {
+        if (vSend.empty())
+        {
+            if (fReplyDone)
+            {
+                fReplyDone = false;
+                HandleReplyDone();
+            }
+            else if (fDraining)
+                Close();
+            return;
+        }
+
+        fWriting = true;
+        strReply.swap(vSend.front());
+        vSend.pop_front();
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(strReply),
+                    boost::bind(&CRPCConnection::HandleWrite, shared_from_this(),
+                        boost::asio::placeholders::error));
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(strReply),
+                    boost::bind(&CRPCConnection::HandleWrite, shared_from_this(),
+                        boost::asio::placeholders::error));
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        fWriting = false;
+        if (error)
+        {
+            vSend.clear();
+            Close();
+            return;
+        }
+        WriteNext();
+    }
+
+    void HandleReplyDone()
+    {
+        if (!fKeepAlive || fShutdown)
+        {
+            Close();
+            return;
+        }
+        // A pipelining client may already have sent its next request
+        ProcessBuffer();
+    }
+
+    void Close()
+    {
+        StopTimer();
+        boost::system::error_code ec;
+        sslStream.lowest_layer().close(ec);
+    }
 };
 
 void ThreadRPCServer(void* parg)
@@ -828,28 +1208,41 @@ void ThreadRPCServer(void* parg)
 }
 
 // Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error);
 
+// Open connections; only touched from the RPC thread
+static std::list<boost::weak_ptr<CRPCConnection> > lRPCConnections;
+
+static size_t CountRPCConnections()
+{
+    for (std::list<boost::weak_ptr<CRPCConnection> >::iterator it = lRPCConnections.begin(); it != lRPCConnections.end(); )
+    {
+        if (it->expired())
+            it = lRPCConnections.erase(it);
+        else
+            ++it;
+    }
+    return lRPCConnections.size();
+}
+
 /**
  * Sets up I/O resources to accept and handle a new connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                    ssl::context& context,
                    const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
+    boost::shared_ptr<CRPCConnection> conn(new CRPCConnection(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
             conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
+            boost::bind(&RPCAcceptHandler,
                 acceptor,
                 boost::ref(context),
                 fUseSSL,
@@ -860,47 +1253,68 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
 /**
  * Accept and handle incoming connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error)
 {
-    vnThreadsRunning[THREAD_RPCLISTENER]++;
-
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted
      && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
-
     // TODO: Actually handle errors
     if (error)
-    {
-        delete conn;
-    }
+        return;
 
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading the request, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn
-          && !ClientAllowed(tcp_conn->peer.address()))
+    if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
+            conn->Reply(HTTPReply(HTTP_FORBIDDEN, "", false), false);
+        return;
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        LogPrintf("Failed to create RPC server client thread\n");
-        delete conn;
+    if (CountRPCConnections() >= (size_t)nRPCMaxConnections)
+    {
+        LogPrint("rpc", "ThreadRPCServer too many connections, refusing %s\n", conn->PeerAddress());
+        if (!fUseSSL)
+            conn->Reply(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Too many connections", false), false);
+        return;
     }
 
-    vnThreadsRunning[THREAD_RPCLISTENER]--;
+    lRPCConnections.push_back(conn);
+    conn->Start();
+}
+
+static void HandleRPCDrainTimeout(bool* pfTimedOut, const boost::system::error_code& error)
+{
+    if (!error)
+        *pfTimedOut = true;
+}
+
+/**
+ * Wakes the RPC thread regularly, so it notices a shutdown while idle.
+ */
+static void RPCShutdownCheck(asio::deadline_timer* timer, const boost::system::error_code& error)
+{
+    if (error || fShutdown)
+        return;
+    timer->expires_from_now(posix_time::milliseconds(250));
+    timer->async_wait(boost::bind(&RPCShutdownCheck, timer, boost::asio::placeholders::error));
+}
+
+static void ThreadRPCWorker(CRPCWorkQueue* queue)
+{
+    RenameThread("Neutron-rpcwork");
+
+    CRPCWorkQueue::WorkItem work;
+    while (queue->Dequeue(work))
+        work();
 }
 
 void ThreadRPCServer2(void* parg)
@@ -1027,11 +1441,44 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    // Calls run on a fixed pool of workers; the io_service only moves bytes
+    nRPCServerTimeout = std::max((int)GetArg("-rpcservertimeout", DEFAULT_RPC_SERVER_TIMEOUT), 1);
+    nRPCMaxConnections = std::max((int)GetArg("-rpcmaxconnections", DEFAULT_RPC_MAX_CONNECTIONS), 1);
+    int nWorkQueue = std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORKQUEUE), 1);
+    int nThreads = std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    nRPCBatchParallel = std::max((int)GetArg("-rpcbatchparallel", DEFAULT_RPC_BATCH_PARALLEL), 1);
+    CRPCWorkQueue workQueue(nWorkQueue);
+    pRPCWorkQueue = &workQueue;
+    boost::thread_group workers;
+    for (int i = 0; i < nThreads; i++)
+        workers.create_thread(boost::bind(&ThreadRPCWorker, &workQueue));
+    LogPrintf("ThreadRPCServer using %d worker threads, work queue depth %d\n", nThreads, nWorkQueue);
+
+    asio::deadline_timer shutdownTimer(io_service);
+    RPCShutdownCheck(&shutdownTimer, boost::system::error_code());
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
     vnThreadsRunning[THREAD_RPCLISTENER]++;
     StopRequests();
+
+    workQueue.Interrupt();
+    workers.join_all();
+    pRPCWorkQueue = NULL;
+
+    // Replies the workers posted, such as the one to "stop", are still
+    // queued on the io_service; write them out before it goes away
+    for (std::list<boost::weak_ptr<CRPCConnection> >::iterator it = lRPCConnections.begin(); it != lRPCConnections.end(); ++it)
+        if (boost::shared_ptr<CRPCConnection> conn = it->lock())
+            io_service.post(boost::bind(&CRPCConnection::Drain, conn));
+    bool fDrainTimedOut = false;
+    asio::deadline_timer drainTimer(io_service);
+    drainTimer.expires_from_now(posix_time::seconds(RPC_SHUTDOWN_DRAIN_TIMEOUT));
+    drainTimer.async_wait(boost::bind(&HandleRPCDrainTimeout, &fDrainTimedOut, boost::asio::placeholders::error));
+    while (!fDrainTimedOut && CountRPCConnections() > 0)
+        io_service.run_one();
+    lRPCConnections.clear();
 }
 
 void JSONRPCRequest::parse(const UniValue& valRequest)
@@ -1088,11 +1535,126 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
-std::string JSONRPCExecBatch(const UniValue& vReq)
+// Batch elements that may run out of order with their neighbours: readers
+// that take what locks they need themselves and change nothing
+static bool IsBatchParallelSafe(const UniValue& req)
+{
+    static const char* const pszParallelSafe[] = {
+        "getbestblockhash", "getblockcount", "getblock", "getblockhash", "getblockbynumber",
+        "getdifficulty", "getrawmempool", "getrawtransaction", "decoderawtransaction", "decodescript",
+    };
+
+    if (!req.isObject())
+        return false;
+    const UniValue& valMethod = find_value(req.get_obj(), "method");
+    if (!valMethod.isStr())
+        return false;
+    for (unsigned int i = 0; i < sizeof(pszParallelSafe) / sizeof(pszParallelSafe[0]); i++)
+        if (valMethod.get_str() == pszParallelSafe[i])
+            return true;
+    return false;
+}
+
+/** A run of batch elements shared between the thread answering the batch
+ * and the helpers it queued. Each element is claimed by exactly one thread.
+ * The owner works through the run itself too, so helpers the pool never
+ * gets to cost nothing but a queue slot; it only waits for helpers that
+ * are still running an element. */
+class CRPCBatchRun
+{
+public:
+    std::vector<UniValue> vReq;
+    std::vector<UniValue> vRet;
+    std::atomic<unsigned int> nNext;
+
+    std::mutex cs;
+    std::condition_variable cond;
+    int nActive;
+
+    CRPCBatchRun() : nNext(0), nActive(0) {}
+
+    // Returns the number of elements this thread ran
+    unsigned int Run(bool fHelper)
+    {
+        if (fHelper)
+        {
+            std::unique_lock<std::mutex> lock(cs);
+            if (nNext >= vReq.size())
+                return 0;
+            nActive++;
+        }
+
+        unsigned int nRan = 0;
+        for (unsigned int i = nNext++; i < vReq.size(); i = nNext++, nRan++)
+            vRet[i] = JSONRPCExecOne(vReq[i]);
+
+        if (fHelper)
+        {
+            std::unique_lock<std::mutex> lock(cs);
+            nActive--;
+            cond.notify_all();
+        }
+        return nRan;
+    }
+
+    void WaitForHelpers()
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        while (nActive > 0)
+            cond.wait(lock);
+    }
+};
+
+static void RunBatchHelper(std::shared_ptr<CRPCBatchRun> run)
+{
+    run->Run(true);
+}
+
+std::string JSONRPCExecBatch(const UniValue& vReq, CRPCWorkQueue* pqueue, int nParallel)
 {
+    std::vector<UniValue> vRet(vReq.size());
+    unsigned int nRanParallel = 0;
+
+    // Elements that must keep their order run one at a time, as before, and
+    // split the batch into runs of parallel-safe elements between them
+    unsigned int nStart = 0;
+    while (nStart < vReq.size())
+    {
+        unsigned int nEnd = nStart;
+        if (pqueue && nParallel > 1)
+            while (nEnd < vReq.size() && IsBatchParallelSafe(vReq[nEnd]))
+                nEnd++;
+
+        if (nEnd - nStart < 2)
+        {
+            vRet[nStart] = JSONRPCExecOne(vReq[nStart]);
+            nStart++;
+            continue;
+        }
+
+        std::shared_ptr<CRPCBatchRun> run = std::make_shared<CRPCBatchRun>();
+        run->vReq.assign(vReq.getValues().begin() + nStart, vReq.getValues().begin() + nEnd);
+        run->vRet.resize(nEnd - nStart);
+
+        int nHelpers = std::min(nParallel - 1, (int)(nEnd - nStart) - 1);
+        for (int i = 0; i < nHelpers; i++)
+            if (!pqueue->Enqueue(boost::bind(&RunBatchHelper, run)))
+                break;
+        unsigned int nRanHere = run->Run(false);
+        run->WaitForHelpers();
+
+        for (unsigned int i = nStart; i < nEnd; i++)
+            vRet[i] = run->vRet[i - nStart];
+        nRanParallel += (nEnd - nStart) - nRanHere;
+        nStart = nEnd;
+    }
+
+    if (nRanParallel > 0)
+        LogPrint("rpc", "ThreadRPCServer batch of %u, %u run by helpers\n", vReq.size(), nRanParallel);
+
     UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    for (unsigned int i = 0; i < vRet.size(); i++)
+        ret.push_back(vRet[i]);
 
     return ret.write() + "\n";
 }
@@ -1141,107 +1703,180 @@ static inline JSONRPCRequest transformNamedArguments(const JSONRPCRequest& in, c
     return out;
 }
 
-void ThreadRPCServer3(void* parg)
+/**
+ * Reply to a command that has a streamer, sending the result as it is
+ * written once it outgrows one flush of the writer. The reply then goes
+ * out with chunked encoding, and fStreamed is set. A result that never got
+ * that big is returned instead, for an ordinary reply.
+ *
+ * Pieces are queued on the connection rather than waiting for the client
+ * to take them, since the command may be holding cs_main while it writes.
+ */
+static string StreamRPCReply(boost::shared_ptr<CRPCConnection> conn, const JSONRPCRequest& jreq, bool fKeepAlive, bool& fStreamed)
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("Neutron-rpchand");
+    CJSONWriter writer([&](const std::string& strData) {
+        if (!fStreamed)
+        {
+            conn->PostSend(HTTPChunkedReplyHeader(fKeepAlive), false, fKeepAlive);
+            fStreamed = true;
+        }
+        conn->PostSend(HTTPChunk(strData), false, fKeepAlive);
+    });
 
+    try
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        writer.BeginObject();
+        writer.Key("result");
+        tableRPC.execute(jreq, writer);
+        writer.Pair("error", NullUniValue);
+        writer.Pair("id", jreq.id);
+        writer.EndObject();
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
-
-    bool fRun = true;
-    while (true)
+    catch (...)
     {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
-        }
-        map<string, string> mapHeaders;
-        string strRequest;
+        // Until something is sent the error gets the usual reply; after,
+        // all that can be done is to leave the reply unfinished
+        if (!fStreamed)
+            throw;
+        LogPrintf("ThreadRPCServer %s failed after %u bytes of its reply to %s\n",
+                  SanitizeString(jreq.strMethod), writer.GetFlushedBytes(), conn->PeerAddress());
+        conn->PostClose();
+        return "";
+    }
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+    if (!fStreamed)
+        return writer.TakeBuffer() + "\n";
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+    LogPrint("rpc", "ThreadRPCServer streamed %u bytes to %s\n", writer.GetFlushedBytes(), conn->PeerAddress());
+    conn->PostSend(HTTPChunk(writer.TakeBuffer() + "\n") + HTTPChunk(""), true, fKeepAlive);
+    return "";
+}
+
+static void ExecuteRPCRequest(boost::shared_ptr<CRPCConnection> conn, const CHTTPRequest& req, int64_t nTimeQueued)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
 
+    bool fKeepAlive = req.fKeepAlive && !fShutdown;
+    map<string, string> mapHeaders = req.mapHeaders;
+    string strMethod;
+    string strReply;
+    bool fStreamed = false;
+    int nReplyDelayMs = 0;
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        strReply = HTTPReply(HTTP_UNAUTHORIZED, "", false);
+        fKeepAlive = false;
+    }
+    else if (!HTTPAuthorized(mapHeaders))
+    {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->PeerAddress().c_str());
+        strReply = HTTPReply(HTTP_UNAUTHORIZED, "", false);
+        fKeepAlive = false;
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            nReplyDelayMs = 250;
+    }
+    else
+    {
         JSONRPCRequest jreq;
         try
         {
             // Parse request
             UniValue valRequest;
-            if (!valRequest.read(strRequest))
+            if (!valRequest.read(req.strBody))
                 throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-            // // Set the URI
-            // jreq.URI = req->GetURI();
-
-            string strReply;
+            string strResult;
 
             // singleton request
             if (valRequest.isObject()) {
                 jreq.parse(valRequest);
+                strMethod = jreq.strMethod;
 
-                UniValue result = tableRPC.execute(jreq);
+                const CRPCCommand* pcmd = tableRPC[jreq.strMethod];
+                if (pcmd && pcmd->streamer && req.nProto >= 1)
+                    strResult = StreamRPCReply(conn, jreq, fKeepAlive, fStreamed);
+                else
+                {
+                    UniValue result = tableRPC.execute(jreq);
 
-                // Send reply
-                strReply = JSONRPCReply(result, NullUniValue, jreq.id);
+                    // Send reply
+                    strResult = JSONRPCReply(result, NullUniValue, jreq.id);
+                }
 
             // array of requests
-            } else if (valRequest.isArray())
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
+            } else if (valRequest.isArray()) {
+                strMethod = strprintf("batch of %u", valRequest.size());
+                strResult = JSONRPCExecBatch(valRequest.get_array(), pRPCWorkQueue, nRPCBatchParallel);
+            } else
                 throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+            strReply = HTTPReply(HTTP_OK, strResult, fKeepAlive);
         }
         catch (const UniValue& objError)
         {
-            JSONErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            strReply = JSONErrorReply(objError, jreq.id);
+            fKeepAlive = false;
         }
         catch (const std::exception& e)
         {
-            JSONErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            strReply = JSONErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+            fKeepAlive = false;
         }
     }
 
-    delete conn;
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
+
+    int64_t nTimeEnd = GetTimeMicros();
+    LogPrint("rpc", "ThreadRPCServer %s from %s: queued %.2fms, ran %.2fms\n",
+             strMethod.empty() ? "request" : SanitizeString(strMethod), conn->PeerAddress(),
+             0.001 * (nTimeStart - nTimeQueued), 0.001 * (nTimeEnd - nTimeStart));
+
+    // The delay is waited out on the io_service rather than in this worker
+    if (nReplyDelayMs > 0)
+        conn->PostDelayedReply(strReply, nReplyDelayMs);
+    else if (!fStreamed)
+        conn->PostReply(strReply, fKeepAlive);
 }
 
 UniValue CRPCTable::execute(const JSONRPCRequest &request) const
 // UniValue CRPCTable::execute(const std::string &method, const UniValue &params) const
+{
+    UniValue result;
+    Dispatch(request, [&](const CRPCCommand* pcmd) {
+        result = pcmd->actor(request.params, false);
+
+        // if (request.params.isObject()) {
+        //     return pcmd->actor(transformNamedArguments(request, pcmd->argNames).params, false);
+        // } else {
+        //     return pcmd->actor(request.params, false);
+        // }
+    });
+    return result;
+}
+
+void CRPCTable::execute(const JSONRPCRequest &request, CJSONWriter& writer) const
+{
+    Dispatch(request, [&](const CRPCCommand* pcmd) {
+        if (pcmd->streamer)
+            pcmd->streamer(request.params, writer);
+        else
+            writer.Value(pcmd->actor(request.params, false));
+    });
+}
+
+void CRPCTable::Dispatch(const JSONRPCRequest& request, const std::function<void(const CRPCCommand*)>& run) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[request.strMethod];
@@ -1254,26 +1889,32 @@ UniValue CRPCTable::execute(const JSONRPCRequest &request) const
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    int64_t nStart = GetTimeMicros();
     try
     {
         // Execute
         if (pcmd->unlocked)
-            return pcmd->actor(request.params, false);
-
-            // if (request.params.isObject()) {
-            //     return pcmd->actor(transformNamedArguments(request, pcmd->argNames).params, false);
-            // } else {
-            //     return pcmd->actor(request.params, false);
-            // }
+        {
+            run(pcmd);
+            RecordCall(pcmd->name, false, false, 0, GetTimeMicros() - nStart);
+        }
         else {
-            LOCK2(cs_main, pwalletMain->cs_wallet);
-            return pcmd->actor(request.params, false);
+            // Probe first, so that contention is counted apart from the
+            // time spent waiting
+            bool fContended = true;
+            {
+                TRY_LOCK(cs_main, lockMain);
+                if (lockMain)
+                {
+                    TRY_LOCK(pwalletMain->cs_wallet, lockWallet);
+                    fContended = !lockWallet;
+                }
+            }
 
-            // if (request.params.isObject()) {
-            //     return pcmd->actor(transformNamedArguments(request, pcmd->argNames).params, false);
-            // } else {
-            //     return pcmd->actor(request.params, false);
-            // }
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            int64_t nLocked = GetTimeMicros();
+            run(pcmd);
+            RecordCall(pcmd->name, true, fContended, nLocked - nStart, GetTimeMicros() - nLocked);
         }
     }
     catch (std::exception& e)
@@ -1282,6 +1923,31 @@ UniValue CRPCTable::execute(const JSONRPCRequest &request) const
     }
 }
 
+void CRPCTable::RecordCall(const std::string& strMethod, bool fLocked, bool fContended, int64_t nLockWaitMicros, int64_t nRunMicros) const
+{
+    LOCK(cs_stats);
+    CRPCCommandStats& stats = mapStats[strMethod];
+    stats.nCalls++;
+    stats.nRunMicros += nRunMicros;
+    if (fLocked)
+    {
+        stats.nLockedCalls++;
+        if (fContended)
+            stats.nContended++;
+        stats.nLockWaitMicros += nLockWaitMicros;
+        stats.nMaxLockWaitMicros = std::max(stats.nMaxLockWaitMicros, nLockWaitMicros);
+    }
+}
+
+std::map<std::string, CRPCCommandStats> CRPCTable::GetStats(bool fReset) const
+{
+    LOCK(cs_stats);
+    std::map<std::string, CRPCCommandStats> mapRet = mapStats;
+    if (fReset)
+        mapStats.clear();
+    return mapRet;
+}
+
 bool CRPCTable::appendCommand(const std::string& name, const CRPCCommand* pcmd)
 {
     if (IsRPCRunning())
@@ -1473,6 +2139,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "echojson", 9, "arg9" },
 
     { "stop", 0, "detach" },
+    { "getrpcstats", 0, "reset" },
     { "reservebalance", 0, "reserve" },
     { "reservebalance", 1, "amount" },
     { "sendalert", 2, "" },
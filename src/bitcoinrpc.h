@@ -6,9 +6,13 @@
 #ifndef _BITCOINRPC_H_
 #define _BITCOINRPC_H_ 1
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <string>
 #include <list>
 #include <map>
+#include <mutex>
 
 class CBlockIndex;
 
@@ -16,6 +20,8 @@ class CBlockIndex;
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
 
+#include "jsonwriter.h"
+#include "sync.h"
 #include "util.h"
 #include "checkpoints.h"
 
@@ -108,6 +114,105 @@ UniValue JSONRPCError(int code, const std::string& message);
 void ThreadRPCServer(void* parg);
 int CommandLineRPC(int argc, char *argv[]);
 
+//! -rpcthreads default: threads executing RPC calls
+static const int DEFAULT_RPC_THREADS = 4;
+//! -rpcworkqueue default: calls waiting for a thread before clients get 503
+static const int DEFAULT_RPC_WORKQUEUE = 16;
+//! -rpcservertimeout default: seconds a client may take to send its request
+static const int DEFAULT_RPC_SERVER_TIMEOUT = 30;
+//! -rpcmaxconnections default: open client connections before more are refused
+static const int DEFAULT_RPC_MAX_CONNECTIONS = 64;
+//! -rpcbatchparallel default: threads, the caller's included, one batch may use
+static const int DEFAULT_RPC_BATCH_PARALLEL = 4;
+//! Largest request line plus headers accepted from an RPC client
+static const unsigned int MAX_RPC_HEADERS_SIZE = 8192;
+
+/** An HTTP request read from an RPC client */
+class CHTTPRequest
+{
+public:
+    std::map<std::string, std::string> mapHeaders; // names lower-cased
+    std::string strBody;
+    int nProto;     // minor version of HTTP/1.x; 1 and up may get chunked replies
+    bool fKeepAlive;
+
+    CHTTPRequest() : nProto(0), fKeepAlive(false) {}
+};
+
+/** Parse the request at the front of strBuf, which holds whatever has
+ * arrived on the connection so far. Returns 0 while more input is needed,
+ * HTTP_OK once req is complete (its bytes are then removed from strBuf), or
+ * an HTTP error status for a request that can't be served. */
+int ParseHTTPRequest(std::string& strBuf, CHTTPRequest& req);
+/** Read a reply as the RPC client does, whether sized or chunked. */
+int ReadHTTP(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet, std::string& strMessageRet);
+
+/** Bounded queue of RPC calls for a fixed pool of worker threads. A full
+ * queue refuses more work instead of growing, so clients see backpressure
+ * as HTTP 503 rather than unbounded latency. */
+class CRPCWorkQueue
+{
+public:
+    typedef std::function<void()> WorkItem;
+
+    explicit CRPCWorkQueue(size_t nMaxDepthIn) : nMaxDepth(nMaxDepthIn), fRunning(true) {}
+
+    // False if the queue is full or stopped
+    bool Enqueue(const WorkItem& item)
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        if (!fRunning || queue.size() >= nMaxDepth)
+            return false;
+        queue.push_back(item);
+        cond.notify_one();
+        return true;
+    }
+
+    // Wait for the next item; false once interrupted
+    bool Dequeue(WorkItem& item)
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        while (fRunning && queue.empty())
+            cond.wait(lock);
+        if (!fRunning)
+            return false;
+        item = queue.front();
+        queue.pop_front();
+        return true;
+    }
+
+    // Items still queued are dropped, releasing the connections they hold
+    // so shutdown need not wait for them to time out
+    void Interrupt()
+    {
+        std::deque<WorkItem> dropped;
+        {
+            std::unique_lock<std::mutex> lock(cs);
+            fRunning = false;
+            queue.swap(dropped);
+            cond.notify_all();
+        }
+    }
+
+    size_t Depth()
+    {
+        std::unique_lock<std::mutex> lock(cs);
+        return queue.size();
+    }
+
+private:
+    std::mutex cs;
+    std::condition_variable cond;
+    std::deque<WorkItem> queue;
+    size_t nMaxDepth;
+    bool fRunning;
+};
+
+/** Answer a batch (JSON array) request. Runs of elements that may be
+ * answered out of order are spread over pqueue's workers, up to nParallel
+ * threads at a time counting the caller; replies keep the request order. */
+std::string JSONRPCExecBatch(const UniValue& vReq, CRPCWorkQueue* pqueue = NULL, int nParallel = 1);
+
 /** Convert parameter values for RPC call from strings to command-specific JSON objects. */
 UniValue RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams);
 
@@ -146,6 +251,8 @@ void RPCTypeCheckObj(const UniValue& o,
 // typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
 typedef UniValue(*rpcfn_type)(const UniValue& params, bool fHelp);
 // typedef UniValue(*rpcfn_type)(const JSONRPCRequest& jsonRequest, bool fHelp);
+// Writes the same result as the actor, but into writer as it goes
+typedef void(*rpcstreamfn_type)(const UniValue& params, CJSONWriter& writer);
 
 class CRPCCommand
 {
@@ -154,9 +261,36 @@ public:
     rpcfn_type actor;
     bool okSafeMode;
     bool unlocked;
+    rpcstreamfn_type streamer;  // optional, for commands with large results
 };
 
 
+/**
+ * What a command has cost since startup (or the last reset), and how much of
+ * that was spent waiting for cs_main and cs_wallet. Commands marked unlocked
+ * never wait here.
+ */
+class CRPCCommandStats
+{
+public:
+    uint64_t nCalls;
+    uint64_t nLockedCalls;
+    uint64_t nContended;          // locked calls that found a lock taken
+    int64_t nLockWaitMicros;
+    int64_t nMaxLockWaitMicros;
+    int64_t nRunMicros;
+
+    CRPCCommandStats()
+    {
+        nCalls = 0;
+        nLockedCalls = 0;
+        nContended = 0;
+        nLockWaitMicros = 0;
+        nMaxLockWaitMicros = 0;
+        nRunMicros = 0;
+    }
+};
+
 /**
  * Bitcoin RPC command dispatcher.
  */
@@ -164,6 +298,13 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+
+    mutable CCriticalSection cs_stats;
+    mutable std::map<std::string, CRPCCommandStats> mapStats;
+
+    void RecordCall(const std::string& strMethod, bool fLocked, bool fContended, int64_t nLockWaitMicros, int64_t nRunMicros) const;
+    // Safe mode, locking and accounting around running one command
+    void Dispatch(const JSONRPCRequest& request, const std::function<void(const CRPCCommand*)>& run) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -186,12 +327,22 @@ public:
      */
     UniValue execute(const JSONRPCRequest &request) const;
 
+    /**
+     * Execute a method, writing its result into writer. Commands with a
+     * streamer write as they go; for the rest the result is built first.
+     * @throws an exception (UniValue) when an error happens.
+     */
+    void execute(const JSONRPCRequest &request, CJSONWriter& writer) const;
+
     /**
      * Appends a CRPCCommand to the dispatch table.
      * Returns false if RPC server is already running (dump concurrency protection).
      * Commands cannot be overwritten (returns false).
      */
     bool appendCommand(const std::string& name, const CRPCCommand* pcmd);
+
+    /** Per-command call and lock wait counters, optionally clearing them */
+    std::map<std::string, CRPCCommandStats> GetStats(bool fReset = false) const;
 };
 
 extern CRPCTable tableRPC;
@@ -202,7 +353,7 @@ extern UniValue ValueFromAmount(int64_t amount);
 extern double GetDifficulty(const CBlockIndex* blockindex = NULL);
 
 extern double GetPoWMHashPS();
-extern double GetPoSKernelPS();
+extern double GetPoSKernelPS(const CBlockIndex* pindexTip = NULL);
 
 extern std::string HexBits(unsigned int nBits);
 extern std::string HelpRequiringPassphrase();
@@ -223,6 +374,7 @@ extern std::string HelpExampleRpc(std::string methodname, std::string args);
 // in rpcnet.cpp
 extern UniValue getconnectioncount(const UniValue& params, bool fHelp);
 extern UniValue getpeerinfo(const UniValue& params, bool fHelp);
+extern UniValue getnettotals(const UniValue& params, bool fHelp);
 extern UniValue addnode(const UniValue& params, bool fHelp);
 extern UniValue disconnectnode(const UniValue& params, bool fHelp);
 extern UniValue setban(const UniValue& params, bool fHelp);
@@ -263,6 +415,7 @@ extern UniValue getaccount(const UniValue& params, bool fHelp);
 extern UniValue getaddressesbyaccount(const UniValue& params, bool fHelp);
 extern UniValue sendtoaddress(const UniValue& params, bool fHelp);
 extern UniValue listaddressgroupings(const UniValue& params, bool fHelp);
+extern void StreamAddressGroupings(const UniValue& params, CJSONWriter& writer);
 extern UniValue signmessage(const UniValue& params, bool fHelp);
 extern UniValue verifymessage(const UniValue& params, bool fHelp);
 extern UniValue getreceivedbyaddress(const UniValue& params, bool fHelp);
@@ -276,6 +429,7 @@ extern UniValue addredeemscript(const UniValue& params, bool fHelp);
 extern UniValue listreceivedbyaddress(const UniValue& params, bool fHelp);
 extern UniValue listreceivedbyaccount(const UniValue& params, bool fHelp);
 extern UniValue listtransactions(const UniValue& params, bool fHelp);
+extern void StreamListTransactions(const UniValue& params, CJSONWriter& writer);
 extern UniValue listaccounts(const UniValue& params, bool fHelp);
 extern UniValue listsinceblock(const UniValue& params, bool fHelp);
 extern UniValue gettransaction(const UniValue& params, bool fHelp);
@@ -297,6 +451,7 @@ extern UniValue getminingreport(const UniValue& params, bool fHelp);
 // in rcprawtransaction.cpp
 extern UniValue getrawtransaction(const UniValue& params, bool fHelp);
 extern UniValue listunspent(const UniValue& params, bool fHelp);
+extern void StreamListUnspent(const UniValue& params, CJSONWriter& writer);
 extern UniValue createrawtransaction(const UniValue& params, bool fHelp);
 extern UniValue decoderawtransaction(const UniValue& params, bool fHelp);
 extern UniValue decodescript(const UniValue& params, bool fHelp);
@@ -309,10 +464,15 @@ extern UniValue getblockcount(const UniValue& params, bool fHelp);
 extern UniValue getdifficulty(const UniValue& params, bool fHelp);
 extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
+extern void StreamRawMempool(const UniValue& params, CJSONWriter& writer);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
 extern UniValue getblock(const UniValue& params, bool fHelp);
+extern void StreamBlock(const UniValue& params, CJSONWriter& writer);
 extern UniValue getblockbynumber(const UniValue& params, bool fHelp);
 extern UniValue getcheckpoint(const UniValue& params, bool fHelp);
 extern UniValue getblockversionstats(const UniValue& params, bool fHelp);
+extern UniValue getaddressutxos(const UniValue& params, bool fHelp);
+extern UniValue getaddressbalance(const UniValue& params, bool fHelp);
+extern UniValue getaddresstxids(const UniValue& params, bool fHelp);
 
 #endif
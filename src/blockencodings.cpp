@@ -0,0 +1,192 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "random.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+// Smallest possible serialized transaction, bounds the transaction count
+static const unsigned int MIN_TRANSACTION_SIZE = ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION);
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+        nNonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    vchBlockSig = block.vchBlockSig;
+    FillShortTxIDSelector();
+
+    // The coinbase and the coinstake are never in a mempool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+            prefilledtxn.push_back(CPrefilledTransaction(i, block.vtx[i]));
+        else
+            shorttxids.push_back(CShortTxID(GetShortID(block.vtx[i].GetHash())));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header << nNonce;
+    uint256 hashKey = ss.GetHash();
+    nShortIDKey0 = hashKey.Get64(0);
+    nShortIDKey1 = hashKey.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool,
+                                              const map<uint256, CTransaction>& mapOrphans)
+{
+    if (cmpctblock.header.IsNull() || cmpctblock.prefilledtxn.empty())
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.assign(cmpctblock.BlockTxCount(), CTransaction());
+    have_txn.assign(cmpctblock.BlockTxCount(), 0);
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn)
+    {
+        if (prefilled.index >= txn_available.size() || have_txn[prefilled.index])
+            return READ_STATUS_INVALID;
+        txn_available[prefilled.index] = prefilled.tx;
+        have_txn[prefilled.index] = 1;
+    }
+    nPrefilledCount = cmpctblock.prefilledtxn.size();
+
+    // Map each short id to the slot it fills; identical ids within the block
+    // cannot be told apart, so those blocks are fetched in full
+    boost::unordered_map<uint64_t, unsigned int> mapShortIDs;
+    mapShortIDs.rehash(cmpctblock.shorttxids.size());
+    unsigned int nIndex = 0;
+    for (unsigned int i = 0; i < cmpctblock.shorttxids.size(); i++)
+    {
+        while (have_txn[nIndex])
+            nIndex++;
+        if (!mapShortIDs.insert(make_pair(cmpctblock.shorttxids[i].nShortID, nIndex)).second)
+            return READ_STATUS_FAILED;
+        nIndex++;
+    }
+
+    // Two local transactions matching the same short id leave the slot
+    // empty, it is requested from the peer instead
+    vector<char> vCollided(txn_available.size(), 0);
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTransaction>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+        {
+            boost::unordered_map<uint64_t, unsigned int>::iterator idit = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (idit == mapShortIDs.end())
+                continue;
+            if (!have_txn[idit->second] && !vCollided[idit->second])
+            {
+                txn_available[idit->second] = it->second;
+                have_txn[idit->second] = 1;
+                nMempoolCount++;
+            }
+            else if (have_txn[idit->second])
+            {
+                have_txn[idit->second] = 0;
+                vCollided[idit->second] = 1;
+                nMempoolCount--;
+            }
+        }
+    }
+    for (map<uint256, CTransaction>::const_iterator it = mapOrphans.begin(); it != mapOrphans.end(); ++it)
+    {
+        boost::unordered_map<uint64_t, unsigned int>::iterator idit = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+        if (idit == mapShortIDs.end() || vCollided[idit->second])
+            continue;
+        if (!have_txn[idit->second])
+        {
+            txn_available[idit->second] = it->second;
+            have_txn[idit->second] = 1;
+            nMempoolCount++;
+        }
+        else if (txn_available[idit->second].GetHash() != it->first)
+        {
+            have_txn[idit->second] = 0;
+            vCollided[idit->second] = 1;
+            nMempoolCount--;
+        }
+    }
+
+    if (fDebug)
+        LogPrintf("PartiallyDownloadedBlock::InitData() : block %s, %u txs, %u prefilled, %u from mempool\n",
+                  header.GetHash().ToString().c_str(), txn_available.size(), nPrefilledCount, nMempoolCount);
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    return index < have_txn.size() && have_txn[index];
+}
+
+vector<unsigned int> PartiallyDownloadedBlock::GetMissing() const
+{
+    vector<unsigned int> vMissing;
+    for (unsigned int i = 0; i < have_txn.size(); i++)
+        if (!have_txn[i])
+            vMissing.push_back(i);
+    return vMissing;
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const vector<CTransaction>& vtx_missing) const
+{
+    if (header.IsNull())
+        return READ_STATUS_INVALID;
+
+    block.SetNull();
+    block.nVersion = header.nVersion;
+    block.hashPrevBlock = header.hashPrevBlock;
+    block.hashMerkleRoot = header.hashMerkleRoot;
+    block.nTime = header.nTime;
+    block.nBits = header.nBits;
+    block.nNonce = header.nNonce;
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.reserve(txn_available.size());
+
+    size_t nMissing = 0;
+    for (unsigned int i = 0; i < txn_available.size(); i++)
+    {
+        if (have_txn[i])
+            block.vtx.push_back(txn_available[i]);
+        else
+        {
+            if (nMissing >= vtx_missing.size())
+                return READ_STATUS_INVALID;
+            block.vtx.push_back(vtx_missing[nMissing++]);
+        }
+    }
+    if (nMissing != vtx_missing.size())
+        return READ_STATUS_INVALID;
+
+    // A short id collision with a local transaction shows up as a wrong
+    // merkle root; the peer did nothing wrong, fetch the full block
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,158 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <map>
+#include <vector>
+
+class CTxMemPool;
+
+/** 48-bit keyed hash of a txid, sent in place of the transaction */
+class CShortTxID
+{
+public:
+    uint64_t nShortID;
+
+    CShortTxID() : nShortID(0) {}
+    CShortTxID(uint64_t nShortIDIn) : nShortID(nShortIDIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        uint32_t nLow = nShortID & 0xffffffff;
+        uint16_t nHigh = (nShortID >> 32) & 0xffff;
+        READWRITE(nLow);
+        READWRITE(nHigh);
+        if (fRead)
+            const_cast<CShortTxID*>(this)->nShortID = ((uint64_t)nHigh << 32) | nLow;
+    )
+};
+
+/** A transaction sent in full with a compact block, with its block index */
+class CPrefilledTransaction
+{
+public:
+    unsigned int index;
+    CTransaction tx;
+
+    CPrefilledTransaction() : index(0) {}
+    CPrefilledTransaction(unsigned int indexIn, const CTransaction& txIn) : index(indexIn), tx(txIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(index));
+        READWRITE(tx);
+    )
+};
+
+/** "cmpctblock": a block announced as its header, block signature, the
+ * coinbase and coinstake, and short ids for every other transaction. The
+ * receiver rebuilds the block from its mempool and orphan pool.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t nShortIDKey0, nShortIDKey1;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlock header; // header fields only, vtx stays empty
+    std::vector<unsigned char> vchBlockSig;
+    uint64_t nNonce;
+    std::vector<CShortTxID> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(vchBlockSig);
+        READWRITE(nNonce);
+        READWRITE(shorttxids);
+        READWRITE(prefilledtxn);
+        if (fRead)
+            FillShortTxIDSelector();
+    )
+};
+
+/** "getblocktxn": indexes of the transactions of a compact block the
+ * receiver is missing */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> indexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(indexes);
+    )
+};
+
+/** "blocktxn": the transactions asked for by a "getblocktxn", in order */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(txn);
+    )
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // peer sent an invalid compact block or transactions
+    READ_STATUS_FAILED,  // could not rebuild the block, fall back to the full block
+};
+
+/** A compact block being rebuilt from the mempool */
+class PartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<char> have_txn;
+    CBlock header;
+    std::vector<unsigned char> vchBlockSig;
+
+public:
+    // Transactions found locally, and those that came prefilled
+    size_t nMempoolCount;
+    size_t nPrefilledCount;
+
+    PartiallyDownloadedBlock() : nMempoolCount(0), nPrefilledCount(0) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool,
+                        const std::map<uint256, CTransaction>& mapOrphans);
+    bool IsTxAvailable(size_t index) const;
+    std::vector<unsigned int> GetMissing() const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
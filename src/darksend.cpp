@@ -32,6 +32,8 @@ CCriticalSection cs_darksend;
 CDarkSendPool darkSendPool;
 /** A helper object for signing messages from masternodes */
 CDarkSendSigner darkSendSigner;
+// Overlay messages whose signature was already verified
+CSeenMessageCache seenMessageCache;
 /** The current darksends in progress on the network */
 std::vector<CDarksendQueue> vecDarksendQueue;
 /** Keep track of the used masternodes */
@@ -122,17 +124,17 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
         vRecv >> nDenom >> txCollateral;
 
         std::string error = "";
-        int mn = GetMasternodeByVin(activeMasternode.vin);
-        if(mn == -1){
+        CMasternode mn;
+        if(!mnodeman.Get(activeMasternode.vin, mn)){
             std::string strError = _("Not in the masternode list.");
             pfrom->PushMessage("dssu", darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_REJECTED, strError);
             return;
         }
 
         if(darkSendPool.sessionUsers == 0) {
-            if(vecMasternodes[mn].nLastDsq != 0 &&
-                    vecMasternodes[mn].nLastDsq + CountMasternodesAboveProtocol(darkSendPool.MIN_PEER_PROTO_VERSION)/5 > darkSendPool.nDsqCount){
-                //LogPrintf("dsa -- last dsq too recent, must wait. %s \n", vecMasternodes[mn].addr.ToString().c_str());
+            if(mn.nLastDsq != 0 &&
+                    mn.nLastDsq + mnodeman.CountMasternodesAboveProtocol(darkSendPool.MIN_PEER_PROTO_VERSION)/5 > darkSendPool.nDsqCount){
+                //LogPrintf("dsa -- last dsq too recent, must wait. %s \n", mn.addr.ToString().c_str());
                 std::string strError = _("Last Darksend was too recent.");
                 pfrom->PushMessage("dssu", darkSendPool.sessionID, darkSendPool.GetState(), darkSendPool.GetEntriesCount(), MASTERNODE_REJECTED, strError);
                 return;
@@ -165,8 +167,7 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
 
         if(dsq.IsExpired()) return;
 
-        int mn = GetMasternodeByVin(dsq.vin);
-        if(mn == -1) return;
+        if(mnodeman.Find(dsq.vin) == NULL) return;
 
         // if the queue is ready, submit if we can
         if(dsq.ready) {
@@ -182,16 +183,22 @@ void ProcessMessageDarksend(CNode* pfrom, std::string& strCommand, CDataStream&
                 if(q.vin == dsq.vin) return;
             }
 
-            if(fDebug) LogPrintf("dsq last %d last2 %d count %d\n", vecMasternodes[mn].nLastDsq, vecMasternodes[mn].nLastDsq + (int)vecMasternodes.size()/5, darkSendPool.nDsqCount);
-            //don't allow a few nodes to dominate the queuing process
-            if(vecMasternodes[mn].nLastDsq != 0 &&
-                    vecMasternodes[mn].nLastDsq + CountMasternodesAboveProtocol(darkSendPool.MIN_PEER_PROTO_VERSION)/5 > darkSendPool.nDsqCount){
-                if(fDebug) LogPrintf("dsq -- masternode sending too many dsq messages. %s \n", vecMasternodes[mn].addr.ToString().c_str());
-                return;
+            {
+                LOCK(cs_masternodes);
+                CMasternode* pmn = mnodeman.Find(dsq.vin);
+                if(pmn == NULL) return;
+
+                if(fDebug) LogPrintf("dsq last %d last2 %d count %d\n", pmn->nLastDsq, pmn->nLastDsq + mnodeman.size()/5, darkSendPool.nDsqCount);
+                //don't allow a few nodes to dominate the queuing process
+                if(pmn->nLastDsq != 0 &&
+                        pmn->nLastDsq + mnodeman.CountMasternodesAboveProtocol(darkSendPool.MIN_PEER_PROTO_VERSION)/5 > darkSendPool.nDsqCount){
+                    if(fDebug) LogPrintf("dsq -- masternode sending too many dsq messages. %s \n", pmn->addr.ToString().c_str());
+                    return;
+                }
+                darkSendPool.nDsqCount++;
+                pmn->nLastDsq = darkSendPool.nDsqCount;
+                pmn->allowFreeTx = true;
             }
-            darkSendPool.nDsqCount++;
-            vecMasternodes[mn].nLastDsq = darkSendPool.nDsqCount;
-            vecMasternodes[mn].allowFreeTx = true;
 
             if(fDebug) LogPrintf("dsq - new darksend queue object - %s\n", addr.ToString().c_str());
             vecDarksendQueue.push_back(dsq);
@@ -2032,8 +2039,13 @@ bool CDarkSendSigner::SignMessage(std::string strMessage, std::string& errorMess
     return true;
 }
 
-bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+bool CDarkSendSigner::VerifyMessage(const CPubKey& pubkey, vector<unsigned char>& vchSig, const std::string& strMessage, std::string& errorMessage)
 {
+    // the same broadcast usually arrives from every peer that relays it
+    uint256 entry = CSeenMessageCache::GetEntry(pubkey, vchSig, strMessage);
+    if (seenMessageCache.Contains(entry))
+        return true;
+
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
@@ -2055,7 +2067,55 @@ bool CDarkSendSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSi
     return (pubkey2.GetID() == pubkey.GetID());*/
     CKey key;
     key.SetPubKey(pubkey);
-    return key.Verify(ss.GetHash(), vchSig);
+    if (!key.Verify(ss.GetHash(), vchSig))
+        return false;
+
+    seenMessageCache.Insert(entry);
+    return true;
+}
+
+uint256 CSeenMessageCache::GetEntry(const CPubKey& pubkey, const std::vector<unsigned char>& vchSig, const std::string& strMessage)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << pubkey << vchSig << strMessage;
+    return ss.GetHash();
+}
+
+bool CSeenMessageCache::Contains(const uint256& entry)
+{
+    LOCK(cs);
+    if (setSeen.count(entry)) {
+        nHits++;
+        return true;
+    }
+    nMisses++;
+    return false;
+}
+
+void CSeenMessageCache::Insert(const uint256& entry)
+{
+    LOCK(cs);
+    if (nMaxSize == 0 || !setSeen.insert(entry).second)
+        return;
+    queueSeen.push_back(entry);
+
+    while (queueSeen.size() > nMaxSize) {
+        setSeen.erase(queueSeen.front());
+        queueSeen.pop_front();
+    }
+}
+
+void CSeenMessageCache::Clear()
+{
+    LOCK(cs);
+    setSeen.clear();
+    queueSeen.clear();
+}
+
+unsigned int CSeenMessageCache::size() const
+{
+    LOCK(cs);
+    return setSeen.size();
 }
 
 bool CDarksendQueue::Sign()
@@ -2101,21 +2161,17 @@ bool CDarksendQueue::Relay()
 
 bool CDarksendQueue::CheckSignature()
 {
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes) {
-
-        if(mn.vin == vin) {
-            std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) + boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready);
+    CMasternode mn;
+    if(!mnodeman.Get(vin, mn)) return false;
 
-            std::string errorMessage = "";
-            if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                return error("CDarksendQueue::CheckSignature() - Got bad masternode address signature %s \n", vin.ToString().c_str());
-            }
+    std::string strMessage = vin.ToString() + boost::lexical_cast<std::string>(nDenom) + boost::lexical_cast<std::string>(time) + boost::lexical_cast<std::string>(ready);
 
-            return true;
-        }
+    std::string errorMessage = "";
+    if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
+        return error("CDarksendQueue::CheckSignature() - Got bad masternode address signature %s \n", vin.ToString().c_str());
     }
 
-    return false;
+    return true;
 }
 
 
@@ -18,6 +18,7 @@ class CBitcoinAddress;
 class CDarksendQueue;
 class CDarksendBroadcastTx;
 class CActiveMasternode;
+class CSeenMessageCache;
 
 #define POOL_MAX_TRANSACTIONS                  3 // wait for X transactions to merge and publish
 #define POOL_STATUS_UNKNOWN                    0 // waiting for update
@@ -36,10 +37,12 @@ class CActiveMasternode;
 #define MASTERNODE_RESET                       -1
 
 #define DARKSEND_QUEUE_TIMEOUT                 120
+#define DARKSEND_SEEN_MESSAGES_MAX             50000
 #define DARKSEND_SIGNING_TIMEOUT               30
 
 extern CDarkSendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
+extern CSeenMessageCache seenMessageCache;
 extern std::vector<CDarksendQueue> vecDarksendQueue;
 extern std::string strMasterNodePrivKey;
 extern map<uint256, CDarksendBroadcastTx> mapDarksendBroadcastTxes;
@@ -200,6 +203,37 @@ public:
     int64_t sigTime;
 };
 
+//
+// Bounded set of overlay messages (dsee, dseep, mnw, ix votes, sporks, ...)
+// whose signature already checked out, so the copies every peer relays to
+// us skip the ECDSA verify. Oldest entries are evicted first.
+//
+class CSeenMessageCache
+{
+private:
+    mutable CCriticalSection cs;
+    std::set<uint256> setSeen;
+    std::deque<uint256> queueSeen;
+    unsigned int nMaxSize;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+public:
+    CSeenMessageCache(unsigned int nMaxSizeIn = DARKSEND_SEEN_MESSAGES_MAX) : nMaxSize(nMaxSizeIn), nHits(0), nMisses(0) {}
+
+    // The entry commits to the key, the signature and the signed text, so a
+    // hit can only come from exactly the message that was verified before
+    static uint256 GetEntry(const CPubKey& pubkey, const std::vector<unsigned char>& vchSig, const std::string& strMessage);
+
+    bool Contains(const uint256& entry);
+    void Insert(const uint256& entry);
+    void Clear();
+
+    unsigned int size() const;
+    uint64_t GetHits() const { LOCK(cs); return nHits; }
+    uint64_t GetMisses() const { LOCK(cs); return nMisses; }
+};
+
 //
 // Helper object for signing and checking signatures
 //
@@ -209,7 +243,7 @@ public:
     bool IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey);
     bool SetKey(std::string strSecret, std::string& errorMessage, CKey& key, CPubKey& pubkey);
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
-    bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    bool VerifyMessage(const CPubKey& pubkey, std::vector<unsigned char>& vchSig, const std::string& strMessage, std::string& errorMessage);
 };
 
 class CDarksendSession
@@ -47,6 +47,7 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    fMockTxnFail = false;
 }
 
 CDBEnv::~CDBEnv()
@@ -354,6 +355,9 @@ bool CDBEnv::RemoveDb(const string& strFile)
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    // A mock database lives in memory: there is no file to rewrite
+    if (bitdb.IsMock())
+        return true;
     while (!fShutdown)
     {
         {
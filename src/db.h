@@ -35,6 +35,7 @@ private:
     bool fDetachDB;
     bool fDbEnvInit;
     bool fMockDb;
+    bool fMockTxnFail;
     boost::filesystem::path pathEnv;
     std::string strPath;
 
@@ -50,6 +51,9 @@ public:
     ~CDBEnv();
     void MakeMock();
     bool IsMock() { return fMockDb; };
+    // Mock environments only: abort every transaction instead of committing it
+    void SetMockTxnFail(bool fFail) { fMockTxnFail = fMockDb && fFail; }
+    bool IsMockTxnFail() { return fMockTxnFail; }
 
     /*
      * Verify that database file strFile is OK. If it is not,
@@ -282,6 +286,12 @@ public:
     {
         if (!pdb || !activeTxn)
             return false;
+        if (bitdb.IsMockTxnFail())
+        {
+            activeTxn->abort();
+            activeTxn = NULL;
+            return false;
+        }
         int ret = activeTxn->commit(0);
         activeTxn = NULL;
         return (ret == 0);
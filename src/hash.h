@@ -126,6 +126,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4 of a 256-bit value with the 128-bit key (k0, k1). Cheap
+ * keyed hash for ids that peers must not be able to make collide. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
@@ -8,6 +8,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "noui.h"
+#include "notifysocket.h"
 #include "init.h"
 #include "rpc/register.h"
 #include "scheduler.h"
@@ -26,6 +27,7 @@
 #include "activemasternode.h"
 #include "spork.h"
 #include "darksend.h"
+#include "masternode.h"
 #include "masternodeconfig.h"
 
 #ifndef WIN32
@@ -44,12 +46,17 @@ unsigned int nNodeLifespan;
 unsigned int nDerivationMethodIndex;
 unsigned int nMinerSleep;
 bool fUseFastIndex;
+bool fAddressIndex;
 enum Checkpoints::CPMode CheckpointsMode;
 
 
 std::unique_ptr<CConnman> g_connman;
 CConnman* shared_connman;
 
+// Only write mncache.dat back if it was read (or found missing) at startup,
+// so a failed init can't replace a good cache with an empty registry
+static bool fMasternodeCacheLoaded = false;
+
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -162,6 +169,11 @@ void PrepareShutdown()
     LogPrintf("%s: call ConnMan::reset\n", __func__);
     g_connman.reset();
     LogPrintf("%s: call ConnMan::reset finished\n", __func__);
+    StopNotifySocket();
+    if (fMasternodeCacheLoaded) {
+        CMasternodeDB mndb;
+        mndb.Write(mnodeman);
+    }
     bitdb.Flush(true);
     boost::filesystem::remove(GetPidFile());
     UnregisterWallet(pwalletMain);
@@ -357,6 +369,11 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -maxuploadtarget=<n>   " + _("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: 0)") + "\n" +
+        "  -maxpeeruploadrate=<n> " + _("Limit upload to each peer to <n>*1000 bytes per second, 0 = no limit (default: 0)") + "\n" +
+        "  -maxpeerdownloadrate=<n> " + _("Limit download from each peer to <n>*1000 bytes per second, 0 = no limit (default: 0)") + "\n" +
+        "  -whitelist=<netmask>   " + _("Whitelist peers connecting from the given netmask or IP address. Can be specified multiple times.") + "\n" +
+        "                         " + _("Whitelisted peers are exempt from -maxuploadtarget and per-peer rate limits") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -386,19 +403,31 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 32000 or testnet: 25715)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_RPC_THREADS) + "\n" +
+        "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls (default: %d)"), DEFAULT_RPC_WORKQUEUE) + "\n" +
+        "  -rpcbatchparallel=<n>  " + strprintf(_("Set how many threads one batch request may use for its read-only calls (default: %d)"), DEFAULT_RPC_BATCH_PARALLEL) + "\n" +
+        "  -rpcservertimeout=<n>  " + strprintf(_("Timeout during HTTP requests (default: %d)"), DEFAULT_RPC_SERVER_TIMEOUT) + "\n" +
+        "  -rpcmaxconnections=<n> " + strprintf(_("Maximum number of open RPC connections (default: %d)"), DEFAULT_RPC_MAX_CONNECTIONS) + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
+        "  -notifyport=<port>     " + _("Publish block, transaction and wallet events to subscribers on <port> (localhost only, open to every local user)") + "\n" +
+#ifndef WIN32
+        "  -notifysocket=<path>   " + _("Publish the same events on a Unix domain socket at <path>, readable by this user only") + "\n" +
+#endif
+        "  -notifymaxqueue=<n>    " + strprintf(_("Megabytes of events queued for a slow subscriber before its events are dropped (default: %u)"), DEFAULT_NOTIFY_MAX_QUEUE) + "\n" +
         "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n" +
         "  -enforcecanonical      " + _("Enforce transaction scripts to use canonical PUSH operators (default: 1)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -usehd                 " + _("Derive the keys of a new wallet from one HD seed (BIP32, m/0'/i); the key pool is the lookahead for rescans (default: 0)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -addressindex          " + _("Maintain an address index for the getaddress* RPCs (default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -490,6 +519,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fAddressIndex = GetBoolArg("-addressindex", false);
     nMinerSleep = GetArg("-minersleep", 500);
 
     CheckpointsMode = Checkpoints::STRICT;
@@ -744,6 +774,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    if (mapArgs.count("-whitelist")) {
+        BOOST_FOREACH(const std::string& net, mapMultiArgs["-whitelist"]) {
+            CSubNet subnet;
+            LookupSubNet(net.c_str(), subnet);
+            if (!subnet.IsValid())
+                return InitError(strprintf(_("Invalid netmask specified in -whitelist: '%s'"), net));
+            connman.AddWhitelistedRange(subnet);
+        }
+    }
+
     CService addrProxy;
     bool fProxy = false;
     if (mapArgs.count("-proxy")) {
@@ -863,6 +903,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    if (!InitAddressIndex())
+        return InitError(_("Error building address index"));
+    if (fRequestShutdown)
+    {
+        LogPrintf("Shutdown requested. Exiting.\n");
+        return false;
+    }
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -940,9 +988,12 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     if (fFirstRun)
     {
-        // Create new keyUser and set as default key
         RandAddSeedPerfmon();
 
+        if (GetBoolArg("-usehd", false) && !pwalletMain->SetHDMasterKey(pwalletMain->GenerateNewKey()))
+            strErrors << _("Cannot create HD seed") << "\n";
+
+        // Create new keyUser and set as default key
         CPubKey newDefaultKey;
         if (pwalletMain->GetKeyFromPool(newDefaultKey, false)) {
             pwalletMain->SetDefaultKey(newDefaultKey);
@@ -950,6 +1001,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 strErrors << _("Cannot write default address") << "\n";
         }
     }
+    else if (GetBoolArg("-usehd", false) && !pwalletMain->IsHDEnabled())
+        strErrors << _("Warning: -usehd only applies to new wallets; this wallet keeps generating random keys") << "\n";
 
     LogPrintf("%s", strErrors.str().c_str());
     LogPrintf(" wallet      %15dms\n", GetTimeMillis() - nStart);
@@ -1098,6 +1151,20 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     darkSendPool.InitCollateralAddress();
 
+    if (!fLiteMode) {
+        uiInterface.InitMessage(_("Loading masternode cache..."));
+        int64_t nStart = GetTimeMillis();
+        CMasternodeDB mndb;
+        if (!mndb.Read(mnodeman))
+            LogPrintf("Invalid or missing mncache.dat; recreating\n");
+        else
+            mnodeman.CheckAndRemove();
+        fMasternodeCacheLoaded = true;
+
+        LogPrintf("Loaded %i masternodes from mncache.dat  %dms\n",
+               mnodeman.size(), GetTimeMillis() - nStart);
+    }
+
     threadGroup.create_thread(boost::bind(&ThreadCheckDarkSend, boost::ref(*g_connman)));
 
 
@@ -1110,11 +1177,17 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("mapWallet.size() = %u\n",       pwalletMain->mapWallet.size());
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain->mapAddressBook.size());
 
+    std::string strNotifyError;
+    if (!StartNotifySocket(strNotifyError))
+        return InitError(strNotifyError);
+
     CConnman::Options connOptions;
     connOptions.nMaxConnections = nMaxConnections;
     connOptions.nMaxOutbound = std::min(MAX_OUTBOUND_CONNECTIONS, connOptions.nMaxConnections);
     connOptions.nMaxAddnode = MAX_ADDNODE_CONNECTIONS;
     connOptions.nMaxFeeler = 1;
+    connOptions.nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
+    connOptions.nMaxOutboundLimit = GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET) * 1024 * 1024;
 
     if (!connman.Start(scheduler, connOptions)) {
         InitError(_("Error: could not start node"));
@@ -0,0 +1,93 @@
+// Copyright (c) 2017 The Neutron developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.h"
+
+#include <assert.h>
+
+CJSONWriter::CJSONWriter(const Sink& sinkIn, size_t nFlushSizeIn) :
+    sink(sinkIn), nFlushSize(nFlushSizeIn), nFlushed(0), fAfterKey(false)
+{
+    strBuf.reserve(nFlushSize + 1024);
+}
+
+void CJSONWriter::Separate()
+{
+    if (fAfterKey)
+    {
+        fAfterKey = false;
+        return;
+    }
+    if (!vFirst.empty())
+    {
+        if (!vFirst.back())
+            strBuf += ',';
+        vFirst.back() = false;
+    }
+}
+
+void CJSONWriter::Append(const std::string& str)
+{
+    strBuf += str;
+    if (strBuf.size() >= nFlushSize)
+        Flush();
+}
+
+void CJSONWriter::BeginObject()
+{
+    Separate();
+    strBuf += '{';
+    vFirst.push_back(true);
+}
+
+void CJSONWriter::EndObject()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    Append("}");
+}
+
+void CJSONWriter::BeginArray()
+{
+    Separate();
+    strBuf += '[';
+    vFirst.push_back(true);
+}
+
+void CJSONWriter::EndArray()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    Append("]");
+}
+
+void CJSONWriter::Key(const std::string& strKey)
+{
+    Separate();
+    strBuf += UniValue(strKey).write();
+    strBuf += ':';
+    fAfterKey = true;
+}
+
+void CJSONWriter::Value(const UniValue& val)
+{
+    Separate();
+    Append(val.write());
+}
+
+void CJSONWriter::Flush()
+{
+    if (strBuf.empty())
+        return;
+    nFlushed += strBuf.size();
+    sink(strBuf);
+    strBuf.clear();
+}
+
+std::string CJSONWriter::TakeBuffer()
+{
+    std::string strRet;
+    strRet.swap(strBuf);
+    return strRet;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2017 The Neutron developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_JSONWRITER_H
+#define BITCOIN_JSONWRITER_H
+
+#include "univalue.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+//! Bytes a CJSONWriter collects before passing them on
+static const size_t JSON_WRITER_FLUSH_SIZE = 65536;
+
+/**
+ * Writes JSON text as it is produced, so a large document never has to
+ * exist as a UniValue tree or as one string. Values are still UniValues,
+ * which keeps the escaping and number formatting identical to
+ * UniValue::write(); only the containers around them are streamed.
+ *
+ * Output is collected and handed to the sink in pieces of about
+ * nFlushSize bytes. Nothing reaches the sink before the first piece is
+ * full, so a writer that ends under that size can still be taken back
+ * whole with TakeBuffer().
+ */
+class CJSONWriter
+{
+public:
+    typedef std::function<void(const std::string&)> Sink;
+
+    explicit CJSONWriter(const Sink& sinkIn, size_t nFlushSizeIn = JSON_WRITER_FLUSH_SIZE);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+
+    //! Name of the next member of the current object
+    void Key(const std::string& strKey);
+    //! A complete value: a member after Key(), or an element of an array
+    void Value(const UniValue& val);
+
+    void Pair(const std::string& strKey, const UniValue& val)
+    {
+        Key(strKey);
+        Value(val);
+    }
+
+    //! Pass whatever is collected to the sink
+    void Flush();
+    //! Take what is collected instead of passing it on
+    std::string TakeBuffer();
+
+    //! Whether anything has gone to the sink yet
+    bool Started() const { return nFlushed > 0; }
+    uint64_t GetFlushedBytes() const { return nFlushed; }
+
+private:
+    Sink sink;
+    size_t nFlushSize;
+    std::string strBuf;
+    uint64_t nFlushed;
+
+    // Per open container: whether it has had an element yet
+    std::vector<bool> vFirst;
+    bool fAfterKey;
+
+    void Separate();
+    void Append(const std::string& str);
+};
+
+#endif
@@ -264,6 +264,29 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
+bool CheckStakeKernelTarget(const uint256& hashProofOfStake, const uint256& bnCoinDayWeight, unsigned int nBits)
+{
+    bool fNegative, fOverflow;
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits, &fNegative, &fOverflow);
+
+    if (bnCoinDayWeight == 0)
+        return hashProofOfStake == 0;
+    if (fNegative)
+        return false;
+    if (fOverflow)
+        return true;
+    if (bnTargetPerCoinDay == 0)
+        return hashProofOfStake == 0;
+
+    // The weighted target can need more than 256 bits; compare against
+    // the quotient instead of multiplying when it might
+    if (bnCoinDayWeight.bits() + bnTargetPerCoinDay.bits() <= 256)
+        return hashProofOfStake <= bnCoinDayWeight * bnTargetPerCoinDay;
+    uint256 bnQuot = hashProofOfStake / bnCoinDayWeight;
+    return bnQuot < bnTargetPerCoinDay || (bnQuot == bnTargetPerCoinDay && bnQuot * bnCoinDayWeight == hashProofOfStake);
+}
+
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
     if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
@@ -273,16 +296,18 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
         return error("CheckStakeKernelHash() : min age violation");
 
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
     int64_t nValueIn = txPrev.vout[prevout.n].nValue;
+    int64_t nTimeWeight = GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx);
 
     uint256 hashBlockFrom = blockFrom.GetHash();
 
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    // A negative weight can never meet the target
+    if (nValueIn < 0 || nTimeWeight < 0)
+        return false;
+    uint256 bnCoinDayWeight = uint256(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
     if (fTestNet)
         bnCoinDayWeight *= 1000;
-    targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
+    targetProofOfStake = bnCoinDayWeight * uint256().SetCompact(nBits);
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
@@ -310,7 +335,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     }
 
     // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+    if (!CheckStakeKernelTarget(hashProofOfStake, bnCoinDayWeight, nBits))
         return false;
     if (fDebug && !fPrintProofOfStake)
     {
@@ -278,6 +278,26 @@ bool CKey::SetSecret(const CSecret& vchSecret, bool fCompressed)
     return true;
 }
 
+bool CKey::SetKeyPair(const CSecret& vchSecret, const CPubKey& vchPubKey)
+{
+    if (vchSecret.size() != 32)
+        throw key_error("CKey::SetKeyPair() : secret must be 32 bytes");
+    Reset();
+    if (!SetPubKey(vchPubKey))
+        return false;
+    BIGNUM *bn = BN_bin2bn(&vchSecret[0],32,BN_new());
+    if (bn == NULL)
+        throw key_error("CKey::SetKeyPair() : BN_bin2bn failed");
+    bool fOk = EC_KEY_set_private_key(pkey, bn);
+    BN_clear_free(bn);
+    if (!fOk)
+    {
+        Reset();
+        return false;
+    }
+    return true;
+}
+
 CSecret CKey::GetSecret(bool &fCompressed) const
 {
     CSecret vchRet;
@@ -307,11 +327,16 @@ CPrivKey CKey::GetPrivKey() const
 
 bool CKey::SetPubKey(const CPubKey& vchPubKey)
 {
-    const unsigned char* pbegin = &vchPubKey.vchPubKey[0];
-    if (o2i_ECPublicKey(&pkey, &pbegin, vchPubKey.vchPubKey.size()))
+    return SetPubKey(&vchPubKey.vchPubKey[0], vchPubKey.vchPubKey.size());
+}
+
+bool CKey::SetPubKey(const unsigned char* pchPubKey, size_t nSize)
+{
+    const unsigned char* pbegin = pchPubKey;
+    if (o2i_ECPublicKey(&pkey, &pbegin, nSize))
     {
         fSet = true;
-        if (vchPubKey.vchPubKey.size() == 33)
+        if (nSize == 33)
             SetCompressedPubKey();
         return true;
     }
@@ -439,9 +464,14 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
 }
 
 bool CKey::Verify(uint256 hash, const std::vector<unsigned char>& vchSig)
+{
+    return Verify(hash, &vchSig[0], vchSig.size());
+}
+
+bool CKey::Verify(uint256 hash, const unsigned char* pchSig, size_t nSigLen)
 {
     // -1 = error, 0 = bad sig, 1 = good
-    if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
+    if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), pchSig, nSigLen, pkey) != 1)
         return false;
 
     return true;
@@ -463,3 +493,145 @@ bool CKey::IsValid()
 }
 
 
+
+// The curve, set up once: BIP32 public derivation multiplies by the generator
+// for every child, which the precomputed tables make several times faster
+static EC_GROUP* NewSecp256k1Group()
+{
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    if (group == NULL)
+        throw key_error("NewSecp256k1Group() : EC_GROUP_new_by_curve_name failed");
+    EC_GROUP_precompute_mult(group, NULL);
+    return group;
+}
+
+static const EC_GROUP* GetSecp256k1Group()
+{
+    static const EC_GROUP* group = NewSecp256k1Group();
+    return group;
+}
+
+// I = HMAC-SHA512(cc, header || data[32] || ser32(nChild))
+static void BIP32Hash(const ChainCode& cc, unsigned int nChild, unsigned char header, const unsigned char* data, unsigned char output[64])
+{
+    unsigned char num[4];
+    num[0] = (nChild >> 24) & 0xFF;
+    num[1] = (nChild >> 16) & 0xFF;
+    num[2] = (nChild >>  8) & 0xFF;
+    num[3] = (nChild >>  0) & 0xFF;
+    HMAC_SHA512_CTX ctx;
+    HMAC_SHA512_Init(&ctx, BEGIN(cc), 32);
+    HMAC_SHA512_Update(&ctx, &header, 1);
+    HMAC_SHA512_Update(&ctx, data, 32);
+    HMAC_SHA512_Update(&ctx, num, 4);
+    HMAC_SHA512_Final(output, &ctx);
+    OPENSSL_cleanse(&ctx, sizeof(ctx));
+}
+
+bool CKey::Derive(CKey& keyChild, ChainCode& ccChild, unsigned int nChild, const ChainCode& cc) const
+{
+    if (!fSet)
+        return false;
+
+    bool fCompressed;
+    CSecret vchSecret = GetSecret(fCompressed);
+    unsigned char out[64];
+    if ((nChild >> 31) == 0)
+    {
+        CPubKey pubkey = GetPubKey();
+        if (!pubkey.IsCompressed())
+            return false;
+        BIP32Hash(cc, nChild, pubkey.vchPubKey[0], &pubkey.vchPubKey[1], out);
+    }
+    else
+        BIP32Hash(cc, nChild, 0, &vchSecret[0], out);
+    memcpy(ccChild.begin(), out + 32, 32);
+
+    // k_child = IL + k_par (mod n), unless IL >= n or the sum is zero
+    bool fRet = false;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM* bnOrder = BN_new();
+    BIGNUM* bnTweak = BN_bin2bn(out, 32, NULL);
+    BIGNUM* bnKey = BN_bin2bn(&vchSecret[0], 32, NULL);
+    if (ctx && bnOrder && bnTweak && bnKey &&
+        EC_GROUP_get_order(EC_KEY_get0_group(pkey), bnOrder, ctx) &&
+        BN_cmp(bnTweak, bnOrder) < 0 &&
+        BN_mod_add(bnKey, bnKey, bnTweak, bnOrder, ctx) &&
+        !BN_is_zero(bnKey))
+    {
+        CSecret vchChild(32, 0);
+        BN_bn2bin(bnKey, &vchChild[32 - BN_num_bytes(bnKey)]);
+        fRet = keyChild.SetSecret(vchChild, true);
+    }
+    BN_clear_free(bnKey);
+    BN_clear_free(bnTweak);
+    BN_free(bnOrder);
+    BN_CTX_free(ctx);
+    OPENSSL_cleanse(out, sizeof(out));
+    return fRet;
+}
+
+bool CPubKey::Derive(CPubKey& pubkeyChild, ChainCode& ccChild, unsigned int nChild, const ChainCode& cc) const
+{
+    if ((nChild >> 31) != 0 || !IsCompressed())
+        return false;
+
+    unsigned char out[64];
+    BIP32Hash(cc, nChild, vchPubKey[0], &vchPubKey[1], out);
+    memcpy(ccChild.begin(), out + 32, 32);
+
+    // K_child = IL*G + K_par, unless IL >= n or the sum is the point at infinity
+    const EC_GROUP* group = GetSecp256k1Group();
+    bool fRet = false;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM* bnOrder = BN_new();
+    BIGNUM* bnTweak = BN_bin2bn(out, 32, NULL);
+    BIGNUM* bnOne = BN_new();
+    EC_POINT* point = EC_POINT_new(group);
+    EC_POINT* result = EC_POINT_new(group);
+    if (ctx && bnOrder && bnTweak && bnOne && point && result &&
+        BN_one(bnOne) &&
+        EC_GROUP_get_order(group, bnOrder, ctx) &&
+        BN_cmp(bnTweak, bnOrder) < 0 &&
+        EC_POINT_oct2point(group, point, &vchPubKey[0], vchPubKey.size(), ctx) &&
+        EC_POINT_mul(group, result, bnTweak, point, bnOne, ctx) &&
+        !EC_POINT_is_at_infinity(group, result))
+    {
+        std::vector<unsigned char> vchChild(33);
+        if (EC_POINT_point2oct(group, result, POINT_CONVERSION_COMPRESSED, &vchChild[0], vchChild.size(), ctx) == vchChild.size())
+        {
+            pubkeyChild = CPubKey(vchChild);
+            fRet = true;
+        }
+    }
+    EC_POINT_free(result);
+    EC_POINT_free(point);
+    BN_free(bnOne);
+    BN_free(bnTweak);
+    BN_free(bnOrder);
+    BN_CTX_free(ctx);
+    return fRet;
+}
+
+void CExtKey::SetMaster(const unsigned char* seed, unsigned int nSeedLen)
+{
+    static const char hashkey[] = {'B','i','t','c','o','i','n',' ','s','e','e','d'};
+    unsigned char out[64];
+    HMAC_SHA512_CTX ctx;
+    HMAC_SHA512_Init(&ctx, hashkey, sizeof(hashkey));
+    HMAC_SHA512_Update(&ctx, seed, nSeedLen);
+    HMAC_SHA512_Final(out, &ctx);
+    OPENSSL_cleanse(&ctx, sizeof(ctx));
+
+    key.SetSecret(CSecret(out, out + 32), true);
+    memcpy(chaincode.begin(), out + 32, 32);
+    OPENSSL_cleanse(out, sizeof(out));
+}
+
+CExtPubKey CExtKey::Neuter() const
+{
+    CExtPubKey ret;
+    ret.pubkey = key.GetPubKey();
+    ret.chaincode = chaincode;
+    return ret;
+}
@@ -61,6 +61,9 @@ public:
     CScriptID(const uint160 &in) : uint160(in) { }
 };
 
+/** BIP32 chain code: the extra entropy child keys are derived with */
+typedef uint256 ChainCode;
+
 /** An encapsulated public key. */
 class CPubKey {
 private:
@@ -100,6 +103,9 @@ public:
         return vchPubKey;
     }
 
+    // BIP32 public child derivation; only non-hardened children of a
+    // compressed key can be derived this way
+    bool Derive(CPubKey& pubkeyChild, ChainCode& ccChild, unsigned int nChild, const ChainCode& cc) const;
 
 };
 
@@ -137,9 +143,13 @@ public:
     void MakeNewKey(bool fCompressed);
     bool SetPrivKey(const CPrivKey& vchPrivKey);
     bool SetSecret(const CSecret& vchSecret, bool fCompressed = false);
+    // Load a secret together with its public key, which is trusted to
+    // match; skips the point multiplication SetSecret has to do
+    bool SetKeyPair(const CSecret& vchSecret, const CPubKey& vchPubKey);
     CSecret GetSecret(bool &fCompressed) const;
     CPrivKey GetPrivKey() const;
     bool SetPubKey(const CPubKey& vchPubKey);
+    bool SetPubKey(const unsigned char* pchPubKey, size_t nSize);
     CPubKey GetPubKey() const;
 
     bool Sign(uint256 hash, std::vector<unsigned char>& vchSig);
@@ -157,11 +167,48 @@ public:
     bool SetCompactSignature(uint256 hash, const std::vector<unsigned char>& vchSig);
 
     bool Verify(uint256 hash, const std::vector<unsigned char>& vchSig);
+    bool Verify(uint256 hash, const unsigned char* pchSig, size_t nSigLen);
 
     bool IsValid();
 
+    // BIP32 private child derivation, hardened (nChild >= 0x80000000) or not
+    bool Derive(CKey& keyChild, ChainCode& ccChild, unsigned int nChild, const ChainCode& cc) const;
+
     // Check whether an element of a signature (r or s) is valid.
     static bool CheckSignatureElement(const unsigned char *vch, int len, bool half);
 };
 
+/** A BIP32 extended public key: a public key and the chain code its
+ * children are derived with */
+struct CExtPubKey
+{
+    CPubKey pubkey;
+    ChainCode chaincode;
+
+    bool Derive(CExtPubKey& out, unsigned int nChild) const
+    {
+        return pubkey.Derive(out.pubkey, out.chaincode, nChild, chaincode);
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(pubkey);
+        READWRITE(chaincode);
+    )
+};
+
+/** A BIP32 extended private key */
+struct CExtKey
+{
+    CKey key;
+    ChainCode chaincode;
+
+    void SetMaster(const unsigned char* seed, unsigned int nSeedLen);
+    bool Derive(CExtKey& out, unsigned int nChild) const
+    {
+        return key.Derive(out.key, out.chaincode, nChild, chaincode);
+    }
+    CExtPubKey Neuter() const;
+};
+
 #endif
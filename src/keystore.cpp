@@ -84,6 +84,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        ClearKeyCache();
     }
 
     NotifyStatusChanged(this);
@@ -127,13 +128,8 @@ bool CCryptoKeyStore::AddKey(const CKey& key)
         if (!IsCrypted())
             return CBasicKeyStore::AddKey(key);
 
-        if (IsLocked())
-            return false;
-
         std::vector<unsigned char> vchCryptedSecret;
-        CPubKey vchPubKey = key.GetPubKey();
-        bool fCompressed;
-        if (!EncryptSecret(vMasterKey, key.GetSecret(fCompressed), vchPubKey.GetHash(), vchCryptedSecret))
+        if (!EncryptKey(key, vchCryptedSecret))
             return false;
 
         if (!AddCryptedKey(key.GetPubKey(), vchCryptedSecret))
@@ -142,6 +138,16 @@ bool CCryptoKeyStore::AddKey(const CKey& key)
     return true;
 }
 
+bool CCryptoKeyStore::EncryptKey(const CKey& key, std::vector<unsigned char>& vchCryptedSecret)
+{
+    LOCK(cs_KeyStore);
+    if (IsLocked())
+        return false;
+
+    bool fCompressed;
+    return EncryptSecret(vMasterKey, key.GetSecret(fCompressed), key.GetPubKey().GetHash(), vchCryptedSecret);
+}
+
 
 bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
@@ -155,10 +161,36 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
     return true;
 }
 
+void CCryptoKeyStore::CacheKey(const CPubKey& vchPubKey, const CSecret& vchSecret) const
+{
+    LOCK(cs_KeyStore);
+    if (!IsCrypted())
+        return;
+    mapKeyCache[vchPubKey.GetID()] = make_pair(vchPubKey, vchSecret);
+}
+
+void CCryptoKeyStore::ClearKeyCache() const
+{
+    LOCK(cs_KeyStore);
+    mapKeyCache.clear();
+}
+
+bool CCryptoKeyStore::GetCachedKey(const CKeyID& address, CKey& keyOut) const
+{
+    LOCK(cs_KeyStore);
+    KeyPairMap::const_iterator mi = mapKeyCache.find(address);
+    if (mi == mapKeyCache.end())
+        return false;
+    return keyOut.SetKeyPair((*mi).second.second, (*mi).second.first);
+}
+
 bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
 {
     {
         LOCK(cs_KeyStore);
+        if (GetCachedKey(address, keyOut))
+            return true;
+
         if (!IsCrypted())
             return CBasicKeyStore::GetKey(address, keyOut);
 
@@ -172,8 +204,11 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
                 return false;
             if (vchSecret.size() != 32)
                 return false;
-            keyOut.SetPubKey(vchPubKey);
-            keyOut.SetSecret(vchSecret);
+            keyOut.Reset();
+            keyOut.SetSecret(vchSecret, vchPubKey.IsCompressed());
+            if (keyOut.GetPubKey() != vchPubKey)
+                return false;
+            CacheKey(vchPubKey, vchSecret);
             return true;
         }
     }
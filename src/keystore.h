@@ -98,6 +98,7 @@ public:
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
+typedef std::map<CKeyID, std::pair<CPubKey, CSecret> > KeyPairMap;
 
 /** Keystore which keeps the private keys encrypted.
  * It derives from the basic key store, which is used if no encryption is active.
@@ -109,6 +110,13 @@ private:
 
     CKeyingMaterial vMasterKey;
 
+    // Keys handed out since an encrypted wallet was unlocked, with their
+    // public keys, so signing the same key again costs neither AES decryption
+    // nor a point multiplication. The secrets sit in locked memory and Lock()
+    // wipes them. Unencrypted wallets hold their keys in mapKeys already and
+    // are not cached, so no second copy of every secret outlives its use.
+    mutable KeyPairMap mapKeyCache;
+
     // if fUseCrypto is true, mapKeys must be empty
     // if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
@@ -121,6 +129,14 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // encrypts the secret of key as AddKey stores it; fails if locked
+    bool EncryptKey(const CKey& key, std::vector<unsigned char>& vchCryptedSecret);
+
+    // vchSecret must be the secret of vchPubKey
+    void CacheKey(const CPubKey& vchPubKey, const CSecret& vchSecret) const;
+    bool GetCachedKey(const CKeyID& address, CKey& keyOut) const;
+    void ClearKeyCache() const;
+
 public:
     CCryptoKeyStore() : fUseCrypto(false)
     {
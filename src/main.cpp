@@ -11,6 +11,10 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "kernel.h"
+#include "blockencodings.h"
+#include "bloom.h"
+#include "merkleblock.h"
+#include "notifysocket.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -19,6 +23,7 @@
 #include "spork.h"
 //#include "txmempool.h"
 
+#include <list>
 #include <stdio.h>
 
 using namespace std;
@@ -41,9 +46,9 @@ unsigned int nTransactionsUpdated = 0;
 map<uint256, CBlockIndex*> mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
-CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // Starting Difficulty: results with 0,000244140625 proof-of-work difficulty
-CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
-CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 2);
+uint256 bnProofOfWorkLimit(~uint256(0) >> 20); // Starting Difficulty: results with 0,000244140625 proof-of-work difficulty
+uint256 bnProofOfStakeLimit(~uint256(0) >> 20);
+uint256 bnProofOfWorkLimitTestNet(~uint256(0) >> 2);
 
 static const int64_t nTargetTimespan = 20 * 60;  // Neutron - every 20mins
 unsigned int nTargetSpacing = 1 * 79; // Neutron - 79 secs
@@ -80,6 +85,24 @@ set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
+// Compact blocks waiting for a "blocktxn" reply, guarded by cs_main
+struct CCompactBlockInFlight
+{
+    NodeId nodeid;
+    int64_t nTime;
+    int nFallbacks; // other announcers asked for the full block meanwhile
+    PartiallyDownloadedBlock partialBlock;
+};
+static map<uint256, CCompactBlockInFlight> mapCompactBlocksInFlight;
+static const unsigned int MAX_COMPACT_BLOCKS_IN_FLIGHT = 16;
+static const int64_t COMPACT_BLOCK_TIMEOUT = 2 * 60;
+static const int MAX_COMPACT_BLOCK_FALLBACKS = 2;
+
+// Peers asked to send us new blocks as compact blocks unannounced (BIP152
+// high-bandwidth mode), least recently useful first; guarded by cs_main
+static list<NodeId> lNodesAnnouncingHeaderAndIDs;
+static const unsigned int MAX_HB_COMPACT_PEERS = 3;
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -144,6 +167,37 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
         pwallet->AddToWalletIfInvolvingMe(tx, pblock, fUpdate);
 }
 
+// make all wallets see the transactions of a connected or disconnected block,
+// each wallet writing what changed in one batch. The wallet in memory has
+// already changed by the time the batch commits, so a failure to write it is
+// fatal rather than leaving memory and disk apart.
+void static SyncBlockWithWallets(const CBlock& block, bool fConnect)
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+    {
+        bool fCommitted = false;
+        try
+        {
+            CWalletBatch batch(pwallet);
+            BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            {
+                if (fConnect)
+                    pwallet->AddToWalletIfInvolvingMe(tx, &block, true);
+                // ppcoin: wallets need to refund inputs when disconnecting coinstake
+                else if (tx.IsCoinStake() && pwallet->IsFromMe(tx))
+                    pwallet->DisableTransaction(tx);
+            }
+            fCommitted = batch.Commit();
+        }
+        catch (std::exception& e)
+        {
+            LogPrintf("SyncBlockWithWallets() : %s\n", e.what());
+        }
+        if (!fCommitted)
+            AbortNode(strprintf("SyncBlockWithWallets() : writing wallet %s failed", pwallet->strWalletFile.c_str()));
+    }
+}
+
 // notify wallets about a new best chain
 void static SetBestChain(const CBlockLocator& loc)
 {
@@ -189,6 +243,51 @@ bool AbortNode(const std::string &strMessage, const std::string &userMessage) {
     return false;
 }
 
+// pfrom was first to give us the new best block: make it one of the
+// MAX_HB_COMPACT_PEERS peers that send new blocks as compact blocks
+// straight away, and return the peer that did so longest ago to sending
+// inventory
+void static MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom, const uint256& hashBlock)
+{
+    if (pfrom->nVersion < COMPACT_BLOCKS_VERSION || hashBlock != hashBestChain || IsInitialBlockDownload())
+        return;
+
+    LOCK(cs_main);
+    list<NodeId>::iterator it = std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->id);
+    if (it != lNodesAnnouncingHeaderAndIDs.end())
+    {
+        lNodesAnnouncingHeaderAndIDs.erase(it);
+        lNodesAnnouncingHeaderAndIDs.push_back(pfrom->id);
+        return;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        // Forget peers that have gone away
+        set<NodeId> setConnected;
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            setConnected.insert(pnode->id);
+        for (it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end();)
+        {
+            if (setConnected.count(*it))
+                ++it;
+            else
+                it = lNodesAnnouncingHeaderAndIDs.erase(it);
+        }
+
+        if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_COMPACT_PEERS)
+        {
+            NodeId nodeidDrop = lNodesAnnouncingHeaderAndIDs.front();
+            lNodesAnnouncingHeaderAndIDs.pop_front();
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->id == nodeidDrop)
+                    pnode->PushMessage(NetMsgType::SENDCMPCT, false, (uint64_t)1);
+        }
+    }
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->id);
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, true, (uint64_t)1);
+}
+
 
 
 
@@ -374,7 +473,7 @@ bool CTransaction::AreInputsStandard(const MapPrevTx& mapInputs) const
         // be quick, because if there are any operations
         // beside "push data" in the scriptSig the
         // IsStandard() call returns false
-        vector<vector<unsigned char> > stack;
+        CScriptStack stack;
         if (!EvalScript(stack, vin[i].scriptSig, *this, i, 0))
             return false;
 
@@ -755,6 +854,7 @@ int CTxIndex::GetDepthInMainChain() const
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
+    CTxIndex txindex;
     {
         LOCK(cs_main);
         {
@@ -766,16 +866,17 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
             }
         }
         CTxDB txdb("r");
-        CTxIndex txindex;
-        if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
-        {
-            CBlock block;
-            if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                hashBlock = block.GetHash();
-            return true;
-        }
+        if (!txdb.ReadTxIndex(hash, txindex))
+            return false;
     }
-    return false;
+
+    // Block files are only ever appended to, so reading them needs no lock
+    if (!tx.ReadFromDisk(txindex.pos))
+        return false;
+    CBlock block;
+    if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        hashBlock = block.GetHash();
+    return true;
 }
 
 
@@ -938,10 +1039,15 @@ int64_t GetProofOfStakeReward(int64_t nCoinAge, int64_t nFees, int nHeight)
 //
 // maximum nBits value could possible be required nTime after
 //
-unsigned int ComputeMaxBits(CBigNum bnTargetLimit, unsigned int nBase, int64_t nTime)
+unsigned int ComputeMaxBits(uint256 bnTargetLimit, unsigned int nBase, int64_t nTime)
 {
-    CBigNum bnResult;
-    bnResult.SetCompact(nBase);
+    // nBase is the nBits of an accepted block, so it is at most the limit
+    // and the doubling below stays within 2 * bnTargetLimit
+    bool fOverflow;
+    uint256 bnResult;
+    bnResult.SetCompact(nBase, NULL, &fOverflow);
+    if (fOverflow || bnResult > bnTargetLimit)
+        return bnTargetLimit.GetCompact();
     bnResult *= 2;
     while (nTime > 0 && bnResult < bnTargetLimit)
     {
@@ -984,7 +1090,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime)
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
 
-    CBigNum bnTargetLimit = fProofOfStake ? bnProofOfStakeLimit : bnProofOfWorkLimit;
+    uint256 bnTargetLimit = fProofOfStake ? bnProofOfStakeLimit : bnProofOfWorkLimit;
 
     if (pindexLast == NULL)
         return bnTargetLimit.GetCompact(); // genesis block
@@ -1002,13 +1108,25 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    bool fNegative, fOverflow;
+    uint256 bnNew;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative, &fOverflow);
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
-
-    if (bnNew <= 0 || bnNew > bnTargetLimit)
+    uint64_t nMul = (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing;
+    uint64_t nDiv = (nInterval + 1) * nTargetSpacing;
+    if (fNegative || fOverflow || bnNew == 0)
+        return bnTargetLimit.GetCompact();
+
+    // bnNew * nMul / nDiv, computed as (q * nDiv + r) * nMul / nDiv so that
+    // no intermediate needs more than 256 bits. A quotient whose product
+    // with nMul has more bits than the limit is clamped without multiplying.
+    uint256 bnQuot = bnNew / nDiv;
+    uint256 bnRem = bnNew - bnQuot * nDiv;
+    if (bnQuot != 0 && (int)(bnQuot.bits() + uint256(nMul).bits()) - 2 >= (int)bnTargetLimit.bits())
+        return bnTargetLimit.GetCompact();
+    bnNew = bnQuot * nMul + bnRem * nMul / nDiv;
+
+    if (bnNew == 0 || bnNew > bnTargetLimit)
         bnNew = bnTargetLimit;
 
     return bnNew.GetCompact();
@@ -1017,15 +1135,16 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1381,13 +1500,173 @@ bool CTransaction::ClientConnectInputs()
 
 
 
+// Address index type and hash of the destination an output pays, if any
+static bool GetAddressIndexDestination(const CScript& scriptPubKey, unsigned char& nType, uint160& hashBytes)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+    if (const CKeyID* keyID = boost::get<CKeyID>(&dest))
+    {
+        nType = ADDRESS_INDEX_KEYHASH;
+        hashBytes = *keyID;
+        return true;
+    }
+    if (const CScriptID* scriptID = boost::get<CScriptID>(&dest))
+    {
+        nType = ADDRESS_INDEX_SCRIPTHASH;
+        hashBytes = *scriptID;
+        return true;
+    }
+    return false;
+}
+
+// Address index records for connecting tx at nHeight: a debit for every
+// input and a credit for every output, and the matching changes to the
+// unspent outputs. inputs holds the transactions tx spends from.
+void GetAddressIndexConnect(const CTransaction& tx, const MapPrevTx& inputs, int nHeight,
+                            AddressIndexVector& vIndex, AddressUnspentVector& vUnspent)
+{
+    uint256 hashTx = tx.GetHash();
+    unsigned char nType;
+    uint160 hashBytes;
+
+    if (!tx.IsCoinBase())
+    {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+            if (mi == inputs.end() || prevout.n >= mi->second.second.vout.size())
+                continue;
+            const CTxOut& txout = mi->second.second.vout[prevout.n];
+            if (!GetAddressIndexDestination(txout.scriptPubKey, nType, hashBytes))
+                continue;
+            vIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, true), -txout.nValue));
+            vUnspent.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue()));
+        }
+    }
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        if (!GetAddressIndexDestination(txout.scriptPubKey, nType, hashBytes))
+            continue;
+        vIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, false), txout.nValue));
+        vUnspent.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, hashTx, i),
+                                     CAddressUnspentValue(txout.nValue, txout.scriptPubKey, nHeight)));
+    }
+}
+
+// The records GetAddressIndexConnect made for tx, to take back out when it is
+// disconnected. The outputs it spent are unspent again, at the height of the
+// block that created them, as given by mapInputHeights.
+bool GetAddressIndexDisconnect(const CTransaction& tx, const MapPrevTx& inputs, const map<uint256, int>& mapInputHeights,
+                               int nHeight, AddressIndexVector& vIndex, AddressUnspentVector& vUnspent)
+{
+    uint256 hashTx = tx.GetHash();
+    unsigned char nType;
+    uint160 hashBytes;
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        if (!GetAddressIndexDestination(txout.scriptPubKey, nType, hashBytes))
+            continue;
+        vIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, false), txout.nValue));
+        vUnspent.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, hashTx, i), CAddressUnspentValue()));
+    }
+
+    if (tx.IsCoinBase())
+        return true;
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+        map<uint256, int>::const_iterator miHeight = mapInputHeights.find(prevout.hash);
+        if (mi == inputs.end() || miHeight == mapInputHeights.end() || prevout.n >= mi->second.second.vout.size())
+            return error("GetAddressIndexDisconnect() : input %s not found", prevout.ToString().c_str());
+        const CTxOut& txout = mi->second.second.vout[prevout.n];
+        if (!GetAddressIndexDestination(txout.scriptPubKey, nType, hashBytes))
+            continue;
+
+        vIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, true), -txout.nValue));
+        vUnspent.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, prevout.hash, prevout.n),
+                                     CAddressUnspentValue(txout.nValue, txout.scriptPubKey, miHeight->second)));
+    }
+    return true;
+}
+
+// The transactions block spends from and the heights of their blocks, for
+// GetAddressIndexDisconnect. Must run before the block's inputs are
+// disconnected, while the tx index still has its own transactions.
+static bool ReadAddressIndexInputs(CTxDB& txdb, const CBlock& block, int nHeight,
+                                   MapPrevTx& inputs, map<uint256, int>& mapInputHeights)
+{
+    // Spends within the block need no disk reads
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        uint256 hashTx = tx.GetHash();
+        inputs[hashTx].second = tx;
+        mapInputHeights[hashTx] = nHeight;
+    }
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const uint256& hashPrev = txin.prevout.hash;
+            if (inputs.count(hashPrev))
+                continue;
+            CTransaction txPrev;
+            CTxIndex txindex;
+            if (!txdb.ReadDiskTx(hashPrev, txPrev, txindex))
+                return error("ReadAddressIndexInputs() : input %s not found", hashPrev.ToString().c_str());
+
+            CBlock blockPrev;
+            if (!blockPrev.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                return error("ReadAddressIndexInputs() : block of %s not readable", hashPrev.ToString().c_str());
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(blockPrev.GetHash());
+            if (mi == mapBlockIndex.end())
+                return error("ReadAddressIndexInputs() : block of %s not indexed", hashPrev.ToString().c_str());
+
+            inputs[hashPrev] = make_pair(txindex, txPrev);
+            mapInputHeights[hashPrev] = mi->second->nHeight;
+        }
+    }
+    return true;
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Address index records are gathered first, while the tx index still
+    // finds every transaction this block spends from. Reverse order here
+    // too, so that an output created and spent within the block is put back
+    // and then erased again
+    AddressIndexVector vAddressIndex;
+    AddressUnspentVector vAddressUnspent;
+    if (fAddressIndex)
+    {
+        MapPrevTx inputs;
+        map<uint256, int> mapInputHeights;
+        if (!ReadAddressIndexInputs(txdb, *this, pindex->nHeight, inputs, mapInputHeights))
+            return false;
+        for (int i = vtx.size()-1; i >= 0; i--)
+            if (!GetAddressIndexDisconnect(vtx[i], inputs, mapInputHeights, pindex->nHeight, vAddressIndex, vAddressUnspent))
+                return false;
+    }
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb))
             return false;
 
+    if (fAddressIndex && (!txdb.EraseAddressIndex(vAddressIndex) || !txdb.UpdateAddressUnspentIndex(vAddressUnspent)))
+        return error("DisconnectBlock() : updating address index failed");
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1399,8 +1678,7 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     }
 
     // ppcoin: clean up wallet after disconnecting coinstake
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, false, false);
+    SyncBlockWithWallets(*this, false);
 
     return true;
 }
@@ -1421,6 +1699,8 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    AddressIndexVector vAddressIndex;
+    AddressUnspentVector vAddressUnspent;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1486,6 +1766,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                 return false;
         }
 
+        if (fAddressIndex && !fJustCheck)
+            GetAddressIndexConnect(tx, mapInputs, pindex->nHeight, vAddressIndex, vAddressUnspent);
+
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
@@ -1644,6 +1927,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    if (fAddressIndex)
+    {
+        if (!txdb.UpdateAddressIndex(vAddressIndex) || !txdb.UpdateAddressUnspentIndex(vAddressUnspent))
+            return error("ConnectBlock() : updating address index failed");
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1655,8 +1944,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     }
 
     // Watch for transactions paying to me
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        SyncWithWallets(tx, this, true);
+    SyncBlockWithWallets(*this, true);
+
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        NotifyTransaction(tx);
 
     if (!IsInitialBlockDownload())
         masternodePayments.ProcessBlock(pindex->nHeight + 1);
@@ -1763,6 +2054,34 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 }
 
 
+static CChainSnapshotRef pChainSnapshot = std::make_shared<const CChainSnapshot>();
+
+CChainSnapshotRef GetChainSnapshot()
+{
+    return std::atomic_load(&pChainSnapshot);
+}
+
+void UpdateChainSnapshot()
+{
+    AssertLockHeld(cs_main);
+
+    std::shared_ptr<CChainSnapshot> pnew = std::make_shared<CChainSnapshot>();
+    if (pindexBest)
+    {
+        pnew->pindexTip = pindexBest;
+        pnew->hashTip = pindexBest->GetBlockHash();
+        pnew->nHeight = pindexBest->nHeight;
+        pnew->nTime = pindexBest->GetBlockTime();
+        pnew->nMoneySupply = pindexBest->nMoneySupply;
+        pnew->nChainTrust = pindexBest->nChainTrust;
+        pnew->pindexLastPoW = GetLastBlockIndex(pindexBest, false);
+        pnew->pindexLastPoS = GetLastBlockIndex(pindexBest, true);
+    }
+
+    std::atomic_store(&pChainSnapshot, CChainSnapshotRef(pnew));
+}
+
+
 // Called from inside SetBestChain: attaches a block to the new best chain being built
 bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 {
@@ -1869,6 +2188,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    UpdateChainSnapshot();
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
@@ -1896,6 +2216,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
             strMiscWarning = _("Warning: This version is obsolete, upgrade required!");
     }
 
+    NotifyBlock(*this);
+
     std::string strCmd = GetArg("-blocknotify", "");
 
     if (!fIsInitialDownload && !strCmd.empty())
@@ -2215,10 +2537,33 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that asked for compact blocks get the block itself right away,
+        // all of them from one serialized copy
+        CDataStream ssCmpct(SER_NETWORK, PROTOCOL_VERSION);
+        ssCmpct << CBlockHeaderAndShortTxIDs(*this);
+        CNetPayloadRef cmpctblock(new CNetPayload(ssCmpct));
+        CInv inv(MSG_BLOCK, hash);
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (pnode->fPreferCompactBlocks)
+            {
+                bool fKnown;
+                {
+                    LOCK(pnode->cs_inventory);
+                    fKnown = pnode->filterInventoryKnown.contains(inv.hash);
+                }
+                if (!fKnown)
+                {
+                    pnode->AddInventoryKnown(inv);
+                    pnode->PushSharedMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+                }
+            }
+            else
+                pnode->PushInventory(inv);
+        }
     }
 
     // ppcoin: check pending sync-checkpoint
@@ -2229,13 +2574,17 @@ bool CBlock::AcceptBlock()
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    if (bnTarget <= 0)
+    if (fNegative || fOverflow || bnTarget == 0)
         return 0;
 
-    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    // 2**256 / (bnTarget+1) does not fit a uint256, but since bnTarget+1 is
+    // at most 2**256 it equals (2**256 - bnTarget - 1) / (bnTarget+1) + 1,
+    // which is ~bnTarget / (bnTarget+1) + 1
+    return (~bnTarget / (bnTarget + 1)) + 1;
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -2274,16 +2623,17 @@ bool ProcessNewBlock(CNode* pfrom, CBlock* pblock)
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
         int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        CBigNum bnNewBlock;
-        bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        bool fNegative, fOverflow;
+        uint256 bnNewBlock;
+        bnNewBlock.SetCompact(pblock->nBits, &fNegative, &fOverflow);
+        uint256 bnRequired;
 
         if (pblock->IsProofOfStake())
             bnRequired.SetCompact(ComputeMinStake(GetLastBlockIndex(pcheckpoint, true)->nBits, deltaTime, pblock->nTime));
         else
             bnRequired.SetCompact(ComputeMinWork(GetLastBlockIndex(pcheckpoint, false)->nBits, deltaTime));
 
-        if (bnNewBlock > bnRequired)
+        if (!fNegative && (fOverflow || bnNewBlock > bnRequired))
         {
             if (pfrom)
                 pfrom->Misbehaving(100);
@@ -2532,6 +2882,10 @@ bool LoadBlockIndex(bool fAllowNew)
     CTxDB txdb("cr+");
     if (!txdb.LoadBlockIndex())
         return false;
+    {
+        LOCK(cs_main);
+        UpdateChainSnapshot();
+    }
 
     //
     // Init with genesis block
@@ -2583,7 +2937,7 @@ bool LoadBlockIndex(bool fAllowNew)
         if (true && (block.GetHash() != (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))) {
             // This will figure out a valid hash and Nonce if you're
             // creating a different genesis block:
-            uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+            uint256 hashTarget = uint256().SetCompact(block.nBits);
             while (block.GetHash() > hashTarget)
             {
                 ++block.nNonce;
@@ -2641,6 +2995,105 @@ bool LoadBlockIndex(bool fAllowNew)
     return true;
 }
 
+// Index the whole main chain, as when -addressindex is first turned on.
+// Blocks are committed a thousand at a time; the flag that marks the index
+// complete is written with the last of them, so an interrupted build starts
+// over on the next start.
+static bool BuildAddressIndex(CTxDB& txdb)
+{
+    if (!txdb.WipeAddressIndex())
+        return false;
+
+    uiInterface.InitMessage(_("Building address index..."));
+    LogPrintf("Building address index...\n");
+    int64_t nStart = GetTimeMillis();
+    int nBlocks = 0;
+    uint64_t nRecords = 0;
+
+    // Previous transactions are read through a second handle, so that their
+    // lookups do not scan the pending batch
+    CTxDB txdbRead("r");
+    txdb.TxnBegin();
+    for (CBlockIndex* pindex = pindexGenesisBlock ? pindexGenesisBlock->pnext : NULL; pindex; pindex = pindex->pnext)
+    {
+        if (fRequestShutdown)
+        {
+            txdb.TxnAbort();
+            LogPrintf("Address index build interrupted at height %d\n", pindex->nHeight);
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+        {
+            txdb.TxnAbort();
+            return error("BuildAddressIndex() : ReadFromDisk failed at height %d", pindex->nHeight);
+        }
+
+        AddressIndexVector vAddressIndex;
+        AddressUnspentVector vAddressUnspent;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            MapPrevTx mapInputs;
+            if (!tx.IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                {
+                    if (mapInputs.count(txin.prevout.hash))
+                        continue;
+                    pair<CTxIndex, CTransaction>& input = mapInputs[txin.prevout.hash];
+                    if (!txdbRead.ReadDiskTx(txin.prevout.hash, input.second, input.first))
+                    {
+                        txdb.TxnAbort();
+                        return error("BuildAddressIndex() : input %s of %s not found", txin.prevout.hash.ToString().c_str(), tx.GetHash().ToString().c_str());
+                    }
+                }
+            }
+            GetAddressIndexConnect(tx, mapInputs, pindex->nHeight, vAddressIndex, vAddressUnspent);
+        }
+        if (!txdb.UpdateAddressIndex(vAddressIndex) || !txdb.UpdateAddressUnspentIndex(vAddressUnspent))
+        {
+            txdb.TxnAbort();
+            return error("BuildAddressIndex() : writing address index failed");
+        }
+        nRecords += vAddressIndex.size();
+
+        if (++nBlocks % 1000 == 0)
+        {
+            if (!txdb.TxnCommit())
+                return error("BuildAddressIndex() : TxnCommit failed");
+            txdb.TxnBegin();
+        }
+        if (nBlocks % 10000 == 0)
+            LogPrintf("Address index: %d blocks, %u records, %dms\n", nBlocks, nRecords, GetTimeMillis() - nStart);
+    }
+
+    if (!txdb.WriteAddressIndexFlag(true) || !txdb.TxnCommit())
+        return error("BuildAddressIndex() : TxnCommit failed");
+
+    int64_t nElapsed = std::max(GetTimeMillis() - nStart, (int64_t)1);
+    LogPrintf("Built address index: %d blocks, %u records in %dms (%.1f blocks/s)\n",
+              nBlocks, nRecords, nElapsed, nBlocks * 1000.0 / nElapsed);
+    return true;
+}
+
+bool InitAddressIndex()
+{
+    LOCK(cs_main);
+    CTxDB txdb("r+");
+    bool fIndexed;
+    txdb.ReadAddressIndexFlag(fIndexed);
+    if (fIndexed == fAddressIndex)
+        return true;
+
+    if (!fAddressIndex)
+    {
+        LogPrintf("Address index turned off, removing it\n");
+        return txdb.WipeAddressIndex();
+    }
+    return BuildAddressIndex(txdb);
+}
+
 
 
 void PrintBlockTree()
@@ -2897,11 +3350,62 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Send block from disk
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                bool send = mi != mapBlockIndex.end();
+
+                // disconnect node in case we have reached the outbound limit for serving historical blocks
+                // never disconnect whitelisted nodes
+                if (send && !pfrom->fWhitelisted && g_connman->OutboundTargetReached(true) &&
+                    (pindexBest->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE || inv.type == MSG_FILTERED_BLOCK))
+                {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+
+                    //disconnect node
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
+
+                if (send)
                 {
                     CBlock block;
                     block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage(NetMsgType::BLOCK, block);
+                    if (inv.type == MSG_BLOCK)
+                        pfrom->PushMessage(NetMsgType::BLOCK, block);
+                    else // MSG_FILTERED_BLOCK
+                    {
+                        // Match under cs_filter but send after releasing it:
+                        // SendMessages takes cs_inventory before cs_filter
+                        bool fFilter = false;
+                        CMerkleBlock merkleBlock;
+                        {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter)
+                            {
+                                merkleBlock = CMerkleBlock(block, *pfrom->pfilter);
+                                fFilter = true;
+                            }
+                        }
+                        if (fFilter)
+                        {
+                            pfrom->PushMessage(NetMsgType::MERKLEBLOCK, merkleBlock);
+                            // The merkleblock only carries hashes, so also send the matched
+                            // transactions the peer has not seen yet. There is no way to ask
+                            // for them separately, so this saves a round trip at the cost of
+                            // the odd duplicate.
+                            typedef std::pair<unsigned int, uint256> PairType;
+                            BOOST_FOREACH(const PairType& pair, merkleBlock.vMatchedTxn)
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->filterInventoryKnown.contains(pair.second);
+                                }
+                                if (!fKnown)
+                                    pfrom->PushMessage(NetMsgType::TX, block.vtx[pair.first]);
+                            }
+                        }
+                        // else
+                            // no response
+                    }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -2922,9 +3426,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CNetPayloadRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage(inv.GetCommand(), (*mi).second);
                         pushed = true;
                     }
                 }
@@ -3167,6 +3671,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     else if (strCommand == NetMsgType::VERACK)
     {
         pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Tell the peer we understand compact blocks, version 1. Only the few
+        // peers that give us new blocks first are asked to send them unasked.
+        if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+            pfrom->PushMessage(NetMsgType::SENDCMPCT, false, (uint64_t)1);
+    }
+
+
+    else if (strCommand == NetMsgType::SENDCMPCT)
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1)
+            pfrom->fPreferCompactBlocks = fAnnounceUsingCMPCTBLOCK;
     }
 
 
@@ -3202,7 +3721,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnown filters of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -3416,37 +3935,40 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             //these allow masternodes to publish a limited amount of free transactions
             vRecv >> tx >> vin >> vchSig >> sigTime;
 
-            BOOST_FOREACH(CMasternode& mn, vecMasternodes) {
-                if(mn.vin == vin) {
-                    if(!mn.allowFreeTx){
-                        //multiple peers can send us a valid masternode transaction
-                        if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
-                        return true;
-                    }
+            CMasternode mn;
+            if(mnodeman.Get(vin, mn)) {
+                if(!mn.allowFreeTx){
+                    //multiple peers can send us a valid masternode transaction
+                    if(fDebug) LogPrintf("dstx: Masternode sending too many transactions %s\n", tx.GetHash().ToString().c_str());
+                    return true;
+                }
 
-                    std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+                std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
 
-                    std::string errorMessage = "";
-                    if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
-                        LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
-                        //pfrom->Misbehaving(20);
-                        return false;
-                    }
+                std::string errorMessage = "";
+                if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
+                    LogPrintf("dstx: Got bad masternode address signature %s \n", vin.ToString().c_str());
+                    //pfrom->Misbehaving(20);
+                    return false;
+                }
 
-                    LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
+                LogPrintf("dstx: Got Masternode transaction %s\n", tx.GetHash().ToString().c_str());
 
-                    allowFree = true;
-                    mn.allowFreeTx = false;
+                allowFree = true;
+                {
+                    LOCK(cs_masternodes);
+                    CMasternode* pmn = mnodeman.Find(vin);
+                    if(pmn != NULL) pmn->allowFreeTx = false;
+                }
 
-                    if(!mapDarksendBroadcastTxes.count(tx.GetHash())){
-                        CDarksendBroadcastTx dstx;
-                        dstx.tx = tx;
-                        dstx.vin = vin;
-                        dstx.vchSig = vchSig;
-                        dstx.sigTime = sigTime;
+                if(!mapDarksendBroadcastTxes.count(tx.GetHash())){
+                    CDarksendBroadcastTx dstx;
+                    dstx.tx = tx;
+                    dstx.vin = vin;
+                    dstx.vchSig = vchSig;
+                    dstx.sigTime = sigTime;
 
-                        mapDarksendBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
-                    }
+                    mapDarksendBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
                 }
             }
         }
@@ -3520,8 +4042,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_BLOCK, hashBlock);
         pfrom->AddInventoryKnown(inv);
 
+        {
+            // The full block makes waiting for a reconstruction of it moot
+            LOCK(cs_main);
+            mapCompactBlocksInFlight.erase(hashBlock);
+        }
+
         if (ProcessNewBlock(pfrom, &block))
+        {
             mapAlreadyAskedFor.erase(inv);
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom, hashBlock);
+        }
         // else
         // {
         //     // Be more aggressive with blockchain download. Send getblocks() message after
@@ -3538,6 +4069,170 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == NetMsgType::CMPCTBLOCK)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        if (fDebug)
+            LogPrintf("received cmpctblock %s, %u txs\n", hashBlock.ToString().substr(0,20).c_str(), cmpctblock.BlockTxCount());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+            return true;
+
+        // Drop reconstructions whose peer never answered
+        int64_t nNow = GetTime();
+        for (map<uint256, CCompactBlockInFlight>::iterator mi = mapCompactBlocksInFlight.begin(); mi != mapCompactBlocksInFlight.end();)
+        {
+            if (mi->second.nTime < nNow - COMPACT_BLOCK_TIMEOUT)
+                mapCompactBlocksInFlight.erase(mi++);
+            else
+                ++mi;
+        }
+
+        // Another announcer is already filling this block in. Rather than
+        // wait on it alone, ask this one for the whole block too.
+        map<uint256, CCompactBlockInFlight>::iterator miInFlight = mapCompactBlocksInFlight.find(hashBlock);
+        if (miInFlight != mapCompactBlocksInFlight.end())
+        {
+            if (miInFlight->second.nodeid != pfrom->id && miInFlight->second.nFallbacks < MAX_COMPACT_BLOCK_FALLBACKS)
+            {
+                miInFlight->second.nFallbacks++;
+                pfrom->PushMessage(NetMsgType::GETDATA, vector<CInv>(1, inv));
+            }
+            return true;
+        }
+
+        PartiallyDownloadedBlock partialBlock;
+        ReadStatus status = partialBlock.InitData(cmpctblock, mempool, mapOrphanTransactions);
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("ProcessMessage() : invalid cmpctblock %s", hashBlock.ToString().substr(0,20).c_str());
+        }
+
+        // Without the parent there is nothing to connect the block to, and
+        // the orphan logic wants the full block anyway
+        if (status == READ_STATUS_FAILED || !mapBlockIndex.count(cmpctblock.header.hashPrevBlock) ||
+            mapCompactBlocksInFlight.size() >= MAX_COMPACT_BLOCKS_IN_FLIGHT)
+        {
+            pfrom->PushMessage(NetMsgType::GETDATA, vector<CInv>(1, inv));
+            return true;
+        }
+
+        BlockTransactionsRequest req;
+        req.blockhash = hashBlock;
+        req.indexes = partialBlock.GetMissing();
+        if (!req.indexes.empty())
+        {
+            CCompactBlockInFlight& inflight = mapCompactBlocksInFlight[hashBlock];
+            inflight.nodeid = pfrom->id;
+            inflight.nTime = nNow;
+            inflight.nFallbacks = 0;
+            inflight.partialBlock = partialBlock;
+            pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+            return true;
+        }
+
+        CBlock block;
+        status = partialBlock.FillBlock(block, vector<CTransaction>());
+        if (status != READ_STATUS_OK)
+        {
+            pfrom->PushMessage(NetMsgType::GETDATA, vector<CInv>(1, inv));
+            return true;
+        }
+
+        if (ProcessNewBlock(pfrom, &block))
+        {
+            mapAlreadyAskedFor.erase(inv);
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom, block.GetHash());
+        }
+        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    }
+
+
+    else if (strCommand == NetMsgType::GETBLOCKTXN)
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+        {
+            LogPrint("net", "peer %d sent getblocktxn for unknown block %s\n", pfrom->id, req.blockhash.ToString());
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk(mi->second))
+            return error("ProcessMessage() : getblocktxn failed to read block %s", req.blockhash.ToString().c_str());
+
+        // Compact blocks are only for the tip, an old block is sent in full
+        if (mi->second->nHeight < nBestHeight - 10)
+        {
+            pfrom->PushMessage(NetMsgType::BLOCK, block);
+            return true;
+        }
+
+        BlockTransactions resp(req);
+        resp.txn.reserve(req.indexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.indexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("ProcessMessage() : getblocktxn with out-of-bounds tx index %u", nIndex);
+            }
+            resp.txn.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+    }
+
+
+    else if (strCommand == NetMsgType::BLOCKTXN)
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+        map<uint256, CCompactBlockInFlight>::iterator mi = mapCompactBlocksInFlight.find(resp.blockhash);
+        if (mi == mapCompactBlocksInFlight.end() || mi->second.nodeid != pfrom->id)
+        {
+            LogPrint("net", "peer %d sent unexpected blocktxn for %s\n", pfrom->id, resp.blockhash.ToString());
+            return true;
+        }
+
+        CBlock block;
+        ReadStatus status = mi->second.partialBlock.FillBlock(block, resp.txn);
+        mapCompactBlocksInFlight.erase(mi);
+
+        CInv inv(MSG_BLOCK, resp.blockhash);
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("ProcessMessage() : invalid blocktxn for %s", resp.blockhash.ToString().substr(0,20).c_str());
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            pfrom->PushMessage(NetMsgType::GETDATA, vector<CInv>(1, inv));
+            return true;
+        }
+
+        if (ProcessNewBlock(pfrom, &block))
+        {
+            mapAlreadyAskedFor.erase(inv);
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom, block.GetHash());
+        }
+        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    }
+
+
     else if (strCommand == NetMsgType::GETADDR)
     {
         // Don't return addresses older than nCutOff timestamp
@@ -3552,13 +4247,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == NetMsgType::MEMPOOL)
     {
+        if (g_connman->OutboundTargetReached(false) && !pfrom->fWhitelisted)
+        {
+            LogPrint("net", "mempool request with bandwidth limit reached, disconnect peer=%d\n", pfrom->GetId());
+            pfrom->fDisconnect = true;
+            return true;
+        }
+
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
         vector<CInv> vInv;
+        LOCK(pfrom->cs_filter);
         for (unsigned int i = 0; i < vtxid.size(); i++) {
+            if (pfrom->pfilter)
+            {
+                CTransaction tx;
+                if (!mempool.lookup(vtxid[i], tx) || !pfrom->pfilter->IsRelevantAndUpdate(tx, vtxid[i]))
+                    continue;
+            }
             CInv inv(MSG_TX, vtxid[i]);
             vInv.push_back(inv);
-            if (i == (MAX_INV_SZ - 1))
+            if (vInv.size() == MAX_INV_SZ)
                 break;
         }
         if (vInv.size() > 0)
@@ -3566,6 +4275,54 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == NetMsgType::FILTERLOAD)
+    {
+        CBloomFilter filter;
+        vRecv >> filter;
+
+        if (!filter.IsWithinSizeConstraints())
+            // There is no excuse for sending a too-large filter
+            pfrom->Misbehaving(100);
+        else
+        {
+            LOCK(pfrom->cs_filter);
+            delete pfrom->pfilter;
+            pfrom->pfilter = new CBloomFilter(filter);
+            pfrom->pfilter->UpdateEmptyFull();
+        }
+        pfrom->fRelayTxes = true;
+    }
+
+
+    else if (strCommand == NetMsgType::FILTERADD)
+    {
+        vector<unsigned char> vData;
+        vRecv >> vData;
+
+        // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
+        // and thus, the maximum size any matched object can have) in a filteradd message
+        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
+            pfrom->Misbehaving(100);
+        else
+        {
+            LOCK(pfrom->cs_filter);
+            if (pfrom->pfilter)
+                pfrom->pfilter->insert(vData);
+            else
+                pfrom->Misbehaving(100);
+        }
+    }
+
+
+    else if (strCommand == NetMsgType::FILTERCLEAR)
+    {
+        LOCK(pfrom->cs_filter);
+        delete pfrom->pfilter;
+        pfrom->pfilter = NULL;
+        pfrom->fRelayTxes = true;
+    }
+
+
     else if (strCommand == NetMsgType::PING)
     {
         if (pfrom->nVersion > BIP0031_VERSION)
@@ -3767,11 +4524,10 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, hashed on the socket thread as the data arrived
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        memcpy(&nChecksum, &msg.hashData, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -3821,7 +4577,11 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
+    {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; ++itDone)
+            pfrom->RecycleRecvBuffer(itDone->vRecv);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
@@ -3856,9 +4616,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
+                    // Periodically clear addrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
+                        pnode->addrKnown.reset();
 
                     // Rebroadcast our address
                     if (fListen)
@@ -3881,9 +4641,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                if (!pto->addrKnown.contains(addr.GetKey()))
                 {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000)
@@ -3910,7 +4670,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -3940,16 +4700,29 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // Peers that asked for no transactions, or loaded a bloom
+                // filter, only hear about the ones they want
+                if (inv.type == MSG_TX)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
+                    if (!pto->fRelayTxes)
+                        continue;
+                    LOCK(pto->cs_filter);
+                    if (pto->pfilter)
                     {
-                        pto->PushMessage(NetMsgType::INV, vInv);
-                        vInv.clear();
+                        CTransaction tx;
+                        if (!mempool.lookup(inv.hash, tx) || !pto->pfilter->IsRelevantAndUpdate(tx, inv.hash))
+                            continue;
                     }
                 }
+
+                // known-check above also catches duplicates queued in this batch
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
+                {
+                    pto->PushMessage(NetMsgType::INV, vInv);
+                    vInv.clear();
+                }
             }
             pto->vInventoryToSend = vInvWait;
         }
@@ -23,6 +23,7 @@
 
 #include <iostream>
 #include <list>
+#include <memory>
 
 using namespace std;
 
@@ -119,6 +120,7 @@ extern int64_t nTransactionFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
+extern bool fAddressIndex;
 extern unsigned int nDerivationMethodIndex;
 
 extern bool fEnforceCanonical;
@@ -138,6 +140,8 @@ bool ProcessNewBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 bool LoadExternalBlockFile(FILE* fileIn);
 bool LoadBlockIndex(bool fAllowNew=true);
+/** Build or remove the address index to match -addressindex */
+bool InitAddressIndex();
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 /** See whether the protocol update is enforced for connected nodes */
@@ -234,6 +238,30 @@ public:
 };
 
 
+/** Compact encoding of a CDiskTxPos for the transaction index: the file and
+ *  block position as varints, and the transaction's offset within its block
+ *  (normally under a few kilobytes) rather than its absolute file offset.
+ */
+class CDiskTxPosCompressor
+{
+private:
+    CDiskTxPos& pos;
+
+public:
+    CDiskTxPosCompressor(CDiskTxPos& posIn) : pos(posIn) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        unsigned int nTxOffset = pos.nTxPos - pos.nBlockPos;
+        READWRITE(VARINT(pos.nFile));
+        READWRITE(VARINT(pos.nBlockPos));
+        READWRITE(VARINT(nTxOffset));
+        if (fRead)
+            pos.nTxPos = pos.nBlockPos + nTxOffset;
+    )
+};
+
+
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
@@ -762,6 +790,68 @@ protected:
 
 
 
+/** Compact encoding of CTxIndex::vSpent: the number of outputs, a bitmap
+ *  with a bit set for each spent output, then the compressed position of the
+ *  spending transaction for each set bit. Unspent outputs cost one bit
+ *  instead of a null 12-byte CDiskTxPos.
+ */
+class CTxSpentCompressor
+{
+private:
+    std::vector<CDiskTxPos>& vSpent;
+
+public:
+    CTxSpentCompressor(std::vector<CDiskTxPos>& vSpentIn) : vSpent(vSpentIn) { }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nOutputs = vSpent.size();
+        unsigned int nSize = GetSizeOfVarInt(nOutputs) + (nOutputs + 7) / 8;
+        for (unsigned int i = 0; i < nOutputs; i++)
+            if (!vSpent[i].IsNull())
+                nSize += ::GetSerializeSize(CDiskTxPosCompressor(vSpent[i]), nType, nVersion);
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        unsigned int nOutputs = vSpent.size();
+        WriteVarInt(s, nOutputs);
+        for (unsigned int i = 0; i < nOutputs; i += 8)
+        {
+            unsigned char chBits = 0;
+            for (unsigned int j = i; j < nOutputs && j < i + 8; j++)
+                if (!vSpent[j].IsNull())
+                    chBits |= 1 << (j - i);
+            WRITEDATA(s, chBits);
+        }
+        for (unsigned int i = 0; i < nOutputs; i++)
+            if (!vSpent[i].IsNull())
+                ::Serialize(s, CDiskTxPosCompressor(vSpent[i]), nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nOutputs = ReadVarInt<Stream, unsigned int>(s);
+        if (nOutputs > MAX_SIZE)
+            throw std::ios_base::failure("CTxSpentCompressor::Unserialize() : too many outputs");
+        std::vector<unsigned char> vBits((nOutputs + 7) / 8);
+        if (!vBits.empty())
+            s.read((char*)&vBits[0], vBits.size());
+        vSpent.assign(nOutputs, CDiskTxPos());
+        for (unsigned int i = 0; i < nOutputs; i++)
+        {
+            if (vBits[i / 8] & (1 << (i % 8)))
+            {
+                CDiskTxPosCompressor posCompressed(vSpent[i]);
+                ::Unserialize(s, posCompressed, nType, nVersion);
+            }
+        }
+    }
+};
+
 /**  A txdb record that contains the disk location of a transaction and the
  * locations of transactions that spend its outputs.  vSpent is really only
  * used as a flag, but having the location is very helpful for debugging.
@@ -786,9 +876,9 @@ public:
     IMPLEMENT_SERIALIZE
     (
         if (!(nType & SER_GETHASH))
-            READWRITE(nVersion);
-        READWRITE(pos);
-        READWRITE(vSpent);
+            READWRITE(VARINT(nVersion));
+        READWRITE(REF(CDiskTxPosCompressor(REF(pos))));
+        READWRITE(REF(CTxSpentCompressor(REF(vSpent))));
     )
 
     void SetNull()
@@ -1432,6 +1522,43 @@ public:
 };
 
 
+/** The best chain as of its last change, published whole so that readers
+ * (the read-only RPCs) can use it without taking cs_main. Block index
+ * entries are never freed, and what is read through them here (hashes,
+ * heights, nBits, times, pprev) does not change once they are connected;
+ * pnext does, so walk the chain backwards from pindexTip only.
+ */
+class CChainSnapshot
+{
+public:
+    const CBlockIndex* pindexTip;
+    uint256 hashTip;
+    int nHeight;
+    int64_t nTime;
+    int64_t nMoneySupply;
+    uint256 nChainTrust;
+    const CBlockIndex* pindexLastPoW;
+    const CBlockIndex* pindexLastPoS;
+
+    CChainSnapshot()
+    {
+        pindexTip = NULL;
+        hashTip = 0;
+        nHeight = -1;
+        nTime = 0;
+        nMoneySupply = 0;
+        nChainTrust = 0;
+        pindexLastPoW = NULL;
+        pindexLastPoS = NULL;
+    }
+};
+
+typedef std::shared_ptr<const CChainSnapshot> CChainSnapshotRef;
+
+/** The snapshot of the current best chain; never null */
+CChainSnapshotRef GetChainSnapshot();
+/** Republish the snapshot from pindexBest; call with cs_main held whenever the tip changes */
+void UpdateChainSnapshot();
 
 
 extern CTxMemPool mempool;
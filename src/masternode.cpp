@@ -13,8 +13,6 @@ CCriticalSection cs_masternodes;
 /** Masternode manager */
 CMasternodeMan mnodeman;
 
-/** The list of active masternodes */
-std::vector<CMasternode> vecMasternodes;
 /** Object for who's going to get paid on which blocks */
 CMasternodePayments masternodePayments;
 // keep track of masternode votes I've seen
@@ -114,31 +112,40 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
         }
 
         //search existing masternode list, this is where we update existing masternodes with new dsee broadcasts
-        CMasternode* pmn = mnodeman.Find(vin);
-        if (pmn != NULL) {
-            if (fDebug) LogPrintf("dsee - Found existing masternode %s - %s - %s\n", pmn->addr.ToString().c_str(), vin.ToString().c_str(), pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS));
-
-            // count == -1 when it's a new entry
-            //   e.g. We don't want the entry relayed/time updated when we're syncing the list
-            // mn.pubkey = pubkey, IsVinAssociatedWithPubkey is validated once below,
-            //   after that they just need to match
-            if(count == -1 && pmn->pubkey == pubkey && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS)){
-                LogPrintf("dsee - Update masternode last seen for %s\n", addr.ToString().c_str());
-
-                pmn->UpdateLastSeen();
-
-                if(pmn->now < sigTime){ //take the newest entry
-                    LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
-                    pmn->pubkey2 = pubkey2;
-                    pmn->now = sigTime;
-                    pmn->sig = vchSig;
-                    pmn->protocolVersion = protocolVersion;
-                    pmn->addr = addr;
-
-                    RelayDarkSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion);
+        // CheckAndRemove() may free the entry, so it is only used under cs_masternodes
+        bool fFound = false;
+        bool fRelay = false;
+        {
+            LOCK(cs_masternodes);
+            CMasternode* pmn = mnodeman.Find(vin);
+            if (pmn != NULL) {
+                fFound = true;
+                if (fDebug) LogPrintf("dsee - Found existing masternode %s - %s - %s\n", pmn->addr.ToString().c_str(), vin.ToString().c_str(), pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS));
+
+                // count == -1 when it's a new entry
+                //   e.g. We don't want the entry relayed/time updated when we're syncing the list
+                // mn.pubkey = pubkey, IsVinAssociatedWithPubkey is validated once below,
+                //   after that they just need to match
+                if(count == -1 && pmn->pubkey == pubkey && !pmn->UpdatedWithin(MASTERNODE_MIN_DSEE_SECONDS)){
+                    LogPrintf("dsee - Update masternode last seen for %s\n", addr.ToString().c_str());
+
+                    pmn->UpdateLastSeen();
+
+                    if(pmn->now < sigTime){ //take the newest entry
+                        LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
+                        pmn->pubkey2 = pubkey2;
+                        pmn->now = sigTime;
+                        pmn->sig = vchSig;
+                        pmn->protocolVersion = protocolVersion;
+                        pmn->addr = addr;
+                        fRelay = true;
+                    }
                 }
             }
-
+        }
+        if (fFound) {
+            if (fRelay)
+                RelayDarkSendElectionEntry(vin, addr, vchSig, sigTime, pubkey, pubkey2, count, current, lastUpdated, protocolVersion);
             return;
         }
 
@@ -178,7 +185,7 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             // add our masternode
             CMasternode mn(addr, vin, pubkey, vchSig, sigTime, pubkey2, protocolVersion);
             mn.UpdateLastSeen(lastUpdated);
-            vecMasternodes.push_back(mn);
+            mnodeman.Add(mn);
 
             // if it matches our masternodeprivkey, then we've been remotely activated
             if(pubkey2 == activeMasternode.pubKeyMasternode && protocolVersion == PROTOCOL_VERSION){
@@ -224,39 +231,54 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
             return;
         }
 
-        // see if we have this masternode
-        CMasternode* pmn = mnodeman.Find(vin);
-        if (pmn != NULL) {
-            if(fDebug) LogPrintf("dseep - Found corresponding mn for vin=%s addr=%s\n", vin.ToString().c_str(), pmn->addr.ToString());
+        // see if we have this masternode; the signature is checked against a
+        // copy, and the entry itself only written under cs_masternodes, as
+        // CheckAndRemove() may free it in the meantime
+        CMasternode mn;
+        if (mnodeman.Get(vin, mn)) {
+            if(fDebug) LogPrintf("dseep - Found corresponding mn for vin=%s addr=%s\n", vin.ToString().c_str(), mn.addr.ToString());
 
             // take this only if it's newer
-            if(sigTime - pmn->lastDseep > MASTERNODE_MIN_DSEEP_SECONDS) {
-                std::string strMessage = pmn->addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop);
+            if(sigTime - mn.lastDseep > MASTERNODE_MIN_DSEEP_SECONDS) {
+                std::string strMessage = mn.addr.ToString() + boost::lexical_cast<std::string>(sigTime) + boost::lexical_cast<std::string>(stop);
 
-                if(fDebug) LogPrintf("dseep - Got newer sigTime - sigTime=%d lastDseep=%d\n", sigTime, pmn->lastDseep);
+                if(fDebug) LogPrintf("dseep - Got newer sigTime - sigTime=%d lastDseep=%d\n", sigTime, mn.lastDseep);
 
                 std::string errorMessage = "";
-                if(!darkSendSigner.VerifyMessage(pmn->pubkey2, vchSig, strMessage, errorMessage)){
+                if(!darkSendSigner.VerifyMessage(mn.pubkey2, vchSig, strMessage, errorMessage)){
                     LogPrintf("dseep - Got bad masternode address signature %s \n", vin.ToString().c_str());
                     pfrom->Misbehaving(33);
                     return;
                 }
 
-                pmn->lastDseep = sigTime;
-                pmn->Check();
+                bool fRelay = false;
+                {
+                    LOCK(cs_masternodes);
+                    // Gone, changed key or address, or pinged again since the copy
+                    CMasternode* pmn = mnodeman.Find(vin);
+                    if (pmn == NULL || pmn->pubkey2 != mn.pubkey2 || pmn->addr != mn.addr ||
+                        sigTime - pmn->lastDseep <= MASTERNODE_MIN_DSEEP_SECONDS)
+                        return;
 
-                if(pmn->IsEnabled()) {
-                    if(fDebug) LogPrintf("dseep - Masternode is enabled addr=%s\n", pmn->addr.ToString());
+                    pmn->lastDseep = sigTime;
+                    pmn->Check();
 
-                    if(stop) {
-                        pmn->Disable();
-                    } else {
-                        if(fDebug) LogPrintf("dseep - UpdatingLastSeen addr=%s\n", pmn->addr.ToString());
-                        pmn->UpdateLastSeen();
+                    if(pmn->IsEnabled()) {
+                        if(fDebug) LogPrintf("dseep - Masternode is enabled addr=%s\n", pmn->addr.ToString());
+
+                        if(stop) {
+                            pmn->Disable();
+                        } else {
+                            if(fDebug) LogPrintf("dseep - UpdatingLastSeen addr=%s\n", pmn->addr.ToString());
+                            pmn->UpdateLastSeen();
+                        }
+                        fRelay = true;
                     }
+                }
+                if (fRelay) {
                     TRY_LOCK(cs_vNodes, lockNodes);
                     if (!lockNodes) return;
-                    if(fDebug) LogPrintf("dseep - relaying %s - %s \n", pmn->addr.ToString(), vin.prevout.hash.ToString());
+                    if(fDebug) LogPrintf("dseep - relaying %s - %s \n", mn.addr.ToString(), vin.prevout.hash.ToString());
                     RelayDarkSendElectionEntryPing(vin, vchSig, sigTime, stop);
                 }
             }
@@ -295,24 +317,27 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
         } //else, asking for a specific node which is ok
 
         LOCK(cs_masternodes);
-        int count = vecMasternodes.size();
-        int i = 0;
+        int count = mnodeman.size();
+
+        if (vin != CTxIn()) {
+            CMasternode* pmn = mnodeman.Find(vin);
+            if (pmn != NULL && !pmn->addr.IsRFC1918()) {
+                if(fDebug) LogPrintf("dseg - Sending masternode entry - %s \n", pmn->addr.ToString().c_str());
+                pfrom->PushMessage(NetMsgType::DSEE, pmn->vin, pmn->addr, pmn->sig, pmn->now, pmn->pubkey, pmn->pubkey2, count, 0, pmn->lastTimeSeen, pmn->protocolVersion);
+                LogPrintf("dseg - Sent 1 masternode entries to peer %s (%s)\n", pfrom->GetId(), pfrom->addr.ToString().c_str());
+            }
+            return;
+        }
 
-        BOOST_FOREACH(CMasternode mn, vecMasternodes) {
+        int i = 0;
+        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
 
             if(mn.addr.IsRFC1918()) continue; //local network
 
-            if(vin == CTxIn()){
-                mn.Check();
-                if(mn.IsEnabled()) {
-                    if(fDebug) LogPrintf("dseg - Sending masternode entry - %s \n", mn.addr.ToString().c_str());
-                    pfrom->PushMessage(NetMsgType::DSEE, mn.vin, mn.addr, mn.sig, mn.now, mn.pubkey, mn.pubkey2, count, i, mn.lastTimeSeen, mn.protocolVersion);
-                }
-            } else if (vin == mn.vin) {
+            if(mn.IsEnabled()) {
                 if(fDebug) LogPrintf("dseg - Sending masternode entry - %s \n", mn.addr.ToString().c_str());
                 pfrom->PushMessage(NetMsgType::DSEE, mn.vin, mn.addr, mn.sig, mn.now, mn.pubkey, mn.pubkey2, count, i, mn.lastTimeSeen, mn.protocolVersion);
-                LogPrintf("dseg - Sent 1 masternode entries to peer %s (%s)\n", pfrom->GetId(), pfrom->addr.ToString().c_str());
-                return;
             }
             i++;
         }
@@ -396,149 +421,28 @@ void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream
     }
 }
 
-struct CompareValueOnly
+// Order (score, entry) pairs by rank: highest score first, ties going to
+// the lowest collateral so every node ranks the registry the same way
+// whatever its hash order. The current masternode is the one ranked first.
+struct CompareScoreMN
 {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-                    const pair<int64_t, CTxIn>& t2) const
+    bool operator()(const pair<unsigned int, CMasternode*>& t1,
+                    const pair<unsigned int, CMasternode*>& t2) const
     {
-        return t1.first < t2.first;
+        if (t1.first != t2.first)
+            return t1.first > t2.first;
+        return t1.second->vin.prevout < t2.second->vin.prevout;
     }
 };
 
-struct CompareValueOnly2
+struct CompareOutPoint
 {
-    bool operator()(const pair<int64_t, int>& t1,
-                    const pair<int64_t, int>& t2) const
+    bool operator()(const CMasternode& mn1, const CMasternode& mn2) const
     {
-        return t1.first < t2.first;
+        return mn1.vin.prevout < mn2.vin.prevout;
     }
 };
 
-int CountMasternodesAboveProtocol(int protocolVersion)
-{
-    int i = 0;
-    LOCK(cs_masternodes);
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes) {
-        if(mn.protocolVersion < protocolVersion) continue;
-        i++;
-    }
-
-    return i;
-
-}
-
-
-int GetMasternodeByVin(CTxIn& vin)
-{
-    int i = 0;
-    LOCK(cs_masternodes);
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes) {
-        if (mn.vin == vin) return i;
-        i++;
-    }
-
-    return -1;
-}
-
-int GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
-{
-    int i = 0;
-    unsigned int score = 0;
-    int winner = -1;
-    LOCK(cs_masternodes);
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode mn, vecMasternodes) {
-        mn.Check();
-        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) {
-            i++;
-            continue;
-        }
-
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = i;
-        }
-        i++;
-    }
-
-    return winner;
-}
-
-int GetMasternodeByRank(int findRank, int64_t nBlockHeight, int minProtocol)
-{
-    LOCK(cs_masternodes);
-    int i = 0;
-
-    std::vector<pair<unsigned int, int> > vecMasternodeScores;
-
-    i = 0;
-    BOOST_FOREACH(CMasternode mn, vecMasternodes) {
-        mn.Check();
-        if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            i++;
-            continue;
-        }
-
-        uint256 n = mn.CalculateScore(nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        vecMasternodeScores.push_back(make_pair(n2, i));
-        i++;
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly2());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, int)& s, vecMasternodeScores){
-        rank++;
-        if(rank == findRank) return s.second;
-    }
-
-    return -1;
-}
-
-int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight, int minProtocol)
-{
-    LOCK(cs_masternodes);
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
-
-    BOOST_FOREACH(CMasternode& mn, vecMasternodes) {
-        mn.Check();
-
-        if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            continue;
-        }
-
-        uint256 n = mn.CalculateScore(nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
-
-    unsigned int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(s.second == vin) {
-            return rank;
-        }
-    }
-
-    return -1;
-}
-
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
@@ -763,7 +667,7 @@ void CMasternodePayments::CleanPaymentList()
     LOCK(cs_masternodes);
     if(pindexBest == NULL) return;
 
-    int nLimit = std::max(((int)vecMasternodes.size())*2, 1000);
+    int nLimit = std::max(mnodeman.size()*2, 1000);
 
     vector<CMasternodePaymentWinner>::iterator it;
     for(it=vWinning.begin();it<vWinning.end();it++){
@@ -778,13 +682,11 @@ void CMasternodePayments::CleanPaymentList()
 bool CMasternodePayments::ProcessBlock(int nBlockHeight)
 {
     CMasternodePaymentWinner winner;
+    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
     {
-        LOCK(cs_masternodes);
         // scan for winner
         unsigned int score = 0;
-        for(CMasternode mn : vecMasternodes) {
-            mn.Check();
-
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
             if(!mn.IsEnabled()) {
                 continue;
             }
@@ -805,16 +707,16 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
     }
 
     //if we can't find someone to get paid, pick randomly
-    if(winner.nBlockHeight == 0 && vecMasternodes.size() > 0) {
+    if(winner.nBlockHeight == 0 && vMasternodes.size() > 0) {
         LogPrintf("CMasternodePayments::ProcessBlock -- Using random mn as winner\n");
         winner.score = 0;
         winner.nBlockHeight = nBlockHeight;
 
         unsigned int nHeightOffset = nBlockHeight;
-        if (nHeightOffset > vecMasternodes.size() - 1)
-            nHeightOffset = (vecMasternodes.size() - 1) % nHeightOffset;
-        winner.vin = vecMasternodes[nHeightOffset].vin;
-        winner.payee = GetScriptForDestination(vecMasternodes[nHeightOffset].pubkey.GetID());
+        if (nHeightOffset > vMasternodes.size() - 1)
+            nHeightOffset = (vMasternodes.size() - 1) % nHeightOffset;
+        winner.vin = vMasternodes[nHeightOffset].vin;
+        winner.payee = GetScriptForDestination(vMasternodes[nHeightOffset].pubkey.GetID());
     }
 
     CTxDestination address1;
@@ -850,7 +752,7 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
 
 bool CMasternodePayments::ProcessManyBlocks(int nBlockHeight)
 {
-    if (vecMasternodes.empty())
+    if (mnodeman.size() == 0)
         return false;
 
     for (int i = nBlockHeight + 1; i < nBlockHeight + 10; i++)
@@ -921,8 +823,8 @@ void CMasternodeMan::Check()
 {
     LOCK(cs_masternodes);
 
-    BOOST_FOREACH (CMasternode& mn, vecMasternodes) {
-        mn.Check();
+    BOOST_FOREACH(MasternodeMap::value_type& item, mapMasternodes) {
+        item.second.Check();
     }
 }
 
@@ -936,11 +838,12 @@ void CMasternodeMan::CheckAndRemove()
         Check();
 
         //remove inactive and outdated
-        vector<CMasternode>::iterator it = vecMasternodes.begin();
-        while (it != vecMasternodes.end()) {
-            if((*it).nActiveState == CMasternode::MASTERNODE_REMOVE || (*it).nActiveState == CMasternode::MASTERNODE_VIN_SPENT){
-                LogPrintf("CMasternodeMan::CheckAndRemove - Removing inactive masternode %s - %s -- reason: %d\n", (*it).addr.ToString().c_str(), (*it).vin.prevout.hash.ToString(), (*it).nActiveState);
-                it = vecMasternodes.erase(it);
+        MasternodeMap::iterator it = mapMasternodes.begin();
+        while (it != mapMasternodes.end()) {
+            const CMasternode& mn = it->second;
+            if(mn.nActiveState == CMasternode::MASTERNODE_REMOVE || mn.nActiveState == CMasternode::MASTERNODE_VIN_SPENT){
+                LogPrintf("CMasternodeMan::CheckAndRemove - Removing inactive masternode %s - %s -- reason: %d\n", mn.addr.ToString().c_str(), mn.vin.prevout.hash.ToString(), mn.nActiveState);
+                it = mapMasternodes.erase(it);
             } else {
                 ++it;
             }
@@ -968,7 +871,13 @@ void CMasternodeMan::CheckAndRemove()
 void CMasternodeMan::Clear()
 {
     LOCK(cs_masternodes);
-    vecMasternodes.clear();
+    mapMasternodes.clear();
+}
+
+bool CMasternodeMan::Add(const CMasternode& mn)
+{
+    LOCK(cs_masternodes);
+    return mapMasternodes.insert(std::make_pair(mn.vin.prevout, mn)).second;
 }
 
 int CMasternodeMan::CountEnabled(int protocolVersion)
@@ -976,7 +885,9 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? ActiveProtocol() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vecMasternodes) {
+    LOCK(cs_masternodes);
+    BOOST_FOREACH(MasternodeMap::value_type& item, mapMasternodes) {
+        CMasternode& mn = item.second;
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -985,14 +896,250 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     return i;
 }
 
+int CMasternodeMan::CountMasternodesAboveProtocol(int protocolVersion)
+{
+    int i = 0;
+    LOCK(cs_masternodes);
+    BOOST_FOREACH(MasternodeMap::value_type& item, mapMasternodes) {
+        if(item.second.protocolVersion < protocolVersion) continue;
+        i++;
+    }
+
+    return i;
+}
+
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs_masternodes);
 
-    BOOST_FOREACH (CMasternode& mn, vecMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
+    MasternodeMap::iterator it = mapMasternodes.find(vin.prevout);
+    if (it == mapMasternodes.end())
+        return NULL;
+    return &it->second;
+}
+
+bool CMasternodeMan::Get(const CTxIn& vin, CMasternode& mnRet)
+{
+    LOCK(cs_masternodes);
+
+    MasternodeMap::const_iterator it = mapMasternodes.find(vin.prevout);
+    if (it == mapMasternodes.end())
+        return false;
+    mnRet = it->second;
+    return true;
+}
+
+std::vector<CMasternode> CMasternodeMan::GetFullMasternodeVector(bool fCheck)
+{
+    LOCK(cs_masternodes);
+
+    if (fCheck)
+        Check();
+
+    std::vector<CMasternode> vMasternodes;
+    vMasternodes.reserve(mapMasternodes.size());
+    BOOST_FOREACH(const MasternodeMap::value_type& item, mapMasternodes)
+        vMasternodes.push_back(item.second);
+    sort(vMasternodes.begin(), vMasternodes.end(), CompareOutPoint());
+
+    return vMasternodes;
+}
+
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+{
+    unsigned int score = 0;
+    CMasternode* winner = NULL;
+    LOCK(cs_masternodes);
+
+    // scan for winner
+    BOOST_FOREACH(MasternodeMap::value_type& item, mapMasternodes) {
+        CMasternode& mn = item.second;
+        mn.Check();
+        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+
+        // calculate the score for each masternode
+        uint256 n = mn.CalculateScore(nBlockHeight);
+        unsigned int n2 = 0;
+        memcpy(&n2, &n, sizeof(n2));
+
+        // determine the winner, the masternode ranked first
+        if(winner == NULL || CompareScoreMN()(make_pair(n2, &mn), make_pair(score, winner))){
+            score = n2;
+            winner = &mn;
+        }
+    }
+
+    return winner;
+}
+
+CMasternode* CMasternodeMan::GetMasternodeByRank(int findRank, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs_masternodes);
+
+    std::vector<pair<unsigned int, CMasternode*> > vecMasternodeScores;
+
+    BOOST_FOREACH(MasternodeMap::value_type& item, mapMasternodes) {
+        CMasternode& mn = item.second;
+        mn.Check();
+        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+
+        uint256 n = mn.CalculateScore(nBlockHeight);
+        unsigned int n2 = 0;
+        memcpy(&n2, &n, sizeof(n2));
+
+        vecMasternodeScores.push_back(make_pair(n2, &mn));
+    }
+
+    sort(vecMasternodeScores.begin(), vecMasternodeScores.end(), CompareScoreMN());
+
+    int rank = 0;
+    BOOST_FOREACH (PAIRTYPE(unsigned int, CMasternode*)& s, vecMasternodeScores){
+        rank++;
+        if(rank == findRank) return s.second;
     }
+
     return NULL;
 }
 
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs_masternodes);
+    std::vector<pair<unsigned int, CMasternode*> > vecMasternodeScores;
+
+    BOOST_FOREACH(MasternodeMap::value_type& item, mapMasternodes) {
+        CMasternode& mn = item.second;
+        mn.Check();
+
+        if(mn.protocolVersion < minProtocol) continue;
+        if(!mn.IsEnabled()) {
+            continue;
+        }
+
+        uint256 n = mn.CalculateScore(nBlockHeight);
+        unsigned int n2 = 0;
+        memcpy(&n2, &n, sizeof(n2));
+
+        vecMasternodeScores.push_back(make_pair(n2, &mn));
+    }
+
+    sort(vecMasternodeScores.begin(), vecMasternodeScores.end(), CompareScoreMN());
+
+    unsigned int rank = 0;
+    BOOST_FOREACH (PAIRTYPE(unsigned int, CMasternode*)& s, vecMasternodeScores){
+        rank++;
+        if(s.second->vin.prevout == vin.prevout) {
+            return rank;
+        }
+    }
+
+    return -1;
+}
+
+CSaltedOutPointHasher::CSaltedOutPointHasher()
+{
+    GetRandBytes((unsigned char*)&k0, sizeof(k0));
+    GetRandBytes((unsigned char*)&k1, sizeof(k1));
+}
+
+
+//
+// CMasternodeDB
+//
+
+
+CMasternodeDB::CMasternodeDB()
+{
+    pathMN = GetDataDir() / "mncache.dat";
+}
+
+bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
+{
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    GetRandBytes((unsigned char *)&randv, sizeof(randv));
+    std::string tmpfn = strprintf("mncache.dat.%04x", randv);
+
+    // serialize the registry, checksum data up to that point, then append csum
+    CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
+    ssMasternodes << FLATDATA(pchMessageStart);
+    ssMasternodes << mnodemanToSave;
+    uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
+    ssMasternodes << hash;
+
+    // open temp output file, and associate with CAutoFile
+    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CMasternodeDB::Write() : open failed");
+
+    // Write and commit header, data
+    try {
+        fileout << ssMasternodes;
+    }
+    catch (std::exception &e) {
+        return error("CMasternodeDB::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    // replace existing mncache.dat, if any, with new mncache.dat.XXXX
+    if (!RenameOver(pathTmp, pathMN))
+        return error("CMasternodeDB::Write() : Rename-into-place failed");
+
+    return true;
+}
+
+bool CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad)
+{
+    // open input file, and associate with CAutoFile
+    FILE *file = fopen(pathMN.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CMasternodeDB::Read() : open failed");
+
+    // use file size to size memory buffer
+    int fileSize = boost::filesystem::file_size(pathMN);
+    int dataSize = fileSize - sizeof(uint256);
+    // Don't try to resize to a negative number if file is small
+    if ( dataSize < 0 ) dataSize = 0;
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("CMasternodeDB::Read() 2 : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMasternodes(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssMasternodes.begin(), ssMasternodes.end());
+    if (hashIn != hashTmp)
+        return error("CMasternodeDB::Read() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    try {
+        // de-serialize file header (pchMessageStart magic number) and
+        ssMasternodes >> FLATDATA(pchMsgTmp);
+
+        // verify the network matches ours
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("CMasternodeDB::Read() : invalid network magic number");
+
+        // de-serialize the registry, including its version
+        ssMasternodes >> mnodemanToLoad;
+    }
+    catch (std::exception &e) {
+        mnodemanToLoad.Clear();
+        return error("CMasternodeDB::Read() : %s", e.what());
+    }
+
+    return true;
+}
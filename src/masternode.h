@@ -20,6 +20,7 @@
 #include "timedata.h"
 #include "script.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/unordered_map.hpp>
 
 
 class CMasternode;
@@ -53,7 +54,6 @@ using namespace std;
 class CMasternodePaymentWinner;
 
 extern CCriticalSection cs_masternodes;
-extern std::vector<CMasternode> vecMasternodes;
 extern CMasternodePayments masternodePayments;
 extern CMasternodeMan mnodeman;
 extern std::vector<CTxIn> vecMasternodeAskedFor;
@@ -63,7 +63,6 @@ extern map<int64_t, uint256> mapCacheBlockHashes;
 
 // manage the masternode connections
 void ProcessMasternodeConnections();
-int CountMasternodesAboveProtocol(int protocolVersion);
 
 
 void ProcessMessageMasternode(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
@@ -103,6 +102,21 @@ public:
 
     int64_t nLastDsq; //the dsq count from the last dsq broadcast of this node
 
+    CMasternode()
+    {
+        nActiveState = MASTERNODE_ENABLED;
+        now = 0;
+        lastTimeSeen = 0;
+        unitTest = false;
+        cacheInputAge = 0;
+        cacheInputAgeBlock = 0;
+        nLastDsq = 0;
+        lastDseep = 0;
+        allowFreeTx = true;
+        protocolVersion = 0;
+        lastTimeChecked = 0;
+    }
+
     CMasternode(CService newAddr, CTxIn newVin, CPubKey newPubkey, std::vector<unsigned char> newSig, int64_t newNow, CPubKey newPubkey2, int protocolVersionIn)
     {
         addr = newAddr;
@@ -123,6 +137,31 @@ public:
         lastTimeChecked = 0;
     }
 
+    // Only what came from the network is cached; the input age and the last
+    // Check() are recomputed after loading
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vin);
+        READWRITE(addr);
+        READWRITE(pubkey);
+        READWRITE(pubkey2);
+        READWRITE(sig);
+        READWRITE(now);
+        READWRITE(lastTimeSeen);
+        READWRITE(lastDseep);
+        READWRITE(nActiveState);
+        READWRITE(protocolVersion);
+        READWRITE(nLastDsq);
+        READWRITE(allowFreeTx);
+        if (fRead) {
+            CMasternode* pmn = const_cast<CMasternode*>(this);
+            pmn->lastTimeChecked = 0;
+            pmn->cacheInputAge = 0;
+            pmn->cacheInputAgeBlock = 0;
+            pmn->unitTest = false;
+        }
+    )
+
     uint256 CalculateScore(unsigned int nBlockHeight);
 
     void UpdateLastSeen(int64_t override=0)
@@ -177,13 +216,6 @@ public:
 };
 
 
-// Get the current winner for this block
-int GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
-
-int GetMasternodeByVin(CTxIn& vin);
-int GetMasternodeRank(CTxIn& vin, int64_t nBlockHeight=0, int minProtocol=0);
-int GetMasternodeByRank(int findRank, int64_t nBlockHeight=0, int minProtocol=0);
-
 
 // for storing the winning payments
 class CMasternodePaymentWinner
@@ -288,13 +320,65 @@ public:
 };
 
 
+/** Salted hash of a collateral outpoint, so peers can't pile masternode
+ * entries into one bucket of the registry. */
+class CSaltedOutPointHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    CSaltedOutPointHasher();
+
+    size_t operator()(const COutPoint& outpoint) const
+    {
+        return SipHashUint256(k0 ^ outpoint.n, k1, outpoint.hash);
+    }
+};
+
 class CMasternodeMan
 {
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
+    // Masternodes keyed by collateral outpoint, guarded by cs_masternodes.
+    // Entries are allocated per node, so a CMasternode* returned by Find()
+    // stays valid until CheckAndRemove() or Clear() drops that entry; callers
+    // hold cs_masternodes while they use it.
+    typedef boost::unordered_map<COutPoint, CMasternode, CSaltedOutPointHasher> MasternodeMap;
+    MasternodeMap mapMasternodes;
+
 public:
+    // Version of the mncache.dat layout; a cache written by another version is discarded
+    static const int CURRENT_VERSION = 1;
+
+    IMPLEMENT_SERIALIZE
+    (({
+        // serialized format:
+        // * version (CURRENT_VERSION)
+        // * all masternodes, ordered by collateral outpoint
+        LOCK(cs_masternodes);
+        int nCacheVersion = CURRENT_VERSION;
+        READWRITE(nCacheVersion);
+        if (fRead && nCacheVersion != CURRENT_VERSION)
+            throw std::ios_base::failure(strprintf("unsupported masternode cache version %d", nCacheVersion));
+
+        CMasternodeMan* mnm = const_cast<CMasternodeMan*>(this);
+        std::vector<CMasternode> vMasternodes;
+        if (!fRead)
+            vMasternodes = mnm->GetFullMasternodeVector(false);
+        READWRITE(vMasternodes);
+        if (fRead) {
+            mnm->mapMasternodes.clear();
+            BOOST_FOREACH(const CMasternode& mn, vMasternodes)
+                mnm->Add(mn);
+        }
+    });)
+
+    /// Add an entry, unless one with the same collateral is already known
+    bool Add(const CMasternode& mn);
+
     /// Ask (source) node for mnb
     void AskForMN(CNode* pnode, CTxIn& vin);
 
@@ -304,16 +388,42 @@ public:
     /// Check all Masternodes and remove inactive
     void CheckAndRemove();
 
-    /// Clear Masternode vector
+    /// Clear Masternode map
     void Clear();
 
     int CountEnabled(int protocolVersion = -1);
 
-    /// Find an entry
+    int CountMasternodesAboveProtocol(int protocolVersion);
+
+    /// Find an entry; CheckAndRemove() may free it, so hold cs_masternodes for as long as the pointer is used
     CMasternode* Find(const CTxIn& vin);
 
+    /// Copy of an entry, for callers that only read it
+    bool Get(const CTxIn& vin, CMasternode& mnRet);
+
+    /// Copy of all entries ordered by collateral outpoint, optionally checked first
+    std::vector<CMasternode> GetFullMasternodeVector(bool fCheck = true);
+
+    /// Get the current winner for this block
+    CMasternode* GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
+
+    CMasternode* GetMasternodeByRank(int findRank, int64_t nBlockHeight=0, int minProtocol=0);
+
+    int GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight=0, int minProtocol=0);
+
     /// Return the number of (unique) Masternodes
-    int size() { return vecMasternodes.size(); }
+    int size() { LOCK(cs_masternodes); return mapMasternodes.size(); }
+};
+
+/** Access to the masternode registry cache (mncache.dat) */
+class CMasternodeDB
+{
+private:
+    boost::filesystem::path pathMN;
+public:
+    CMasternodeDB();
+    bool Write(const CMasternodeMan& mnodemanToSave);
+    bool Read(CMasternodeMan& mnodemanToLoad);
 };
 
 
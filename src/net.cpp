@@ -6,6 +6,7 @@
 #include "net.h"
 
 #include "addrman.h"
+#include "bloom.h"
 #include "clientversion.h"
 #include "db.h"
 #include "init.h"
@@ -22,6 +23,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -37,6 +39,15 @@
 // Dump addresses to peers.dat and banlist.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
+// Most buffers handed to one scatter-gather send, two per queued message
+static const int MAX_SEND_BUFFERS = 64;
+
+// The receive buffer grows by at most this much ahead of the data that has
+// actually arrived, whatever size the header claims
+static const unsigned int RECV_CHUNK_SIZE = 256 * 1024;
+// Largest receive buffer a peer keeps for reuse once its message is processed
+static const unsigned int RECV_SPARE_SIZE = 64 * 1024;
+
 void ThreadMessageHandler2(void* parg);
 #ifdef USE_UPNP
 void ThreadMapPort2(void* parg);
@@ -55,7 +66,7 @@ bool fClient = false;
 bool fDiscover = true;
 bool fListen = false;
 bool fUseUPnP = false;
-uint64_t nLocalServices = (fClient ? 0 : NODE_NETWORK);
+uint64_t nLocalServices = (fClient ? 0 : NODE_NETWORK) | NODE_BLOOM;
 static CCriticalSection cs_mapLocalHost;
 static map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
@@ -69,7 +80,7 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetPayloadRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -409,6 +420,88 @@ CNode* CConnman::ConnectNode(CAddress addrConnect, const char *pszDest, bool dar
     return NULL;
 }
 
+std::vector<CService> InterleaveAddressFamilies(const std::vector<CService>& vAddr)
+{
+    if (vAddr.empty())
+        return vAddr;
+
+    std::vector<CService> vFirst, vOther;
+    BOOST_FOREACH(const CService& addr, vAddr)
+    {
+        if (addr.GetNetwork() == vAddr[0].GetNetwork())
+            vFirst.push_back(addr);
+        else
+            vOther.push_back(addr);
+    }
+
+    std::vector<CService> vRet;
+    for (unsigned int i = 0; i < vFirst.size() || i < vOther.size(); i++)
+    {
+        if (i < vFirst.size())
+            vRet.push_back(vFirst[i]);
+        if (i < vOther.size())
+            vRet.push_back(vOther[i]);
+    }
+    return vRet;
+}
+
+CPendingConnect::CPendingConnect(const CAddress& addrIn, const std::vector<CService>& vCandidatesIn) :
+    addrConnect(addrIn), vCandidates(vCandidatesIn), nNextCandidate(0), nNextDial(0)
+{
+}
+
+CPendingConnect::~CPendingConnect()
+{
+    BOOST_FOREACH(Attempt& attempt, vAttempts)
+        CloseSocket(attempt.hSocket);
+}
+
+bool CPendingConnect::Dial(int64_t nNow, int nTimeout)
+{
+    for (std::vector<Attempt>::iterator it = vAttempts.begin(); it != vAttempts.end(); )
+    {
+        if (nNow - it->nTimeStart >= nTimeout)
+        {
+            LogPrint("net", "connection to %s timeout\n", it->addr.ToString());
+            CloseSocket(it->hSocket);
+            it = vAttempts.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    // With nothing left in flight the next candidate goes at once
+    while (nNextCandidate < vCandidates.size() && (nNow >= nNextDial || vAttempts.empty()))
+    {
+        Attempt attempt;
+        attempt.addr = vCandidates[nNextCandidate++];
+        attempt.nTimeStart = nNow;
+        if (!StartConnectSocket(attempt.addr, attempt.hSocket))
+            continue;
+        if (!IsSelectableSocket(attempt.hSocket))
+        {
+            LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
+            CloseSocket(attempt.hSocket);
+            continue;
+        }
+        vAttempts.push_back(attempt);
+        nNextDial = nNow + CONNECTION_ATTEMPT_DELAY;
+        break;
+    }
+
+    return !vAttempts.empty() || nNextCandidate < vCandidates.size();
+}
+
+bool CPendingConnect::Matches(const CService& addr) const
+{
+    if ((CService)addrConnect == addr)
+        return true;
+    BOOST_FOREACH(const CService& candidate, vCandidates)
+        if (candidate == addr)
+            return true;
+    return false;
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
@@ -480,6 +573,7 @@ void CConnman::ClearBanned()
 {
     LOCK(cs_setBanned);
     setBanned.clear();
+    setBannedIsDirty = true;
 }
 
 bool CConnman::IsBanned(CNetAddr ip)
@@ -556,6 +650,7 @@ bool CConnman::Unban(const CSubNet &subNet) {
         LOCK(cs_setBanned);
         if (!setBanned.erase(subNet))
             return false;
+        setBannedIsDirty = true;
     }
     return true;
 }
@@ -606,6 +701,174 @@ void CConnman::SetBannedSetDirty(bool dirty)
     setBannedIsDirty = dirty;
 }
 
+
+bool CConnman::IsWhitelistedRange(const CNetAddr &addr) {
+    LOCK(cs_vWhitelistedRange);
+    BOOST_FOREACH(const CSubNet& subnet, vWhitelistedRange) {
+        if (subnet.Match(addr))
+            return true;
+    }
+    return false;
+}
+
+void CConnman::AddWhitelistedRange(const CSubNet &subnet) {
+    LOCK(cs_vWhitelistedRange);
+    vWhitelistedRange.push_back(subnet);
+}
+
+void CConnman::RecordBytesRecv(uint64_t bytes)
+{
+    LOCK(cs_totalBytesRecv);
+    nTotalBytesRecv += bytes;
+}
+
+void CConnman::RecordBytesSent(uint64_t bytes)
+{
+    LOCK(cs_totalBytesSent);
+    nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now)
+    {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CConnman::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+}
+
+uint64_t CConnman::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CConnman::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+uint64_t CConnman::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - GetTime();
+}
+
+void CConnman::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe)
+    {
+        // reset measure-cycle in case of changing
+        // the timeframe
+        nMaxOutboundCycleStartTime = GetTime();
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+bool CConnman::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit)
+    {
+        // keep a large enough buffer to at least relay each block once
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / nTargetSpacing * UPLOAD_TARGET_BLOCK_RESERVE;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CConnman::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+uint64_t CConnman::GetTotalBytesRecv()
+{
+    LOCK(cs_totalBytesRecv);
+    return nTotalBytesRecv;
+}
+
+uint64_t CConnman::GetTotalBytesSent()
+{
+    LOCK(cs_totalBytesSent);
+    return nTotalBytesSent;
+}
+
+
+void CTokenBucket::SetRate(int64_t nRateIn)
+{
+    nRate = nRateIn;
+    nTokens = nRate;
+    nLastRefill = 0;
+}
+
+int64_t CTokenBucket::Available(int64_t nTimeMicros)
+{
+    if (nRate <= 0)
+        return std::numeric_limits<int64_t>::max();
+
+    int64_t nElapsed = nTimeMicros - nLastRefill;
+    if (nLastRefill == 0 || nElapsed >= 1000000)
+    {
+        nTokens = nRate;
+        nLastRefill = nTimeMicros;
+    }
+    else if (nElapsed < 0)
+        nLastRefill = nTimeMicros; // the clock went back: count from here
+    else
+    {
+        // Only whole tokens are added, and the clock only moves on by the
+        // time they took, so the fraction left over is not lost
+        int64_t nAdded = nElapsed * nRate / 1000000;
+        if (nTokens + nAdded >= nRate)
+        {
+            nTokens = nRate;
+            nLastRefill = nTimeMicros;
+        }
+        else if (nAdded > 0)
+        {
+            nTokens += nAdded;
+            nLastRefill += nAdded * 1000000 / nRate;
+        }
+    }
+    return nTokens;
+}
+
+void CTokenBucket::Consume(int64_t nBytes)
+{
+    if (nRate > 0)
+        nTokens -= nBytes;
+}
+
 bool CNode::Misbehaving(int howmuch)
 {
     if (addr.IsLocal())
@@ -643,18 +906,33 @@ void CNode::copyStats(CNodeStats &stats)
     X(fInbound);
     X(nStartingHeight);
     X(nMisbehavior);
+    X(fWhitelisted);
+    {
+        LOCK(cs_vSend);
+        X(mapSendBytesPerMsgCmd);
+        X(nSendBytes);
+    }
+    {
+        LOCK(cs_vRecvMsg);
+        X(mapRecvBytesPerMsgCmd);
+        X(nRecvBytes);
+    }
 }
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
+    nRecvBytes += nBytes;
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
+        {
             vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            vRecvMsg.back().vRecv.swap(vchRecvSpare);
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -677,6 +955,14 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete()) {
+            //store received bytes per message command
+            //to prevent a memory DOS, only allow valid commands
+            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+            if (i == mapRecvBytesPerMsgCmd.end())
+                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+            assert(i != mapRecvBytesPerMsgCmd.end());
+            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
             msg.nTime = GetTimeMicros();
             messageHandlerCondition.notify_one();
         }
@@ -685,6 +971,13 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+void CNode::RecycleRecvBuffer(CDataStream& vRecv)
+{
+    vRecv.clear();
+    if (vRecv.capacity() <= RECV_SPARE_SIZE && vRecv.capacity() > vchRecvSpare.capacity())
+        vRecv.swap(vchRecvSpare);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -712,7 +1005,8 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    if (hdr.nMessageSize == 0)
+        hashData = hasher.GetHash();
 
     return nCopy;
 }
@@ -722,9 +1016,16 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
+    if (vRecv.size() < nDataPos + nCopy)
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + RECV_CHUNK_SIZE));
+
+    hasher.write(pch, nCopy);
     memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
+    if (complete())
+        hashData = hasher.GetHash();
+
     return nCopy;
 }
 
@@ -737,24 +1038,105 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // NTRN TODO - implement: void CConnman::AcceptConnection
 
 
+#ifdef WIN32
+typedef WSABUF CSendBuffer;
+
+static inline void SetSendBuffer(CSendBuffer& buf, const char* pch, size_t nLen)
+{
+    buf.buf = const_cast<char*>(pch);
+    buf.len = nLen;
+}
+
+static int SendBuffers(SOCKET hSocket, CSendBuffer* pbuf, int nCount)
+{
+    DWORD nSent = 0;
+    if (WSASend(hSocket, pbuf, nCount, &nSent, 0, NULL, NULL) == SOCKET_ERROR)
+        return -1;
+    return nSent;
+}
+#else
+typedef struct iovec CSendBuffer;
+
+static inline void SetSendBuffer(CSendBuffer& buf, const char* pch, size_t nLen)
+{
+    buf.iov_base = const_cast<char*>(pch);
+    buf.iov_len = nLen;
+}
+
+static int SendBuffers(SOCKET hSocket, CSendBuffer* pbuf, int nCount)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = pbuf;
+    msg.msg_iovlen = nCount;
+    return sendmsg(hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+#endif
+
 // requires LOCK(cs_vSend)
-void SocketSendData(CNode *pnode)
+size_t SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    size_t nSentSize = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (!pnode->vSendMsg.empty())
+    {
+        // Never hand the socket more than the peer's upload allowance
+        int64_t nAllowance = pnode->sendBucket.Available(GetTimeMicros());
+        if (nAllowance <= 0)
+            break;
+
+        // Gather the unsent headers and payloads of as many queued messages
+        // as fit in one call
+        CSendBuffer vBuf[MAX_SEND_BUFFERS];
+        int nBuf = 0;
+        size_t nOffset = pnode->nSendOffset;
+        size_t nToSend = 0;
+        size_t nMaxSend = std::min((int64_t)std::numeric_limits<int>::max(), nAllowance);
+        for (std::deque<CSendMessage>::const_iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nBuf + 2 <= MAX_SEND_BUFFERS && nToSend < nMaxSend; ++it)
+        {
+            const CSendMessage& msg = *it;
+            assert(msg.size() > nOffset);
+            if (nOffset < CMessageHeader::HEADER_SIZE)
+            {
+                size_t nLen = std::min(CMessageHeader::HEADER_SIZE - nOffset, nMaxSend - nToSend);
+                SetSendBuffer(vBuf[nBuf++], msg.header + nOffset, nLen);
+                nToSend += nLen;
+                nOffset = 0;
+            }
+            else
+                nOffset -= CMessageHeader::HEADER_SIZE;
+            if (nOffset < msg.payload->vch.size() && nToSend < nMaxSend)
+            {
+                size_t nLen = std::min(msg.payload->vch.size() - nOffset, nMaxSend - nToSend);
+                SetSendBuffer(vBuf[nBuf++], &msg.payload->vch[nOffset], nLen);
+                nToSend += nLen;
+            }
+            nOffset = 0;
+        }
+
+        int nBytes = SendBuffers(pnode->hSocket, vBuf, nBuf);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            pnode->nSendBytes += nBytes;
+            pnode->sendBucket.Consume(nBytes);
+            nSentSize += nBytes;
+            size_t nSent = nBytes;
+            while (nSent > 0)
+            {
+                const CSendMessage& msg = pnode->vSendMsg.front();
+                size_t nLeft = msg.size() - pnode->nSendOffset;
+                if (nSent < nLeft)
+                {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
+                pnode->nSendSize -= msg.size();
+                pnode->vSendMsg.pop_front();
+            }
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -772,11 +1154,11 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    return nSentSize;
 }
 
 void CConnman::ThreadSocketHandler()
@@ -907,10 +1289,14 @@ void CConnman::ThreadSocketHandler2()
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
                     if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
+                        // do not read, if draining write queue; a peer out of
+                        // tokens waits for the next poll either way
+                        int64_t nNow = GetTimeMicros();
+                        if (!pnode->vSendMsg.empty()) {
+                            if (pnode->sendBucket.Available(nNow) > 0)
+                                FD_SET(pnode->hSocket, &fdsetSend);
+                        }
+                        else if (pnode->recvBucket.Available(nNow) > 0)
                             FD_SET(pnode->hSocket, &fdsetRecv);
                         FD_SET(pnode->hSocket, &fdsetError);
                         hSocketMax = max(hSocketMax, pnode->hSocket);
@@ -920,6 +1306,9 @@ void CConnman::ThreadSocketHandler2()
             }
         }
 
+        if (DialPendingConnects(fdsetSend, fdsetError, hSocketMax))
+            have_fds = true;
+
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
         int nSelect = select(have_fds ? hSocketMax + 1 : 0,
                              &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
@@ -941,6 +1330,12 @@ void CConnman::ThreadSocketHandler2()
         }
 
 
+        //
+        // Complete outbound connections
+        //
+        CompletePendingConnects(fdsetSend, fdsetError);
+
+
         //
         // Accept new connections
         //
@@ -983,6 +1378,8 @@ void CConnman::ThreadSocketHandler2()
             {
                 LogPrintf("accepted connection %s\n", addr.ToString().c_str());
                 CNode* pnode = new CNode(hSocket, addr, "", true);
+                if (IsWhitelistedRange(addr))
+                    pnode->SetWhitelisted();
                 pnode->AddRef();
                 {
                     LOCK(cs_vNodes);
@@ -1022,15 +1419,21 @@ void CConnman::ThreadSocketHandler2()
                             LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
                         pnode->CloseSocketDisconnect();
                     }
+                    else if (pnode->recvBucket.Available(GetTimeMicros()) <= 0) {
+                        // out of download tokens, leave the data in the socket buffer for now
+                    }
                     else {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        int nRecvMax = std::min((int64_t)sizeof(pchBuf), pnode->recvBucket.Available(GetTimeMicros()));
+                        int nBytes = recv(pnode->hSocket, pchBuf, nRecvMax, MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
+                            pnode->recvBucket.Consume(nBytes);
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
+                            RecordBytesRecv(nBytes);
                         }
                         else if (nBytes == 0)
                         {
@@ -1063,7 +1466,7 @@ void CConnman::ThreadSocketHandler2()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SocketSendData(pnode);
+                    RecordBytesSent(SocketSendData(pnode));
             }
 
             //
@@ -1336,9 +1739,42 @@ void CConnman::DumpAddresses()
            addrman.size(), GetTimeMillis() - nStart);
 }
 
+void CConnman::DumpBanlist()
+{
+    SweepBanned(); // clean unused entries (if bantime has expired)
+
+    if (!BannedSetIsDirty())
+        return;
+
+    int64_t nStart = GetTimeMillis();
+
+    banmap_t banmap;
+    {
+        LOCK(cs_setBanned);
+        banmap = setBanned;
+        setBannedIsDirty = false;
+    }
+
+    CBanDB bandb;
+    if (!bandb.Write(banmap))
+        SetBannedSetDirty(true);
+
+    LogPrint("net", "Flushed %d banned node ips/subnets to banlist.dat  %dms\n",
+             banmap.size(), GetTimeMillis() - nStart);
+}
+
 void CConnman::DumpData()
 {
     DumpAddresses();
+    DumpBanlist();
+}
+
+void CConnman::ThreadDumpData()
+{
+    // Both files are written from here, off the socket and connection
+    // threads; each dump holds its lock only while taking the snapshot
+    while (interruptNet.sleep_for(std::chrono::seconds(DUMP_ADDRESSES_INTERVAL)))
+        DumpData();
 }
 
 void CConnman::ThreadOpenConnections()
@@ -1430,12 +1866,16 @@ void CConnman::ThreadOpenConnections2()
 
     // Minimum time before next feeler connection (in microseconds).
     int64_t nNextFeeler = PoissonNextSend(nStart*1000*1000, FEELER_INTERVAL);
+    bool fQueued = false;
     while (!interruptNet)
     {
         ProcessOneShot();
 
-        if (!interruptNet.sleep_for(std::chrono::milliseconds(500)))
+        // Connects complete in the socket thread, so after queueing one go
+        // straight on to the next slot
+        if (!interruptNet.sleep_for(std::chrono::milliseconds(fQueued ? 0 : 500)))
             return;
+        fQueued = false;
 
         CSemaphoreGrant grant(*semOutbound);
         if (interruptNet)
@@ -1480,6 +1920,13 @@ void CConnman::ThreadOpenConnections2()
                 }
             }
         }
+        {
+            LOCK(cs_vPendingConnects);
+            BOOST_FOREACH(const CPendingConnect* pconnect, vPendingConnects) {
+                setConnected.insert(pconnect->addrConnect.GetGroup());
+                nOutbound++;
+            }
+        }
 
         // Feeler Connections
         //
@@ -1538,7 +1985,7 @@ void CConnman::ThreadOpenConnections2()
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+            fQueued = StartNetworkConnection(addrConnect, std::vector<CService>(1, addrConnect), grant);
     }
 }
 
@@ -1618,8 +2065,12 @@ void CConnman::ThreadOpenAddedConnections2()
         }
         BOOST_FOREACH(vector<CService>& vserv, vservConnectAddresses)
         {
+            // Race the resolved addresses rather than dialing only the first
+            std::vector<CService> vCandidates = InterleaveAddressFamilies(vserv);
+            if (vCandidates.size() > MAX_CONNECTION_CANDIDATES)
+                vCandidates.resize(MAX_CONNECTION_CANDIDATES);
             CSemaphoreGrant grant(*semOutbound);
-            OpenNetworkConnection(CAddress(*(vserv.begin())), &grant);
+            StartNetworkConnection(CAddress(vCandidates[0]), vCandidates, grant);
             MilliSleep(500);
             if (fShutdown)
                 return;
@@ -1667,6 +2118,136 @@ bool CConnman::OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGran
     return true;
 }
 
+bool CConnman::StartNetworkConnection(const CAddress& addrConnect, const std::vector<CService>& vCandidates, CSemaphoreGrant& grantOutbound)
+{
+    // SOCKS negotiation is still done blocking
+    proxyType proxy;
+    bool fProxy = vCandidates.empty();
+    BOOST_FOREACH(const CService& addr, vCandidates)
+        if (GetProxy(addr.GetNetwork(), proxy))
+            fProxy = true;
+    if (fProxy)
+        return OpenNetworkConnection(addrConnect, &grantOutbound);
+
+    if (fShutdown)
+        return false;
+    if (IsLocal(addrConnect) ||
+        FindNode((CNetAddr)addrConnect) || IsBanned(addrConnect) ||
+        FindNode(addrConnect.ToStringIPPort().c_str()) || IsPendingConnect(addrConnect))
+        return false;
+
+    if (fDebug)
+        LogPrintf("trying connection %s lastseen=%.1fhrs (%u candidates)\n",
+        addrConnect.ToString(), (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0, vCandidates.size());
+
+    addrman.Attempt(addrConnect);
+
+    CPendingConnect* pconnect = new CPendingConnect(addrConnect, vCandidates);
+    grantOutbound.MoveTo(pconnect->grantOutbound);
+    LOCK(cs_vPendingConnects);
+    vPendingConnects.push_back(pconnect);
+    return true;
+}
+
+bool CConnman::IsPendingConnect(const CService& addr)
+{
+    LOCK(cs_vPendingConnects);
+    BOOST_FOREACH(const CPendingConnect* pconnect, vPendingConnects)
+        if (pconnect->Matches(addr))
+            return true;
+    return false;
+}
+
+bool CConnman::DialPendingConnects(fd_set& fdsetSend, fd_set& fdsetError, SOCKET& hSocketMax)
+{
+    bool fHaveFds = false;
+    int64_t nNow = GetTimeMillis();
+
+    LOCK(cs_vPendingConnects);
+    std::list<CPendingConnect*>::iterator it = vPendingConnects.begin();
+    while (it != vPendingConnects.end())
+    {
+        CPendingConnect* pconnect = *it;
+        if (!pconnect->Dial(nNow, nConnectTimeout))
+        {
+            LogPrint("net", "connection to %s failed\n", pconnect->addrConnect.ToString());
+            // releases the outbound grant
+            delete pconnect;
+            it = vPendingConnects.erase(it);
+            continue;
+        }
+        BOOST_FOREACH(const CPendingConnect::Attempt& attempt, pconnect->vAttempts)
+        {
+            FD_SET(attempt.hSocket, &fdsetSend);
+            FD_SET(attempt.hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, attempt.hSocket);
+            fHaveFds = true;
+        }
+        ++it;
+    }
+    return fHaveFds;
+}
+
+void CConnman::CompletePendingConnects(fd_set& fdsetSend, fd_set& fdsetError)
+{
+    LOCK(cs_vPendingConnects);
+    std::list<CPendingConnect*>::iterator it = vPendingConnects.begin();
+    while (it != vPendingConnects.end())
+    {
+        CPendingConnect* pconnect = *it;
+        SOCKET hSocket = INVALID_SOCKET;
+        CService addrConnected;
+        std::vector<CPendingConnect::Attempt>::iterator itAttempt = pconnect->vAttempts.begin();
+        while (itAttempt != pconnect->vAttempts.end())
+        {
+            if (!FD_ISSET(itAttempt->hSocket, &fdsetSend) && !FD_ISSET(itAttempt->hSocket, &fdsetError))
+            {
+                ++itAttempt;
+                continue;
+            }
+            // a failed attempt is closed and its slot goes to the next candidate
+            bool fConnected = FinishConnectSocket(itAttempt->addr, itAttempt->hSocket);
+            if (fConnected)
+            {
+                hSocket = itAttempt->hSocket;
+                addrConnected = itAttempt->addr;
+            }
+            itAttempt = pconnect->vAttempts.erase(itAttempt);
+            if (fConnected)
+                break;
+        }
+        if (hSocket == INVALID_SOCKET)
+        {
+            ++it;
+            continue;
+        }
+
+        CAddress addr(addrConnected, pconnect->addrConnect.nServices);
+        addr.nTime = pconnect->addrConnect.nTime;
+        if (FindNode((CService)addr))
+        {
+            // connected some other way meanwhile
+            CloseSocket(hSocket);
+        }
+        else
+        {
+            LogPrint("net", "connected to %s\n", addr.ToString());
+            CNode* pnode = new CNode(hSocket, addr, "", false);
+            pnode->AddRef();
+            pnode->nTimeConnected = GetTime();
+            pnode->fNetworkNode = true;
+            pconnect->grantOutbound.MoveTo(pnode->grantOutbound);
+
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+
+        // closes the attempts that lost the race
+        delete pconnect;
+        it = vPendingConnects.erase(it);
+    }
+}
+
 
 
 
@@ -1952,6 +2533,12 @@ CConnman::CConnman(uint64_t nSeed0In, uint64_t nSeed1In) :
     nMaxConnections = 0;
     nMaxOutbound = 0;
     nMaxAddnode = 0;
+    nTotalBytesRecv = 0;
+    nTotalBytesSent = 0;
+    nMaxOutboundTotalBytesSentInCycle = 0;
+    nMaxOutboundCycleStartTime = 0;
+    nMaxOutboundLimit = 0;
+    nMaxOutboundTimeframe = 0;
     // nBestHeight = 0;
     // clientInterface = NULL;
     flagInterruptMsgProc = false;
@@ -1973,6 +2560,9 @@ bool CConnman::Start(CScheduler& scheduler, Options connOptions)
     nMaxAddnode = connOptions.nMaxAddnode;
     nMaxFeeler = connOptions.nMaxFeeler;
 
+    nMaxOutboundTimeframe = connOptions.nMaxOutboundTimeframe;
+    nMaxOutboundLimit = connOptions.nMaxOutboundLimit;
+
     uiInterface.InitMessage(_("Loading addresses..."));
     // Load addresses for peers.dat
     int64_t nStart = GetTimeMillis();
@@ -1982,11 +2572,27 @@ bool CConnman::Start(CScheduler& scheduler, Options connOptions)
             LogPrintf("Invalid or missing peers.dat; recreating\n");
     }
 
-    // TODO: NTRN - possibly implement banlist
-
     LogPrintf("Loaded %i addresses from peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
 
+    // Load banlist.dat
+    nStart = GetTimeMillis();
+    {
+        CBanDB bandb;
+        banmap_t banmap;
+        if (bandb.Read(banmap)) {
+            SetBanned(banmap); // thread save setter
+            SetBannedSetDirty(false); // no need to write down, just read data
+            SweepBanned(); // sweep out unused entries
+
+            LogPrint("net", "Loaded %d banned node ips/subnets from banlist.dat  %dms\n",
+                     banmap.size(), GetTimeMillis() - nStart);
+        } else {
+            LogPrintf("Invalid or missing banlist.dat; recreating\n");
+            SetBannedSetDirty(true); // force write
+        }
+    }
+
     uiInterface.InitMessage(_("Starting network threads..."));
 
     fAddressesInitialized = true;
@@ -2052,8 +2658,8 @@ bool CConnman::Start(CScheduler& scheduler, Options connOptions)
         if (!NewThread(ThreadStakeMiner, pwalletMain))
             LogPrintf("Error: NewThread(ThreadStakeMiner) failed\n");
 
-    // Dump network addresses
-    scheduler.scheduleEvery(boost::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL);
+    // Dump network addresses and the banlist
+    threadDumpData = std::thread(&TraceThread<std::function<void()> >, "dumpaddr", std::function<void()>(std::bind(&CConnman::ThreadDumpData, this)));
 
     return true;
 }
@@ -2106,6 +2712,16 @@ void CConnman::Stop()
     LogPrintf("CConnman::Stop() 4 threadSocketHandler\n");
     if (threadSocketHandler.joinable())
         threadSocketHandler.join();
+    if (threadDumpData.joinable())
+        threadDumpData.join();
+
+    // Abandon connects still in flight, returning their outbound grants
+    {
+        LOCK(cs_vPendingConnects);
+        BOOST_FOREACH(CPendingConnect* pconnect, vPendingConnects)
+            delete pconnect;
+        vPendingConnects.clear();
+    }
 
     LogPrintf("CConnman::Stop() 5 DumpData\n");
     if (fAddressesInitialized)
@@ -2212,7 +2828,7 @@ void RelayInv(CInv& inv)
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
+    ss.reserve(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
     ss << tx;
     RelayTransaction(tx, hash, ss);
 }
@@ -2229,8 +2845,9 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved;
+        // every peer that asks for it is sent this same copy
+        mapRelay.insert(std::make_pair(inv, MakeNetPayload(ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
 
@@ -2317,7 +2934,9 @@ void RelayDarkSendCompletedTransaction(const int sessionID, const bool error, co
 }
 
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+    addrKnown(ADDR_KNOWN_ELEMENTS, ADDR_KNOWN_FPRATE),
+    filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, INVENTORY_KNOWN_FPRATE)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2339,15 +2958,25 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendBytes = 0;
+    nRecvBytes = 0;
+    fWhitelisted = false;
+    sendBucket.SetRate(MaxPeerUploadRate());
+    recvBucket.SetRate(MaxPeerDownloadRate());
     hashContinue = 0;
     pindexLastGetBlocksBegin = 0;
     hashLastGetBlocksEnd = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
+    fPreferCompactBlocks = false;
+    pfilter = NULL;
     nMisbehavior = 0;
     hashCheckpointKnown = 0;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
+
+    BOOST_FOREACH(const std::string &msg, getAllNetMessageTypes())
+        mapRecvBytesPerMsgCmd[msg] = 0;
+    mapRecvBytesPerMsgCmd[NET_MESSAGE_COMMAND_OTHER] = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2373,6 +3002,8 @@ CNode::~CNode()
         CloseSocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
+    if (pfilter)
+        delete pfilter;
 }
 
 void CNode::AskFor(const CInv& inv)
@@ -2395,11 +3026,34 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+CNetPayload::CNetPayload(CDataStream& ss)
+{
+    ss.GetAndClear(vch);
+    uint256 hash = Hash(vch.begin(), vch.end());
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+}
+
+CNetPayloadRef MakeNetPayload(const CDataStream& ss)
+{
+    CDataStream ssCopy(ss);
+    return CNetPayloadRef(new CNetPayload(ssCopy));
+}
+
+CSendMessage::CSendMessage(const char* pszCommand, const CNetPayloadRef& payloadIn) : payload(payloadIn)
+{
+    CMessageHeader hdr(pszCommand, payload->vch.size());
+    hdr.nChecksum = payload->nChecksum;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    assert(ss.size() == CMessageHeader::HEADER_SIZE);
+    memcpy(header, &ss[0], CMessageHeader::HEADER_SIZE);
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(pszCommand, 0);
+    strSendCommand = pszCommand;
     if (fDebug)
         LogPrintf("sending: %s ", SanitizeString(pszCommand));
 }
@@ -2407,12 +3061,32 @@ void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSen
 void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
 {
     ssSend.clear();
+    strSendCommand.clear();
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 
     LogPrint("net", "(aborted)\n");
 }
 
+// requires LOCK(cs_vSend)
+static void QueueSendMessage(CNode* pnode, const char* pszCommand, const CNetPayloadRef& payload)
+{
+    if (fDebug) {
+        LogPrintf("(%d bytes)\n", payload->vch.size());
+    }
+
+    pnode->vSendMsg.push_back(CSendMessage(pszCommand, payload));
+    pnode->nSendSize += pnode->vSendMsg.back().size();
+    pnode->mapSendBytesPerMsgCmd[pszCommand] += pnode->vSendMsg.back().size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (pnode->vSendMsg.size() == 1) {
+        size_t nBytes = SocketSendData(pnode);
+        if (nBytes && g_connman)
+            g_connman->RecordBytesSent(nBytes);
+    }
+}
+
 void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 {
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
@@ -2422,95 +3096,91 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    if (ssSend.size() == 0)
+    if (strSendCommand.empty())
         return;
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
-
-    if (fDebug) {
-        LogPrintf("(%d bytes)\n", nSize);
-    }
-
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
-
-    // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
-        SocketSendData(this);
+    QueueSendMessage(this, strSendCommand.c_str(), CNetPayloadRef(new CNetPayload(ssSend)));
+    strSendCommand.clear();
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushSharedMessage(const char* pszCommand, const CNetPayloadRef& payload)
+{
+    LOCK(cs_vSend);
+    if (fDebug)
+        LogPrintf("sending: %s ", SanitizeString(pszCommand));
+    QueueSendMessage(this, pszCommand, payload);
+}
+
 
 
 //
-// CAddrDB
+// CAddrDB / CBanDB
 //
 
+// peers.dat and banlist.dat share one envelope:
+//   network magic | file format version | payload | double-SHA256 of all before it
+// The snapshot is taken into memory under the owner's lock (the payload's
+// own serializer locks it); the file is then written without any lock.
+// peers.dat files written before the version byte existed start their
+// payload with CAddrMan's own version byte 0, and are still accepted.
+// Version 1 payloads are the owners' serializations unchanged: CAddrMan's
+// bucket-indexed format and the plain ban map. A more compact encoding
+// would get a new version here.
+static const unsigned char NET_FILE_VERSION = 1;
 
-CAddrDB::CAddrDB()
+template <typename Data>
+static void SnapshotFileDB(CDataStream& stream, const Data& data)
 {
-    pathAddr = GetDataDir() / "peers.dat";
+    stream << FLATDATA(pchMessageStart);
+    stream << NET_FILE_VERSION;
+    stream << data;
+    uint256 hash = Hash(stream.begin(), stream.end());
+    stream << hash;
 }
 
-bool CAddrDB::Write(const CAddrMan& addr)
+static bool WriteFileDB(const boost::filesystem::path& path, const CDataStream& stream)
 {
     // Generate random temporary filename
     unsigned short randv = 0;
-    RAND_bytes((unsigned char *)&randv, sizeof(randv));
-    std::string tmpfn = strprintf("peers.dat.%04x", randv);
-
-    // serialize addresses, checksum data up to that point, then append csum
-    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
-    ssPeers << FLATDATA(pchMessageStart);
-    ssPeers << addr;
-    uint256 hash = Hash(ssPeers.begin(), ssPeers.end());
-    ssPeers << hash;
+    GetRandBytes((unsigned char *)&randv, sizeof(randv));
+    boost::filesystem::path pathTmp = path.string() + strprintf(".%04x", randv);
 
     // open temp output file, and associate with CAutoFile
-    boost::filesystem::path pathTmp = GetDataDir() / tmpfn;
     FILE *file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
     if (!fileout)
-        return error("CAddrman::Write() : open failed");
+        return error("%s : open %s failed", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
-        fileout << ssPeers;
+        fileout.write(&stream[0], stream.size());
     }
     catch (std::exception &e) {
-        return error("CAddrman::Write() : I/O error");
+        return error("%s : I/O error writing %s", __func__, pathTmp.string());
     }
     FileCommit(fileout);
     fileout.fclose();
 
-    // replace existing peers.dat, if any, with new peers.dat.XXXX
-    if (!RenameOver(pathTmp, pathAddr))
-        return error("CAddrman::Write() : Rename-into-place failed");
+    // replace the existing file, if any, with the new one
+    if (!RenameOver(pathTmp, path))
+        return error("%s : rename-into-place of %s failed", __func__, path.string());
 
     return true;
 }
 
-bool CAddrDB::Read(CAddrMan& addr)
+template <typename Data>
+static bool ReadFileDB(const boost::filesystem::path& path, Data& data, bool fAllowUnversioned)
 {
     // open input file, and associate with CAutoFile
-    FILE *file = fopen(pathAddr.string().c_str(), "rb");
+    FILE *file = fopen(path.string().c_str(), "rb");
     CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
     if (!filein)
-        return error("CAddrman::Read() : open failed");
+        return error("%s : open %s failed", __func__, path.string());
 
     // use file size to size memory buffer
-    int fileSize = boost::filesystem::file_size(pathAddr);
+    int fileSize = boost::filesystem::file_size(path);
     int dataSize = fileSize - sizeof(uint256);
     // Don't try to resize to a negative number if file is small
     if ( dataSize < 0 ) dataSize = 0;
@@ -2524,32 +3194,72 @@ bool CAddrDB::Read(CAddrMan& addr)
         filein >> hashIn;
     }
     catch (std::exception &e) {
-        return error("CAddrman::Read() 2 : I/O error or stream data corrupted");
+        return error("%s : I/O error or stream data corrupted in %s", __func__, path.string());
     }
     filein.fclose();
 
-    CDataStream ssPeers(vchData, SER_DISK, CLIENT_VERSION);
+    CDataStream stream(vchData, SER_DISK, CLIENT_VERSION);
 
     // verify stored checksum matches input data
-    uint256 hashTmp = Hash(ssPeers.begin(), ssPeers.end());
+    uint256 hashTmp = Hash(stream.begin(), stream.end());
     if (hashIn != hashTmp)
-        return error("CAddrman::Read() : checksum mismatch; data corrupted");
+        return error("%s : checksum mismatch in %s; data corrupted", __func__, path.string());
 
     unsigned char pchMsgTmp[4];
     try {
         // de-serialize file header (pchMessageStart magic number) and
-        ssPeers >> FLATDATA(pchMsgTmp);
+        stream >> FLATDATA(pchMsgTmp);
 
         // verify the network matches ours
         if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
-            return error("CAddrman::Read() : invalid network magic number");
+            return error("%s : invalid network magic number in %s", __func__, path.string());
 
-        // de-serialize address data into one CAddrMan object
-        ssPeers >> addr;
+        // an unversioned file goes straight on to the payload
+        unsigned char nFileVersion = stream.empty() ? 0 : (unsigned char)stream[0];
+        if (nFileVersion == NET_FILE_VERSION)
+            stream >> nFileVersion;
+        else if (nFileVersion != 0 || !fAllowUnversioned)
+            return error("%s : unsupported format version %d in %s", __func__, nFileVersion, path.string());
+
+        stream >> data;
     }
     catch (std::exception &e) {
-        return error("CAddrman::Read() : I/O error or stream data corrupted");
+        return error("%s : I/O error or stream data corrupted in %s", __func__, path.string());
     }
 
     return true;
 }
+
+CAddrDB::CAddrDB()
+{
+    pathAddr = GetDataDir() / "peers.dat";
+}
+
+bool CAddrDB::Write(const CAddrMan& addr)
+{
+    CDataStream ssPeers(SER_DISK, CLIENT_VERSION);
+    SnapshotFileDB(ssPeers, addr);
+    return WriteFileDB(pathAddr, ssPeers);
+}
+
+bool CAddrDB::Read(CAddrMan& addr)
+{
+    return ReadFileDB(pathAddr, addr, true);
+}
+
+CBanDB::CBanDB()
+{
+    pathBanlist = GetDataDir() / "banlist.dat";
+}
+
+bool CBanDB::Write(const banmap_t& banSet)
+{
+    CDataStream ssBanlist(SER_DISK, CLIENT_VERSION);
+    SnapshotFileDB(ssBanlist, banSet);
+    return WriteFileDB(pathBanlist, ssBanlist);
+}
+
+bool CBanDB::Read(banmap_t& banSet)
+{
+    return ReadFileDB(pathBanlist, banSet, false);
+}
@@ -7,12 +7,12 @@
 #define BITCOIN_NET_H
 
 #include "addrman.h"
+#include "bloom.h"
 #include "key.h"
 #include "keystore.h"
 #include "netaddress.h"
 #include "protocol.h"
 #include "main.h"
-#include "mruset.h"
 #include "random.h"
 #include "scheduler.h"
 #include "script.h"
@@ -22,6 +22,7 @@
 #include "utiltime.h"
 
 #include <deque>
+#include <list>
 #include <thread>
 
 #ifndef WIN32
@@ -30,6 +31,7 @@
 
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 
@@ -39,18 +41,29 @@ class CRequestTracker;
 class CScheduler;
 class CNode;
 class CBlockIndex;
+class CBloomFilter;
 extern int nBestHeight;
 
 /** Run the feeler connection loop once every 2 minutes or 120 seconds. **/
 static const int FEELER_INTERVAL = 120;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Addresses a peer is remembered to know, and the chance one it doesn't know is skipped. */
+static const unsigned int ADDR_KNOWN_ELEMENTS = 5000;
+static const double ADDR_KNOWN_FPRATE = 0.001;
+/** Inventory a peer is remembered to know, and the chance an unknown item is not announced to it. */
+static const unsigned int INVENTORY_KNOWN_ELEMENTS = 10000;
+static const double INVENTORY_KNOWN_FPRATE = 0.000001;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
 /** Maximum number of automatic outgoing nodes */
 static const int MAX_OUTBOUND_CONNECTIONS = 64;
 /** Maximum number of addnode outgoing nodes */
 static const int MAX_ADDNODE_CONNECTIONS = 8;
+/** Milliseconds before the next candidate address of a connection is dialed alongside the first (RFC 8305) */
+static const int CONNECTION_ATTEMPT_DELAY = 250;
+/** Maximum candidate addresses raced for one outbound connection */
+static const unsigned int MAX_CONNECTION_CANDIDATES = 8;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** -upnp default */
@@ -61,12 +74,112 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** The default for -maxuploadtarget. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The default timeframe for -maxuploadtarget. 1 day. */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Bytes of the upload target held back for each block still expected in the
+ * cycle, so new blocks keep relaying after historical serving stops. Sized for
+ * typical blocks; reserving MAX_BLOCK_SIZE per block would swallow any budget. */
+static const uint64_t UPLOAD_TARGET_BLOCK_RESERVE = 100 * 1000;
+/** Blocks older than this are "historical" and stop being served once the upload target is reached */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** The default for -maxpeeruploadrate and -maxpeerdownloadrate. 0 = Unlimited */
+static const int64_t DEFAULT_MAX_PEER_RATE = 0;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
+inline int64_t MaxPeerUploadRate() { return 1000*GetArg("-maxpeeruploadrate", DEFAULT_MAX_PEER_RATE); }
+inline int64_t MaxPeerDownloadRate() { return 1000*GetArg("-maxpeerdownloadrate", DEFAULT_MAX_PEER_RATE); }
+
+/** Token bucket shaping one direction of a connection to nRate bytes per
+ * second. It holds at most one second's worth of tokens, so a connection
+ * that was idle can burst that much. A rate of 0 means unlimited. */
+class CTokenBucket
+{
+public:
+    CTokenBucket() : nRate(0), nTokens(0), nLastRefill(0) {}
+
+    void SetRate(int64_t nRateIn);
+    int64_t GetRate() const { return nRate; }
+
+    // Bytes that may be transferred at nTimeMicros
+    int64_t Available(int64_t nTimeMicros);
+    void Consume(int64_t nBytes);
+
+private:
+    int64_t nRate;
+    int64_t nTokens;
+    int64_t nLastRefill;
+};
+
+/** Serialized message payload. It is immutable once built, so one copy is
+ * queued for every peer it is sent to; the checksum is computed only once. */
+class CNetPayload
+{
+public:
+    CSerializeData vch;
+    unsigned int nChecksum;
+
+    // Takes the contents of ss, leaving it empty
+    explicit CNetPayload(CDataStream& ss);
+};
+typedef boost::shared_ptr<const CNetPayload> CNetPayloadRef;
+
+CNetPayloadRef MakeNetPayload(const CDataStream& ss);
+
+/** A message in a peer's send queue: its own header and a shared payload */
+class CSendMessage
+{
+public:
+    char header[CMessageHeader::HEADER_SIZE];
+    CNetPayloadRef payload;
+
+    CSendMessage(const char* pszCommand, const CNetPayloadRef& payloadIn);
+
+    size_t size() const { return CMessageHeader::HEADER_SIZE + payload->vch.size(); }
+};
 
 typedef std::map<CSubNet, int64_t> banmap_t;
 
+/** Order resolved addresses for racing: alternate between the network of
+ * the first address and the others, so an unreachable family costs one
+ * CONNECTION_ATTEMPT_DELAY rather than a timeout per address. */
+std::vector<CService> InterleaveAddressFamilies(const std::vector<CService>& vAddr);
+
+/** An outbound connection being established by the socket thread without
+ * blocking. Its candidate addresses are dialed one CONNECTION_ATTEMPT_DELAY
+ * apart while earlier ones are still in flight; the first to complete
+ * becomes the peer and the rest are dropped. */
+class CPendingConnect
+{
+public:
+    struct Attempt
+    {
+        CService addr;
+        SOCKET hSocket;
+        int64_t nTimeStart;
+    };
+
+    CAddress addrConnect;
+    std::vector<CService> vCandidates;
+    unsigned int nNextCandidate;
+    int64_t nNextDial;
+    std::vector<Attempt> vAttempts;
+    CSemaphoreGrant grantOutbound;
+
+    CPendingConnect(const CAddress& addrIn, const std::vector<CService>& vCandidatesIn);
+    ~CPendingConnect();
+
+    // Dial the next candidate if due and drop attempts past nTimeout; false once every candidate has failed
+    bool Dial(int64_t nNow, int nTimeout);
+    bool Matches(const CService& addr) const;
+
+private:
+    CPendingConnect(const CPendingConnect&);
+    CPendingConnect& operator=(const CPendingConnect&);
+};
+
 bool RecvLine(SOCKET hSocket, std::string& strLine);
 bool GetMyExternalIP(CNetAddr& ipRet);
 void AddressCurrentlyConnected(const CService& addr);
@@ -76,7 +189,7 @@ CNode* FindNode(const CService& ip);
 void MapPort();
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
-void SocketSendData(CNode *pnode);
+size_t SocketSendData(CNode *pnode);
 
 typedef int NodeId;
 
@@ -161,7 +274,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetPayloadRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -208,6 +321,10 @@ public:
     // bool GetNetworkActive() const { return fNetworkActive; };
     // void SetNetworkActive(bool active);
     bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+    // Like OpenNetworkConnection, but returns at once and leaves the connect
+    // (raced across vCandidates) to the socket thread. Proxied destinations
+    // still connect synchronously.
+    bool StartNetworkConnection(const CAddress& addrConnect, const std::vector<CService>& vCandidates, CSemaphoreGrant& grantOutbound);
     // bool OpenMasternodeConnection(const CAddress& addrConnect);
     // bool CheckIncomingNonce(uint64_t nonce);
 
@@ -406,33 +523,38 @@ public:
 
     // unsigned int GetSendBufferSize() const;
 
-    // void AddWhitelistedRange(const CSubNet &subnet);
+    void AddWhitelistedRange(const CSubNet &subnet);
 
     // ServiceFlags GetLocalServices() const;
 
-    // //!set the max outbound target in bytes
-    // void SetMaxOutboundTarget(uint64_t limit);
-    // uint64_t GetMaxOutboundTarget();
+    //!set the max outbound target in bytes
+    void SetMaxOutboundTarget(uint64_t limit);
+    uint64_t GetMaxOutboundTarget();
 
-    // //!set the timeframe for the max outbound target
-    // void SetMaxOutboundTimeframe(uint64_t timeframe);
-    // uint64_t GetMaxOutboundTimeframe();
+    //!set the timeframe for the max outbound target
+    void SetMaxOutboundTimeframe(uint64_t timeframe);
+    uint64_t GetMaxOutboundTimeframe();
 
-    // //!check if the outbound target is reached
-    // // if param historicalBlockServingLimit is set true, the function will
-    // // response true if the limit for serving historical blocks has been reached
-    // bool OutboundTargetReached(bool historicalBlockServingLimit);
+    //!check if the outbound target is reached
+    // if param historicalBlockServingLimit is set true, the function will
+    // response true if the limit for serving historical blocks has been reached
+    bool OutboundTargetReached(bool historicalBlockServingLimit);
 
-    // //!response the bytes left in the current max outbound cycle
-    // // in case of no limit, it will always response 0
-    // uint64_t GetOutboundTargetBytesLeft();
+    //!response the bytes left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    uint64_t GetOutboundTargetBytesLeft();
 
-    // //!response the time in second left in the current max outbound cycle
-    // // in case of no limit, it will always response 0
-    // uint64_t GetMaxOutboundTimeLeftInCycle();
+    //!response the time in second left in the current max outbound cycle
+    // in case of no limit, it will always response 0
+    uint64_t GetMaxOutboundTimeLeftInCycle();
 
-    // uint64_t GetTotalBytesRecv();
-    // uint64_t GetTotalBytesSent();
+    uint64_t GetTotalBytesRecv();
+    uint64_t GetTotalBytesSent();
+
+    // Network stats; sends also happen outside the socket thread, from
+    // CNode::EndMessage's optimistic write, so these are public
+    void RecordBytesRecv(uint64_t bytes);
+    void RecordBytesSent(uint64_t bytes);
 
     // void SetBestHeight(int height);
     // int GetBestHeight() const;
@@ -463,7 +585,11 @@ private:
     // void AcceptConnection(const ListenSocket& hListenSocket);
     void ThreadSocketHandler();
     void ThreadSocketHandler2();
+    bool DialPendingConnects(fd_set& fdsetSend, fd_set& fdsetError, SOCKET& hSocketMax);
+    void CompletePendingConnects(fd_set& fdsetSend, fd_set& fdsetError);
+    bool IsPendingConnect(const CService& addr);
     void ThreadDNSAddressSeed();
+    void ThreadDumpData();
     // void ThreadOpenMasternodeConnections();
 
     // uint64_t CalculateKeyedNetGroup(const CAddress& ad) const;
@@ -475,7 +601,7 @@ private:
 
     // bool AttemptToEvictConnection();
     // CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL, bool darkSendMaster=false);
-    // bool IsWhitelistedRange(const CNetAddr &addr);
+    bool IsWhitelistedRange(const CNetAddr &addr);
 
     // void DeleteNode(CNode* pnode);
 
@@ -489,32 +615,28 @@ private:
     //!clean unused entries (if bantime has expired)
     void SweepBanned();
     void DumpAddresses();
+    void DumpBanlist();
     void DumpData();
-    // void DumpBanlist();
-
-    // // Network stats
-    // void RecordBytesRecv(uint64_t bytes);
-    // void RecordBytesSent(uint64_t bytes);
 
     // // Whether the node should be passed out in ForEach* callbacks
     // static bool NodeFullyConnected(const CNode* pnode);
 
-    // // Network usage totals
-    // CCriticalSection cs_totalBytesRecv;
-    // CCriticalSection cs_totalBytesSent;
-    // uint64_t nTotalBytesRecv;
-    // uint64_t nTotalBytesSent;
+    // Network usage totals
+    CCriticalSection cs_totalBytesRecv;
+    CCriticalSection cs_totalBytesSent;
+    uint64_t nTotalBytesRecv;
+    uint64_t nTotalBytesSent;
 
-    // // outbound limit & stats
-    // uint64_t nMaxOutboundTotalBytesSentInCycle;
-    // uint64_t nMaxOutboundCycleStartTime;
-    // uint64_t nMaxOutboundLimit;
-    // uint64_t nMaxOutboundTimeframe;
+    // outbound limit & stats
+    uint64_t nMaxOutboundTotalBytesSentInCycle;
+    uint64_t nMaxOutboundCycleStartTime;
+    uint64_t nMaxOutboundLimit;
+    uint64_t nMaxOutboundTimeframe;
 
-    // // Whitelisted ranges. Any node connecting from these is automatically
-    // // whitelisted (as well as those connecting to whitelisted binds).
-    // std::vector<CSubNet> vWhitelistedRange;
-    // CCriticalSection cs_vWhitelistedRange;
+    // Whitelisted ranges. Any node connecting from these is automatically
+    // whitelisted.
+    std::vector<CSubNet> vWhitelistedRange;
+    CCriticalSection cs_vWhitelistedRange;
 
     // unsigned int nSendBufferMaxSize;
     // unsigned int nReceiveFloodSize;
@@ -545,6 +667,8 @@ private:
 
     CSemaphore *semOutbound;
     CSemaphore *semAddnode;
+    std::list<CPendingConnect*> vPendingConnects;
+    CCriticalSection cs_vPendingConnects;
     // CSemaphore *semMasternodeOutbound;
     int nMaxConnections;
     int nMaxOutbound;
@@ -569,6 +693,7 @@ private:
     std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
+    std::thread threadDumpData;
     // std::thread threadOpenMasternodeConnections;
     // std::thread threadMessageHandler;
 };
@@ -581,6 +706,11 @@ extern std::unique_ptr<CConnman> g_connman;
 
 
 
+typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
+
+/** Received bytes of commands outside getAllNetMessageTypes() are counted under this key */
+const std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
+
 class CNodeStats
 {
 public:
@@ -596,6 +726,11 @@ public:
     bool fInbound;
     int nStartingHeight;
     int nMisbehavior;
+    bool fWhitelisted;
+    uint64_t nSendBytes;
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    uint64_t nRecvBytes;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
 };
 
 
@@ -612,9 +747,12 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    CHashWriter hasher;             // double-SHA256 of the data received so far
+    uint256 hashData;               // set once the message is complete
+
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn), hasher(SER_GETHASH, 0) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
@@ -649,15 +787,23 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream ssSend;
+    CDataStream ssSend; // payload of the message being built
+    std::string strSendCommand;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
+    uint64_t nSendBytes;
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    CTokenBucket sendBucket;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    CSerializeData vchRecvSpare;    // storage of a processed message, for the next one
+    uint64_t nRecvBytes;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    CTokenBucket recvBucket;
     int nRecvVersion;
 
     int64_t nLastSend;
@@ -670,6 +816,8 @@ public:
     int nVersion;
     std::string cleanSubVer;
     std::string strSubVer;
+    // Whitelisted peers are exempt from the upload target and traffic shaping
+    bool fWhitelisted;
     bool fOneShot;
     bool fClient;
     bool fInbound;
@@ -677,6 +825,9 @@ public:
     bool fSuccessfullyConnected;
     bool fDisconnect;
     bool fRelayTxes;
+    bool fPreferCompactBlocks; // peer asked for new blocks as "cmpctblock"
+    CCriticalSection cs_filter;
+    CBloomFilter* pfilter; // set by filterload; NULL relays everything
     bool fDarkSendMaster;
     // If 'true' this node will be disconnected on CMasternodeMan::ProcessMasternodeConnections()
     bool fMasternode; // NTRN TODO - finish implementing this
@@ -697,13 +848,13 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -721,6 +872,14 @@ public:
       return id;
     }
 
+    void SetWhitelisted()
+    {
+        fWhitelisted = true;
+        LOCK2(cs_vSend, cs_vRecvMsg);
+        sendBucket.SetRate(0);
+        recvBucket.SetRate(0);
+    }
+
     int GetRefCount()
     {
         assert(nRefCount >= 0);
@@ -739,6 +898,11 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // Keep the storage of a processed message for the next message to
+    // receive into, so small messages do not each allocate, and zero on
+    // free, a buffer of their own. requires LOCK(cs_vRecvMsg)
+    void RecycleRecvBuffer(CDataStream& vRecv);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -761,7 +925,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -769,7 +933,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -783,7 +947,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -791,7 +955,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -807,6 +971,9 @@ public:
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    // Queue a payload that may also be queued for other peers, without copying it
+    void PushSharedMessage(const char* pszCommand, const CNetPayloadRef& payload);
+
     void PushVersion();
 
 
@@ -1108,6 +1275,17 @@ public:
     bool Read(CAddrMan& addr);
 };
 
+/** Access to the banned subnets database (banlist.dat) */
+class CBanDB
+{
+private:
+    boost::filesystem::path pathBanlist;
+public:
+    CBanDB();
+    bool Write(const banmap_t& banSet);
+    bool Read(banmap_t& banSet);
+};
+
 
 
 /** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
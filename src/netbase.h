@@ -51,6 +51,11 @@ CService LookupNumeric(const char *pszName, int portDefault = 0);
 bool LookupSubNet(const char *pszName, CSubNet& subnet);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout, bool *outProxyConnectionFailed = 0);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault, int nTimeout, bool *outProxyConnectionFailed = 0);
+/** Begin a non-blocking connect to addr, never through a proxy. Once the
+ * socket selects writable (or errored), FinishConnectSocket tells the outcome. */
+bool StartConnectSocket(const CService &addr, SOCKET& hSocketRet);
+/** True if the connect begun on hSocket succeeded; otherwise closes it */
+bool FinishConnectSocket(const CService &addr, SOCKET& hSocket);
 /** Return readable error string for a network error code */
 std::string NetworkErrorString(int err);
 /** Close socket and set hSocket to INVALID_SOCKET */
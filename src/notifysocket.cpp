@@ -0,0 +1,473 @@
+// Copyright (c) 2017 The Neutron developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notifysocket.h"
+
+#include "main.h"
+#include "sync.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <deque>
+#include <set>
+
+using namespace std;
+using namespace boost::asio;
+
+typedef boost::shared_ptr<const string> FrameRef;
+
+class CNotifyServer;
+
+/**
+ * One subscriber connection. Everything here runs on the server's
+ * io_service thread, so none of it needs a lock.
+ */
+class CNotifySubscriber : public boost::enable_shared_from_this<CNotifySubscriber>
+{
+public:
+    unsigned char nTopics;
+    int nId;
+
+    CNotifySubscriber(CNotifyServer* pserverIn, int nIdIn) :
+        nTopics(0), nId(nIdIn), pserver(pserverIn), nQueuedBytes(0), nWriting(0), nDropped(0)
+    {
+    }
+    virtual ~CNotifySubscriber() { }
+
+    void Start() { AsyncRead(&chSubscribe); }
+    void Push(const FrameRef& frame, size_t nMaxQueue);
+    virtual void Close() = 0;
+
+    void HandleRead(const boost::system::error_code& err);
+    void HandleWrite(const boost::system::error_code& err);
+
+protected:
+    CNotifyServer* pserver;
+    unsigned char chSubscribe;
+
+    // Frames not yet written, the first nWriting of them being written now
+    deque<FrameRef> queue;
+    size_t nQueuedBytes;
+    size_t nWriting;
+    uint64_t nDropped;
+
+    virtual void AsyncRead(unsigned char* pch) = 0;
+    virtual void AsyncWrite(const vector<const_buffer>& vBuffers) = 0;
+
+    void WriteQueued();
+};
+
+template <typename Protocol>
+class CNotifyConnection : public CNotifySubscriber
+{
+public:
+    typename Protocol::socket socket;
+
+    CNotifyConnection(io_service& ios, CNotifyServer* pserverIn, int nIdIn) :
+        CNotifySubscriber(pserverIn, nIdIn), socket(ios)
+    {
+    }
+
+    void Close()
+    {
+        boost::system::error_code err;
+        socket.close(err);
+    }
+
+protected:
+    void AsyncRead(unsigned char* pch)
+    {
+        async_read(socket, buffer(pch, 1),
+            boost::bind(&CNotifySubscriber::HandleRead, shared_from_this(), boost::asio::placeholders::error));
+    }
+
+    void AsyncWrite(const vector<const_buffer>& vBuffers)
+    {
+        async_write(socket, vBuffers,
+            boost::bind(&CNotifySubscriber::HandleWrite, shared_from_this(), boost::asio::placeholders::error));
+    }
+};
+
+// Frames are small and latency is the point, so don't let Nagle hold them
+static void SetSocketOptions(ip::tcp::socket& socket)
+{
+    boost::system::error_code err;
+    socket.set_option(ip::tcp::no_delay(true), err);
+}
+
+template <typename Socket>
+static void SetSocketOptions(Socket& socket)
+{
+}
+
+class CNotifyServer
+{
+public:
+    io_service ios;
+
+    explicit CNotifyServer(size_t nMaxQueueIn) : work(ios), nMaxQueue(nMaxQueueIn), nNextId(0) { }
+    ~CNotifyServer();
+
+    bool Bind(string& strError);
+    void Start() { thread = boost::thread(boost::bind(&CNotifyServer::Run, this)); }
+    void Stop();
+
+    void Dispatch(unsigned char nTopic, const FrameRef& frame);
+    void Remove(const boost::shared_ptr<CNotifySubscriber>& subscriber);
+    void UpdateTopics();
+
+private:
+    io_service::work work;
+    boost::thread thread;
+    size_t nMaxQueue;
+    int nNextId;
+    set<boost::shared_ptr<CNotifySubscriber> > setSubscribers;
+    boost::shared_ptr<ip::tcp::acceptor> tcpAcceptor;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    boost::shared_ptr<local::stream_protocol::acceptor> localAcceptor;
+    boost::filesystem::path pathSocket;
+#endif
+
+    void Run();
+
+    template <typename Protocol>
+    void Listen(boost::shared_ptr<typename Protocol::acceptor> acceptor);
+    template <typename Protocol>
+    void HandleAccept(boost::shared_ptr<typename Protocol::acceptor> acceptor,
+                      boost::shared_ptr<CNotifyConnection<Protocol> > conn,
+                      const boost::system::error_code& err);
+};
+
+static CCriticalSection cs_notify;
+static CNotifyServer* pnotifyServer = NULL;
+static map<unsigned char, uint64_t> mapNotifySequence;
+// Topics some subscriber wants; nothing is serialized for the others
+static std::atomic<unsigned int> nNotifyTopics(0);
+
+void CNotifySubscriber::HandleRead(const boost::system::error_code& err)
+{
+    if (err)
+    {
+        pserver->Remove(shared_from_this());
+        return;
+    }
+    nTopics = chSubscribe;
+    LogPrint("notify", "notify subscriber %d: topics 0x%02x\n", nId, nTopics);
+    pserver->UpdateTopics();
+    AsyncRead(&chSubscribe);
+}
+
+void CNotifySubscriber::Push(const FrameRef& frame, size_t nMaxQueue)
+{
+    // A frame larger than the whole queue still goes out once the queue is empty
+    if (!queue.empty() && nQueuedBytes + frame->size() > nMaxQueue)
+    {
+        if (nDropped++ == 0)
+            LogPrintf("notify subscriber %d is not keeping up, dropping frames\n", nId);
+        return;
+    }
+    if (nDropped > 0)
+    {
+        LogPrintf("notify subscriber %d caught up, %u frames dropped\n", nId, nDropped);
+        nDropped = 0;
+    }
+    queue.push_back(frame);
+    nQueuedBytes += frame->size();
+    if (nWriting == 0)
+        WriteQueued();
+}
+
+// Everything queued goes out in one gathered write, so a burst costs one
+// system call rather than one per frame
+void CNotifySubscriber::WriteQueued()
+{
+    vector<const_buffer> vBuffers;
+    vBuffers.reserve(queue.size());
+    BOOST_FOREACH(const FrameRef& frame, queue)
+        vBuffers.push_back(buffer(*frame));
+    nWriting = queue.size();
+    AsyncWrite(vBuffers);
+}
+
+void CNotifySubscriber::HandleWrite(const boost::system::error_code& err)
+{
+    if (err)
+    {
+        pserver->Remove(shared_from_this());
+        return;
+    }
+    for (; nWriting > 0; nWriting--)
+    {
+        nQueuedBytes -= queue.front()->size();
+        queue.pop_front();
+    }
+    if (!queue.empty())
+        WriteQueued();
+}
+
+CNotifyServer::~CNotifyServer()
+{
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    if (!pathSocket.empty())
+    {
+        boost::system::error_code err;
+        boost::filesystem::remove(pathSocket, err);
+    }
+#endif
+}
+
+bool CNotifyServer::Bind(string& strError)
+{
+    if (mapArgs.count("-notifyport"))
+    {
+        // Subscribers aren't authenticated, so only local ones are accepted
+        ip::tcp::endpoint endpoint(ip::address_v4::loopback(), GetArg("-notifyport", 0));
+        tcpAcceptor.reset(new ip::tcp::acceptor(ios));
+        try
+        {
+            tcpAcceptor->open(endpoint.protocol());
+            tcpAcceptor->set_option(ip::tcp::acceptor::reuse_address(true));
+            tcpAcceptor->bind(endpoint);
+            tcpAcceptor->listen(socket_base::max_connections);
+        }
+        catch (boost::system::system_error& e)
+        {
+            strError = strprintf(_("Unable to listen for notification subscribers on port %u: %s"), endpoint.port(), e.what());
+            return false;
+        }
+        Listen<ip::tcp>(tcpAcceptor);
+        LogPrintf("Notification socket listening on port %u\n", endpoint.port());
+    }
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    if (mapArgs.count("-notifysocket"))
+    {
+        boost::filesystem::path path(GetArg("-notifysocket", ""));
+        if (!path.is_complete())
+            path = GetDataDir() / path;
+        // A socket file left by an earlier run would make bind() fail; anything
+        // else at the path isn't ours to delete
+        boost::system::error_code errStatus;
+        boost::filesystem::file_status status = boost::filesystem::symlink_status(path, errStatus);
+        if (status.type() == boost::filesystem::socket_file)
+        {
+            boost::system::error_code errRemove;
+            boost::filesystem::remove(path, errRemove);
+        }
+        else if (boost::filesystem::exists(status))
+        {
+            strError = strprintf(_("Unable to listen for notification subscribers on %s: a file that is not a socket is in the way"), path.string());
+            return false;
+        }
+
+        local::stream_protocol::endpoint endpoint(path.string());
+        localAcceptor.reset(new local::stream_protocol::acceptor(ios));
+        try
+        {
+            localAcceptor->open(endpoint.protocol());
+            localAcceptor->bind(endpoint);
+            // Wallet events are private; nobody can connect before listen()
+            boost::filesystem::permissions(path, boost::filesystem::owner_read | boost::filesystem::owner_write);
+            localAcceptor->listen(socket_base::max_connections);
+        }
+        catch (boost::system::system_error& e)
+        {
+            strError = strprintf(_("Unable to listen for notification subscribers on %s: %s"), path.string(), e.what());
+            return false;
+        }
+        pathSocket = path;
+        Listen<local::stream_protocol>(localAcceptor);
+        LogPrintf("Notification socket listening on %s\n", path.string());
+    }
+#endif
+    return true;
+}
+
+template <typename Protocol>
+void CNotifyServer::Listen(boost::shared_ptr<typename Protocol::acceptor> acceptor)
+{
+    boost::shared_ptr<CNotifyConnection<Protocol> > conn(new CNotifyConnection<Protocol>(ios, this, nNextId++));
+    acceptor->async_accept(conn->socket,
+        boost::bind(&CNotifyServer::HandleAccept<Protocol>, this, acceptor, conn, boost::asio::placeholders::error));
+}
+
+template <typename Protocol>
+void CNotifyServer::HandleAccept(boost::shared_ptr<typename Protocol::acceptor> acceptor,
+                                 boost::shared_ptr<CNotifyConnection<Protocol> > conn,
+                                 const boost::system::error_code& err)
+{
+    if (err == error::operation_aborted || !acceptor->is_open())
+        return;
+    if (!err)
+    {
+        SetSocketOptions(conn->socket);
+        setSubscribers.insert(conn);
+        conn->Start();
+        LogPrint("notify", "notify subscriber %d connected\n", conn->nId);
+    }
+    Listen<Protocol>(acceptor);
+}
+
+void CNotifyServer::Run()
+{
+    RenameThread("Neutron-notify");
+    ios.run();
+}
+
+void CNotifyServer::Stop()
+{
+    ios.stop();
+    thread.join();
+    BOOST_FOREACH(const boost::shared_ptr<CNotifySubscriber>& subscriber, setSubscribers)
+        subscriber->Close();
+    setSubscribers.clear();
+    boost::system::error_code err;
+    if (tcpAcceptor)
+        tcpAcceptor->close(err);
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+    if (localAcceptor)
+        localAcceptor->close(err);
+#endif
+}
+
+void CNotifyServer::Dispatch(unsigned char nTopic, const FrameRef& frame)
+{
+    BOOST_FOREACH(const boost::shared_ptr<CNotifySubscriber>& subscriber, setSubscribers)
+        if (subscriber->nTopics & nTopic)
+            subscriber->Push(frame, nMaxQueue);
+}
+
+void CNotifyServer::Remove(const boost::shared_ptr<CNotifySubscriber>& subscriber)
+{
+    if (!setSubscribers.erase(subscriber))
+        return;
+    subscriber->Close();
+    LogPrint("notify", "notify subscriber %d disconnected\n", subscriber->nId);
+    UpdateTopics();
+}
+
+void CNotifyServer::UpdateTopics()
+{
+    unsigned int nTopics = 0;
+    BOOST_FOREACH(const boost::shared_ptr<CNotifySubscriber>& subscriber, setSubscribers)
+        nTopics |= subscriber->nTopics;
+    nNotifyTopics = nTopics;
+}
+
+bool StartNotifySocket(string& strError)
+{
+    if (!mapArgs.count("-notifyport") && !mapArgs.count("-notifysocket"))
+        return true;
+
+    size_t nMaxQueue = std::max((int64_t)GetArg("-notifymaxqueue", DEFAULT_NOTIFY_MAX_QUEUE), (int64_t)1) * 1024 * 1024;
+    CNotifyServer* pserver = new CNotifyServer(nMaxQueue);
+    if (!pserver->Bind(strError))
+    {
+        delete pserver;
+        return false;
+    }
+    pserver->Start();
+
+    LOCK(cs_notify);
+    pnotifyServer = pserver;
+    mapNotifySequence.clear();
+    return true;
+}
+
+void StopNotifySocket()
+{
+    CNotifyServer* pserver;
+    {
+        LOCK(cs_notify);
+        pserver = pnotifyServer;
+        pnotifyServer = NULL;
+    }
+    nNotifyTopics = 0;
+    if (pserver == NULL)
+        return;
+    pserver->Stop();
+    delete pserver;
+}
+
+unsigned int GetNotifyTopics()
+{
+    return nNotifyTopics;
+}
+
+// A frame under construction: room for the header, then the payload
+static CDataStream NewFrame()
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.resize(NOTIFY_FRAME_HEADER_SIZE);
+    return ss;
+}
+
+static void Publish(unsigned char nTopic, CDataStream& ss)
+{
+    LOCK(cs_notify);
+    if (pnotifyServer == NULL)
+        return;
+
+    // Sequence numbers are taken and frames handed over under one lock, so
+    // each topic's frames reach the io_service in sequence order
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << (uint32_t)(ss.size() - 4) << nTopic << mapNotifySequence[nTopic]++ << GetTimeMicros();
+    assert(ssHeader.size() == NOTIFY_FRAME_HEADER_SIZE);
+    memcpy(&ss[0], &ssHeader[0], NOTIFY_FRAME_HEADER_SIZE);
+
+    FrameRef frame(new string(ss.str()));
+    pnotifyServer->ios.post(boost::bind(&CNotifyServer::Dispatch, pnotifyServer, nTopic, frame));
+}
+
+void NotifyBlock(const CBlock& block)
+{
+    unsigned int nTopics = nNotifyTopics;
+    if (nTopics & NOTIFY_HASHBLOCK)
+    {
+        CDataStream ss = NewFrame();
+        ss << block.GetHash();
+        Publish(NOTIFY_HASHBLOCK, ss);
+    }
+    if (nTopics & NOTIFY_RAWBLOCK)
+    {
+        CDataStream ss = NewFrame();
+        ss << block;
+        Publish(NOTIFY_RAWBLOCK, ss);
+    }
+}
+
+void NotifyTransaction(const CTransaction& tx)
+{
+    unsigned int nTopics = nNotifyTopics;
+    if (nTopics & NOTIFY_HASHTX)
+    {
+        CDataStream ss = NewFrame();
+        ss << tx.GetHash();
+        Publish(NOTIFY_HASHTX, ss);
+    }
+    if (nTopics & NOTIFY_RAWTX)
+    {
+        CDataStream ss = NewFrame();
+        ss << tx;
+        Publish(NOTIFY_RAWTX, ss);
+    }
+}
+
+void NotifyWalletTransaction(const CTransaction& tx, int nChange)
+{
+    if (!(nNotifyTopics & NOTIFY_WALLETTX))
+        return;
+    CDataStream ss = NewFrame();
+    ss << tx.GetHash() << (unsigned char)nChange << tx;
+    Publish(NOTIFY_WALLETTX, ss);
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2017 The Neutron developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NOTIFYSOCKET_H
+#define BITCOIN_NOTIFYSOCKET_H
+
+#include <string>
+
+class CBlock;
+class CTransaction;
+
+/**
+ * Block, transaction and wallet events pushed to local subscribers over a
+ * socket, for consumers that can't afford -blocknotify/-walletnotify
+ * starting a shell per event.
+ *
+ * A subscriber connects to -notifyport (TCP, localhost only) or
+ * -notifysocket (a Unix domain socket) and sends one byte, the topics it
+ * wants OR'd together; it may send another byte later to change them.
+ * From then on it receives frames, integers little-endian:
+ *
+ *   uint32  size of the rest of the frame
+ *   uint8   topic
+ *   uint64  sequence number, counted per topic from 0
+ *   int64   when the frame was published, in microseconds since the epoch
+ *   ...     payload
+ *
+ * NOTIFY_HASHBLOCK, NOTIFY_HASHTX: the 32 byte hash in serialized order,
+ *     which is the reverse of the hex RPC shows
+ * NOTIFY_RAWBLOCK, NOTIFY_RAWTX: the serialized block or transaction
+ * NOTIFY_WALLETTX: the txid, one byte of ChangeType (CT_NEW, CT_UPDATED)
+ *     and the serialized transaction
+ *
+ * A block is published when it becomes the best block. A transaction is
+ * published when it enters the memory pool and again when a block with it
+ * is connected.
+ *
+ * Subscribers are not authenticated. Any local user can connect to
+ * -notifyport and see the wallet's transactions; the -notifysocket file is
+ * made accessible to the node's own user only, so use it where other users
+ * share the machine.
+ *
+ * Frames wait in a queue per subscriber. Once a subscriber has
+ * -notifymaxqueue megabytes waiting, new frames for it are dropped,
+ * which it sees as a gap in the sequence numbers; other subscribers
+ * and the node never wait for it.
+ */
+enum NotifyTopic
+{
+    NOTIFY_HASHBLOCK = (1U << 0),
+    NOTIFY_HASHTX    = (1U << 1),
+    NOTIFY_RAWBLOCK  = (1U << 2),
+    NOTIFY_RAWTX     = (1U << 3),
+    NOTIFY_WALLETTX  = (1U << 4),
+};
+
+static const unsigned int NOTIFY_FRAME_HEADER_SIZE = 4 + 1 + 8 + 8;
+static const unsigned int DEFAULT_NOTIFY_MAX_QUEUE = 16;
+
+//! Listen on -notifyport and -notifysocket, if either is set
+bool StartNotifySocket(std::string& strError);
+void StopNotifySocket();
+//! Topics at least one subscriber currently wants
+unsigned int GetNotifyTopics();
+
+void NotifyBlock(const CBlock& block);
+void NotifyTransaction(const CTransaction& tx);
+void NotifyWalletTransaction(const CTransaction& tx, int nChange);
+
+#endif
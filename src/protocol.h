@@ -221,6 +221,29 @@ extern const char *REJECT;
  * @see https://bitcoin.org/en/developer-reference#sendheaders
  */
 extern const char *SENDHEADERS;
+/**
+ * Contains a boolean "announce" and a uint64_t "version". A peer that sends
+ * it with announce set wants new blocks pushed as "cmpctblock" messages.
+ * @since protocol version COMPACT_BLOCKS_VERSION, modelled on BIP152.
+ */
+extern const char *SENDCMPCT;
+/**
+ * Contains a CBlockHeaderAndShortTxIDs: the header, block signature, the
+ * coinbase and coinstake, and short ids for every other transaction.
+ * @since protocol version COMPACT_BLOCKS_VERSION.
+ */
+extern const char *CMPCTBLOCK;
+/**
+ * Contains a BlockTransactionsRequest: the transactions of a compact block
+ * that the receiver could not find in its mempool.
+ * @since protocol version COMPACT_BLOCKS_VERSION.
+ */
+extern const char *GETBLOCKTXN;
+/**
+ * Contains a BlockTransactions, the reply to "getblocktxn".
+ * @since protocol version COMPACT_BLOCKS_VERSION.
+ */
+extern const char *BLOCKTXN;
 
 // Neutron message types
 // NOTE: do NOT declare non-implmented here, we don't want them to be exposed to the outside
@@ -243,6 +266,9 @@ const std::vector<std::string> &getAllNetMessageTypes();
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // Serves bloom filtered connections: filterload, filteradd, filterclear
+    // and MSG_FILTERED_BLOCK requests
+    NODE_BLOOM = (1 << 2),
 };
 
 /** A CService with information about it as peer */
@@ -159,6 +159,8 @@ void AskPassphraseDialog::accept()
         else
         {
             fWalletUnlockStakingOnly = ui->stakingCheckBox->isChecked();
+            if (fWalletUnlockStakingOnly)
+                model->cacheStakingKeys();
             QDialog::accept(); // Success
         }
         break;
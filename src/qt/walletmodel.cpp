@@ -332,6 +332,11 @@ bool WalletModel::isAnonymizeOnlyUnlocked()
     return wallet->fWalletUnlockAnonymizeOnly;
 }
 
+void WalletModel::cacheStakingKeys()
+{
+    wallet->CacheStakingKeys();
+}
+
 bool WalletModel::changePassphrase(const SecureString &oldPass, const SecureString &newPass)
 {
     bool retval;
@@ -99,6 +99,8 @@ public:
     // Wallet backup
     bool backupWallet(const QString &filename);
     bool isAnonymizeOnlyUnlocked();
+    // Decrypt the staking keys ahead of a staking-only session
+    void cacheStakingKeys();
 
     // RAI object for unlocking wallet, returned by requestUnlock()
     class UnlockContext
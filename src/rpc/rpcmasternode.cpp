@@ -58,13 +58,13 @@ UniValue masternodelist(const UniValue& params, bool fHelp)
     // NTRN TODO: rename mn.pubkey to mn.pubKeyCollateralAddress
 
     UniValue obj(UniValue::VOBJ);
+    std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
     if (strMode == "rank") {
-        BOOST_FOREACH(CMasternode mn, vecMasternodes) {
-            mn.Check();
-            obj.push_back(Pair(mn.addr.ToString().c_str(), (int)(GetMasternodeRank(mn.vin, pindexBest->nHeight))));
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+            obj.push_back(Pair(mn.addr.ToString().c_str(), (int)(mnodeman.GetMasternodeRank(mn.vin, pindexBest->nHeight))));
         }
     } else {
-        BOOST_FOREACH(CMasternode mn, vecMasternodes) {
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
             std::string strOutpoint = mn.addr.ToString().c_str();
             if (strMode == "activeseconds") {
                 if (strFilter !="" && strOutpoint.find(strFilter) == std::string::npos) continue;
@@ -153,9 +153,9 @@ UniValue masternodelist(const UniValue& params, bool fHelp)
 }
 
 static const CRPCCommand commands[] =
-{ //  name                      actor (function)         okSafeMode  unlocked
-  //  ------------------------  -----------------------  ----------  --------
-    { "masternodelist",         &masternodelist,         true,       true },
+{ //  name                      actor (function)         okSafeMode  unlocked  streamer
+  //  ------------------------  -----------------------  ----------  --------  --------
+    { "masternodelist",         &masternodelist,         true,       true,     NULL },
 };
 
 void RegisterMasternodeRPCCommands(CRPCTable &t)
@@ -5,6 +5,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
+#include "base58.h"
 #include "utiltime.h"
 #include "bitcoinrpc.h"
 #include "wallet.h"
@@ -73,14 +75,14 @@ double GetPoWMHashPS()
     return GetDifficulty() * 4294.967296 / nTargetSpacingWork;
 }
 
-double GetPoSKernelPS()
+double GetPoSKernelPS(const CBlockIndex* pindexTip)
 {
     int nPoSInterval = 72;
     double dStakeKernelsTriedAvg = 0;
     int nStakesHandled = 0, nStakesTime = 0;
 
-    CBlockIndex* pindex = pindexBest;;
-    CBlockIndex* pindexPrevStake = NULL;
+    const CBlockIndex* pindex = pindexTip ? pindexTip : pindexBest;
+    const CBlockIndex* pindexPrevStake = NULL;
 
     while (pindex && nStakesHandled < nPoSInterval)
     {
@@ -98,13 +100,25 @@ double GetPoSKernelPS()
     return nStakesTime ? dStakeKernelsTriedAvg / nStakesTime : 0;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+// Everything about a block but its transactions and signature
+static UniValue blockHeaderToJSON(const CBlock& block, const CBlockIndex* blockindex)
 {
+    // Only what depends on the current main chain needs cs_main, the rest
+    // is read from the block and its (immutable) index entry
+    int nConfirmations;
+    uint256 hashNext = 0;
+    {
+        LOCK(cs_main);
+        CMerkleTx txGen(block.vtx[0]);
+        txGen.SetMerkleBranch(&block);
+        nConfirmations = txGen.GetDepthInMainChain();
+        if (blockindex->pnext)
+            hashNext = blockindex->pnext->GetBlockHash();
+    }
+
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
+    result.push_back(Pair("confirmations", nConfirmations));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", block.nVersion));
@@ -118,29 +132,35 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fP
     result.push_back(Pair("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0')));
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
+    if (hashNext != 0)
+        result.push_back(Pair("nextblockhash", hashNext.GetHex()));
 
     result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
     result.push_back(Pair("proofhash", blockindex->hashProof.GetHex()));
     result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
     result.push_back(Pair("modifier", strprintf("%016" PRIx64, blockindex->nStakeModifier)));
     result.push_back(Pair("modifierchecksum", strprintf("%08x", blockindex->nStakeModifierChecksum)));
-    UniValue txinfo(UniValue::VARR);
-    BOOST_FOREACH (const CTransaction& tx, block.vtx)
-    {
-        if (fPrintTransactionDetail)
-        {
-            UniValue entry(UniValue::VOBJ);
+    return result;
+}
 
-            entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-            TxToJSON(tx, 0, entry);
+static UniValue blockTxToJSON(const CTransaction& tx, bool fPrintTransactionDetail)
+{
+    if (!fPrintTransactionDetail)
+        return tx.GetHash().GetHex();
 
-            txinfo.push_back(entry);
-        }
-        else
-            txinfo.push_back(tx.GetHash().GetHex());
-    }
+    UniValue entry(UniValue::VOBJ);
+    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
+    TxToJSON(tx, 0, entry);
+    return entry;
+}
+
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+{
+    UniValue result = blockHeaderToJSON(block, blockindex);
+
+    UniValue txinfo(UniValue::VARR);
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+        txinfo.push_back(blockTxToJSON(tx, fPrintTransactionDetail));
 
     result.push_back(Pair("tx", txinfo));
 
@@ -150,6 +170,26 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fP
     return result;
 }
 
+// The same as blockToJSON, one transaction at a time
+static void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer)
+{
+    UniValue header = blockHeaderToJSON(block, blockindex);
+
+    writer.BeginObject();
+    for (unsigned int i = 0; i < header.size(); i++)
+        writer.Pair(header.getKeys()[i], header.getValues()[i]);
+
+    writer.Key("tx");
+    writer.BeginArray();
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+        writer.Value(blockTxToJSON(tx, fPrintTransactionDetail));
+    writer.EndArray();
+
+    if (block.IsProofOfStake())
+        writer.Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
+    writer.EndObject();
+}
+
 UniValue getbestblockhash(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -157,7 +197,7 @@ UniValue getbestblockhash(const UniValue& params, bool fHelp)
             "getbestblockhash\n"
             "Returns the hash of the best block in the longest block chain.");
 
-    return hashBestChain.GetHex();
+    return GetChainSnapshot()->hashTip.GetHex();
 }
 
 UniValue getblockcount(const UniValue& params, bool fHelp)
@@ -167,7 +207,7 @@ UniValue getblockcount(const UniValue& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
-    return nBestHeight;
+    return GetChainSnapshot()->nHeight;
 }
 
 
@@ -178,9 +218,11 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
             "getdifficulty\n"
             "Returns the difficulty as a multiple of the minimum difficulty.");
 
+    CChainSnapshotRef chain = GetChainSnapshot();
+
     UniValue obj(UniValue::VOBJ);
-    obj.push_back(Pair("proof-of-work",        GetDifficulty()));
-    obj.push_back(Pair("proof-of-stake",       GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    obj.push_back(Pair("proof-of-work",        chain->pindexLastPoW ? GetDifficulty(chain->pindexLastPoW) : 1.0));
+    obj.push_back(Pair("proof-of-stake",       chain->pindexLastPoS ? GetDifficulty(chain->pindexLastPoS) : 1.0));
     obj.push_back(Pair("search-interval",      (int)nLastCoinStakeSearchInterval));
     return obj;
 }
@@ -216,6 +258,23 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     return a;
 }
 
+void StreamRawMempool(const UniValue& params, CJSONWriter& writer)
+{
+    if (params.size() != 0)
+    {
+        writer.Value(getrawmempool(params, false));
+        return;
+    }
+
+    vector<uint256> vtxid;
+    mempool.queryHashes(vtxid);
+
+    writer.BeginArray();
+    BOOST_FOREACH(const uint256& hash, vtxid)
+        writer.Value(hash.ToString());
+    writer.EndArray();
+}
+
 UniValue getblockhash(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -224,6 +283,8 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
             "Returns hash of block in best-block-chain at <index>.");
 
     int nHeight = params[0].get_int();
+
+    LOCK(cs_main);
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
@@ -231,6 +292,24 @@ UniValue getblockhash(const UniValue& params, bool fHelp)
     return pblockindex->phashBlock->GetHex();
 }
 
+static const CBlockIndex* ReadBlockByHash(const std::string& strHash, CBlock& block)
+{
+    uint256 hash(strHash);
+
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+    }
+
+    // Index entries are never freed, so the read needs no lock
+    block.ReadFromDisk(pblockindex, true);
+    return pblockindex;
+}
+
 UniValue getblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -239,17 +318,24 @@ UniValue getblock(const UniValue& params, bool fHelp)
             "txinfo optional to print more detailed tx info\n"
             "Returns details of a block with given block-hash.");
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(strHash);
+    CBlock block;
+    const CBlockIndex* pblockindex = ReadBlockByHash(params[0].get_str(), block);
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+}
+
+void StreamBlock(const UniValue& params, CJSONWriter& writer)
+{
+    if (params.size() < 1 || params.size() > 2)
+    {
+        writer.Value(getblock(params, false));  // throws the usage
+        return;
+    }
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    block.ReadFromDisk(pblockindex, true);
+    const CBlockIndex* pblockindex = ReadBlockByHash(params[0].get_str(), block);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
 }
 
 UniValue getblockbynumber(const UniValue& params, bool fHelp)
@@ -261,17 +347,20 @@ UniValue getblockbynumber(const UniValue& params, bool fHelp)
             "Returns details of a block with given block-number.");
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > nBestHeight)
-        throw runtime_error("Block number out of range.");
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
 
-    uint256 hash = *pblockindex->phashBlock;
+    // FindBlockByHeight follows the main chain, so it needs cs_main, but
+    // only for the lookup: it starts from the nearer of the genesis block,
+    // the tip and the last block it found, instead of walking back from
+    // the tip every time
+    const CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        if (nHeight < 0 || nHeight > nBestHeight)
+            throw runtime_error("Block number out of range.");
+        pblockindex = FindBlockByHeight(nHeight);
+    }
 
-    pblockindex = mapBlockIndex[hash];
+    CBlock block;
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -340,3 +429,168 @@ UniValue getblockversionstats(const UniValue& params, bool fHelp) {
 
     return results;
 }
+
+// Addresses named by an address index query: a single address, or an object
+// with an "addresses" array
+static vector<pair<unsigned char, uint160> > ParseAddressIndexQuery(const UniValue& param)
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex");
+
+    vector<string> vstrAddresses;
+    if (param.isStr())
+        vstrAddresses.push_back(param.get_str());
+    else if (param.isObject())
+    {
+        const UniValue& addresses = find_value(param.get_obj(), "addresses");
+        if (!addresses.isArray())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Addresses is expected to be an array");
+        for (unsigned int i = 0; i < addresses.size(); i++)
+            vstrAddresses.push_back(addresses[i].get_str());
+    }
+    else
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an object with an addresses array");
+
+    vector<pair<unsigned char, uint160> > vAddresses;
+    BOOST_FOREACH(const string& strAddress, vstrAddresses)
+    {
+        CBitcoinAddress address(strAddress);
+        CTxDestination dest = address.Get();
+        if (const CKeyID* keyID = boost::get<CKeyID>(&dest))
+            vAddresses.push_back(make_pair((unsigned char)ADDRESS_INDEX_KEYHASH, uint160(*keyID)));
+        else if (const CScriptID* scriptID = boost::get<CScriptID>(&dest))
+            vAddresses.push_back(make_pair((unsigned char)ADDRESS_INDEX_SCRIPTHASH, uint160(*scriptID)));
+        else
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address: " + strAddress);
+    }
+    return vAddresses;
+}
+
+static string AddressIndexToString(unsigned char nType, const uint160& hashBytes)
+{
+    if (nType == ADDRESS_INDEX_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <address or {\"addresses\":[address,...]}>\n"
+            "Returns the unspent outputs paying the given addresses, oldest first.\n"
+            "Needs -addressindex.");
+
+    vector<pair<unsigned char, uint160> > vAddresses = ParseAddressIndexQuery(params[0]);
+
+    // The index is read straight from the database, which is only updated a
+    // whole block at a time, so this needs no cs_main
+    CTxDB txdb("r");
+    vector<pair<int, UniValue> > vOutputs;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        AddressUnspentVector vUnspent;
+        if (!txdb.ReadAddressUnspentIndex(vAddresses[i].first, vAddresses[i].second, vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+        string strAddress = AddressIndexToString(vAddresses[i].first, vAddresses[i].second);
+        BOOST_FOREACH(const PAIRTYPE(CAddressUnspentKey, CAddressUnspentValue)& item, vUnspent)
+        {
+            UniValue output(UniValue::VOBJ);
+            output.push_back(Pair("address", strAddress));
+            output.push_back(Pair("txid", item.first.txid.GetHex()));
+            output.push_back(Pair("outputIndex", (int)item.first.nIndex));
+            output.push_back(Pair("script", HexStr(item.second.script.begin(), item.second.script.end())));
+            output.push_back(Pair("satoshis", item.second.nValue));
+            output.push_back(Pair("height", item.second.nHeight));
+            vOutputs.push_back(make_pair(item.second.nHeight, output));
+        }
+    }
+    stable_sort(vOutputs.begin(), vOutputs.end(), [](const pair<int, UniValue>& a, const pair<int, UniValue>& b) {
+        return a.first < b.first;
+    });
+
+    UniValue result(UniValue::VARR);
+    for (unsigned int i = 0; i < vOutputs.size(); i++)
+        result.push_back(vOutputs[i].second);
+    return result;
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address or {\"addresses\":[address,...]}>\n"
+            "Returns the balance of the given addresses and the total they have received, in satoshis.\n"
+            "Needs -addressindex.");
+
+    vector<pair<unsigned char, uint160> > vAddresses = ParseAddressIndexQuery(params[0]);
+
+    CTxDB txdb("r");
+    int64_t nBalance = 0;
+    int64_t nReceived = 0;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        AddressIndexVector vEntries;
+        if (!txdb.ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, vEntries))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+        BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, int64_t)& item, vEntries)
+        {
+            if (item.second > 0)
+                nReceived += item.second;
+            nBalance += item.second;
+        }
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", nBalance));
+    result.push_back(Pair("received", nReceived));
+    return result;
+}
+
+UniValue getaddresstxids(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids <address or {\"addresses\":[address,...],\"start\":n,\"end\":n}>\n"
+            "Returns the ids of the transactions that credit or debit the given addresses,\n"
+            "oldest first, optionally only those in blocks start to end.\n"
+            "Needs -addressindex.");
+
+    vector<pair<unsigned char, uint160> > vAddresses = ParseAddressIndexQuery(params[0]);
+
+    int nStart = 0;
+    int nEnd = -1;
+    if (params[0].isObject())
+    {
+        const UniValue& startValue = find_value(params[0].get_obj(), "start");
+        const UniValue& endValue = find_value(params[0].get_obj(), "end");
+        if (!startValue.isNull() || !endValue.isNull())
+        {
+            if (!startValue.isNum() || !endValue.isNum())
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end must be given together");
+            nStart = startValue.get_int();
+            nEnd = endValue.get_int();
+            if (nStart < 0 || nEnd < nStart)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Start and end must be heights with start <= end");
+        }
+    }
+
+    CTxDB txdb("r");
+    set<pair<int, uint256> > setTxids;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        AddressIndexVector vEntries;
+        if (!txdb.ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, vEntries, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+        BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, int64_t)& item, vEntries)
+            setTxids.insert(make_pair(item.first.nHeight, item.first.txid));
+    }
+
+    UniValue result(UniValue::VARR);
+    BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, setTxids)
+        result.push_back(item.second.GetHex());
+    return result;
+}
@@ -61,7 +61,11 @@ UniValue getpoolinfo(const UniValue& params, bool fHelp)
             "Returns an object containing anonymous pool-related information.");
 
     UniValue obj(UniValue::VOBJ);
-    obj.push_back(Pair("current_masternode",        GetCurrentMasterNode()));
+    {
+        LOCK(cs_masternodes);
+        CMasternode* pmn = mnodeman.GetCurrentMasterNode();
+        obj.push_back(Pair("current_masternode",        pmn != NULL ? pmn->addr.ToString() : ""));
+    }
     obj.push_back(Pair("state",        darkSendPool.GetState()));
     obj.push_back(Pair("entries",      darkSendPool.GetEntriesCount()));
     obj.push_back(Pair("entries_accepted",      darkSendPool.GetCountEntriesAccepted()));
@@ -77,9 +81,9 @@ UniValue masternode(const UniValue& params, bool fHelp)
 
     if (fHelp  ||
         (strCommand != "start" && strCommand != "start-alias" && strCommand != "start-many" && strCommand != "stop" && strCommand != "stop-alias" && strCommand != "stop-many" && strCommand != "list" && strCommand != "list-conf" && strCommand != "count"  && strCommand != "enforce"
-            && strCommand != "debug" && strCommand != "current" && strCommand != "winners" && strCommand != "genkey" && strCommand != "connect" && strCommand != "outputs"))
+            && strCommand != "debug" && strCommand != "current" && strCommand != "winners" && strCommand != "genkey" && strCommand != "connect" && strCommand != "outputs" && strCommand != "seencache"))
         throw runtime_error(
-            "masternode <start|start-alias|start-many|stop|stop-alias|stop-many|list|list-conf|count|debug|current|winners|genkey|enforce|outputs> [passphrase]\n");
+            "masternode <start|start-alias|start-many|stop|stop-alias|stop-many|list|list-conf|count|debug|current|winners|genkey|enforce|outputs|seencache> [passphrase]\n");
 
     if (strCommand == "stop")
     {
@@ -237,9 +241,8 @@ UniValue masternode(const UniValue& params, bool fHelp)
         }
 
         UniValue obj(UniValue::VOBJ);
-        BOOST_FOREACH(CMasternode mn, vecMasternodes) {
-            mn.Check();
-
+        std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
             if(strCommand == "active"){
                 obj.push_back(Pair(mn.addr.ToString().c_str(),       (int)mn.IsEnabled()));
             } else if (strCommand == "vin") {
@@ -253,14 +256,14 @@ UniValue masternode(const UniValue& params, bool fHelp)
             } else if (strCommand == "activeseconds") {
                 obj.push_back(Pair(mn.addr.ToString().c_str(),       (int64_t)(mn.lastTimeSeen - mn.now)));
             } else if (strCommand == "rank") {
-                obj.push_back(Pair(mn.addr.ToString().c_str(),       (int)(GetMasternodeRank(mn.vin, pindexBest->nHeight))));
+                obj.push_back(Pair(mn.addr.ToString().c_str(),       (int)(mnodeman.GetMasternodeRank(mn.vin, pindexBest->nHeight))));
             } else if (strCommand == "status") {
                 obj.push_back(Pair(mn.addr.ToString().c_str(),       mn.GetStatus()));
             }
         }
         return obj;
     }
-    if (strCommand == "count") return (int)vecMasternodes.size();
+    if (strCommand == "count") return mnodeman.size();
 
     if (strCommand == "start")
     {
@@ -420,7 +423,7 @@ UniValue masternode(const UniValue& params, bool fHelp)
         if(activeMasternode.status == MASTERNODE_SYNC_IN_PROCESS) return "sync in process. Must wait until client is synced to start.";
 
         CTxIn vin = CTxIn();
-        CPubKey pubkey = CScript();
+        CPubKey pubkey;
         CKey key;
         bool found = activeMasternode.GetMasterNodeVin(vin, pubkey, key);
         if(!found){
@@ -430,6 +433,19 @@ UniValue masternode(const UniValue& params, bool fHelp)
         }
     }
 
+    if (strCommand == "seencache")
+    {
+        uint64_t nHits = seenMessageCache.GetHits();
+        uint64_t nMisses = seenMessageCache.GetMisses();
+
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("size",      (int64_t)seenMessageCache.size()));
+        obj.push_back(Pair("hits",      nHits));
+        obj.push_back(Pair("misses",    nMisses));
+        obj.push_back(Pair("hitrate",   nHits + nMisses > 0 ? (double)nHits / (nHits + nMisses) : 0.0));
+        return obj;
+    }
+
     if (strCommand == "create")
     {
 
@@ -438,9 +454,10 @@ UniValue masternode(const UniValue& params, bool fHelp)
 
     if (strCommand == "current")
     {
-        int winner = GetCurrentMasterNode(1);
-        if(winner >= 0) {
-            return vecMasternodes[winner].addr.ToString().c_str();
+        LOCK(cs_masternodes);
+        CMasternode* winner = mnodeman.GetCurrentMasterNode(1);
+        if(winner != NULL) {
+            return winner->addr.ToString().c_str();
         }
 
         return "unknown";
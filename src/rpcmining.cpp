@@ -65,10 +65,16 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
             "getstakinginfo\n"
             "Returns an object containing staking-related information.");
 
+    CChainSnapshotRef chain = GetChainSnapshot();
+
+    // The weight walks the wallet's coins and their depth in the live chain
     uint64_t nMinWeight = 0, nMaxWeight = 0, nWeight = 0;
-    pwalletMain->GetStakeWeight(*pwalletMain, nMinWeight, nMaxWeight, nWeight);
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pwalletMain->GetStakeWeight(*pwalletMain, nMinWeight, nMaxWeight, nWeight);
+    }
 
-    uint64_t nNetworkWeight = GetPoSKernelPS();
+    uint64_t nNetworkWeight = GetPoSKernelPS(chain->pindexTip);
     bool staking = nLastCoinStakeSearchInterval && nWeight;
     int nExpectedTime = staking ? (nTargetSpacing * nNetworkWeight / nWeight) : -1;
 
@@ -81,8 +87,9 @@ UniValue getstakinginfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("Current Block Size", (uint64_t)nLastBlockSize));
     obj.push_back(Pair("Current Block Tx", (uint64_t)nLastBlockTx));
     obj.push_back(Pair("Pooled Tx", (uint64_t)mempool.size()));
+    obj.push_back(Pair("Pooled Bytes", mempool.GetTotalTxSize()));
 
-    obj.push_back(Pair("Difficulty", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    obj.push_back(Pair("Difficulty", chain->pindexLastPoS ? GetDifficulty(chain->pindexLastPoS) : 1.0));
     obj.push_back(Pair("Search Interval", (int)nLastCoinStakeSearchInterval));
 
     obj.push_back(Pair("Weight", (uint64_t)nWeight));
@@ -161,7 +168,7 @@ UniValue getworkex(const UniValue& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         CTransaction coinbaseTx = pblock->vtx[0];
         std::vector<uint256> merkle = pblock->GetMerkleBranch(0);
@@ -303,7 +310,7 @@ UniValue getwork(const UniValue& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         UniValue result(UniValue::VOBJ);
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -470,7 +477,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     UniValue aux(UniValue::VOBJ);
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     UniValue aMutable(UniValue::VARR);
     if (aMutable.empty())
@@ -134,21 +134,14 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
 
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hex", strHex));
+    LOCK(cs_main);  // for the block's place in the main chain
     TxToJSON(tx, hashBlock, result);
     return result;
 }
 
-UniValue listunspent(const UniValue& params, bool fHelp)
+// The outputs listunspent returns, one at a time
+static void ListUnspent(const UniValue& params, const std::function<void(const UniValue&)>& fnEntry)
 {
-    if (fHelp || params.size() > 3)
-        throw runtime_error(
-            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
-            "Returns array of unspent transaction outputs\n"
-            "with between minconf and maxconf (inclusive) confirmations.\n"
-            "Optionally filtered to only include txouts paid to specified addresses.\n"
-            "Results are an array of Objects, each of which has:\n"
-            "{txid, vout, scriptPubKey, amount, confirmations}");
-
     // RPCTypeCheck(params, list_of(int_type)(int_type)(array_type));
 
     int nMinDepth = 1;
@@ -178,7 +171,6 @@ UniValue listunspent(const UniValue& params, bool fHelp)
         }
     }
 
-    UniValue results(UniValue::VARR);
     std::vector<COutput> vecOutputs;
     pwalletMain->AvailableCoins(vecOutputs, false);
     BOOST_FOREACH(const COutput& out, vecOutputs)
@@ -211,12 +203,39 @@ UniValue listunspent(const UniValue& params, bool fHelp)
         entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
         entry.push_back(Pair("amount",ValueFromAmount(nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        fnEntry(entry);
     }
+}
 
+UniValue listunspent(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
+            "Returns array of unspent transaction outputs\n"
+            "with between minconf and maxconf (inclusive) confirmations.\n"
+            "Optionally filtered to only include txouts paid to specified addresses.\n"
+            "Results are an array of Objects, each of which has:\n"
+            "{txid, vout, scriptPubKey, amount, confirmations}");
+
+    UniValue results(UniValue::VARR);
+    ListUnspent(params, [&results](const UniValue& entry) { results.push_back(entry); });
     return results;
 }
 
+void StreamListUnspent(const UniValue& params, CJSONWriter& writer)
+{
+    if (params.size() > 3)
+    {
+        writer.Value(listunspent(params, false));  // throws the usage
+        return;
+    }
+
+    writer.BeginArray();
+    ListUnspent(params, [&writer](const UniValue& entry) { writer.Value(entry); });
+    writer.EndArray();
+}
+
 UniValue createrawtransaction(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 2)
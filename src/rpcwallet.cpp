@@ -330,16 +330,9 @@ UniValue sendtoaddress(const UniValue& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
-UniValue listaddressgroupings(const UniValue& params, bool fHelp)
+// The groups listaddressgroupings returns, one at a time
+static void ListAddressGroupings(const std::function<void(const UniValue&)>& fnGrouping)
 {
-    if (fHelp)
-        throw runtime_error(
-            "listaddressgroupings\n"
-            "Lists groups of addresses which have had their common ownership\n"
-            "made public by common use as inputs or as the resulting change\n"
-            "in past transactions");
-
-    UniValue jsonGroupings(UniValue::VARR);
     map<CTxDestination, int64_t> balances = pwalletMain->GetAddressBalances();
     BOOST_FOREACH(set<CTxDestination> grouping, pwalletMain->GetAddressGroupings())
     {
@@ -356,11 +349,31 @@ UniValue listaddressgroupings(const UniValue& params, bool fHelp)
             }
             jsonGrouping.push_back(addressInfo);
         }
-        jsonGroupings.push_back(jsonGrouping);
+        fnGrouping(jsonGrouping);
     }
+}
+
+UniValue listaddressgroupings(const UniValue& params, bool fHelp)
+{
+    if (fHelp)
+        throw runtime_error(
+            "listaddressgroupings\n"
+            "Lists groups of addresses which have had their common ownership\n"
+            "made public by common use as inputs or as the resulting change\n"
+            "in past transactions");
+
+    UniValue jsonGroupings(UniValue::VARR);
+    ListAddressGroupings([&jsonGroupings](const UniValue& grouping) { jsonGroupings.push_back(grouping); });
     return jsonGroupings;
 }
 
+void StreamAddressGroupings(const UniValue& params, CJSONWriter& writer)
+{
+    writer.BeginArray();
+    ListAddressGroupings([&writer](const UniValue& grouping) { writer.Value(grouping); });
+    writer.EndArray();
+}
+
 UniValue signmessage(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 2)
@@ -628,34 +641,38 @@ UniValue movecmd(const UniValue& params, bool fHelp)
     if (params.size() > 4)
         strComment = params[4].get_str();
 
-    CWalletDB walletdb(pwalletMain->strWalletFile);
-    if (!walletdb.TxnBegin())
-        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    // Both entries and the order counter are written as one transaction
+    CWalletBatch batch(pwalletMain);
 
     int64_t nNow = GetAdjustedTime();
 
     // Debit
     CAccountingEntry debit;
-    debit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    debit.nOrderPos = pwalletMain->IncOrderPosNext();
     debit.strAccount = strFrom;
     debit.nCreditDebit = -nAmount;
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    if (!pwalletMain->WriteAccountingEntry(debit))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
     // Credit
     CAccountingEntry credit;
-    credit.nOrderPos = pwalletMain->IncOrderPosNext(&walletdb);
+    credit.nOrderPos = pwalletMain->IncOrderPosNext();
     credit.strAccount = strTo;
     credit.nCreditDebit = nAmount;
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    if (!pwalletMain->WriteAccountingEntry(credit))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
-    if (!walletdb.TxnCommit())
+    // Nothing is listed until both entries are on disk
+    if (!batch.Commit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    pwalletMain->LoadAccountingEntry(debit);
+    pwalletMain->LoadAccountingEntry(credit);
 
     return true;
 }
@@ -1094,13 +1111,11 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Un
     }
 }
 
-UniValue listtransactions(const UniValue& params, bool fHelp)
+// The entries listtransactions returns, oldest to newest, one at a time.
+// The wallet is walked newest first only as far back as the window reaches,
+// and only the entries inside the window are kept to be handed out.
+static void ListTransactionsWindow(const UniValue& params, const std::function<void(const UniValue&)>& fnEntry)
 {
-    if (fHelp || params.size() > 3)
-        throw runtime_error(
-            "listtransactions [account] [count=10] [from=0]\n"
-            "Returns up to [count] most recent transactions skipping the first [from] transactions for account [account].");
-
     string strAccount = "*";
     if (params.size() > 0)
         strAccount = params[0].get_str();
@@ -1116,47 +1131,56 @@ UniValue listtransactions(const UniValue& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
-    UniValue ret(UniValue::VARR);
-
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    const int64_t nEnd = (int64_t)nFrom + nCount;
+    int64_t nSeen = 0;
+    vector<UniValue> vWindow; // newest to oldest, reversed when handed out
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount+nFrom)) break;
-    }
-    // ret is newest to oldest
-
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
+        LOCK(pwalletMain->cs_wallet);
+        const CWallet::TxItems& txOrdered = pwalletMain->GetOrderedTxItems(strAccount);
 
-    std::vector<UniValue> arrTmp = ret.getValues();
+        for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend() && nSeen < nEnd; ++it)
+        {
+            UniValue entries(UniValue::VARR);
+            CWalletTx *const pwtx = (*it).second.first;
+            if (pwtx != 0)
+                ListTransactions(*pwtx, strAccount, 0, true, entries);
+            CAccountingEntry *const pacentry = (*it).second.second;
+            if (pacentry != 0)
+                AcentryToJSON(*pacentry, strAccount, entries);
+
+            for (unsigned int i = 0; i < entries.size() && nSeen < nEnd; i++, nSeen++)
+                if (nSeen >= nFrom)
+                    vWindow.push_back(entries[i]);
+        }
+    }
 
-    std::vector<UniValue>::iterator first = arrTmp.begin();
-    std::advance(first, nFrom);
-    std::vector<UniValue>::iterator last = arrTmp.begin();
-    std::advance(last, nFrom+nCount);
+    for (vector<UniValue>::const_reverse_iterator it = vWindow.rbegin(); it != vWindow.rend(); ++it)
+        fnEntry(*it);
+}
 
-    if (last != arrTmp.end()) arrTmp.erase(last, arrTmp.end());
-    if (first != arrTmp.begin()) arrTmp.erase(arrTmp.begin(), first);
+UniValue listtransactions(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 3)
+        throw runtime_error(
+            "listtransactions [account] [count=10] [from=0]\n"
+            "Returns up to [count] most recent transactions skipping the first [from] transactions for account [account].");
 
-    std::reverse(arrTmp.begin(), arrTmp.end()); // Return oldest to newest
+    UniValue ret(UniValue::VARR);
+    ListTransactionsWindow(params, [&ret](const UniValue& entry) { ret.push_back(entry); });
+    return ret;
+}
 
-    ret.clear();
-    ret.setArray();
-    ret.push_backV(arrTmp);
+void StreamListTransactions(const UniValue& params, CJSONWriter& writer)
+{
+    if (params.size() > 3)
+    {
+        writer.Value(listtransactions(params, false));  // throws the usage
+        return;
+    }
 
-    return ret;
+    writer.BeginArray();
+    ListTransactionsWindow(params, [&writer](const UniValue& entry) { writer.Value(entry); });
+    writer.EndArray();
 }
 
 UniValue listaccounts(const UniValue& params, bool fHelp)
@@ -1202,9 +1226,7 @@ UniValue listaccounts(const UniValue& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    CWalletDB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     UniValue ret(UniValue::VOBJ);
@@ -1474,6 +1496,8 @@ UniValue walletpassphrase(const UniValue& params, bool fHelp)
         fWalletUnlockStakingOnly = params[2].get_bool();
     else
         fWalletUnlockStakingOnly = false;
+    if (fWalletUnlockStakingOnly)
+        pwalletMain->CacheStakingKeys();
 
     return NullUniValue;
 }
@@ -20,11 +20,11 @@ using namespace boost;
 
 
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(const stackvaltype& vchSig, const stackvaltype& vchPubKey, const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
-static const valtype vchFalse(0);
-static const valtype vchZero(0);
-static const valtype vchTrue(1, 1);
+static const stackvaltype vchFalse(0);
+static const stackvaltype vchZero(0);
+static const stackvaltype vchTrue(1, (unsigned char)1);
 static const CBigNum bnZero(0);
 static const CBigNum bnOne(1);
 static const CBigNum bnFalse(0);
@@ -32,15 +32,20 @@ static const CBigNum bnTrue(1);
 static const size_t nMaxNumSize = 4;
 
 
-CBigNum CastToBigNum(const valtype& vch)
+CBigNum CastToBigNum(const stackvaltype& vch)
 {
     if (vch.size() > nMaxNumSize)
         throw runtime_error("CastToBigNum() : overflow");
     // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
+    return CBigNum(CBigNum(valtype(vch.begin(), vch.end())).getvch());
 }
 
-bool CastToBool(const valtype& vch)
+static inline stackvaltype ToStackValue(const valtype& vch)
+{
+    return stackvaltype(vch.begin(), vch.end());
+}
+
+bool CastToBool(const stackvaltype& vch)
 {
     for (unsigned int i = 0; i < vch.size(); i++)
     {
@@ -62,7 +67,7 @@ bool CastToBool(const valtype& vch)
 // resize process. MakeSameSize() is currently only used by the disabled
 // opcodes OP_AND, OP_OR, and OP_XOR.
 //
-void MakeSameSize(valtype& vch1, valtype& vch2)
+void MakeSameSize(stackvaltype& vch1, stackvaltype& vch2)
 {
     // Lengthen the shorter one
     if (vch1.size() < vch2.size())
@@ -89,7 +94,7 @@ void MakeSameSize(valtype& vch1, valtype& vch2)
 //
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack() : stack empty");
@@ -255,7 +260,7 @@ const char* GetOpName(opcodetype opcode)
     }
 }
 
-static bool IsCanonicalPubKey(const valtype &vchPubKey) {
+static bool IsCanonicalPubKey(const stackvaltype &vchPubKey) {
     if (vchPubKey.size() < 33)
         return error("Non-canonical public key: too short");
     if (vchPubKey[0] == 0x04) {
@@ -270,7 +275,7 @@ static bool IsCanonicalPubKey(const valtype &vchPubKey) {
     return true;
 }
 
-static bool IsCanonicalSignature(const valtype &vchSig) {
+static bool IsCanonicalSignature(const stackvaltype &vchSig) {
     // See https://bitcointalk.org/index.php?topic=8392.msg127623#msg127623
     // A canonical signature exists of: <30> <total len> <02> <len R> <R> <02> <len S> <S> <hashtype>
     // Where R and S are not negative (their first byte has its highest bit not set), and not
@@ -323,16 +328,16 @@ static bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
-    valtype vchPushValue;
+    stackvaltype vchPushValue;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack;
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -399,7 +404,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     // ( -- value)
                     CBigNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ToStackValue(bn.getvch()));
                 }
                 break;
 
@@ -421,7 +426,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     {
                         if (stack.size() < 1)
                             return false;
-                        valtype& vch = stacktop(-1);
+                        stackvaltype& vch = stacktop(-1);
                         fValue = CastToBool(vch);
                         if (opcode == OP_NOTIF)
                             fValue = !fValue;
@@ -504,8 +509,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch1 = stacktop(-2);
-                    valtype vch2 = stacktop(-1);
+                    stackvaltype vch1 = stacktop(-2);
+                    stackvaltype vch2 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -516,9 +521,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 -- x1 x2 x3 x1 x2 x3)
                     if (stack.size() < 3)
                         return false;
-                    valtype vch1 = stacktop(-3);
-                    valtype vch2 = stacktop(-2);
-                    valtype vch3 = stacktop(-1);
+                    stackvaltype vch1 = stacktop(-3);
+                    stackvaltype vch2 = stacktop(-2);
+                    stackvaltype vch3 = stacktop(-1);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                     stack.push_back(vch3);
@@ -530,8 +535,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 -- x1 x2 x3 x4 x1 x2)
                     if (stack.size() < 4)
                         return false;
-                    valtype vch1 = stacktop(-4);
-                    valtype vch2 = stacktop(-3);
+                    stackvaltype vch1 = stacktop(-4);
+                    stackvaltype vch2 = stacktop(-3);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
                 }
@@ -542,8 +547,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 x3 x4 x5 x6 -- x3 x4 x5 x6 x1 x2)
                     if (stack.size() < 6)
                         return false;
-                    valtype vch1 = stacktop(-6);
-                    valtype vch2 = stacktop(-5);
+                    stackvaltype vch1 = stacktop(-6);
+                    stackvaltype vch2 = stacktop(-5);
                     stack.erase(stack.end()-6, stack.end()-4);
                     stack.push_back(vch1);
                     stack.push_back(vch2);
@@ -565,7 +570,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x - 0 | x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    stackvaltype vch = stacktop(-1);
                     if (CastToBool(vch))
                         stack.push_back(vch);
                 }
@@ -575,7 +580,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     // -- stacksize
                     CBigNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ToStackValue(bn.getvch()));
                 }
                 break;
 
@@ -593,7 +598,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x -- x x)
                     if (stack.size() < 1)
                         return false;
-                    valtype vch = stacktop(-1);
+                    stackvaltype vch = stacktop(-1);
                     stack.push_back(vch);
                 }
                 break;
@@ -612,7 +617,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x1 x2 x1)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-2);
+                    stackvaltype vch = stacktop(-2);
                     stack.push_back(vch);
                 }
                 break;
@@ -628,7 +633,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
-                    valtype vch = stacktop(-n-1);
+                    stackvaltype vch = stacktop(-n-1);
                     if (opcode == OP_ROLL)
                         stack.erase(stack.end()-n-1);
                     stack.push_back(vch);
@@ -661,7 +666,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- x2 x1 x2)
                     if (stack.size() < 2)
                         return false;
-                    valtype vch = stacktop(-1);
+                    stackvaltype vch = stacktop(-1);
                     stack.insert(stack.end()-2, vch);
                 }
                 break;
@@ -675,8 +680,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    stackvaltype& vch1 = stacktop(-2);
+                    stackvaltype& vch2 = stacktop(-1);
                     vch1.insert(vch1.end(), vch2.begin(), vch2.end());
                     popstack(stack);
                     if (stacktop(-1).size() > MAX_SCRIPT_ELEMENT_SIZE)
@@ -689,7 +694,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in begin size -- out)
                     if (stack.size() < 3)
                         return false;
-                    valtype& vch = stacktop(-3);
+                    stackvaltype& vch = stacktop(-3);
                     int nBegin = CastToBigNum(stacktop(-2)).getint();
                     int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
                     if (nBegin < 0 || nEnd < nBegin)
@@ -711,7 +716,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in size -- out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch = stacktop(-2);
+                    stackvaltype& vch = stacktop(-2);
                     int nSize = CastToBigNum(stacktop(-1)).getint();
                     if (nSize < 0)
                         return false;
@@ -731,7 +736,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 1)
                         return false;
                     CBigNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ToStackValue(bn.getvch()));
                 }
                 break;
 
@@ -744,7 +749,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in - out)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
+                    stackvaltype& vch = stacktop(-1);
                     for (unsigned int i = 0; i < vch.size(); i++)
                         vch[i] = ~vch[i];
                 }
@@ -762,8 +767,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - out)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    stackvaltype& vch1 = stacktop(-2);
+                    stackvaltype& vch2 = stacktop(-1);
                     MakeSameSize(vch1, vch2); // <-- NOT SAFE FOR SIGNED VALUES
                     if (opcode == OP_AND)
                     {
@@ -791,8 +796,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 - bool)
                     if (stack.size() < 2)
                         return false;
-                    valtype& vch1 = stacktop(-2);
-                    valtype& vch2 = stacktop(-1);
+                    stackvaltype& vch1 = stacktop(-2);
+                    stackvaltype& vch2 = stacktop(-1);
                     bool fEqual = (vch1 == vch2);
                     // OP_NOTEQUAL is disabled because it would be too easy to say
                     // something like n != 1 and have some wiseguy pass in 1 with extra
@@ -842,7 +847,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ToStackValue(bn.getvch()));
                 }
                 break;
 
@@ -923,7 +928,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.push_back(ToStackValue(bn.getvch()));
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -964,8 +969,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- hash)
                     if (stack.size() < 1)
                         return false;
-                    valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    stackvaltype& vch = stacktop(-1);
+                    stackvaltype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
                     if (opcode == OP_RIPEMD160)
                         RIPEMD160(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_SHA1)
@@ -974,7 +979,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         SHA256(&vch[0], vch.size(), &vchHash[0]);
                     else if (opcode == OP_HASH160)
                     {
-                        uint160 hash160 = Hash160(vch);
+                        uint160 hash160 = Hash160(vch.begin(), vch.end());
                         memcpy(&vchHash[0], &hash160, sizeof(hash160));
                     }
                     else if (opcode == OP_HASH256)
@@ -1001,8 +1006,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
 
-                    valtype& vchSig    = stacktop(-2);
-                    valtype& vchPubKey = stacktop(-1);
+                    stackvaltype& vchSig    = stacktop(-2);
+                    stackvaltype& vchPubKey = stacktop(-1);
 
                     ////// debug print
                     //PrintHex(vchSig.begin(), vchSig.end(), "sig: %s\n");
@@ -1064,15 +1069,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signatures, since there's no way for a signature to sign itself
                     for (int k = 0; k < nSigsCount; k++)
                     {
-                        valtype& vchSig = stacktop(-isig-k);
+                        stackvaltype& vchSig = stacktop(-isig-k);
                         scriptCode.FindAndDelete(CScript(vchSig));
                     }
 
                     bool fSuccess = true;
                     while (fSuccess && nSigsCount > 0)
                     {
-                        valtype& vchSig    = stacktop(-isig);
-                        valtype& vchPubKey = stacktop(-ikey);
+                        stackvaltype& vchSig    = stacktop(-isig);
+                        stackvaltype& vchPubKey = stacktop(-ikey);
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
@@ -1190,11 +1195,10 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         txTmp.vin.resize(1);
     }
 
-    // Serialize and hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss.reserve(10000);
+    // Serialize straight into the hasher, no intermediate buffer
+    CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    return ss.GetHash();
 }
 
 
@@ -1205,28 +1209,35 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
+    // Entries are the hash of (signature hash, signature, public key), so a
+    // lookup needs no copies of the signature or key data.
+    std::set<uint256> setValid;
     CCriticalSection cs_sigcache;
 
 public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    static uint256 ComputeEntry(const uint256& hash, const unsigned char* pchSig, size_t nSigLen,
+                                const unsigned char* pchPubKey, size_t nPubKeyLen)
     {
-        LOCK(cs_sigcache);
+        // The signature length is hashed too, or the split between
+        // signature and public key would be ambiguous.
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << hash;
+        WriteCompactSize(ss, nSigLen);
+        ss.write((const char*)pchSig, nSigLen);
+        ss.write((const char*)pchPubKey, nPubKeyLen);
+        return ss.GetHash();
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
+    bool Get(const uint256& entry)
+    {
+        LOCK(cs_sigcache);
+        return setValid.count(entry) != 0;
     }
 
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    void Set(const uint256& entry)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
+        // DoS prevention: limit cache size
+        // (~100 bytes per cache entry times 50,000 entries)
         // Since there are a maximum of 20,000 signature operations per block
         // 50,000 is a reasonable default.
         int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
@@ -1240,21 +1251,17 @@ public:
             // foil would-be DoS attackers who might try to pre-generate
             // and re-use a set of valid signatures just-slightly-greater
             // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
+            std::set<uint256>::iterator it = setValid.lower_bound(GetRandHash());
             if (it == setValid.end())
                 it = setValid.begin();
-            setValid.erase(*it);
+            setValid.erase(it);
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        setValid.insert(entry);
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+bool CheckSig(const stackvaltype& vchSig, const stackvaltype& vchPubKey, const CScript& scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
     static CSignatureCache signatureCache;
@@ -1266,21 +1273,23 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         nHashType = vchSig.back();
     else if (nHashType != vchSig.back())
         return false;
-    vchSig.pop_back();
+    const unsigned char* pchSig = &vchSig[0];
+    size_t nSigLen = vchSig.size() - 1;
 
     uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
-    if (signatureCache.Get(sighash, vchSig, vchPubKey))
+    uint256 entry = CSignatureCache::ComputeEntry(sighash, pchSig, nSigLen, &vchPubKey[0], vchPubKey.size());
+    if (signatureCache.Get(entry))
         return true;
 
     CKey key;
-    if (!key.SetPubKey(vchPubKey))
+    if (!key.SetPubKey(&vchPubKey[0], vchPubKey.size()))
         return false;
 
-    if (!key.Verify(sighash, vchSig))
+    if (!key.Verify(sighash, pchSig, nSigLen))
         return false;
 
-    signatureCache.Set(sighash, vchSig, vchPubKey);
+    signatureCache.Set(entry);
     return true;
 }
 
@@ -1691,10 +1700,204 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
     return true;
 }
 
+//
+// Fast path for the standard script templates. The signatures and public
+// keys are taken straight out of the scripts and checked exactly as
+// EvalScript would check them, without running the interpreter.
+//
+
+// Enough for a 16-of-16 multisig scriptSig: the dummy element, 16
+// signatures and a P2SH redeem script.
+static const unsigned int MAX_STANDARD_PUSHES = 18;
+
+// Read the data pushes of scriptSig. Fails for anything EvalScript might
+// treat differently: other opcodes, oversized elements or too many pushes.
+static bool GetStandardPushes(const CScript& scriptSig, stackvaltype* pvchPushes, unsigned int& nPushesRet)
+{
+    nPushesRet = 0;
+    if (scriptSig.size() > 10000)
+        return false;
+
+    CScript::const_iterator pc = scriptSig.begin();
+    opcodetype opcode;
+    while (pc < scriptSig.end())
+    {
+        if (nPushesRet == MAX_STANDARD_PUSHES)
+            return false;
+        if (!scriptSig.GetOp(pc, opcode, pvchPushes[nPushesRet]))
+            return false;
+        if (opcode > OP_PUSHDATA4 || pvchPushes[nPushesRet].size() > MAX_SCRIPT_ELEMENT_SIZE)
+            return false;
+        nPushesRet++;
+    }
+    return true;
+}
+
+static bool CheckStandardSig(const stackvaltype& vchSig, const stackvaltype& vchPubKey, const CScript& script,
+                             const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    // Same as OP_CHECKSIG
+    CScript scriptCode(script);
+    scriptCode.FindAndDelete(CScript(vchSig));
+
+    return IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
+        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+}
+
+static bool EvalStandardMultisig(const stackvaltype* pvchStack, unsigned int nStackSize, const CScript& script,
+                                 const CTransaction& txTo, unsigned int nIn, int nHashType, bool& fRet)
+{
+    // OP_m <pubkey> ... <pubkey> OP_n OP_CHECKMULTISIG
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    if (!script.GetOp(pc, opcode) || opcode < OP_1 || opcode > OP_16)
+        return false;
+    int nSigsCount = CScript::DecodeOP_N(opcode);
+
+    stackvaltype vchPubKeys[16];
+    stackvaltype vch;
+    int nKeysCount = 0;
+    while (true)
+    {
+        if (!script.GetOp(pc, opcode, vch))
+            return false;
+        if (opcode >= OP_1 && opcode <= OP_16)
+            break;
+        if (opcode > OP_PUSHDATA4 || nKeysCount == 16 || (vch.size() != 33 && vch.size() != 65))
+            return false;
+        vchPubKeys[nKeysCount++] = vch;
+    }
+    if (CScript::DecodeOP_N(opcode) != nKeysCount || nSigsCount > nKeysCount)
+        return false;
+    if (!script.GetOp(pc, opcode) || opcode != OP_CHECKMULTISIG || pc != script.end())
+        return false;
+
+    // The dummy element consumed by OP_CHECKMULTISIG, then the signatures
+    if (nStackSize != (unsigned int)nSigsCount + 1)
+        return false;
+
+    // From here on this mirrors OP_CHECKMULTISIG, which works from the top
+    // of the stack down: last signature and last key first.
+    CScript scriptCode(script);
+    for (int k = nSigsCount; k >= 1; k--)
+        scriptCode.FindAndDelete(CScript(pvchStack[k]));
+
+    int isig = nSigsCount;
+    int ikey = nKeysCount - 1;
+    bool fSuccess = true;
+    while (fSuccess && nSigsCount > 0)
+    {
+        const stackvaltype& vchSig    = pvchStack[isig];
+        const stackvaltype& vchPubKey = vchPubKeys[ikey];
+
+        bool fOk = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
+            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+
+        if (fOk)
+        {
+            isig--;
+            nSigsCount--;
+        }
+        ikey--;
+        nKeysCount--;
+
+        if (nSigsCount > nKeysCount)
+            fSuccess = false;
+    }
+
+    fRet = fSuccess;
+    return true;
+}
+
+// Evaluate script against a stack made of data pushes. Returns false if
+// script is not one of the standard templates, or the stack does not have
+// the shape it expects; fRet is only set when true is returned.
+static bool EvalStandardScript(const stackvaltype* pvchStack, unsigned int nStackSize, const CScript& script,
+                               const CTransaction& txTo, unsigned int nIn, int nHashType, bool& fRet)
+{
+    unsigned int nSize = script.size();
+
+    // TX_PUBKEYHASH: OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG
+    if (nSize == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+    {
+        if (nStackSize != 2)
+            return false;
+        const stackvaltype& vchPubKey = pvchStack[1];
+        uint160 hash160 = Hash160(vchPubKey.begin(), vchPubKey.end());
+        if (memcmp(&hash160, &script[3], 20) != 0)
+            fRet = false;
+        else
+            fRet = CheckStandardSig(pvchStack[0], vchPubKey, script, txTo, nIn, nHashType);
+        return true;
+    }
+
+    // TX_PUBKEY: <33 or 65 byte pubkey> OP_CHECKSIG
+    if ((nSize == 35 || nSize == 67) && script[0] == nSize - 2 && script[nSize - 1] == OP_CHECKSIG)
+    {
+        if (nStackSize != 1)
+            return false;
+        stackvaltype vchPubKey(script.begin() + 1, script.end() - 1);
+        fRet = CheckStandardSig(pvchStack[0], vchPubKey, script, txTo, nIn, nHashType);
+        return true;
+    }
+
+    // TX_MULTISIG
+    if (nSize > 0 && script[nSize - 1] == OP_CHECKMULTISIG)
+        return EvalStandardMultisig(pvchStack, nStackSize, script, txTo, nIn, nHashType, fRet);
+
+    return false;
+}
+
+// Returns false if the scripts are not handled by the fast path and must
+// go through the interpreter; otherwise fRet is what VerifyScript would
+// have returned.
+bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                          int nHashType, bool& fRet)
+{
+    stackvaltype vchPushes[MAX_STANDARD_PUSHES];
+    unsigned int nPushes;
+    if (!GetStandardPushes(scriptSig, vchPushes, nPushes))
+        return false;
+
+    try
+    {
+        if (scriptPubKey.IsPayToScriptHash())
+        {
+            if (nPushes < 2)
+                return false;
+
+            // HASH160 <hash> EQUAL against the serialized redeem script
+            const stackvaltype& vchRedeemScript = vchPushes[nPushes - 1];
+            uint160 hash160 = Hash160(vchRedeemScript.begin(), vchRedeemScript.end());
+            if (memcmp(&hash160, &scriptPubKey[2], 20) != 0)
+            {
+                fRet = false;
+                return true;
+            }
+
+            CScript scriptRedeem(vchRedeemScript.begin(), vchRedeemScript.end());
+            return EvalStandardScript(vchPushes, nPushes - 1, scriptRedeem, txTo, nIn, nHashType, fRet);
+        }
+
+        return EvalStandardScript(vchPushes, nPushes, scriptPubKey, txTo, nIn, nHashType, fRet);
+    }
+    catch (...)
+    {
+        // EvalScript fails the script on any exception
+        fRet = false;
+        return true;
+    }
+}
+
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   int nHashType)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
+    bool fRet;
+    if (VerifyStandardScript(scriptSig, scriptPubKey, txTo, nIn, nHashType, fRet))
+        return fRet;
+
+    CScriptStack stack, stackCopy;
     if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
         return false;
 
@@ -1714,7 +1917,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         if (!scriptSig.IsPushOnly()) // scriptSig must be literals-only
             return false;            // or validation fails
 
-        const valtype& pubKeySerialized = stackCopy.back();
+        const stackvaltype& pubKeySerialized = stackCopy.back();
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
@@ -1756,7 +1959,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         bool fSolved =
             Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        txin.scriptSig << static_cast<valtype>(subscript);
+        txin.scriptSig << valtype(subscript.begin(), subscript.end());
         if (!fSolved) return false;
     }
 
@@ -1830,7 +2033,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0))
+            if (CheckSig(ToStackValue(sig), ToStackValue(pubkey), scriptPubKey, txTo, nIn, 0))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -1907,10 +2110,16 @@ CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsign
     vector<vector<unsigned char> > vSolutions;
     Solver(scriptPubKey, txType, vSolutions);
 
-    vector<valtype> stack1;
-    EvalScript(stack1, scriptSig1, CTransaction(), 0, 0);
-    vector<valtype> stack2;
-    EvalScript(stack2, scriptSig2, CTransaction(), 0, 0);
+    CScriptStack evalStack1;
+    EvalScript(evalStack1, scriptSig1, CTransaction(), 0, 0);
+    CScriptStack evalStack2;
+    EvalScript(evalStack2, scriptSig2, CTransaction(), 0, 0);
+
+    vector<valtype> stack1, stack2;
+    BOOST_FOREACH(const stackvaltype& v, evalStack1)
+        stack1.push_back(valtype(v.begin(), v.end()));
+    BOOST_FOREACH(const stackvaltype& v, evalStack2)
+        stack2.push_back(valtype(v.begin(), v.end()));
 
     return CombineSignatures(scriptPubKey, txTo, nIn, txType, vSolutions, stack1, stack2);
 }
@@ -1969,9 +2178,9 @@ bool CScript::IsPayToScriptHash() const
 {
     // Extra-fast test for pay-to-script-hash CScripts:
     return (this->size() == 23 &&
-            this->at(0) == OP_HASH160 &&
-            this->at(1) == 0x14 &&
-            this->at(22) == OP_EQUAL);
+            (*this)[0] == OP_HASH160 &&
+            (*this)[1] == 0x14 &&
+            (*this)[22] == OP_EQUAL);
 }
 
 bool CScript::HasCanonicalPushes() const
@@ -16,10 +16,21 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "prevector.h"
 #include "utilstrencodings.h"
 
 typedef std::vector<unsigned char> valtype;
 
+/** Largest stack element kept inline by the script interpreter: any DER
+ *  signature plus its hashtype byte (<= 73) and any public key (33 or 65). */
+static const unsigned int MAX_INLINE_STACK_ELEMENT = 75;
+
+/** Script interpreter stack element.  Standard scripts only ever push
+ *  signatures, public keys, hashes and small numbers, so evaluating them
+ *  does not touch the heap. */
+typedef prevector<MAX_INLINE_STACK_ELEMENT, unsigned char> stackvaltype;
+typedef std::vector<stackvaltype> CScriptStack;
+
 class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
@@ -222,14 +233,14 @@ inline std::string ValueString(const std::vector<unsigned char>& vch)
         return HexStr(vch);
 }
 
-inline std::string StackString(const std::vector<std::vector<unsigned char> >& vStack)
+inline std::string StackString(const CScriptStack& vStack)
 {
     std::string str;
-    BOOST_FOREACH(const std::vector<unsigned char>& vch, vStack)
+    BOOST_FOREACH(const stackvaltype& vch, vStack)
     {
         if (!str.empty())
             str += " ";
-        str += ValueString(vch);
+        str += ValueString(valtype(vch.begin(), vch.end()));
     }
     return str;
 }
@@ -241,8 +252,14 @@ CScript GetScriptForDestination(const CTxDestination& dest);
 
 
 
+/** We use a prevector for the script to reduce the considerable memory
+ *  overhead of vectors in cases where they normally contain a small number
+ *  of small elements.  28 bytes covers pay-to-pubkey-hash (25) and
+ *  pay-to-script-hash (23) outputs without a separate allocation. */
+typedef prevector<28, unsigned char> CScriptBase;
+
 /** Serialized script, used inside transaction inputs and outputs */
-class CScript : public std::vector<unsigned char>
+class CScript : public CScriptBase
 {
 protected:
     CScript& push_int64(int64_t n)
@@ -273,13 +290,39 @@ protected:
         return *this;
     }
 
+    template<typename T>
+    CScript& push_data(const T& b)
+    {
+        if (b.size() < OP_PUSHDATA1)
+        {
+            insert(end(), (unsigned char)b.size());
+        }
+        else if (b.size() <= 0xff)
+        {
+            insert(end(), OP_PUSHDATA1);
+            insert(end(), (unsigned char)b.size());
+        }
+        else if (b.size() <= 0xffff)
+        {
+            insert(end(), OP_PUSHDATA2);
+            unsigned short nSize = b.size();
+            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
+        }
+        else
+        {
+            insert(end(), OP_PUSHDATA4);
+            unsigned int nSize = b.size();
+            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
+        }
+        insert(end(), b.begin(), b.end());
+        return *this;
+    }
+
 public:
     CScript() { }
-    CScript(const CScript& b) : std::vector<unsigned char>(b.begin(), b.end()) { }
-    CScript(const_iterator pbegin, const_iterator pend) : std::vector<unsigned char>(pbegin, pend) { }
-#ifndef _MSC_VER
-    CScript(const unsigned char* pbegin, const unsigned char* pend) : std::vector<unsigned char>(pbegin, pend) { }
-#endif
+    CScript(const CScript& b) : CScriptBase(b.begin(), b.end()) { }
+    template<typename InputIterator>
+    CScript(InputIterator pbegin, InputIterator pend) : CScriptBase(pbegin, pend) { }
 
     CScript& operator+=(const CScript& b)
     {
@@ -311,6 +354,7 @@ public:
     explicit CScript(const uint256& b) { operator<<(b); }
     explicit CScript(const CBigNum& b) { operator<<(b); }
     explicit CScript(const std::vector<unsigned char>& b) { operator<<(b); }
+    explicit CScript(const stackvaltype& b) { operator<<(b); }
 
 
     //CScript& operator<<(char b) is not portable.  Use 'signed char' or 'unsigned char'.
@@ -359,32 +403,8 @@ public:
         return *this;
     }
 
-    CScript& operator<<(const std::vector<unsigned char>& b)
-    {
-        if (b.size() < OP_PUSHDATA1)
-        {
-            insert(end(), (unsigned char)b.size());
-        }
-        else if (b.size() <= 0xff)
-        {
-            insert(end(), OP_PUSHDATA1);
-            insert(end(), (unsigned char)b.size());
-        }
-        else if (b.size() <= 0xffff)
-        {
-            insert(end(), OP_PUSHDATA2);
-            unsigned short nSize = b.size();
-            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
-        }
-        else
-        {
-            insert(end(), OP_PUSHDATA4);
-            unsigned int nSize = b.size();
-            insert(end(), (unsigned char*)&nSize, (unsigned char*)&nSize + sizeof(nSize));
-        }
-        insert(end(), b.begin(), b.end());
-        return *this;
-    }
+    CScript& operator<<(const std::vector<unsigned char>& b) { return push_data(b); }
+    CScript& operator<<(const stackvaltype& b)               { return push_data(b); }
 
     CScript& operator<<(const CScript& b)
     {
@@ -407,7 +427,7 @@ public:
     bool GetOp(iterator& pc, opcodetype& opcodeRet)
     {
          const_iterator pc2 = pc;
-         bool fRet = GetOp2(pc2, opcodeRet, NULL);
+         bool fRet = GetOp2<std::vector<unsigned char> >(pc2, opcodeRet, NULL);
          pc = begin() + (pc2 - begin());
          return fRet;
     }
@@ -417,12 +437,18 @@ public:
         return GetOp2(pc, opcodeRet, &vchRet);
     }
 
+    bool GetOp(const_iterator& pc, opcodetype& opcodeRet, stackvaltype& vchRet) const
+    {
+        return GetOp2(pc, opcodeRet, &vchRet);
+    }
+
     bool GetOp(const_iterator& pc, opcodetype& opcodeRet) const
     {
-        return GetOp2(pc, opcodeRet, NULL);
+        return GetOp2<std::vector<unsigned char> >(pc, opcodeRet, NULL);
     }
 
-    bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, std::vector<unsigned char>* pvchRet) const
+    template<typename T>
+    bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, T* pvchRet) const
     {
         opcodeRet = OP_INVALIDOPCODE;
         if (pvchRet)
@@ -588,15 +614,33 @@ public:
 
     CScriptID GetID() const
     {
-        return CScriptID(Hash160(*this));
+        return CScriptID(Hash160(begin(), end()));
     }
 };
 
+// Serialized exactly like the std::vector<unsigned char> CScript used to be
+inline unsigned int GetSerializeSize(const CScript& v, int nType, int nVersion)
+{
+    return GetSerializeSize((const CScriptBase&)v, nType, nVersion);
+}
+
+template<typename Stream>
+void Serialize(Stream& os, const CScript& v, int nType, int nVersion)
+{
+    Serialize(os, (const CScriptBase&)v, nType, nVersion);
+}
+
+template<typename Stream>
+void Unserialize(Stream& is, CScript& v, int nType, int nVersion)
+{
+    Unserialize(is, (CScriptBase&)v, nType, nVersion);
+}
+
 
 
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -119,9 +119,11 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity(); }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
+    void swap(vector_type& vchOther)                 { vch.swap(vchOther); nReadPos = 0; }
     iterator insert(iterator it, const char& x=char()) { return vch.insert(it, x); }
     void insert(iterator it, size_type n, const char& x) { vch.insert(it, n, x); }
 
@@ -319,6 +321,90 @@ public:
 };
 
 
+/** Minimal stream that appends serialized data to a caller-owned vector.
+ *
+ * Unlike CDataStream it neither owns nor zeroes its buffer, so a caller can
+ * keep one vector around and reuse its capacity for every object it writes.
+ * Only use it for data that is not secret.
+ */
+class CVectorWriter
+{
+protected:
+    std::vector<char>& vch;
+public:
+    int nType;
+    int nVersion;
+
+    CVectorWriter(int nTypeIn, int nVersionIn, std::vector<char>& vchIn) : vch(vchIn), nType(nTypeIn), nVersion(nVersionIn) { }
+
+    CVectorWriter& write(const char* pch, size_t nSize)
+    {
+        vch.insert(vch.end(), pch, pch + nSize);
+        return (*this);
+    }
+
+    int GetType() const    { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    template<typename T>
+    CVectorWriter& operator<<(const T& obj)
+    {
+        // Serialize to this stream
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
+/** Minimal stream that reads serialized data straight out of a memory
+ * range it does not own, such as a LevelDB slice, without copying it first.
+ * The range must outlive the reader.
+ */
+class CSpanReader
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CSpanReader(int nTypeIn, int nVersionIn, const char* pbeginIn, const char* pendIn) :
+        pbegin(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) { }
+
+    size_t size() const { return pend - pbegin; }
+    bool empty() const  { return pbegin == pend; }
+    bool eof() const    { return pbegin == pend; }
+
+    int GetType() const    { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    CSpanReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            THROW_WITH_STACKTRACE(std::ios_base::failure("CSpanReader::read() : end of data"));
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    CSpanReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            THROW_WITH_STACKTRACE(std::ios_base::failure("CSpanReader::ignore() : end of data"));
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** RAII wrapper for FILE*.
  *
  * Will automatically close the file when it goes out of scope if not null.
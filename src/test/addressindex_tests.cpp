@@ -0,0 +1,226 @@
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "txdb.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static string KeyBytes(const CAddressIndexKey& key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair(string("addr"), key);
+    return ss.str();
+}
+
+static CScript PayTo(const uint160& hashBytes)
+{
+    CScript script;
+    script.SetDestination(CKeyID(hashBytes));
+    return script;
+}
+
+// Everything the index holds for one key-hash address, as bytes to compare
+static string IndexState(CTxDB& txdb, const uint160& hashBytes)
+{
+    AddressIndexVector vIndex;
+    AddressUnspentVector vUnspent;
+    BOOST_CHECK(txdb.ReadAddressIndex(ADDRESS_INDEX_KEYHASH, hashBytes, vIndex));
+    BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_INDEX_KEYHASH, hashBytes, vUnspent));
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << vIndex << vUnspent;
+    return ss.str();
+}
+
+static void ApplyConnect(CTxDB& txdb, const CTransaction& tx, const MapPrevTx& inputs, int nHeight)
+{
+    AddressIndexVector vIndex;
+    AddressUnspentVector vUnspent;
+    GetAddressIndexConnect(tx, inputs, nHeight, vIndex, vUnspent);
+    BOOST_CHECK(txdb.UpdateAddressIndex(vIndex));
+    BOOST_CHECK(txdb.UpdateAddressUnspentIndex(vUnspent));
+}
+
+static int64_t Balance(CTxDB& txdb, const uint160& hashBytes, int nStart = 0, int nEnd = -1)
+{
+    AddressIndexVector vIndex;
+    BOOST_CHECK(txdb.ReadAddressIndex(ADDRESS_INDEX_KEYHASH, hashBytes, vIndex, nStart, nEnd));
+    int64_t nBalance = 0;
+    BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, int64_t)& item, vIndex)
+        nBalance += item.second;
+    return nBalance;
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_roundtrip)
+{
+    uint160 hashBytes;
+    hashBytes.SetHex("00112233445566778899aabbccddeeff00112233");
+    uint256 txid;
+    txid.SetHex("f00dbabe00000000000000000000000000000000000000000000000000000001");
+
+    CAddressIndexKey key(ADDRESS_INDEX_SCRIPTHASH, hashBytes, 0x01020304, txid, 7, true);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << key;
+    BOOST_CHECK_EQUAL(ss.size(), 1U + 20 + 4 + 32 + 4 + 1);
+    // Height right after the address, most significant byte first
+    BOOST_CHECK_EQUAL(ss[21], 0x01);
+    BOOST_CHECK_EQUAL(ss[24], 0x04);
+
+    CAddressIndexKey key2;
+    ss >> key2;
+    BOOST_CHECK_EQUAL(key2.nAddressType, ADDRESS_INDEX_SCRIPTHASH);
+    BOOST_CHECK(key2.hashBytes == hashBytes);
+    BOOST_CHECK_EQUAL(key2.nHeight, 0x01020304);
+    BOOST_CHECK(key2.txid == txid);
+    BOOST_CHECK_EQUAL(key2.nIndex, 7U);
+    BOOST_CHECK(key2.fSpending);
+
+    CAddressUnspentValue value(5000, CScript() << OP_TRUE, 1234);
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << value;
+    CAddressUnspentValue value2;
+    BOOST_CHECK(value2.IsNull());
+    ssValue >> value2;
+    BOOST_CHECK(!value2.IsNull());
+    BOOST_CHECK_EQUAL(value2.nValue, 5000);
+    BOOST_CHECK(value2.script == value.script);
+    BOOST_CHECK_EQUAL(value2.nHeight, 1234);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    // LevelDB keeps keys in byte order; an address's records must come out
+    // grouped together and by height, whatever their txids
+    uint160 hashA, hashB;
+    hashA.SetHex("01");
+    hashB.SetHex("02");
+    uint256 txidLow, txidHigh;
+    txidLow.SetHex("01");
+    txidHigh.SetHex("ff00000000000000000000000000000000000000000000000000000000000000");
+
+    int vHeights[] = { 0, 1, 255, 256, 65535, 65536, 1000000, 0x7fffffff };
+    vector<string> vKeys;
+    for (unsigned int i = 0; i < sizeof(vHeights) / sizeof(vHeights[0]); i++)
+    {
+        vKeys.push_back(KeyBytes(CAddressIndexKey(ADDRESS_INDEX_KEYHASH, hashA, vHeights[i], txidHigh, 0, false)));
+        vKeys.push_back(KeyBytes(CAddressIndexKey(ADDRESS_INDEX_KEYHASH, hashA, vHeights[i], txidLow, 3, true)));
+    }
+    for (unsigned int i = 1; i < vKeys.size(); i++)
+        BOOST_CHECK(vKeys[i - 1] != vKeys[i]);
+
+    vector<string> vSorted = vKeys;
+    sort(vSorted.begin(), vSorted.end());
+    for (unsigned int i = 0; i < vSorted.size(); i += 2)
+    {
+        CDataStream ss(vSorted[i].data(), vSorted[i].data() + vSorted[i].size(), SER_DISK, CLIENT_VERSION);
+        string strType;
+        CAddressIndexKey key;
+        ss >> strType >> key;
+        BOOST_CHECK_EQUAL(key.nHeight, vHeights[i / 2]);
+    }
+
+    // Another address never falls inside the range, nor does the other type
+    string strOther = KeyBytes(CAddressIndexKey(ADDRESS_INDEX_KEYHASH, hashB, 0, 0, 0, false));
+    string strScript = KeyBytes(CAddressIndexKey(ADDRESS_INDEX_SCRIPTHASH, hashA, 0, 0, 0, false));
+    BOOST_CHECK(strOther > vSorted.back());
+    BOOST_CHECK(strScript > strOther);
+
+    // The first key of a range query sorts at or before every record in it
+    string strSeek = KeyBytes(CAddressIndexKey(ADDRESS_INDEX_KEYHASH, hashA, 256, 0, 0, false));
+    BOOST_CHECK(strSeek > vSorted[5]);
+    BOOST_CHECK(strSeek <= vSorted[6]);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_connect_disconnect)
+{
+    CTxDB txdb("r+");
+    uint160 hashA, hashB;
+    hashA.SetHex("adde55000000000000000000000000000000000a");
+    hashB.SetHex("adde55000000000000000000000000000000000b");
+    string strEmptyA = IndexState(txdb, hashA), strEmptyB = IndexState(txdb, hashB);
+
+    // Funded at height 10 by a coinbase paying A 60 and B 40
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.SetNull();
+    txFund.vin[0].scriptSig = CScript() << 10;
+    txFund.vout.push_back(CTxOut(60, PayTo(hashA)));
+    txFund.vout.push_back(CTxOut(40, PayTo(hashB)));
+    ApplyConnect(txdb, txFund, MapPrevTx(), 10);
+    string strFundedA = IndexState(txdb, hashA), strFundedB = IndexState(txdb, hashB);
+
+    // The block at 20 spends A's 60 to B 50 and A 10, then, in the same
+    // block, A's 10 to B
+    CTransaction tx1;
+    tx1.vin.push_back(CTxIn(COutPoint(txFund.GetHash(), 0)));
+    tx1.vout.push_back(CTxOut(50, PayTo(hashB)));
+    tx1.vout.push_back(CTxOut(10, PayTo(hashA)));
+    CTransaction tx2;
+    tx2.vin.push_back(CTxIn(COutPoint(tx1.GetHash(), 1)));
+    tx2.vout.push_back(CTxOut(10, PayTo(hashB)));
+
+    MapPrevTx inputs;
+    map<uint256, int> mapInputHeights;
+    inputs[txFund.GetHash()].second = txFund;
+    mapInputHeights[txFund.GetHash()] = 10;
+    inputs[tx1.GetHash()].second = tx1;
+    mapInputHeights[tx1.GetHash()] = 20;
+    inputs[tx2.GetHash()].second = tx2;
+    mapInputHeights[tx2.GetHash()] = 20;
+
+    AddressIndexVector vIndex;
+    AddressUnspentVector vUnspent;
+    GetAddressIndexConnect(tx1, inputs, 20, vIndex, vUnspent);
+    GetAddressIndexConnect(tx2, inputs, 20, vIndex, vUnspent);
+    BOOST_CHECK(txdb.UpdateAddressIndex(vIndex));
+    BOOST_CHECK(txdb.UpdateAddressUnspentIndex(vUnspent));
+
+    BOOST_CHECK_EQUAL(Balance(txdb, hashA), 0);
+    BOOST_CHECK_EQUAL(Balance(txdb, hashB), 100);
+    BOOST_CHECK_EQUAL(Balance(txdb, hashA, 0, 10), 60);
+    BOOST_CHECK_EQUAL(Balance(txdb, hashA, 20, 20), -60);
+    BOOST_CHECK_EQUAL(Balance(txdb, hashB, 11, 19), 0);
+
+    // The change output created and spent within the block is not unspent
+    AddressUnspentVector vUnspentA, vUnspentB;
+    BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_INDEX_KEYHASH, hashA, vUnspentA));
+    BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_INDEX_KEYHASH, hashB, vUnspentB));
+    BOOST_CHECK(vUnspentA.empty());
+    BOOST_CHECK_EQUAL(vUnspentB.size(), 3U);
+
+    // Disconnecting in reverse order restores A's output at its own height
+    vIndex.clear();
+    vUnspent.clear();
+    BOOST_CHECK(GetAddressIndexDisconnect(tx2, inputs, mapInputHeights, 20, vIndex, vUnspent));
+    BOOST_CHECK(GetAddressIndexDisconnect(tx1, inputs, mapInputHeights, 20, vIndex, vUnspent));
+    BOOST_CHECK(txdb.EraseAddressIndex(vIndex));
+    BOOST_CHECK(txdb.UpdateAddressUnspentIndex(vUnspent));
+    BOOST_CHECK(IndexState(txdb, hashA) == strFundedA);
+    BOOST_CHECK(IndexState(txdb, hashB) == strFundedB);
+
+    vUnspentA.clear();
+    BOOST_CHECK(txdb.ReadAddressUnspentIndex(ADDRESS_INDEX_KEYHASH, hashA, vUnspentA));
+    BOOST_CHECK_EQUAL(vUnspentA.size(), 1U);
+    if (!vUnspentA.empty())
+    {
+        BOOST_CHECK(vUnspentA[0].first.txid == txFund.GetHash());
+        BOOST_CHECK_EQUAL(vUnspentA[0].second.nValue, 60);
+        BOOST_CHECK_EQUAL(vUnspentA[0].second.nHeight, 10);
+    }
+
+    // An input whose transaction is unknown can't be taken back out
+    map<uint256, int> mapNoHeights;
+    BOOST_CHECK(!GetAddressIndexDisconnect(tx1, inputs, mapNoHeights, 20, vIndex, vUnspent));
+
+    // And the funding coinbase, leaving nothing behind
+    vIndex.clear();
+    vUnspent.clear();
+    BOOST_CHECK(GetAddressIndexDisconnect(txFund, inputs, mapInputHeights, 10, vIndex, vUnspent));
+    BOOST_CHECK(txdb.EraseAddressIndex(vIndex));
+    BOOST_CHECK(txdb.UpdateAddressUnspentIndex(vUnspent));
+    BOOST_CHECK(IndexState(txdb, hashA) == strEmptyA);
+    BOOST_CHECK(IndexState(txdb, hashB) == strEmptyB);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,94 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "util.h"
+
+using namespace std;
+
+static CAddress MakeAddress(unsigned int n)
+{
+    // Spread over many /16 groups, as gossip from the whole network would be
+    struct in_addr ip;
+    ip.s_addr = htonl(0x0b000000 + n * 7919);
+    CAddress addr(CService(CNetAddr(ip), 18332), NODE_NETWORK);
+    addr.nTime = GetAdjustedTime() - 3600;
+    return addr;
+}
+
+static CNetAddr MakeSource(unsigned int n)
+{
+    struct in_addr ip;
+    ip.s_addr = htonl(0x5c000000 + (n % 509) * 65536);
+    return CNetAddr(ip);
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    for (unsigned int i = 0; i < 2000; i++)
+        addrman.Add(MakeAddress(i), MakeSource(i));
+    for (unsigned int i = 0; i < 2000; i += 10)
+        addrman.Good(MakeAddress(i));
+    BOOST_CHECK(addrman.size() > 0);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+
+    CAddrMan addrman2;
+    ss >> addrman2;
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+    BOOST_CHECK(ss.empty());
+}
+
+BOOST_AUTO_TEST_CASE(addrman_benchmark)
+{
+    // 100k addresses offered, as a long-running node sees over time; the
+    // snapshot is what peers.dat dumps hold the addrman lock for
+    static const unsigned int nAddrs = 100000;
+
+    CAddrMan addrman;
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nAddrs; i++)
+        addrman.Add(MakeAddress(i), MakeSource(i));
+    int64_t nAdd = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nAddrs; i += 20)
+        addrman.Good(MakeAddress(i));
+    int64_t nGood = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < 10000; i++)
+        addrman.Select();
+    int64_t nSelect = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    vector<CAddress> vAddr = addrman.GetAddr();
+    int64_t nGetAddr = GetTimeMicros() - nStart;
+    BOOST_CHECK(!vAddr.empty());
+
+    nStart = GetTimeMicros();
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    int64_t nSnapshot = GetTimeMicros() - nStart;
+    unsigned int nBytes = ss.size();
+
+    nStart = GetTimeMicros();
+    CAddrMan addrman2;
+    ss >> addrman2;
+    int64_t nLoad = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(addrman2.size(), addrman.size());
+
+    BOOST_TEST_MESSAGE(strprintf("CAddrMan: %u offered, %d kept; Add %.2f us, Good %.2f us, Select %.2f us",
+                                 nAddrs, addrman.size(), (double)nAdd / nAddrs,
+                                 (double)nGood / (nAddrs / 20), (double)nSelect / 10000));
+    BOOST_TEST_MESSAGE(strprintf("CAddrMan: GetAddr %.2f ms, snapshot %.2f ms (%u bytes), load %.2f ms",
+                                 (double)nGetAddr / 1000, (double)nSnapshot / 1000, nBytes,
+                                 (double)nLoad / 1000));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
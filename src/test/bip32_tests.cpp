@@ -0,0 +1,97 @@
+#include <boost/test/unit_test.hpp>
+
+#include "clientversion.h"
+#include "key.h"
+#include "streams.h"
+#include "utilstrencodings.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bip32_tests)
+
+// BIP32 test vector 1: seed 000102030405060708090a0b0c0d0e0f
+struct TestDerivation
+{
+    unsigned int nChild;
+    const char* pszChainCode;
+    const char* pszSecret;
+    const char* pszPubKey;
+};
+
+static const TestDerivation vDerivations[] = {
+    { 0x80000000,
+      "47fdacbd0f1097043b78c63c20c34ef4ed9a111d980047ad16282c7ae6236141",
+      "edb2e14f9ee77d26dd93b4ecede8d16ed408ce149b6cd80b0715a2d911a0afea",
+      "035a784662a4a20a65bf6aab9ae98a6c068a81c52e4b032c0fb5400c706cfccc56" },
+    { 1,
+      "2a7857631386ba23dacac34180dd1983734e444fdbf774041578e9b6adb37c19",
+      "3c6cb8d0f6a264c91ea8b5030fadaa8e538b020f0a387421a12de9319dc93368",
+      "03501e454bf00751f24b1b489aa925215d66af2234e3891c3b21a52bedb3cd711c" },
+};
+
+static string ChainCodeHex(ChainCode cc)
+{
+    return HexStr(cc.begin(), cc.end());
+}
+
+BOOST_AUTO_TEST_CASE(bip32_vector1)
+{
+    vector<unsigned char> vchSeed = ParseHex("000102030405060708090a0b0c0d0e0f");
+    CExtKey extKey;
+    extKey.SetMaster(&vchSeed[0], vchSeed.size());
+
+    bool fCompressed;
+    CSecret vchSecret = extKey.key.GetSecret(fCompressed);
+    BOOST_CHECK_EQUAL(ChainCodeHex(extKey.chaincode), "873dff81c02f525623fd1fe5167eac3a55a049de3d314bb42ee227ffed37d508");
+    BOOST_CHECK_EQUAL(HexStr(vchSecret.begin(), vchSecret.end()), "e8f32e723decf4051aefac8e2c93c9c5b214313817cdb01a1494b917c8436b35");
+    BOOST_CHECK_EQUAL(HexStr(extKey.key.GetPubKey().Raw()), "0339a36013301597daef41fbe593a02cc513d0b55527ec2df1050e2e8ff49c85c2");
+
+    CExtPubKey extPubKey = extKey.Neuter();
+    for (unsigned int i = 0; i < sizeof(vDerivations) / sizeof(vDerivations[0]); i++)
+    {
+        const TestDerivation& test = vDerivations[i];
+
+        CExtKey extKeyChild;
+        BOOST_CHECK(extKey.Derive(extKeyChild, test.nChild));
+        vchSecret = extKeyChild.key.GetSecret(fCompressed);
+        BOOST_CHECK_EQUAL(ChainCodeHex(extKeyChild.chaincode), test.pszChainCode);
+        BOOST_CHECK_EQUAL(HexStr(vchSecret.begin(), vchSecret.end()), test.pszSecret);
+        BOOST_CHECK_EQUAL(HexStr(extKeyChild.key.GetPubKey().Raw()), test.pszPubKey);
+
+        // Public derivation gives the same key, and only for normal children
+        CExtPubKey extPubKeyChild;
+        if (test.nChild >= 0x80000000)
+            BOOST_CHECK(!extPubKey.Derive(extPubKeyChild, test.nChild));
+        else
+        {
+            BOOST_CHECK(extPubKey.Derive(extPubKeyChild, test.nChild));
+            BOOST_CHECK(extPubKeyChild.pubkey == extKeyChild.key.GetPubKey());
+            BOOST_CHECK(extPubKeyChild.chaincode == extKeyChild.chaincode);
+        }
+
+        extKey = extKeyChild;
+        extPubKey = extKeyChild.Neuter();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bip32_extpubkey_serialize)
+{
+    vector<unsigned char> vchSeed = ParseHex("fffcf9f6f3f0edeae7e4e1dedbd8d5d2cfccc9c6c3c0bdbab7b4b1aeaba8a5a29f9c999693908d8a8784817e7b7875726f6c696663605d5a5754514e4b484542");
+    CExtKey extKey;
+    extKey.SetMaster(&vchSeed[0], vchSeed.size());
+    CExtPubKey extPubKey = extKey.Neuter();
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << extPubKey;
+    CExtPubKey extPubKey2;
+    ss >> extPubKey2;
+    BOOST_CHECK(extPubKey2.pubkey == extPubKey.pubkey);
+    BOOST_CHECK(extPubKey2.chaincode == extPubKey.chaincode);
+
+    CExtPubKey extChild, extChild2;
+    BOOST_CHECK(extPubKey.Derive(extChild, 7));
+    BOOST_CHECK(extPubKey2.Derive(extChild2, 7));
+    BOOST_CHECK(extChild.pubkey == extChild2.pubkey);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,181 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "hash.h"
+#include "main.h"
+#include "txmempool.h"
+
+using namespace std;
+
+// A proof-of-work block with a coinbase and nTx - 1 spends of distinct outputs
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.hashPrevBlock = uint256(42);
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 12345;
+
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 50 * COIN;
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(txCoinbase);
+
+    for (unsigned int i = 1; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(i), 0);
+        tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02);
+        tx.vout.resize(2);
+        tx.vout[0].nValue = i * CENT;
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[1].nValue = COIN;
+        tx.vout[1].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, i + 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Plays the sender and the receiver of one block announcement, returns the
+// number of round trips needed after the "cmpctblock" and the bytes sent
+static unsigned int Relay(const CBlock& block, CTxMemPool& pool, CBlock& blockOut, size_t& nBytes)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CBlockHeaderAndShortTxIDs(block);
+    nBytes = ss.size();
+
+    CBlockHeaderAndShortTxIDs cmpctblock;
+    ss >> cmpctblock;
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_REQUIRE(partialBlock.InitData(cmpctblock, pool, map<uint256, CTransaction>()) == READ_STATUS_OK);
+
+    BlockTransactionsRequest req;
+    req.blockhash = cmpctblock.header.GetHash();
+    req.indexes = partialBlock.GetMissing();
+    if (req.indexes.empty())
+    {
+        BOOST_CHECK(partialBlock.FillBlock(blockOut, vector<CTransaction>()) == READ_STATUS_OK);
+        return 0;
+    }
+
+    ss << req;
+    nBytes += ss.size();
+    BlockTransactionsRequest req2;
+    ss >> req2;
+    BlockTransactions resp(req2);
+    BOOST_FOREACH(unsigned int nIndex, req2.indexes)
+        resp.txn.push_back(block.vtx[nIndex]);
+
+    ss << resp;
+    nBytes += ss.size();
+    BlockTransactions resp2;
+    ss >> resp2;
+    BOOST_CHECK(resp2.blockhash == block.GetHash());
+    BOOST_CHECK(partialBlock.FillBlock(blockOut, resp2.txn) == READ_STATUS_OK);
+    return 1;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(siphash_uint256)
+{
+    // Reference vector of the SipHash-2-4 paper key on the bytes 00..1f
+    vector<unsigned char> vch;
+    for (int i = 0; i < 32; i++)
+        vch.push_back(i);
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256(vch)), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_serialize)
+{
+    CBlock block = BuildBlock(20);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), 20U);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn.size(), 1U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblock2.nNonce == cmpctblock.nNonce);
+    BOOST_REQUIRE_EQUAL(cmpctblock2.shorttxids.size(), 19U);
+    for (unsigned int i = 0; i < 19; i++)
+    {
+        BOOST_CHECK_EQUAL(cmpctblock2.shorttxids[i].nShortID, cmpctblock.shorttxids[i].nShortID);
+        BOOST_CHECK(cmpctblock2.shorttxids[i].nShortID < (1ULL << 48));
+        // The receiver derives the same short ids from the header and nonce
+        BOOST_CHECK_EQUAL(cmpctblock2.GetShortID(block.vtx[i + 1].GetHash()), cmpctblock.shorttxids[i].nShortID);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_relay)
+{
+    CBlock block = BuildBlock(200);
+    size_t nFullBytes = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Every transaction already relayed: no round trip, a fraction of the bytes
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+    CBlock block2;
+    size_t nBytes;
+    BOOST_CHECK_EQUAL(Relay(block, pool, block2, nBytes), 0U);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+    BOOST_CHECK(nBytes * 10 < nFullBytes);
+
+    // A tenth of them missing: a single getblocktxn/blocktxn round trip
+    for (unsigned int i = 1; i < block.vtx.size(); i += 10)
+        pool.mapTx.erase(block.vtx[i].GetHash());
+    CBlock block3;
+    BOOST_CHECK_EQUAL(Relay(block, pool, block3, nBytes), 1U);
+    BOOST_CHECK(block3.BuildMerkleTree() == block.hashMerkleRoot);
+    BOOST_CHECK(nBytes < nFullBytes / 2);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_invalid)
+{
+    CBlock block = BuildBlock(10);
+    CTxMemPool pool;
+
+    // Prefilled index past the end of the block
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.prefilledtxn[0].index = 10;
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(cmpctblock, pool, map<uint256, CTransaction>()) == READ_STATUS_INVALID);
+
+    // Two identical short ids cannot be resolved, fetch the full block
+    CBlockHeaderAndShortTxIDs cmpctblock2(block);
+    cmpctblock2.shorttxids[1] = cmpctblock2.shorttxids[0];
+    PartiallyDownloadedBlock partialBlock2;
+    BOOST_CHECK(partialBlock2.InitData(cmpctblock2, pool, map<uint256, CTransaction>()) == READ_STATUS_FAILED);
+
+    // Wrong number of missing transactions supplied
+    CBlockHeaderAndShortTxIDs cmpctblock3(block);
+    PartiallyDownloadedBlock partialBlock3;
+    BOOST_REQUIRE(partialBlock3.InitData(cmpctblock3, pool, map<uint256, CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock3.GetMissing().size(), 9U);
+    CBlock block2;
+    BOOST_CHECK(partialBlock3.FillBlock(block2, vector<CTransaction>(block.vtx.begin() + 1, block.vtx.begin() + 9)) == READ_STATUS_INVALID);
+
+    // Transactions that do not hash to the merkle root
+    vector<CTransaction> vtx(block.vtx.begin() + 1, block.vtx.end());
+    swap(vtx[0], vtx[1]);
+    BOOST_CHECK(partialBlock3.FillBlock(block2, vtx) == READ_STATUS_FAILED);
+    swap(vtx[0], vtx[1]);
+    BOOST_CHECK(partialBlock3.FillBlock(block2, vtx) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
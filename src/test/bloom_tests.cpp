@@ -0,0 +1,368 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "main.h"
+#include "merkleblock.h"
+#include "mruset.h"
+#include "protocol.h"
+#include "random.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+using namespace std;
+
+// A transaction paying to a pubkey-hash derived from n, spending an output of prev
+static CTransaction MakeTx(unsigned int n, const uint256& prev)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev, n % 3);
+    tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, n & 0xff);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = n * CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, n & 0xff) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1].nValue = COIN;
+    tx.vout[1].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, (n >> 8) & 0xff) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.nTime = n;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(bloom_create_insert_serialize)
+{
+    CBloomFilter filter(3, 0.01, 0, BLOOM_UPDATE_ALL);
+
+    filter.insert(ParseHex("99108ad8ed9bb6274d3980bab5a85c048f0950c8"));
+    BOOST_CHECK_MESSAGE( filter.contains(ParseHex("99108ad8ed9bb6274d3980bab5a85c048f0950c8")), "BloomFilter doesn't contain just-inserted object!");
+    // One bit different in first byte
+    BOOST_CHECK_MESSAGE(!filter.contains(ParseHex("19108ad8ed9bb6274d3980bab5a85c048f0950c8")), "BloomFilter contains something it shouldn't!");
+
+    filter.insert(ParseHex("b5a2c786d9ef4658287ced5914b37a1b4aa32eee"));
+    BOOST_CHECK_MESSAGE(filter.contains(ParseHex("b5a2c786d9ef4658287ced5914b37a1b4aa32eee")), "BloomFilter doesn't contain just-inserted object (2)!");
+
+    filter.insert(ParseHex("b9300670b4c5366e95b2699e8b18bc75e5f729c5"));
+    BOOST_CHECK_MESSAGE(filter.contains(ParseHex("b9300670b4c5366e95b2699e8b18bc75e5f729c5")), "BloomFilter doesn't contain just-inserted object (3)!");
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << filter;
+
+    vector<unsigned char> vch = ParseHex("03614e9b050000000000000001");
+    vector<char> expected(vch.size());
+
+    for (unsigned int i = 0; i < vch.size(); i++)
+        expected[i] = (char)vch[i];
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(stream.begin(), stream.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(bloom_match)
+{
+    CTransaction tx = MakeTx(7, uint256(1));
+    uint256 hash = tx.GetHash();
+    CTransaction txSpend = MakeTx(8, hash);
+
+    CBloomFilter filter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(hash);
+    BOOST_CHECK_MESSAGE(filter.IsRelevantAndUpdate(tx, hash), "Simple Bloom filter didn't match tx hash");
+
+    // Matching a script data element adds the output, so its spender matches too
+    filter = CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(vector<unsigned char>(20, 7));
+    BOOST_CHECK_MESSAGE(filter.IsRelevantAndUpdate(tx, hash), "Simple Bloom filter didn't match output address");
+    BOOST_CHECK_MESSAGE(filter.contains(COutPoint(hash, 0)), "Matched output wasn't added to the filter");
+    txSpend.vin[0].prevout = COutPoint(hash, 0);
+    BOOST_CHECK_MESSAGE(filter.IsRelevantAndUpdate(txSpend, txSpend.GetHash()), "Spending tx didn't match the added outpoint");
+
+    // Pay-to-pubkey-hash outputs are not added with BLOOM_UPDATE_P2PUBKEY_ONLY
+    filter = CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_P2PUBKEY_ONLY);
+    filter.insert(vector<unsigned char>(20, 7));
+    BOOST_CHECK(filter.IsRelevantAndUpdate(tx, hash));
+    BOOST_CHECK(!filter.contains(COutPoint(hash, 0)));
+
+    // Input script data and spent outpoints
+    filter = CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_NONE);
+    filter.insert(COutPoint(uint256(1), 7 % 3));
+    BOOST_CHECK_MESSAGE(filter.IsRelevantAndUpdate(tx, hash), "Simple Bloom filter didn't match COutPoint");
+    filter = CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_NONE);
+    filter.insert(vector<unsigned char>(33, 7));
+    BOOST_CHECK_MESSAGE(filter.IsRelevantAndUpdate(tx, hash), "Simple Bloom filter didn't match input signature");
+
+    filter = CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(uint256(2));
+    filter.insert(COutPoint(uint256(1), 2));
+    BOOST_CHECK_MESSAGE(!filter.IsRelevantAndUpdate(tx, hash), "Simple Bloom filter matched random data");
+
+    // A filter with every bit set matches without hashing, an empty one never does
+    CBloomFilter filterFull(1, 0.5, 0, BLOOM_UPDATE_NONE);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vector<unsigned char>(1, 0xff) << (unsigned int)MAX_HASH_FUNCS << (unsigned int)0 << (unsigned char)0;
+    ss >> filterFull;
+    BOOST_CHECK(filterFull.IsWithinSizeConstraints());
+    filterFull.UpdateEmptyFull();
+    BOOST_CHECK(filterFull.IsRelevantAndUpdate(tx, hash));
+    CBloomFilter filterEmpty(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filterEmpty.UpdateEmptyFull();
+    BOOST_CHECK(!filterEmpty.IsRelevantAndUpdate(tx, hash));
+
+    // Filters past the protocol limits are rejected on load
+    CBloomFilter filterBig(1, 0.5, 0, BLOOM_UPDATE_NONE);
+    ss << vector<unsigned char>(MAX_BLOOM_FILTER_SIZE + 1, 0) << (unsigned int)1 << (unsigned int)0 << (unsigned char)0;
+    ss >> filterBig;
+    BOOST_CHECK(!filterBig.IsWithinSizeConstraints());
+}
+
+BOOST_AUTO_TEST_CASE(pmt_test1)
+{
+    static const unsigned int nTxCounts[] = {1, 4, 7, 17, 56, 100, 127, 256, 312, 513, 1000, 4095};
+
+    for (int n = 0; n < 12; n++)
+    {
+        unsigned int nTx = nTxCounts[n];
+
+        // build a block with some dummy transactions
+        CBlock block;
+        for (unsigned int j = 0; j < nTx; j++)
+            block.vtx.push_back(MakeTx(j, uint256(n)));
+
+        // calculate actual merkle root and height
+        uint256 merkleRoot1 = block.BuildMerkleTree();
+        vector<uint256> vTxid(nTx, 0);
+        for (unsigned int j = 0; j < nTx; j++)
+            vTxid[j] = block.vtx[j].GetHash();
+        int nHeight = 1, nTx_ = nTx;
+        while (nTx_ > 1) {
+            nTx_ = (nTx_+1)/2;
+            nHeight++;
+        }
+
+        // check with random subsets with inclusion chances 1, 1/2, 1/4, ..., 1/128
+        for (int att = 1; att < 15; att++) {
+            // build random subset of txid's
+            vector<bool> vMatch(nTx, false);
+            vector<uint256> vMatchTxid1;
+            for (unsigned int j = 0; j < nTx; j++) {
+                bool fInclude = (GetRandInt(1 << (att/2))) == 0;
+                vMatch[j] = fInclude;
+                if (fInclude)
+                    vMatchTxid1.push_back(vTxid[j]);
+            }
+
+            // build the partial merkle tree, from the txids and from the block's tree
+            CPartialMerkleTree pmt1(vTxid, vMatch);
+            CPartialMerkleTree pmtBlock(nTx, block.vMerkleTree, vMatch);
+
+            // serialize
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << pmt1;
+            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock << pmtBlock;
+            BOOST_CHECK(ss.str() == ssBlock.str());
+
+            // verify CPartialMerkleTree's size guarantees
+            unsigned int nLeaves = std::min<unsigned int>(nTx, 1 + vMatchTxid1.size()*nHeight);
+            BOOST_CHECK(ss.size() <= 10 + (258*nLeaves+7)/8);
+
+            // deserialize into a tester copy
+            CPartialMerkleTree pmt2;
+            ss >> pmt2;
+
+            // extract merkle root and matched txids from copy
+            vector<uint256> vMatchTxid2;
+            uint256 merkleRoot2 = pmt2.ExtractMatches(vMatchTxid2);
+
+            // check that it has the same merkle root as the original, and a valid one
+            BOOST_CHECK(merkleRoot1 == merkleRoot2);
+            BOOST_CHECK(merkleRoot2 != 0);
+
+            // check that it contains the matched transactions (in the same order!)
+            BOOST_CHECK(vMatchTxid1 == vMatchTxid2);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_block)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.hashPrevBlock = uint256(42);
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0fffff;
+    for (unsigned int j = 0; j < 10; j++)
+        block.vtx.push_back(MakeTx(j, uint256(3)));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBloomFilter filter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    filter.insert(block.vtx[8].GetHash());
+    filter.insert(vector<unsigned char>(20, 3));
+
+    CMerkleBlock merkleBlock(block, filter);
+    BOOST_REQUIRE_EQUAL(merkleBlock.vMatchedTxn.size(), 2U);
+    BOOST_CHECK(merkleBlock.vMatchedTxn[0] == make_pair(3U, block.vtx[3].GetHash()));
+    BOOST_CHECK(merkleBlock.vMatchedTxn[1] == make_pair(8U, block.vtx[8].GetHash()));
+
+    // The header is sent without the block signature and transactions
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << merkleBlock;
+    CMerkleBlock merkleBlock2;
+    ss >> merkleBlock2;
+    BOOST_CHECK(merkleBlock2.header.GetHash() == block.GetHash());
+
+    vector<uint256> vMatched;
+    BOOST_CHECK(merkleBlock2.txn.ExtractMatches(vMatched) == block.hashMerkleRoot);
+    BOOST_REQUIRE_EQUAL(vMatched.size(), 2U);
+    BOOST_CHECK(vMatched[0] == block.vtx[3].GetHash());
+    BOOST_CHECK(vMatched[1] == block.vtx[8].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(merkle_block_benchmark)
+{
+    static const int nIterations = 20;
+
+    CBlock block;
+    for (unsigned int j = 0; j < 2000; j++)
+        block.vtx.push_back(MakeTx(j, uint256(j)));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // A light wallet watching 1000 addresses, none of them in the block.
+    // The block's tree is built already, so this times the filtering and
+    // the partial tree alone
+    CBloomFilter filter(1000, 0.0001, GetRandInt(1 << 30), BLOOM_UPDATE_NONE);
+    for (unsigned int j = 0; j < 1000; j++)
+        filter.insert(GetRandHash());
+
+    int64_t nStart = GetTimeMicros();
+    size_t nMatched = 0;
+    for (int i = 0; i < nIterations; i++)
+    {
+        CMerkleBlock merkleBlock(block, filter);
+        nMatched += merkleBlock.vMatchedTxn.size();
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    BOOST_CHECK(nMatched < (size_t)nIterations * 10);
+
+    BOOST_TEST_MESSAGE(strprintf("CMerkleBlock: %u txs against a 1000 element filter, %.2f ms/block",
+                                 block.vtx.size(), (double)nElapsed / nIterations / 1000));
+}
+
+static vector<unsigned char> RandomKey()
+{
+    uint256 hash = GetRandHash();
+    return vector<unsigned char>(UBEGIN(hash), UBEGIN(hash) + 18);
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CRollingBloomFilter rb(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE = 399;
+    vector<uint256> data;
+    for (int i = 0; i < DATASIZE; i++)
+    {
+        data.push_back(GetRandHash());
+        rb.insert(data.back());
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = 299; i < DATASIZE; i++)
+        BOOST_CHECK(rb.contains(data[i]));
+
+    // false positive rate is 1%, so we should get about 100 hits if
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when we've inserted one minus an integer multiple of nElement*2.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++)
+        if (rb.contains(GetRandHash()))
+            ++nHits;
+    // Run test_neutron with --log_level=message to see BOOST_TEST_MESSAGEs:
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+    // Insanely unlikely to get a fp count outside this range:
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+
+    BOOST_CHECK(rb.contains(data[DATASIZE-1]));
+    rb.reset();
+    BOOST_CHECK(!rb.contains(data[DATASIZE-1]));
+
+    // Address keys go through the vector interface
+    vector<vector<unsigned char> > vKeys;
+    for (int i = 0; i < DATASIZE; i++)
+    {
+        vKeys.push_back(RandomKey());
+        rb.insert(vKeys.back());
+    }
+    for (int i = 299; i < DATASIZE; i++)
+        BOOST_CHECK(rb.contains(vKeys[i]));
+    // The oldest generation has been wiped
+    nHits = 0;
+    for (int i = 0; i < 100; i++)
+        if (rb.contains(vKeys[i]))
+            ++nHits;
+    BOOST_CHECK(nHits < 10);
+
+    // Memory does not depend on how much was inserted
+    CRollingBloomFilter rb2(1000, 0.001);
+    size_t nUsage = rb2.DynamicMemoryUsage();
+    for (int i = 0; i < 10000; i++)
+        rb2.insert(GetRandHash());
+    BOOST_CHECK_EQUAL(rb2.DynamicMemoryUsage(), nUsage);
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_relay_benchmark)
+{
+    // Announce a stream of new inventory to every peer, checking and
+    // updating each peer's known set the way SendMessages does.
+    static const int nInvs = 2000;
+    static const int vPeerCounts[] = {8, 64, 256};
+
+    vector<CInv> vInv;
+    for (int i = 0; i < nInvs; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+
+    // Long-lived peers: every known set is already full and evicting
+    mruset<CInv> setFull(INVENTORY_KNOWN_ELEMENTS);
+    CRollingBloomFilter filterFull(INVENTORY_KNOWN_ELEMENTS, INVENTORY_KNOWN_FPRATE);
+    for (unsigned int i = 0; i < INVENTORY_KNOWN_ELEMENTS; i++)
+    {
+        uint256 hash = GetRandHash();
+        setFull.insert(CInv(MSG_TX, hash));
+        filterFull.insert(hash);
+    }
+
+    for (unsigned int c = 0; c < sizeof(vPeerCounts) / sizeof(vPeerCounts[0]); c++)
+    {
+        int nPeers = vPeerCounts[c];
+
+        vector<mruset<CInv> > vSets(nPeers, setFull);
+        int64_t nStart = GetTimeMicros();
+        unsigned int nSetSent = 0;
+        BOOST_FOREACH(const CInv& inv, vInv)
+            for (int p = 0; p < nPeers; p++)
+                if (vSets[p].insert(inv).second)
+                    nSetSent++;
+        int64_t nSetTime = GetTimeMicros() - nStart;
+
+        vector<CRollingBloomFilter> vFilters(nPeers, filterFull);
+        nStart = GetTimeMicros();
+        unsigned int nFilterSent = 0;
+        BOOST_FOREACH(const CInv& inv, vInv)
+            for (int p = 0; p < nPeers; p++)
+                if (!vFilters[p].contains(inv.hash))
+                {
+                    vFilters[p].insert(inv.hash);
+                    nFilterSent++;
+                }
+        int64_t nFilterTime = GetTimeMicros() - nStart;
+
+        BOOST_CHECK_EQUAL(nSetSent, (unsigned int)(nInvs * nPeers));
+        BOOST_CHECK(nFilterSent + 2 >= nSetSent);
+
+        BOOST_TEST_MESSAGE(strprintf("relay fan-out to %d peers: mruset %.3f us/inv, rolling bloom %.3f us/inv (%u bytes/peer)",
+                                     nPeers, (double)nSetTime / nInvs, (double)nFilterTime / nInvs,
+                                     vFilters[0].DynamicMemoryUsage()));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
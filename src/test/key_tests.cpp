@@ -5,6 +5,7 @@
 
 #include "key.h"
 #include "base58.h"
+#include "keystore.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -144,4 +145,127 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_setkeypair)
+{
+    for (int nCompressed = 0; nCompressed < 2; nCompressed++)
+    {
+        CKey key;
+        key.MakeNewKey(nCompressed == 1);
+        bool fCompressed;
+        CSecret secret = key.GetSecret(fCompressed);
+
+        CKey keyPair;
+        BOOST_CHECK(keyPair.SetKeyPair(secret, key.GetPubKey()));
+        BOOST_CHECK(keyPair.GetPubKey() == key.GetPubKey());
+        BOOST_CHECK(keyPair.IsCompressed() == fCompressed);
+        bool fCompressedPair;
+        BOOST_CHECK(keyPair.GetSecret(fCompressedPair) == secret);
+        BOOST_CHECK(fCompressedPair == fCompressed);
+    }
+}
+
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::EncryptKeys(vMasterKeyIn); }
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::Unlock(vMasterKeyIn); }
+    void ClearKeyCache() const { CCryptoKeyStore::ClearKeyCache(); }
+    bool GetCachedKey(const CKeyID& address, CKey& keyOut) const { return CCryptoKeyStore::GetCachedKey(address, keyOut); }
+};
+
+BOOST_AUTO_TEST_CASE(key_crypted_cache)
+{
+    CTestCryptoKeyStore keystore;
+    CKey key1, key2;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    BOOST_CHECK(keystore.AddKey(key1));
+    BOOST_CHECK(keystore.AddKey(key2));
+
+    CKeyingMaterial vMasterKey(32, 0x5a);
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+    BOOST_CHECK(keystore.Lock());
+
+    CKey key;
+    BOOST_CHECK(!keystore.GetKey(key1.GetPubKey().GetID(), key));
+    BOOST_CHECK(keystore.Unlock(vMasterKey));
+
+    // The second lookup of each key comes from the cache
+    for (int i = 0; i < 2; i++)
+    {
+        bool fCompressed;
+        BOOST_CHECK(keystore.GetKey(key1.GetPubKey().GetID(), key));
+        BOOST_CHECK(key.GetPubKey() == key1.GetPubKey());
+        BOOST_CHECK(key.GetSecret(fCompressed) == key1.GetSecret(fCompressed));
+        BOOST_CHECK(keystore.GetKey(key2.GetPubKey().GetID(), key));
+        BOOST_CHECK(key.GetPubKey() == key2.GetPubKey());
+        BOOST_CHECK(!key.IsCompressed());
+    }
+
+    // Locking forgets the decrypted keys
+    BOOST_CHECK(keystore.Lock());
+    BOOST_CHECK(!keystore.GetKey(key1.GetPubKey().GetID(), key));
+    BOOST_CHECK(!keystore.GetKey(key2.GetPubKey().GetID(), key));
+}
+
+BOOST_AUTO_TEST_CASE(key_unencrypted_not_cached)
+{
+    CTestCryptoKeyStore keystore;
+    CKey key1;
+    key1.MakeNewKey(true);
+    BOOST_CHECK(keystore.AddKey(key1));
+
+    // An unencrypted store already holds its secrets; keep no second copy
+    CKey key;
+    BOOST_CHECK(keystore.GetKey(key1.GetPubKey().GetID(), key));
+    BOOST_CHECK(key.GetPubKey() == key1.GetPubKey());
+    BOOST_CHECK(!keystore.GetCachedKey(key1.GetPubKey().GetID(), key));
+}
+
+BOOST_AUTO_TEST_CASE(key_sign_benchmark)
+{
+    // Signing with keys of an unlocked encrypted wallet, as the staker and
+    // block signer do, with every GetKey decrypting and with the key cache
+    static const int nKeys = 100;
+
+    CTestCryptoKeyStore keystore;
+    vector<CKeyID> vKeyIDs;
+    for (int i = 0; i < nKeys; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        BOOST_CHECK(keystore.AddKey(key));
+        vKeyIDs.push_back(key.GetPubKey().GetID());
+    }
+    CKeyingMaterial vMasterKey(32, 0x5a);
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey));
+
+    uint256 hash = Hash(strSecret1.begin(), strSecret1.end());
+    vector<unsigned char> vchSig;
+    CKey key;
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nKeys; i++)
+    {
+        keystore.ClearKeyCache();
+        BOOST_CHECK(keystore.GetKey(vKeyIDs[i], key));
+        BOOST_CHECK(key.Sign(hash, vchSig));
+    }
+    int64_t nUncached = GetTimeMicros() - nStart;
+
+    for (int i = 0; i < nKeys; i++)
+        BOOST_CHECK(keystore.GetKey(vKeyIDs[i], key));
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nKeys; i++)
+    {
+        BOOST_CHECK(keystore.GetKey(vKeyIDs[i], key));
+        BOOST_CHECK(key.Sign(hash, vchSig));
+    }
+    int64_t nCached = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("GetKey+Sign: %d keys, uncached %.2f us/sig (%.0f sig/s), cached %.2f us/sig (%.0f sig/s)",
+                                 nKeys, (double)nUncached / nKeys, 1e6 * nKeys / std::max(nUncached, (int64_t)1),
+                                 (double)nCached / nKeys, 1e6 * nKeys / std::max(nCached, (int64_t)1)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
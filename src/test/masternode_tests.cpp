@@ -0,0 +1,129 @@
+#include <boost/test/unit_test.hpp>
+
+#include "darksend.h"
+#include "masternode.h"
+
+using namespace std;
+
+static CMasternode MakeMasternode(int n)
+{
+    CTxIn vin(COutPoint(uint256(1000 + n / 4), n % 4));
+    CService addr(CNetAddr(strprintf("1.2.%d.%d", n / 256, n % 256)), GetDefaultPort());
+    CMasternode mn(addr, vin, CPubKey(), vector<unsigned char>(), 1400000000 + n, CPubKey(), PROTOCOL_VERSION);
+    mn.nLastDsq = n;
+    return mn;
+}
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+BOOST_AUTO_TEST_CASE(masternodeman_find)
+{
+    CMasternodeMan man;
+    BOOST_CHECK(man.Add(MakeMasternode(1)));
+    BOOST_CHECK(!man.Add(MakeMasternode(1)));
+    BOOST_CHECK_EQUAL(man.size(), 1);
+
+    // Looked up by collateral only, whatever the signature script says
+    CTxIn vin(COutPoint(uint256(1000), 1), CScript() << OP_TRUE);
+    CMasternode* pmn = man.Find(vin);
+    BOOST_CHECK(pmn != NULL);
+    BOOST_CHECK_EQUAL(pmn->nLastDsq, 1);
+    BOOST_CHECK(man.Find(CTxIn(COutPoint(uint256(1000), 2))) == NULL);
+
+    // Handles survive the registry growing around them
+    for (int i = 2; i < 2000; i++)
+        man.Add(MakeMasternode(i));
+    BOOST_CHECK_EQUAL(man.size(), 1999);
+    BOOST_CHECK(man.Find(vin) == pmn);
+    BOOST_CHECK_EQUAL(pmn->nLastDsq, 1);
+
+    man.Clear();
+    BOOST_CHECK_EQUAL(man.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_serialize)
+{
+    CMasternodeMan man;
+    for (int i = 0; i < 50; i++)
+        man.Add(MakeMasternode(i));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << man;
+
+    CMasternodeMan man2;
+    man2.Add(MakeMasternode(100));
+    ss >> man2;
+    BOOST_CHECK_EQUAL(man2.size(), 50);
+    BOOST_CHECK(man2.Find(MakeMasternode(100).vin) == NULL);
+
+    vector<CMasternode> v1 = man.GetFullMasternodeVector(false);
+    vector<CMasternode> v2 = man2.GetFullMasternodeVector(false);
+    BOOST_CHECK_EQUAL(v1.size(), v2.size());
+    for (unsigned int i = 0; i < v1.size() && i < v2.size(); i++)
+    {
+        BOOST_CHECK(v1[i].vin == v2[i].vin);
+        BOOST_CHECK(v1[i].addr == v2[i].addr);
+        BOOST_CHECK_EQUAL(v1[i].now, v2[i].now);
+        BOOST_CHECK_EQUAL(v1[i].nLastDsq, v2[i].nLastDsq);
+    }
+
+    // A cache from another version is refused rather than misread
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << (int)(CMasternodeMan::CURRENT_VERSION + 1) << vector<CMasternode>();
+    CMasternodeMan man3;
+    BOOST_CHECK_THROW(ssOld >> man3, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_rank_ties)
+{
+    CMasternodeMan man;
+    for (int i = 0; i < 20; i++)
+    {
+        CMasternode mn = MakeMasternode(i);
+        mn.unitTest = true;
+        mn.UpdateLastSeen();
+        man.Add(mn);
+    }
+
+    // Past the tip there is no block hash to score against, so every score
+    // is 0: the winner and the first rank both go to the lowest collateral
+    static const int64_t nHeight = 1000000000;
+    CMasternode* pmn = man.GetCurrentMasterNode(1, nHeight, 0);
+    BOOST_CHECK(pmn != NULL);
+    BOOST_CHECK(pmn == man.GetMasternodeByRank(1, nHeight, 0));
+    BOOST_CHECK(pmn != NULL && pmn->vin == MakeMasternode(0).vin);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(MakeMasternode(0).vin, nHeight, 0), 1);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(MakeMasternode(19).vin, nHeight, 0), 20);
+}
+
+BOOST_AUTO_TEST_CASE(seen_message_cache)
+{
+    CSeenMessageCache cache(100);
+    CPubKey pubkey;
+    vector<unsigned char> vchSig(65, 1);
+
+    uint256 entry = CSeenMessageCache::GetEntry(pubkey, vchSig, "message");
+    BOOST_CHECK(!cache.Contains(entry));
+    cache.Insert(entry);
+    cache.Insert(entry);
+    BOOST_CHECK(cache.Contains(entry));
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    // A different signature or text over the same key is a different message
+    vector<unsigned char> vchSig2(65, 2);
+    BOOST_CHECK(CSeenMessageCache::GetEntry(pubkey, vchSig2, "message") != entry);
+    BOOST_CHECK(CSeenMessageCache::GetEntry(pubkey, vchSig, "message2") != entry);
+
+    // Bounded, dropping the oldest entries first
+    for (int i = 0; i < 150; i++)
+        cache.Insert(CSeenMessageCache::GetEntry(pubkey, vchSig, strprintf("%d", i)));
+    BOOST_CHECK_EQUAL(cache.size(), 100U);
+    BOOST_CHECK(!cache.Contains(entry));
+    BOOST_CHECK(!cache.Contains(CSeenMessageCache::GetEntry(pubkey, vchSig, "49")));
+    BOOST_CHECK(cache.Contains(CSeenMessageCache::GetEntry(pubkey, vchSig, "50")));
+
+    BOOST_CHECK_EQUAL(cache.GetHits(), 2U);
+    BOOST_CHECK_EQUAL(cache.GetMisses(), 3U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
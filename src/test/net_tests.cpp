@@ -0,0 +1,148 @@
+#include <boost/test/unit_test.hpp>
+
+#include <limits>
+
+#include "net.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(token_bucket_unlimited)
+{
+    CTokenBucket bucket;
+    BOOST_CHECK_EQUAL(bucket.Available(1000000), std::numeric_limits<int64_t>::max());
+    bucket.Consume(1 << 30);
+    BOOST_CHECK_EQUAL(bucket.Available(1000001), std::numeric_limits<int64_t>::max());
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket_rate)
+{
+    static const int64_t nStart = 1000000000;
+    CTokenBucket bucket;
+    bucket.SetRate(10000);
+
+    // Starts with one second's worth
+    BOOST_CHECK_EQUAL(bucket.Available(nStart), 10000);
+    bucket.Consume(10000);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart), 0);
+
+    // Refills in proportion to the time elapsed
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 100000), 1000);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 500000), 5000);
+
+    // An overdraft (a send that took more than was left) is paid back first
+    bucket.Consume(8000);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 500000), -3000);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 800000), 0);
+
+    // Never holds more than one second's worth, however long it idles
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 1800000), 10000);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 60000000), 10000);
+
+    // Time going backwards does not mint tokens
+    bucket.Consume(10000);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 50000000), 0);
+
+    // Dropping the limit, as for whitelisted peers
+    bucket.SetRate(0);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart + 50000000), std::numeric_limits<int64_t>::max());
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket_fraction)
+{
+    // At 10 bytes/s a check every 50 ms earns half a byte each time; the
+    // halves add up rather than being dropped
+    static const int64_t nStart = 1000000000;
+    CTokenBucket bucket;
+    bucket.SetRate(10);
+    BOOST_CHECK_EQUAL(bucket.Available(nStart), 10);
+    bucket.Consume(10);
+    for (int i = 1; i <= 19; i++)
+        BOOST_CHECK_EQUAL(bucket.Available(nStart + i * 50000), i / 2);
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket_throughput)
+{
+    // Draining in 64 KB reads every 50 ms, as the socket thread does, moves
+    // no more than the configured rate plus the initial burst
+    static const int64_t nRate = 200000;
+    CTokenBucket bucket;
+    bucket.SetRate(nRate);
+
+    int64_t nTotal = 0;
+    for (int64_t nTime = 1000000; nTime <= 11000000; nTime += 50000)
+    {
+        int64_t nBytes = std::min((int64_t)0x10000, bucket.Available(nTime));
+        if (nBytes <= 0)
+            continue;
+        bucket.Consume(nBytes);
+        nTotal += nBytes;
+    }
+    BOOST_CHECK(nTotal <= nRate * 11);
+    BOOST_CHECK(nTotal >= nRate * 10);
+}
+
+BOOST_AUTO_TEST_CASE(interleave_address_families)
+{
+    vector<CService> vAddr;
+    vAddr.push_back(CService("2001:db8::1", 18332));
+    vAddr.push_back(CService("2001:db8::2", 18332));
+    vAddr.push_back(CService("2001:db8::3", 18332));
+    vAddr.push_back(CService("1.2.3.4", 18332));
+    vAddr.push_back(CService("1.2.3.5", 18332));
+
+    // Alternates, starting with the family listed first
+    vector<CService> vRet = InterleaveAddressFamilies(vAddr);
+    BOOST_REQUIRE_EQUAL(vRet.size(), 5U);
+    BOOST_CHECK(vRet[0] == vAddr[0]);
+    BOOST_CHECK(vRet[1] == vAddr[3]);
+    BOOST_CHECK(vRet[2] == vAddr[1]);
+    BOOST_CHECK(vRet[3] == vAddr[4]);
+    BOOST_CHECK(vRet[4] == vAddr[2]);
+
+    vAddr.resize(2);
+    BOOST_CHECK(InterleaveAddressFamilies(vAddr) == vAddr);
+    BOOST_CHECK(InterleaveAddressFamilies(vector<CService>()).empty());
+}
+
+// A message of nSize zero bytes, header included
+static CDataStream MakeRawMessage(unsigned int nSize)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("ping", nSize);
+    ss.resize(ss.size() + nSize, 0);
+    return ss;
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_reuse)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("1.2.3.4", 18332)), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    CDataStream ss = MakeRawMessage(1000);
+    BOOST_CHECK(node.ReceiveMsgBytes(&ss[0], ss.size()));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_REQUIRE(node.vRecvMsg.front().complete());
+    const char* pchFirst = &node.vRecvMsg.front().vRecv[0];
+    node.RecycleRecvBuffer(node.vRecvMsg.front().vRecv);
+    node.vRecvMsg.pop_front();
+
+    // The next message is read into the storage the last one left behind
+    BOOST_CHECK(node.ReceiveMsgBytes(&ss[0], ss.size()));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(&node.vRecvMsg.front().vRecv[0] == pchFirst);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.front().vRecv.size(), 1000U);
+    node.RecycleRecvBuffer(node.vRecvMsg.front().vRecv);
+    node.vRecvMsg.pop_front();
+
+    // A large buffer is freed rather than kept
+    CDataStream ssLarge = MakeRawMessage(100000);
+    BOOST_CHECK(node.ReceiveMsgBytes(&ssLarge[0], ssLarge.size()));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    node.RecycleRecvBuffer(node.vRecvMsg.front().vRecv);
+    node.vRecvMsg.pop_front();
+    BOOST_CHECK_EQUAL(node.vchRecvSpare.capacity(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
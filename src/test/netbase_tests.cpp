@@ -1,4 +1,5 @@
 #include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
 
 #include <string>
 #include <vector>
@@ -99,4 +100,54 @@ BOOST_AUTO_TEST_CASE(onioncat_test)
     BOOST_CHECK(addr1.IsRoutable());
 }
 
+BOOST_AUTO_TEST_CASE(netbase_nonblocking_connect)
+{
+    // A listener on an ephemeral loopback port
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = 0;
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    BOOST_REQUIRE(::bind(hListen, (struct sockaddr*)&sa, sizeof(sa)) != SOCKET_ERROR);
+    BOOST_REQUIRE(listen(hListen, SOMAXCONN) != SOCKET_ERROR);
+    socklen_t len = sizeof(sa);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sa, &len) != SOCKET_ERROR);
+    CService addr(CNetAddr(sa.sin_addr), ntohs(sa.sin_port));
+
+    // Several connects in flight at once, none of them blocking
+    vector<SOCKET> vSockets;
+    for (int i = 0; i < 8; i++)
+    {
+        SOCKET hSocket;
+        BOOST_REQUIRE(StartConnectSocket(addr, hSocket));
+        vSockets.push_back(hSocket);
+    }
+    BOOST_FOREACH(SOCKET& hSocket, vSockets)
+    {
+        struct timeval timeout = MillisToTimeval(5000);
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+        BOOST_CHECK_EQUAL(select(hSocket + 1, NULL, &fdset, NULL, &timeout), 1);
+        BOOST_CHECK(FinishConnectSocket(addr, hSocket));
+        CloseSocket(hSocket);
+    }
+
+    // Nothing listening any more: refused, either at once or on completion
+    CloseSocket(hListen);
+    SOCKET hSocket;
+    if (StartConnectSocket(addr, hSocket))
+    {
+        struct timeval timeout = MillisToTimeval(5000);
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+        BOOST_CHECK_EQUAL(select(hSocket + 1, NULL, &fdset, NULL, &timeout), 1);
+        BOOST_CHECK(!FinishConnectSocket(addr, hSocket));
+        BOOST_CHECK(hSocket == INVALID_SOCKET);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,202 @@
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "notifysocket.h"
+#include "util.h"
+#include "utiltime.h"
+
+using namespace std;
+using namespace boost::asio;
+
+BOOST_AUTO_TEST_SUITE(notifysocket_tests)
+
+static const int nTestPort = 28432;
+
+struct CTestFrame
+{
+    unsigned char nTopic;
+    uint64_t nSequence;
+    int64_t nTime;
+    string strPayload;
+};
+
+static void ReadFrame(ip::tcp::socket& socket, CTestFrame& frame)
+{
+    uint32_t nSize;
+    boost::asio::read(socket, buffer(&nSize, 4));
+    vector<char> vch(nSize);
+    boost::asio::read(socket, buffer(vch));
+    CDataStream ss(vch, SER_NETWORK, PROTOCOL_VERSION);
+    ss >> frame.nTopic >> frame.nSequence >> frame.nTime;
+    frame.strPayload = ss.str();
+}
+
+// The subscription byte is handled on the notify thread; wait for it
+static void Subscribe(ip::tcp::socket& socket, unsigned char nTopics)
+{
+    socket.connect(ip::tcp::endpoint(ip::address_v4::loopback(), nTestPort));
+    boost::asio::write(socket, buffer(&nTopics, 1));
+    for (int i = 0; i < 500 && (GetNotifyTopics() & nTopics) != nTopics; i++)
+        MilliSleep(10);
+    BOOST_REQUIRE((GetNotifyTopics() & nTopics) == nTopics);
+}
+
+static CTransaction MakeTransaction(unsigned int nDataSize)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << vector<unsigned char>(nDataSize, 0x42) << OP_DROP << OP_TRUE;
+    return tx;
+}
+
+static string Serialized(const CTransaction& tx)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_CASE(notify_frames)
+{
+    mapArgs.clear();
+    mapArgs["-notifyport"] = itostr(nTestPort);
+    string strError;
+    BOOST_REQUIRE(StartNotifySocket(strError));
+
+    io_service ios;
+    ip::tcp::socket socket(ios);
+    Subscribe(socket, NOTIFY_HASHTX | NOTIFY_RAWTX);
+
+    CTransaction tx = MakeTransaction(10);
+    int64_t nStart = GetTimeMicros();
+    NotifyTransaction(tx);
+    NotifyTransaction(tx);
+    NotifyBlock(CBlock()); // not subscribed
+
+    // Each topic counts its own frames
+    CTestFrame frame;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        ReadFrame(socket, frame);
+        BOOST_CHECK_EQUAL(frame.nSequence, i / 2);
+        BOOST_CHECK(frame.nTime >= nStart && frame.nTime <= GetTimeMicros());
+        if (i % 2 == 0)
+        {
+            uint256 hash = tx.GetHash();
+            BOOST_CHECK_EQUAL(frame.nTopic, NOTIFY_HASHTX);
+            BOOST_CHECK(frame.strPayload == string((const char*)BEGIN(hash), 32));
+        }
+        else
+        {
+            BOOST_CHECK_EQUAL(frame.nTopic, NOTIFY_RAWTX);
+            BOOST_CHECK(frame.strPayload == Serialized(tx));
+        }
+    }
+
+    // A new subscription byte replaces the topics
+    unsigned char nTopics = NOTIFY_HASHBLOCK;
+    boost::asio::write(socket, buffer(&nTopics, 1));
+    for (int i = 0; i < 500 && GetNotifyTopics() != NOTIFY_HASHBLOCK; i++)
+        MilliSleep(10);
+    BOOST_CHECK_EQUAL(GetNotifyTopics(), (unsigned int)NOTIFY_HASHBLOCK);
+
+    socket.close();
+    for (int i = 0; i < 500 && GetNotifyTopics() != 0; i++)
+        MilliSleep(10);
+    BOOST_CHECK_EQUAL(GetNotifyTopics(), 0U);
+
+    StopNotifySocket();
+    mapArgs.clear();
+}
+
+BOOST_AUTO_TEST_CASE(notify_slow_subscriber)
+{
+    mapArgs.clear();
+    mapArgs["-notifyport"] = itostr(nTestPort);
+    mapArgs["-notifymaxqueue"] = "1";
+    string strError;
+    BOOST_REQUIRE(StartNotifySocket(strError));
+
+    // One subscriber reads nothing while 40MB are published
+    io_service ios;
+    ip::tcp::socket socket(ios);
+    Subscribe(socket, NOTIFY_RAWTX);
+
+    CTransaction tx = MakeTransaction(200000);
+    const unsigned int nFrames = 200;
+    int64_t nStart = GetTimeMillis();
+    for (unsigned int i = 0; i < nFrames; i++)
+        NotifyTransaction(tx);
+    // Publishing never waits for the subscriber
+    BOOST_CHECK(GetTimeMillis() - nStart < 5000);
+
+    // Read what was queued; whatever arrives is whole and in order
+    MilliSleep(500);
+    CTestFrame frame;
+    uint64_t nLast = 0;
+    unsigned int nReceived = 0;
+    for (;;)
+    {
+        boost::system::error_code err;
+        if (socket.available(err) == 0)
+        {
+            MilliSleep(200);
+            if (socket.available(err) == 0)
+                break;
+        }
+        ReadFrame(socket, frame);
+        BOOST_CHECK(frame.strPayload == Serialized(tx));
+        BOOST_CHECK(nReceived == 0 || frame.nSequence > nLast);
+        nLast = frame.nSequence;
+        nReceived++;
+    }
+    BOOST_CHECK(nReceived > 0);
+    BOOST_CHECK(nReceived < nFrames);
+
+    // The frames that didn't fit were dropped, which the next one shows
+    NotifyTransaction(tx);
+    ReadFrame(socket, frame);
+    BOOST_CHECK_EQUAL(frame.nSequence, nFrames);
+    BOOST_CHECK(frame.nSequence > nLast + 1);
+
+    StopNotifySocket();
+    mapArgs.clear();
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+BOOST_AUTO_TEST_CASE(notify_socket_file)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    mapArgs.clear();
+    mapArgs["-notifysocket"] = path.string();
+
+    // A file that isn't a socket is left alone
+    {
+        boost::filesystem::ofstream file(path);
+        file << "wallet";
+    }
+    string strError;
+    BOOST_CHECK(!StartNotifySocket(strError));
+    BOOST_CHECK(!strError.empty());
+    BOOST_CHECK(boost::filesystem::is_regular_file(path));
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), 6U);
+    boost::filesystem::remove(path);
+
+    // The socket is created for the node's user only
+    BOOST_REQUIRE(StartNotifySocket(strError));
+    boost::filesystem::file_status status = boost::filesystem::status(path);
+    BOOST_CHECK(status.type() == boost::filesystem::socket_file);
+    BOOST_CHECK((status.permissions() & boost::filesystem::perms_mask) == (boost::filesystem::owner_read | boost::filesystem::owner_write));
+
+    StopNotifySocket();
+    BOOST_CHECK(!boost::filesystem::exists(path));
+    mapArgs.clear();
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,116 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "prevector.h"
+#include "random.h"
+
+using namespace std;
+
+#define NUM_TESTS 32
+#define NUM_OPS 256
+
+// Applies every operation to both a prevector and a std::vector and checks
+// that the two always hold the same elements.
+class prevectortester
+{
+private:
+    prevector<8, int> pv;
+    std::vector<int> v;
+
+public:
+    void check()
+    {
+        BOOST_REQUIRE_EQUAL(pv.size(), v.size());
+        BOOST_CHECK_EQUAL(pv.empty(), v.empty());
+        for (unsigned int i = 0; i < v.size(); i++)
+            BOOST_CHECK_EQUAL(pv[i], v[i]);
+        BOOST_CHECK(std::vector<int>(pv.begin(), pv.end()) == v);
+
+        prevector<8, int> pvCopy(pv);
+        BOOST_CHECK(pvCopy == pv);
+    }
+
+    void push_back(int n)       { pv.push_back(n); v.push_back(n); check(); }
+    void pop_back()             { if (v.empty()) return; pv.pop_back(); v.pop_back(); check(); }
+    void resize(unsigned int n) { pv.resize(n); v.resize(n); check(); }
+    void clear()                { pv.clear(); v.clear(); check(); }
+    void shrink_to_fit()        { pv.shrink_to_fit(); check(); }
+
+    void insert(unsigned int pos, int n)
+    {
+        pos = v.empty() ? 0 : pos % (v.size() + 1);
+        pv.insert(pv.begin() + pos, n);
+        v.insert(v.begin() + pos, n);
+        check();
+    }
+
+    void insert_range(unsigned int pos, const std::vector<int>& values)
+    {
+        pos = v.empty() ? 0 : pos % (v.size() + 1);
+        pv.insert(pv.begin() + pos, values.begin(), values.end());
+        v.insert(v.begin() + pos, values.begin(), values.end());
+        check();
+    }
+
+    void erase(unsigned int first, unsigned int count)
+    {
+        if (v.empty()) return;
+        first %= v.size();
+        unsigned int last = std::min<unsigned int>(first + count, v.size());
+        pv.erase(pv.begin() + first, pv.begin() + last);
+        v.erase(v.begin() + first, v.begin() + last);
+        check();
+    }
+
+    void swap()
+    {
+        prevector<8, int> pvOther(pv);
+        pv.clear();
+        pv.swap(pvOther);
+        check();
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(prevector_tests)
+
+BOOST_AUTO_TEST_CASE(prevector_like_vector)
+{
+    for (int nTest = 0; nTest < NUM_TESTS; nTest++)
+    {
+        prevectortester tester;
+        for (int nOp = 0; nOp < NUM_OPS; nOp++)
+        {
+            int n = GetRandInt(1000);
+            switch (GetRandInt(9))
+            {
+            case 0: tester.pop_back(); break;
+            case 1: tester.resize(GetRandInt(24)); break;
+            case 2: tester.insert(GetRandInt(64), n); break;
+            case 3: tester.insert_range(GetRandInt(64), std::vector<int>(GetRandInt(12), n)); break;
+            case 4: tester.erase(GetRandInt(64), GetRandInt(6)); break;
+            case 5: tester.swap(); break;
+            case 6: if (GetRandInt(16) == 0) tester.clear(); else tester.shrink_to_fit(); break;
+            default: tester.push_back(n); break;
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prevector_inline_storage)
+{
+    // Up to N elements live in the object itself; one more moves them to the heap
+    prevector<4, unsigned char> pv;
+    for (unsigned char i = 0; i < 4; i++)
+        pv.push_back(i);
+    BOOST_CHECK_EQUAL(pv.allocated_memory(), 0U);
+    pv.push_back(4);
+    BOOST_CHECK(pv.allocated_memory() > 0);
+    pv.resize(2);
+    pv.shrink_to_fit();
+    BOOST_CHECK_EQUAL(pv.allocated_memory(), 0U);
+    BOOST_CHECK_EQUAL(pv[0], 0);
+    BOOST_CHECK_EQUAL(pv[1], 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
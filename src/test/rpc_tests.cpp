@@ -1,9 +1,13 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
 #include "base58.h"
 #include "util.h"
 #include "bitcoinrpc.h"
+#include "jsonwriter.h"
+#include "main.h"
+#include "wallet.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -59,4 +63,258 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_parse_http_request)
+{
+    CHTTPRequest req;
+
+    // Nothing is taken until the request has fully arrived
+    string strBuf = "POST / HTTP/1.1\r\nContent-Length: 5\r\nAuthorization: Basic x\r\n\r\nhel";
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(strBuf, req), 0);
+    strBuf += "lo";
+
+    // Pipelined requests are taken one at a time
+    strBuf += "POST / HTTP/1.0\r\nContent-Length: 2\r\n\r\n[]";
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(strBuf, req), HTTP_OK);
+    BOOST_CHECK_EQUAL(req.strBody, "hello");
+    BOOST_CHECK_EQUAL(req.mapHeaders["authorization"], "Basic x");
+    BOOST_CHECK(req.fKeepAlive);
+
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(strBuf, req), HTTP_OK);
+    BOOST_CHECK_EQUAL(req.strBody, "[]");
+    BOOST_CHECK(!req.fKeepAlive);
+    BOOST_CHECK(strBuf.empty());
+
+    strBuf = "POST / HTTP/1.1\nConnection: close\n\n";
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(strBuf, req), HTTP_OK);
+    BOOST_CHECK(!req.fKeepAlive);
+    BOOST_CHECK(req.strBody.empty());
+
+    // Malformed or oversized requests are refused
+    strBuf = "GARBAGE\r\n\r\n";
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(strBuf, req), HTTP_BAD_REQUEST);
+    strBuf = string(MAX_RPC_HEADERS_SIZE + 1, 'x');
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(strBuf, req), HTTP_BAD_REQUEST);
+    strBuf = "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n";
+    BOOST_CHECK_EQUAL(ParseHTTPRequest(strBuf, req), HTTP_BAD_REQUEST);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_work_queue)
+{
+    CRPCWorkQueue queue(2);
+    int nRun = 0;
+    BOOST_CHECK(queue.Enqueue([&nRun]() { nRun++; }));
+    BOOST_CHECK(queue.Enqueue([&nRun]() { nRun += 10; }));
+
+    // Full: the server answers 503 instead of queueing without bound
+    BOOST_CHECK(!queue.Enqueue([&nRun]() { nRun += 100; }));
+    BOOST_CHECK_EQUAL(queue.Depth(), 2U);
+
+    CRPCWorkQueue::WorkItem work;
+    BOOST_CHECK(queue.Dequeue(work));
+    work();
+    BOOST_CHECK(queue.Enqueue([&nRun]() { nRun += 1000; }));
+    while (queue.Depth() > 0 && queue.Dequeue(work))
+        work();
+    BOOST_CHECK_EQUAL(nRun, 1011);
+
+    // Interrupting releases waiting workers and refuses new work; what was
+    // still queued is dropped along with whatever it held
+    std::shared_ptr<int> pHeld = std::make_shared<int>(0);
+    BOOST_CHECK(queue.Enqueue([pHeld]() {}));
+    BOOST_CHECK_EQUAL(pHeld.use_count(), 2);
+    queue.Interrupt();
+    BOOST_CHECK_EQUAL(queue.Depth(), 0U);
+    BOOST_CHECK_EQUAL(pHeld.use_count(), 1);
+    BOOST_CHECK(!queue.Dequeue(work));
+    BOOST_CHECK(!queue.Enqueue([&nRun]() { nRun++; }));
+}
+
+BOOST_AUTO_TEST_CASE(rpc_json_writer)
+{
+    UniValue tx(UniValue::VOBJ);
+    tx.pushKV("txid", "ab\"cd");
+    tx.pushKV("amount", 1.5);
+    tx.pushKV("confirmations", 12);
+    UniValue vTx(UniValue::VARR);
+    for (int i = 0; i < 200; i++)
+        vTx.push_back(tx);
+    UniValue tree(UniValue::VOBJ);
+    tree.pushKV("empty", UniValue(UniValue::VARR));
+    tree.pushKV("tx", vTx);
+    tree.pushKV("fee", UniValue());
+
+    // Same text as writing the whole tree, handed over in small pieces
+    vector<string> vPieces;
+    CJSONWriter writer([&vPieces](const string& str) { vPieces.push_back(str); }, 256);
+    writer.BeginObject();
+    writer.Key("empty");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Key("tx");
+    writer.BeginArray();
+    for (int i = 0; i < 200; i++)
+    {
+        writer.BeginObject();
+        for (unsigned int j = 0; j < tx.size(); j++)
+            writer.Pair(tx.getKeys()[j], tx.getValues()[j]);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.Pair("fee", UniValue());
+    writer.EndObject();
+    BOOST_CHECK(writer.Started());
+    string strRest = writer.TakeBuffer();
+    BOOST_CHECK(strRest.size() < 256);
+    BOOST_CHECK(vPieces.size() > 10);
+
+    string strOut;
+    BOOST_FOREACH(const string& str, vPieces)
+    {
+        BOOST_CHECK(str.size() >= 256);
+        strOut += str;
+    }
+    BOOST_CHECK_EQUAL(writer.GetFlushedBytes(), strOut.size());
+    BOOST_CHECK_EQUAL(strOut + strRest, tree.write());
+
+    // A small document never reaches the sink
+    CJSONWriter small([&vPieces](const string& str) { vPieces.push_back(str); });
+    small.BeginArray();
+    small.Value(1);
+    small.Value("x");
+    small.EndArray();
+    BOOST_CHECK(!small.Started());
+    BOOST_CHECK_EQUAL(small.TakeBuffer(), "[1,\"x\"]");
+}
+
+BOOST_AUTO_TEST_CASE(rpc_read_chunked)
+{
+    map<string, string> mapHeaders;
+    string strMessage;
+    std::istringstream stream(
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "b\r\n{\"result\":[\r\n"
+        "1c\r\n1,2,3],\"error\":null,\"id\":1}\n\r\n"
+        "0\r\n\r\n"
+        "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n{}");
+    BOOST_CHECK_EQUAL(ReadHTTP(stream, mapHeaders, strMessage), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, "{\"result\":[1,2,3],\"error\":null,\"id\":1}\n");
+    BOOST_CHECK_EQUAL(mapHeaders["connection"], "keep-alive");
+
+    // The stream is left at the next reply on the connection
+    BOOST_CHECK_EQUAL(ReadHTTP(stream, mapHeaders, strMessage), HTTP_OK);
+    BOOST_CHECK_EQUAL(strMessage, "{}");
+
+    // A truncated chunked reply is an error, not a short result
+    std::istringstream truncated(
+        "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nab");
+    BOOST_CHECK_EQUAL(ReadHTTP(truncated, mapHeaders, strMessage), HTTP_INTERNAL_SERVER_ERROR);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_chain_snapshot)
+{
+    // Published with the block index, matching the globals it stands for
+    CChainSnapshotRef chain = GetChainSnapshot();
+    BOOST_REQUIRE(chain);
+    BOOST_CHECK(chain->pindexTip == pindexBest);
+    BOOST_CHECK(chain->hashTip == hashBestChain);
+    BOOST_CHECK_EQUAL(chain->nHeight, nBestHeight);
+
+    // A reader keeps the snapshot it took across a republication
+    {
+        LOCK(cs_main);
+        UpdateChainSnapshot();
+    }
+    BOOST_CHECK(GetChainSnapshot() != chain);
+    BOOST_CHECK(GetChainSnapshot()->hashTip == chain->hashTip);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_lock_stats)
+{
+    tableRPC.GetStats(true);
+
+    JSONRPCRequest request;
+    request.params = UniValue(UniValue::VARR);
+
+    // With cs_main held elsewhere, as while connecting a block, the snapshot
+    // readers answer at once and the locked commands queue behind it
+    CSemaphore semLocked(0);
+    boost::thread holder([&semLocked]() {
+        LOCK(cs_main);
+        semLocked.post();
+        MilliSleep(200);
+    });
+    semLocked.wait();
+
+    request.strMethod = "getblockcount";
+    BOOST_CHECK_EQUAL(tableRPC.execute(request).get_int(), nBestHeight);
+    request.strMethod = "getconnectioncount";
+    tableRPC.execute(request);
+    holder.join();
+
+    std::map<std::string, CRPCCommandStats> mapStats = tableRPC.GetStats(true);
+    BOOST_CHECK_EQUAL(mapStats["getblockcount"].nCalls, 1U);
+    BOOST_CHECK_EQUAL(mapStats["getblockcount"].nLockedCalls, 0U);
+    BOOST_CHECK_EQUAL(mapStats["getconnectioncount"].nLockedCalls, 1U);
+    BOOST_CHECK_EQUAL(mapStats["getconnectioncount"].nContended, 1U);
+    BOOST_CHECK(mapStats["getconnectioncount"].nLockWaitMicros > 0);
+    BOOST_CHECK(tableRPC.GetStats().empty());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch_parallel)
+{
+    // What an indexer sends: numbered getblock calls, here with one call
+    // that has to keep its place in the middle
+    static const int nCalls = 400;
+    UniValue vReq(UniValue::VARR);
+    for (int i = 0; i < nCalls; i++)
+    {
+        UniValue params(UniValue::VARR);
+        if (i != nCalls / 2)
+        {
+            params.push_back(hashBestChain.GetHex());
+            params.push_back(true);
+        }
+        vReq.push_back(JSONRPCRequestObj(i == nCalls / 2 ? "getconnectioncount" : "getblock", params, i));
+    }
+
+    CRPCWorkQueue queue(DEFAULT_RPC_WORKQUEUE);
+    boost::thread_group workers;
+    for (int i = 0; i < DEFAULT_RPC_THREADS; i++)
+        workers.create_thread([&queue]() {
+            CRPCWorkQueue::WorkItem work;
+            while (queue.Dequeue(work))
+                work();
+        });
+
+    int64_t nStart = GetTimeMicros();
+    string strSequential = JSONRPCExecBatch(vReq);
+    int64_t nSequential = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    string strParallel = JSONRPCExecBatch(vReq, &queue, DEFAULT_RPC_BATCH_PARALLEL);
+    int64_t nParallel = GetTimeMicros() - nStart;
+
+    queue.Interrupt();
+    workers.join_all();
+
+    // Same replies, in request order
+    BOOST_CHECK(strParallel == strSequential);
+    UniValue ret;
+    BOOST_REQUIRE(ret.read(strParallel));
+    BOOST_REQUIRE_EQUAL(ret.size(), (size_t)nCalls);
+    for (int i = 0; i < nCalls; i++)
+    {
+        BOOST_CHECK_EQUAL(find_value(ret[i].get_obj(), "id").get_int(), i);
+        BOOST_CHECK(find_value(ret[i].get_obj(), "error").isNull());
+    }
+
+    // With no room in the queue the caller answers everything itself
+    CRPCWorkQueue queueFull(0);
+    BOOST_CHECK(JSONRPCExecBatch(vReq, &queueFull, DEFAULT_RPC_BATCH_PARALLEL) == strSequential);
+
+    BOOST_TEST_MESSAGE(strprintf("Batch of %d getblock: sequential %.2f ms, %d threads %.2f ms",
+                                 nCalls, (double)nSequential / 1000,
+                                 DEFAULT_RPC_BATCH_PARALLEL, (double)nParallel / 1000));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
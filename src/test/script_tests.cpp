@@ -13,6 +13,7 @@
 #include "json/json_spirit_utils.h"
 
 #include "main.h"
+#include "random.h"
 #include "wallet.h"
 
 using namespace std;
@@ -22,6 +23,9 @@ using namespace boost::algorithm;
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
 extern bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                          bool fValidatePayToScriptHash, int nHashType);
+extern bool VerifyStandardScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
+                                 int nHashType, bool& fRet);
+extern bool CastToBool(const stackvaltype& vch);
 
 CScript
 ParseScript(string s)
@@ -180,18 +184,18 @@ BOOST_AUTO_TEST_CASE(script_PushData)
     static const unsigned char pushdata2[] = { OP_PUSHDATA2, 1, 0, 0x5a };
     static const unsigned char pushdata4[] = { OP_PUSHDATA4, 1, 0, 0, 0, 0x5a };
 
-    vector<vector<unsigned char> > directStack;
+    CScriptStack directStack;
     BOOST_CHECK(EvalScript(directStack, CScript(&direct[0], &direct[sizeof(direct)]), CTransaction(), 0, 0));
 
-    vector<vector<unsigned char> > pushdata1Stack;
+    CScriptStack pushdata1Stack;
     BOOST_CHECK(EvalScript(pushdata1Stack, CScript(&pushdata1[0], &pushdata1[sizeof(pushdata1)]), CTransaction(), 0, 0));
     BOOST_CHECK(pushdata1Stack == directStack);
 
-    vector<vector<unsigned char> > pushdata2Stack;
+    CScriptStack pushdata2Stack;
     BOOST_CHECK(EvalScript(pushdata2Stack, CScript(&pushdata2[0], &pushdata2[sizeof(pushdata2)]), CTransaction(), 0, 0));
     BOOST_CHECK(pushdata2Stack == directStack);
 
-    vector<vector<unsigned char> > pushdata4Stack;
+    CScriptStack pushdata4Stack;
     BOOST_CHECK(EvalScript(pushdata4Stack, CScript(&pushdata4[0], &pushdata4[sizeof(pushdata4)]), CTransaction(), 0, 0));
     BOOST_CHECK(pushdata4Stack == directStack);
 }
@@ -383,7 +387,7 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSigCopy || combined == scriptSig);
     // dummy scriptSigCopy with placeholder, should always choose non-placeholder:
-    scriptSigCopy = CScript() << OP_0 << static_cast<vector<unsigned char> >(pkSingle);
+    scriptSigCopy = CScript() << OP_0 << vector<unsigned char>(pkSingle.begin(), pkSingle.end());
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSig);
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSig, scriptSigCopy);
@@ -442,4 +446,202 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+// VerifyScript() as it was before the standard template fast path: the
+// reference the fast path is checked against.
+static bool
+VerifyScriptInterpreted(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn)
+{
+    CScriptStack stack, stackCopy;
+    if (!EvalScript(stack, scriptSig, txTo, nIn, 0))
+        return false;
+    stackCopy = stack;
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, 0))
+        return false;
+    if (stack.empty() || !CastToBool(stack.back()))
+        return false;
+
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        if (!scriptSig.IsPushOnly() || stackCopy.empty())
+            return false;
+        CScript pubKey2(stackCopy.back().begin(), stackCopy.back().end());
+        stackCopy.pop_back();
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, 0))
+            return false;
+        return !stackCopy.empty() && CastToBool(stackCopy.back());
+    }
+    return true;
+}
+
+// Randomly damages a script: flips, drops or inserts a byte, or reorders pushes.
+static CScript
+MutateScript(const CScript& script)
+{
+    CScript result(script);
+    switch (GetRandInt(5))
+    {
+    case 0:
+        if (!result.empty())
+            result[GetRandInt(result.size())] ^= (1 << GetRandInt(8));
+        break;
+    case 1:
+        if (!result.empty())
+            result.erase(result.begin() + GetRandInt(result.size()));
+        break;
+    case 2:
+        result.insert(result.begin() + GetRandInt(result.size() + 1), (unsigned char)GetRandInt(256));
+        break;
+    case 3:
+    {
+        // Swap the first two pushes
+        CScript::const_iterator pc = script.begin();
+        opcodetype opcode;
+        valtype vch1, vch2;
+        if (script.GetOp(pc, opcode, vch1) && script.GetOp(pc, opcode, vch2))
+            result = (CScript() << vch2 << vch1) + CScript(pc, script.end());
+        break;
+    }
+    default:
+        result << valtype(GetRandInt(80), (unsigned char)GetRandInt(256));
+        break;
+    }
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(script_standard_fastpath)
+{
+    // Differential test: VerifyScript() with its standard template fast path
+    // must agree with the plain interpreter on valid and damaged scripts.
+    CBasicKeyStore keystore;
+    vector<CKey> keys;
+    for (int i = 0; i < 3; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i != 1);
+        keys.push_back(key);
+        keystore.AddKey(key);
+    }
+
+    vector<CScript> scripts;
+    CScript script;
+    script.SetDestination(keys[0].GetPubKey().GetID());
+    scripts.push_back(script);
+    script = CScript() << keys[1].GetPubKey() << OP_CHECKSIG;
+    scripts.push_back(script);
+    script.SetMultisig(1, keys);
+    scripts.push_back(script);
+    script.SetMultisig(2, keys);
+    scripts.push_back(script);
+    unsigned int nBare = scripts.size();
+    for (unsigned int i = 0; i < nBare; i++)
+    {
+        keystore.AddCScript(scripts[i]);
+        script.SetDestination(scripts[i].GetID());
+        scripts.push_back(script);
+    }
+
+    int nFastPath = 0;
+    for (unsigned int i = 0; i < scripts.size(); i++)
+    {
+        CTransaction txFrom;
+        txFrom.vout.resize(1);
+        txFrom.vout[0].scriptPubKey = scripts[i];
+
+        CTransaction txTo;
+        txTo.vin.resize(1);
+        txTo.vout.resize(1);
+        txTo.vin[0].prevout.n = 0;
+        txTo.vin[0].prevout.hash = txFrom.GetHash();
+        txTo.vout[0].nValue = 1;
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+        CScript scriptSig = txTo.vin[0].scriptSig;
+
+        bool fRet;
+        BOOST_CHECK(VerifyStandardScript(scriptSig, scripts[i], txTo, 0, 0, fRet) && fRet);
+
+        for (int j = 0; j < 100; j++)
+        {
+            CScript scriptSigTest = (j == 0) ? scriptSig : MutateScript(scriptSig);
+            CScript scriptPubKeyTest = (j % 10 == 9) ? MutateScript(scripts[i]) : scripts[i];
+            CTransaction txTest = txTo;
+            if (j % 7 == 6)
+                txTest.vout[0].nValue++;
+
+            if (VerifyStandardScript(scriptSigTest, scriptPubKeyTest, txTest, 0, 0, fRet))
+                nFastPath++;
+            BOOST_CHECK_MESSAGE(VerifyScript(scriptSigTest, scriptPubKeyTest, txTest, 0, 0) ==
+                                VerifyScriptInterpreted(scriptSigTest, scriptPubKeyTest, txTest, 0),
+                                strprintf("script %u, round %d: %s / %s", i, j,
+                                          scriptSigTest.ToString().c_str(), scriptPubKeyTest.ToString().c_str()));
+        }
+    }
+    BOOST_CHECK(nFastPath > 0);
+}
+
+// Not a correctness test: times VerifyScript() over the standard script
+// templates so interpreter changes can be compared. Run with
+// --log_level=message to see the numbers.
+BOOST_AUTO_TEST_CASE(script_verify_benchmark)
+{
+    static const int nIterations = 2000;
+
+    CBasicKeyStore keystore;
+    vector<CKey> keys;
+    for (int i = 0; i < 3; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        keys.push_back(key);
+        keystore.AddKey(key);
+    }
+
+    CScript scriptP2PKH;
+    scriptP2PKH.SetDestination(keys[0].GetPubKey().GetID());
+    CScript scriptP2PK;
+    scriptP2PK << keys[1].GetPubKey() << OP_CHECKSIG;
+    CScript scriptMultisig;
+    scriptMultisig.SetMultisig(2, keys);
+    keystore.AddCScript(scriptP2PKH);
+    CScript scriptP2SH;
+    scriptP2SH.SetDestination(scriptP2PKH.GetID());
+
+    const CScript* scripts[] = { &scriptP2PKH, &scriptP2PK, &scriptMultisig, &scriptP2SH };
+    const char* names[] = { "P2PKH", "P2PK", "multisig 2-of-3", "P2SH(P2PKH)" };
+
+    for (int i = 0; i < 4; i++)
+    {
+        // A signature cache size of 0 stores nothing, so every iteration
+        // really checks the signatures; the cached figure comes after
+        mapArgs["-maxsigcachesize"] = "0";
+
+        CTransaction txFrom;
+        txFrom.vout.resize(1);
+        txFrom.vout[0].scriptPubKey = *scripts[i];
+
+        CTransaction txTo;
+        txTo.vin.resize(1);
+        txTo.vout.resize(1);
+        txTo.vin[0].prevout.n = 0;
+        txTo.vin[0].prevout.hash = txFrom.GetHash();
+        txTo.vout[0].nValue = 1;
+        BOOST_CHECK_MESSAGE(SignSignature(keystore, txFrom, txTo, 0), names[i]);
+
+        int64_t nStart = GetTimeMicros();
+        for (int j = 0; j < nIterations; j++)
+            BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, *scripts[i], txTo, 0, 0));
+        int64_t nElapsed = GetTimeMicros() - nStart;
+
+        mapArgs.erase("-maxsigcachesize");
+        BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, *scripts[i], txTo, 0, 0));
+        nStart = GetTimeMicros();
+        for (int j = 0; j < nIterations; j++)
+            BOOST_CHECK(VerifyScript(txTo.vin[0].scriptSig, *scripts[i], txTo, 0, 0));
+        int64_t nElapsedCached = GetTimeMicros() - nStart;
+
+        BOOST_TEST_MESSAGE(strprintf("VerifyScript %s: %d iterations, %.2f us/verify, %.2f us/verify cached",
+                                     names[i], nIterations, (double)nElapsed / nIterations,
+                                     (double)nElapsedCached / nIterations));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdint.h>
+
+#include "main.h"
+#include "serialize.h"
+#include "streams.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(serialize_tests)
+
+BOOST_AUTO_TEST_CASE(varints)
+{
+    // encode
+    CDataStream ss(SER_DISK, 0);
+    CDataStream::size_type size = 0;
+    for (int i = 0; i < 100000; i++) {
+        ss << VARINT(i);
+        size += ::GetSerializeSize(VARINT(i), 0, 0);
+        BOOST_CHECK(size == ss.size());
+    }
+
+    for (uint64_t i = 0;  i < 100000000000ULL; i += 999999937) {
+        ss << VARINT(i);
+        size += ::GetSerializeSize(VARINT(i), 0, 0);
+        BOOST_CHECK(size == ss.size());
+    }
+
+    // decode
+    for (int i = 0; i < 100000; i++) {
+        int j = -1;
+        ss >> VARINT(j);
+        BOOST_CHECK_MESSAGE(i == j, "decoded:" << j << " expected:" << i);
+    }
+
+    for (uint64_t i = 0;  i < 100000000000ULL; i += 999999937) {
+        uint64_t j = -1;
+        ss >> VARINT(j);
+        BOOST_CHECK_MESSAGE(i == j, "decoded:" << j << " expected:" << i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(varint_overflow)
+{
+    // Nine continuation bytes do not fit an unsigned int
+    CDataStream ss(SER_DISK, 0);
+    for (int i = 0; i < 9; i++)
+        ss << (unsigned char)0xff;
+    ss << (unsigned char)0x00;
+    unsigned int n;
+    BOOST_CHECK_THROW(ss >> VARINT(n), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(txindex_compact)
+{
+    CDiskTxPos pos(3, 123456789, 123456789 + 81);
+    CTxIndex txindex(pos, 20);
+    txindex.vSpent[0] = CDiskTxPos(3, 123500000, 123500000 + 500);
+    txindex.vSpent[9] = CDiskTxPos(4, 1000, 1081);
+    txindex.vSpent[19] = CDiskTxPos(1, 1, 1); // in-memory spend marker used by the mempool
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txindex;
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(txindex, SER_DISK, CLIENT_VERSION));
+
+    CTxIndex txindex2;
+    ss >> txindex2;
+    BOOST_CHECK(txindex2 == txindex);
+    BOOST_CHECK(ss.empty());
+
+    // The old encoding spent 12 bytes on every output, spent or not
+    BOOST_CHECK(::GetSerializeSize(txindex, SER_DISK, CLIENT_VERSION) <
+                ::GetSerializeSize(txindex.vSpent, SER_DISK, CLIENT_VERSION) / 4);
+
+    // Unspent outputs only cost their bit
+    CTxIndex txindexEmpty(pos, 8);
+    CTxIndex txindexEmpty2;
+    ss << txindexEmpty;
+    BOOST_CHECK_EQUAL(ss.size(), 3U + 6U + 1U + 1U);
+    ss >> txindexEmpty2;
+    BOOST_CHECK(txindexEmpty2 == txindexEmpty);
+}
+
+BOOST_AUTO_TEST_CASE(vector_writer_span_reader)
+{
+    CDiskTxPos pos(3, 123456789, 123456789 + 81);
+    CTxIndex txindex(pos, 5);
+    txindex.vSpent[2] = CDiskTxPos(4, 1000, 1081);
+
+    // Same bytes as CDataStream, written into a buffer the caller reuses
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair(string("txi"), uint256(1)) << txindex;
+    std::vector<char> vch;
+    for (int i = 0; i < 2; i++)
+    {
+        vch.clear();
+        CVectorWriter(SER_DISK, CLIENT_VERSION, vch) << make_pair(string("txi"), uint256(1)) << txindex;
+        BOOST_CHECK(std::vector<char>(ss.begin(), ss.end()) == vch);
+    }
+
+    CSpanReader reader(SER_DISK, CLIENT_VERSION, &vch[0], &vch[0] + vch.size());
+    pair<string, uint256> key;
+    CTxIndex txindex2;
+    reader >> key >> txindex2;
+    BOOST_CHECK(key.first == "txi" && key.second == uint256(1));
+    BOOST_CHECK(txindex2 == txindex);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> txindex2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
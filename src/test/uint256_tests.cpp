@@ -1,7 +1,98 @@
 #include <boost/test/unit_test.hpp>
 
+#include "bignum.h"
+#include "kernel.h"
+#include "main.h"
+#include "random.h"
 #include "uint256.h"
 
+using namespace std;
+
+extern uint256 bnProofOfWorkLimit;
+extern uint256 bnProofOfStakeLimit;
+extern unsigned int nTargetSpacing;
+
+// Random value of random length, so that small and large numbers are
+// both well covered
+static uint256 RandUint256()
+{
+    return GetRandHash() >> GetRandInt(257);
+}
+
+// Compact values around every size and sign/overflow boundary plus random ones
+static vector<unsigned int> CompactTestValues()
+{
+    static const unsigned int pnWords[] = { 0x000000, 0x000001, 0x00007f, 0x000080, 0x0000ff, 0x000100,
+                                            0x007fff, 0x008000, 0x00ffff, 0x010000, 0x123456, 0x7fffff,
+                                            0x800000, 0x800001, 0x80ffff, 0xffffff };
+    vector<unsigned int> vCompact;
+    for (unsigned int nSize = 0; nSize <= 40; nSize++)
+        for (unsigned int i = 0; i < sizeof(pnWords) / sizeof(pnWords[0]); i++)
+            vCompact.push_back((nSize << 24) | pnWords[i]);
+    for (int i = 0; i < 5000; i++)
+        vCompact.push_back((GetRandInt(40) << 24) | GetRandInt(0x1000000));
+    return vCompact;
+}
+
+// The CBigNum versions of the consensus code, kept to check the uint256
+// versions against
+static uint256 GetBlockTrustBigNum(unsigned int nBits)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    if (bnTarget <= 0)
+        return 0;
+    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+}
+
+static bool CheckProofOfWorkBigNum(uint256 hash, unsigned int nBits)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    if (bnTarget <= 0 || bnTarget > CBigNum(bnProofOfWorkLimit))
+        return false;
+    return hash <= bnTarget.getuint256();
+}
+
+static unsigned int ComputeMinWorkBigNum(unsigned int nBase, int64_t nTime)
+{
+    CBigNum bnTargetLimit(bnProofOfWorkLimit);
+    CBigNum bnResult;
+    bnResult.SetCompact(nBase);
+    bnResult *= 2;
+    while (nTime > 0 && bnResult < bnTargetLimit)
+    {
+        bnResult *= 2;
+        nTime -= 24 * 60 * 60;
+    }
+    if (bnResult > bnTargetLimit)
+        bnResult = bnTargetLimit;
+    return bnResult.GetCompact();
+}
+
+static unsigned int RetargetBigNum(unsigned int nBits, int64_t nActualSpacing, const uint256& bnLimit)
+{
+    static const int64_t nTargetTimespan = 20 * 60;
+    CBigNum bnTargetLimit(bnLimit);
+    if (nActualSpacing < 0)
+        nActualSpacing = nTargetSpacing;
+    CBigNum bnNew;
+    bnNew.SetCompact(nBits);
+    int64_t nInterval = nTargetTimespan / nTargetSpacing;
+    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
+    bnNew /= ((nInterval + 1) * nTargetSpacing);
+    if (bnNew <= 0 || bnNew > bnTargetLimit)
+        bnNew = bnTargetLimit;
+    return bnNew.GetCompact();
+}
+
+static bool CheckStakeKernelTargetBigNum(const uint256& hashProofOfStake, const uint256& bnCoinDayWeight, unsigned int nBits)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    return !(CBigNum(hashProofOfStake) > CBigNum(bnCoinDayWeight) * bnTargetPerCoinDay);
+}
+
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
 BOOST_AUTO_TEST_CASE(uint256_equality)
@@ -10,9 +101,129 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     uint256 num2 = 11;
     BOOST_CHECK(num1+1 == num2);
 
-    uint64 num3 = 10;
+    uint64_t num3 = 10;
     BOOST_CHECK(num1 == num3);
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_muldiv)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        uint256 a = RandUint256(), b = RandUint256();
+        BOOST_CHECK((a * b) == (CBigNum(a) * CBigNum(b)).getuint256());
+        BOOST_CHECK_EQUAL((int)a.bits(), CBigNum(a).bitSize());
+        if (b != 0)
+            BOOST_CHECK((a / b) == (CBigNum(a) / CBigNum(b)).getuint256());
+        uint64_t n = GetRand(std::numeric_limits<uint64_t>::max());
+        BOOST_CHECK((uint256(a) *= n) == (CBigNum(a) * CBigNum(uint256(n))).getuint256());
+        if (n != 0)
+            BOOST_CHECK((uint256(a) /= n) == (CBigNum(a) / CBigNum(uint256(n))).getuint256());
+    }
+
+    // Edge cases: wrapping, identities and division by zero
+    uint256 nMax = ~uint256(0);
+    BOOST_CHECK(nMax * nMax == 1);
+    BOOST_CHECK(nMax * 2 == nMax - 1);
+    BOOST_CHECK(nMax / nMax == 1);
+    BOOST_CHECK(nMax / 1 == nMax);
+    BOOST_CHECK(uint256(5) / 7 == 0);
+    BOOST_CHECK(uint256(0) / nMax == 0);
+    BOOST_CHECK((uint256(1) << 255) / (uint256(1) << 128) == (uint256(1) << 127));
+    BOOST_CHECK_EQUAL(uint256(0).bits(), 0U);
+    BOOST_CHECK_EQUAL(nMax.bits(), 256U);
+    BOOST_CHECK_THROW(nMax / 0, uint_error);
+}
+
+BOOST_AUTO_TEST_CASE(uint256_compact)
+{
+    const CBigNum bnMax(~uint256(0));
+    vector<unsigned int> vCompact = CompactTestValues();
+    BOOST_FOREACH(unsigned int nCompact, vCompact)
+    {
+        CBigNum bn;
+        bn.SetCompact(nCompact);
+        bool fNegative, fOverflow;
+        uint256 n;
+        n.SetCompact(nCompact, &fNegative, &fOverflow);
+
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        BOOST_CHECK_EQUAL(fOverflow, bn > bnMax || -bn > bnMax);
+        if (fOverflow)
+            continue;
+        BOOST_CHECK(n == bn.getuint256());
+        BOOST_CHECK_EQUAL(n.GetCompact(fNegative), bn.GetCompact());
+    }
+
+    for (int i = 0; i < 20000; i++)
+    {
+        uint256 n = RandUint256();
+        BOOST_CHECK_EQUAL(n.GetCompact(), CBigNum(n).GetCompact());
+        BOOST_CHECK_EQUAL(n.GetCompact(true), (-CBigNum(n)).GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(uint256_consensus_equivalence)
+{
+    vector<unsigned int> vCompact = CompactTestValues();
+    BOOST_FOREACH(unsigned int nCompact, vCompact)
+    {
+        CBlockIndex index;
+        index.nBits = nCompact;
+        BOOST_CHECK(index.GetBlockTrust() == GetBlockTrustBigNum(nCompact));
+
+        uint256 hash = RandUint256();
+        BOOST_CHECK_EQUAL(CheckProofOfWork(hash, nCompact), CheckProofOfWorkBigNum(hash, nCompact));
+        uint256 bnTarget = uint256().SetCompact(nCompact);
+        BOOST_CHECK_EQUAL(CheckProofOfWork(bnTarget, nCompact), CheckProofOfWorkBigNum(bnTarget, nCompact));
+        BOOST_CHECK_EQUAL(CheckProofOfWork(bnTarget + 1, nCompact), CheckProofOfWorkBigNum(bnTarget + 1, nCompact));
+    }
+
+    // Minimum work and retargeting from every target up to the limits
+    for (int i = 0; i < 5000; i++)
+    {
+        unsigned int nBase = (bnProofOfWorkLimit >> GetRandInt(256)).GetCompact();
+        int64_t nTime = GetRandInt(60 * 24 * 60 * 60);
+        BOOST_CHECK_EQUAL(ComputeMinWork(nBase, nTime), ComputeMinWorkBigNum(nBase, nTime));
+
+        bool fProofOfStake = GetRandInt(2);
+        CBlockIndex index[3];
+        for (int j = 0; j < 3; j++)
+        {
+            index[j].pprev = j ? &index[j - 1] : NULL;
+            index[j].nFlags = fProofOfStake ? CBlockIndex::BLOCK_PROOF_OF_STAKE : 0;
+            index[j].nBits = vCompact[GetRandInt(vCompact.size())];
+        }
+        index[1].nTime = GetRandInt(std::numeric_limits<int>::max());
+        index[2].nTime = GetRandInt(2) ? index[1].nTime + GetRandInt(1000) : GetRandInt(std::numeric_limits<int>::max());
+        if (GetRandInt(2))
+            index[2].nBits = (bnProofOfWorkLimit >> GetRandInt(256)).GetCompact();
+        BOOST_CHECK_EQUAL(GetNextTargetRequired(&index[2], fProofOfStake),
+                          RetargetBigNum(index[2].nBits, (int64_t)index[2].nTime - index[1].nTime,
+                                         fProofOfStake ? bnProofOfStakeLimit : bnProofOfWorkLimit));
+    }
+
+    // Kernel targets, including weighted targets wider than 256 bits and
+    // hashes right at the boundary
+    for (int i = 0; i < 20000; i++)
+    {
+        uint256 bnCoinDayWeight = GetRandHash() >> GetRandInt(257);
+        unsigned int nBits = vCompact[GetRandInt(vCompact.size())];
+        uint256 hash = RandUint256();
+        BOOST_CHECK_EQUAL(CheckStakeKernelTarget(hash, bnCoinDayWeight, nBits),
+                          CheckStakeKernelTargetBigNum(hash, bnCoinDayWeight, nBits));
+        uint256 bnTarget = bnCoinDayWeight * uint256().SetCompact(nBits);
+        for (int j = -1; j <= 1; j++)
+        {
+            hash = bnTarget;
+            if (j < 0)
+                hash -= 1;
+            if (j > 0)
+                hash += 1;
+            BOOST_CHECK_EQUAL(CheckStakeKernelTarget(hash, bnCoinDayWeight, nBits),
+                              CheckStakeKernelTargetBigNum(hash, bnCoinDayWeight, nBits));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
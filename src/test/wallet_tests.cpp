@@ -1,5 +1,7 @@
 #include <boost/test/unit_test.hpp>
 
+#include "db.h"
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -292,4 +294,293 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(wallet_order_index)
+{
+    CWallet orderWallet;
+    CKey keyA, keyB;
+    keyA.MakeNewKey(true);
+    keyB.MakeNewKey(true);
+    orderWallet.SetAddressBookName(keyA.GetPubKey().GetID(), "alice");
+
+    // Three transactions paying alice, bob's unlabelled key and alice again,
+    // inserted out of order
+    int64_t vOrderPos[] = { 2, 0, 1 };
+    CKeyID vDest[] = { keyA.GetPubKey().GetID(), keyB.GetPubKey().GetID(), keyA.GetPubKey().GetID() };
+    vector<uint256> vHash;
+    for (int i = 0; i < 3; i++)
+    {
+        CTransaction tx;
+        tx.nLockTime = i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey.SetDestination(vDest[i]);
+        CWalletTx wtx(&orderWallet, tx);
+        wtx.nOrderPos = vOrderPos[i];
+        vHash.push_back(wtx.GetHash());
+        orderWallet.mapWallet[wtx.GetHash()] = wtx;
+    }
+    orderWallet.BuildOrderIndex();
+
+    LOCK(orderWallet.cs_wallet);
+    const CWallet::TxItems& txAll = orderWallet.GetOrderedTxItems();
+    BOOST_CHECK_EQUAL(txAll.size(), 3U);
+    int64_t nLast = -1;
+    BOOST_FOREACH(const CWallet::TxItems::value_type& item, txAll)
+    {
+        BOOST_CHECK(item.first > nLast);
+        BOOST_CHECK_EQUAL(item.second.first->nOrderPos, item.first);
+        nLast = item.first;
+    }
+
+    BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems("alice").size(), 2U);
+    BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems("").size(), 3U); // strFromAccount is "" too
+    BOOST_CHECK(orderWallet.GetOrderedTxItems("carol").empty());
+
+    // Relabelling moves transactions between accounts
+    orderWallet.SetAddressBookName(keyB.GetPubKey().GetID(), "bob");
+    const CWallet::TxItems& txBob = orderWallet.GetOrderedTxItems("bob");
+    BOOST_CHECK_EQUAL(txBob.size(), 1U);
+    BOOST_CHECK(txBob.begin()->second.first->GetHash() == vHash[1]);
+
+    // Accounting entries are listed under their own account
+    CAccountingEntry acentry;
+    acentry.strAccount = "bob";
+    acentry.nOrderPos = 3;
+    orderWallet.laccentries.push_back(acentry);
+    orderWallet.BuildOrderIndex();
+    BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems("bob").size(), 2U);
+    BOOST_CHECK(orderWallet.GetOrderedTxItems("bob").rbegin()->second.second != NULL);
+    BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems().size(), 4U);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_order_index_updates)
+{
+    // File backed, so order positions and entries are written as in use
+    CWallet orderWallet("wallet_order.dat");
+    bool fFirstRun;
+    orderWallet.LoadWallet(fFirstRun);
+    CKey keyA;
+    keyA.MakeNewKey(true);
+    orderWallet.SetAddressBookName(keyA.GetPubKey().GetID(), "alice");
+
+    vector<uint256> vHash;
+    for (int i = 0; i < 3; i++)
+    {
+        CTransaction tx;
+        tx.nLockTime = i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey.SetDestination(keyA.GetPubKey().GetID());
+        CWalletTx wtx(&orderWallet, tx);
+        BOOST_CHECK(orderWallet.AddToWallet(wtx));
+        vHash.push_back(wtx.GetHash());
+
+        // The first query builds the per-account index; later additions
+        // must be added to it as well
+        LOCK(orderWallet.cs_wallet);
+        BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems("alice").size(), (unsigned int)i + 1);
+    }
+    {
+        LOCK(orderWallet.cs_wallet);
+        const CWallet::TxItems& txAll = orderWallet.GetOrderedTxItems();
+        BOOST_CHECK_EQUAL(txAll.size(), 3U);
+        int i = 0;
+        BOOST_FOREACH(const CWallet::TxItems::value_type& item, txAll)
+            BOOST_CHECK(item.second.first->GetHash() == vHash[i++]);
+    }
+
+    CAccountingEntry acentry;
+    acentry.strAccount = "alice";
+    acentry.nCreditDebit = 5;
+    acentry.nOrderPos = orderWallet.IncOrderPosNext();
+    BOOST_CHECK(orderWallet.AddAccountingEntry(acentry));
+    {
+        LOCK(orderWallet.cs_wallet);
+        BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems("alice").size(), 4U);
+        BOOST_CHECK(orderWallet.GetOrderedTxItems("alice").rbegin()->second.second != NULL);
+        BOOST_CHECK(orderWallet.GetOrderedTxItems("bob").empty());
+    }
+
+    // An entry written in a batch that fails to commit is never listed
+    CAccountingEntry acentryLost = acentry;
+    acentryLost.nOrderPos = orderWallet.IncOrderPosNext();
+    {
+        CWalletBatch batch(&orderWallet);
+        BOOST_CHECK(orderWallet.WriteAccountingEntry(acentryLost));
+        bitdb.SetMockTxnFail(true);
+        BOOST_CHECK(!batch.Commit());
+        bitdb.SetMockTxnFail(false);
+    }
+    list<CAccountingEntry> lEntries;
+    CWalletDB("wallet_order.dat").ListAccountCreditDebit("alice", lEntries);
+    BOOST_CHECK_EQUAL(lEntries.size(), 1U);
+
+    // Erasing drops a transaction from every view
+    BOOST_CHECK(orderWallet.EraseFromWallet(vHash[0]));
+    {
+        LOCK(orderWallet.cs_wallet);
+        BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems().size(), 3U);
+        BOOST_CHECK_EQUAL(orderWallet.GetOrderedTxItems("alice").size(), 3U);
+        BOOST_FOREACH(const CWallet::TxItems::value_type& item, orderWallet.GetOrderedTxItems())
+            BOOST_CHECK(!item.second.first || item.second.first->GetHash() != vHash[0]);
+    }
+}
+
+// Exposes the raw-key encryption calls, to lock and unlock without the
+// passphrase stretching and file rewrite of EncryptWallet
+class CTestHDWallet : public CWallet
+{
+public:
+    CTestHDWallet(const string& strWalletFileIn) : CWallet(strWalletFileIn) {}
+    bool EncryptKeysRaw(CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::EncryptKeys(vMasterKeyIn); }
+    bool UnlockRaw(const CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::Unlock(vMasterKeyIn); }
+};
+
+BOOST_AUTO_TEST_CASE(wallet_hd_keypool)
+{
+    mapArgs["-keypool"] = "5";
+    bool fFirstRun;
+    vector<CPubKey> vChild;
+    {
+        CTestHDWallet hdWallet("wallet_hd.dat");
+        hdWallet.LoadWallet(fFirstRun);
+        BOOST_CHECK(hdWallet.SetHDMasterKey(hdWallet.GenerateNewKey()));
+        BOOST_CHECK(hdWallet.IsHDEnabled());
+
+        // Filling the pool derives children of m/0' and writes only the counter
+        BOOST_CHECK(hdWallet.TopUpKeyPool());
+        BOOST_CHECK_EQUAL(hdWallet.GetKeyPoolSize(), 6U);
+        BOOST_CHECK_EQUAL(hdWallet.hdChain.nExternalChainCounter, 6U);
+        for (unsigned int i = 0; i < 12; i++)
+        {
+            CExtPubKey extPubKeyChild;
+            BOOST_CHECK(hdWallet.hdChain.extPubKey.Derive(extPubKeyChild, i));
+            vChild.push_back(extPubKeyChild.pubkey);
+        }
+        CKey key;
+        for (unsigned int i = 0; i < 6; i++)
+        {
+            BOOST_CHECK(hdWallet.HaveKey(vChild[i].GetID()));
+            BOOST_CHECK(hdWallet.GetKey(vChild[i].GetID(), key));
+            BOOST_CHECK(key.GetPubKey() == vChild[i]);
+        }
+        BOOST_CHECK(!hdWallet.HaveKey(vChild[6].GetID()));
+
+        CPubKey pubkey;
+        BOOST_CHECK(hdWallet.GetKeyFromPool(pubkey, false));
+        BOOST_CHECK(pubkey == vChild[0]);
+
+        // A payment to child 3 uses up 1 to 3 as well; the lookahead moves
+        // past it and the pool is refilled to 4..9
+        CTransaction tx;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1;
+        tx.vout[0].scriptPubKey.SetDestination(vChild[3].GetID());
+        BOOST_CHECK(hdWallet.AddToWallet(CWalletTx(&hdWallet, tx)));
+        BOOST_CHECK_EQUAL(hdWallet.GetKeyPoolSize(), 6U);
+        BOOST_CHECK_EQUAL(hdWallet.hdChain.nExternalChainCounter, 10U);
+        BOOST_CHECK(hdWallet.HaveKey(vChild[9].GetID()));
+
+        // Locked, no HD child can be derived, not even one used before
+        CKeyingMaterial vMasterKey(32, 0x5a);
+        BOOST_CHECK(hdWallet.EncryptKeysRaw(vMasterKey));
+        BOOST_CHECK(hdWallet.Lock());
+        BOOST_CHECK(hdWallet.HaveKey(vChild[2].GetID()));
+        BOOST_CHECK(!hdWallet.GetKey(vChild[2].GetID(), key));
+        BOOST_CHECK(hdWallet.UnlockRaw(vMasterKey));
+        BOOST_CHECK(hdWallet.GetKey(vChild[2].GetID(), key));
+        BOOST_CHECK(key.GetPubKey() == vChild[2]);
+        BOOST_CHECK(hdWallet.Lock());
+        BOOST_CHECK(!hdWallet.GetKey(vChild[2].GetID(), key));
+
+        // Public keys need no unlocking, so the pool still fills while locked
+        BOOST_CHECK(hdWallet.TopUpKeyPool(6));
+        BOOST_CHECK_EQUAL(hdWallet.hdChain.nExternalChainCounter, 11U);
+    }
+
+    // On load the children are derived again from the stored counter, and
+    // the pool is everything after the last key in use, not just new keys
+    {
+        CTestHDWallet hdWallet("wallet_hd.dat");
+        hdWallet.LoadWallet(fFirstRun);
+        BOOST_CHECK(hdWallet.IsHDEnabled());
+        BOOST_CHECK_EQUAL(hdWallet.hdChain.nExternalChainCounter, 11U);
+        BOOST_CHECK(hdWallet.HaveKey(vChild[0].GetID()));
+        BOOST_CHECK(hdWallet.HaveKey(vChild[10].GetID()));
+        BOOST_CHECK(!hdWallet.HaveKey(vChild[11].GetID()));
+        BOOST_CHECK_EQUAL(hdWallet.GetKeyPoolSize(), 7U);
+
+        CPubKey pubkey;
+        BOOST_CHECK(hdWallet.GetKeyFromPool(pubkey, false));
+        BOOST_CHECK(pubkey == vChild[4]);
+    }
+    mapArgs.erase("-keypool");
+}
+
+BOOST_AUTO_TEST_CASE(wallet_hd_encrypt_new_seed)
+{
+    mapArgs["-keypool"] = "5";
+    bool fFirstRun;
+    CTestHDWallet hdWallet("wallet_hd_encrypt.dat");
+    hdWallet.LoadWallet(fFirstRun);
+    BOOST_CHECK(hdWallet.SetHDMasterKey(hdWallet.GenerateNewKey()));
+    BOOST_CHECK(hdWallet.TopUpKeyPool());
+    CKeyID oldMasterKeyID = hdWallet.hdChain.masterKeyID;
+    CExtPubKey oldExtPubKey = hdWallet.hdChain.extPubKey;
+    vector<CPubKey> vOldChild;
+    for (unsigned int i = 0; i < 6; i++)
+    {
+        CExtPubKey extPubKeyChild;
+        BOOST_CHECK(oldExtPubKey.Derive(extPubKeyChild, i));
+        vOldChild.push_back(extPubKeyChild.pubkey);
+    }
+
+    // The old seed was on disk in the clear, so encrypting moves the pool
+    // to a new one
+    SecureString strPassphrase("hd encrypt test");
+    BOOST_CHECK(hdWallet.EncryptWallet(strPassphrase));
+    BOOST_CHECK(hdWallet.IsHDEnabled());
+    BOOST_CHECK(hdWallet.hdChain.masterKeyID != oldMasterKeyID);
+    BOOST_CHECK_EQUAL(hdWallet.hdChain.nExternalChainCounter, 5U);
+
+    CExtPubKey extPubKeyChild;
+    BOOST_CHECK(hdWallet.hdChain.extPubKey.Derive(extPubKeyChild, 0));
+    CPubKey pubkey;
+    BOOST_CHECK(hdWallet.GetKeyFromPool(pubkey, false));
+    BOOST_CHECK(pubkey == extPubKeyChild.pubkey);
+    BOOST_CHECK(find(vOldChild.begin(), vOldChild.end(), pubkey) == vOldChild.end());
+
+    // The old children are still the wallet's, and spendable once unlocked
+    CKey key;
+    BOOST_CHECK(hdWallet.HaveKey(vOldChild[5].GetID()));
+    BOOST_CHECK(!hdWallet.GetKey(vOldChild[5].GetID(), key));
+    BOOST_CHECK(hdWallet.Unlock(strPassphrase));
+    BOOST_CHECK(hdWallet.GetKey(vOldChild[5].GetID(), key));
+    BOOST_CHECK(key.GetPubKey() == vOldChild[5]);
+    BOOST_CHECK(hdWallet.Lock());
+    mapArgs.erase("-keypool");
+}
+
+BOOST_AUTO_TEST_CASE(wallet_batch_commit_fail)
+{
+    set<CKeyID> setKeysBefore;
+    pwalletMain->GetKeys(setKeysBefore);
+    unsigned int nPoolBefore = pwalletMain->GetKeyPoolSize();
+
+    // A keypool refill that fails to commit leaves no keys and no pool
+    // entries behind to be handed out
+    bitdb.SetMockTxnFail(true);
+    BOOST_CHECK_THROW(pwalletMain->TopUpKeyPool(nPoolBefore + 10), runtime_error);
+    bitdb.SetMockTxnFail(false);
+    set<CKeyID> setKeysAfter;
+    pwalletMain->GetKeys(setKeysAfter);
+    BOOST_CHECK(setKeysAfter == setKeysBefore);
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nPoolBefore);
+
+    // Once committed, the pool entries are on disk and their keys known
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nPoolBefore + 10));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nPoolBefore + 11);
+    set<CKeyID> setReserveKeys;
+    BOOST_CHECK_NO_THROW(pwalletMain->GetAllReserveKeys(setReserveKeys));
+    BOOST_CHECK_EQUAL(setReserveKeys.size(), nPoolBefore + 11);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread/tss.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -93,7 +94,18 @@ CTxDB::CTxDB(const char* pszMode)
         ReadVersion(nVersion);
         LogPrintf("Transaction index version is %d\n", nVersion);
 
-        if (nVersion < DATABASE_VERSION)
+        if (nVersion >= DATABASE_VERSION_TXINDEX_UPGRADE && nVersion < DATABASE_VERSION)
+        {
+            LogPrintf("Required index version is %d, upgrading transaction index\n", DATABASE_VERSION);
+
+            UpgradeTxIndex();
+
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(DATABASE_VERSION); // Save transaction index version
+            fReadOnly = fTmp;
+        }
+        else if (nVersion < DATABASE_VERSION)
         {
             LogPrintf("Required index version is %d, removing old database\n", DATABASE_VERSION);
 
@@ -123,6 +135,88 @@ CTxDB::CTxDB(const char* pszMode)
     LogPrintf("Opened LevelDB successfully\n");
 }
 
+// CTxIndex as stored under "tx" before DATABASE_VERSION 70510: a full
+// CDiskTxPos for the transaction and for every one of its outputs.
+class CTxIndexV1
+{
+public:
+    CDiskTxPos pos;
+    std::vector<CDiskTxPos> vSpent;
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(pos);
+        READWRITE(vSpent);
+    )
+};
+
+// Rewrite every "tx" record into the compact CTxIndex encoding under "txi".
+// Each batch erases the records it converted, so an interrupted upgrade
+// picks up where it stopped on the next start.
+void CTxDB::UpgradeTxIndex()
+{
+    int64_t nStart = GetTimeMillis();
+    unsigned int nUpgraded = 0;
+    uint64_t nOldBytes = 0, nNewBytes = 0;
+
+    leveldb::WriteBatch batch;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("tx"), uint256(0));
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        leveldb::Slice slKey = iterator->key(), slValue = iterator->value();
+        CSpanReader ssKey(SER_DISK, CLIENT_VERSION, slKey.data(), slKey.data() + slKey.size());
+        string strType;
+        uint256 hash;
+        ssKey >> strType;
+        if (strType != "tx")
+            break;
+        ssKey >> hash;
+
+        CSpanReader ssValue(SER_DISK, CLIENT_VERSION, slValue.data(), slValue.data() + slValue.size());
+        CTxIndexV1 txindexOld;
+        ssValue >> txindexOld;
+
+        CTxIndex txindex;
+        txindex.pos = txindexOld.pos;
+        txindex.vSpent.swap(txindexOld.vSpent);
+
+        CDataStream ssNewKey(SER_DISK, CLIENT_VERSION);
+        ssNewKey << make_pair(string("txi"), hash);
+        CDataStream ssNewValue(SER_DISK, CLIENT_VERSION);
+        ssNewValue << txindex;
+
+        batch.Put(ssNewKey.str(), ssNewValue.str());
+        batch.Delete(iterator->key());
+        nOldBytes += iterator->value().size();
+        nNewBytes += ssNewValue.size();
+
+        if (++nUpgraded % 10000 == 0)
+        {
+            leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+                throw runtime_error(strprintf("CTxDB::UpgradeTxIndex() : %s", status.ToString().c_str()));
+            batch.Clear();
+            LogPrintf("Upgraded %u transaction index entries\n", nUpgraded);
+        }
+    }
+    delete iterator;
+
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        throw runtime_error(strprintf("CTxDB::UpgradeTxIndex() : %s", status.ToString().c_str()));
+
+    // Reclaim the space of the old records now rather than whenever
+    // compaction gets around to it
+    pdb->CompactRange(NULL, NULL);
+
+    LogPrintf("Upgraded %u transaction index entries (%u kB -> %u kB) in %dms\n", nUpgraded,
+              (unsigned int)(nOldBytes / 1024), (unsigned int)(nNewBytes / 1024), GetTimeMillis() - nStart);
+}
+
 void CTxDB::Close()
 {
     delete txdb;
@@ -155,9 +249,17 @@ bool CTxDB::TxnCommit()
     return true;
 }
 
+CTxDB::CTxDBBuffers& CTxDB::GetBuffers()
+{
+    static boost::thread_specific_ptr<CTxDBBuffers> txdbBuffers;
+    if (txdbBuffers.get() == NULL)
+        txdbBuffers.reset(new CTxDBBuffers());
+    return *txdbBuffers;
+}
+
 class CBatchScanner : public leveldb::WriteBatch::Handler {
 public:
-    std::string needle;
+    leveldb::Slice needle;
     bool *deleted;
     std::string *foundValue;
     bool foundEntry;
@@ -165,15 +267,15 @@ public:
     CBatchScanner() : foundEntry(false) {}
 
     virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
+        if (key == needle) {
             foundEntry = true;
             *deleted = false;
-            *foundValue = value.ToString();
+            foundValue->assign(value.data(), value.size());
         }
     }
 
     virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
+        if (key == needle) {
             foundEntry = true;
             *deleted = true;
         }
@@ -185,11 +287,11 @@ public:
 // a database transaction begins reads are consistent with it. It would be good
 // to change that assumption in future and avoid the performance hit, though in
 // practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
+bool CTxDB::ScanBatch(const leveldb::Slice &key, string *value, bool *deleted) const {
     assert(activeBatch);
     *deleted = false;
     CBatchScanner scanner;
-    scanner.needle = key.str();
+    scanner.needle = key;
     scanner.deleted = deleted;
     scanner.foundValue = value;
     leveldb::Status status = activeBatch->Iterate(&scanner);
@@ -203,13 +305,13 @@ bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
     txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
+    return Read(make_pair(string("txi"), hash), txindex);
 }
 
 bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
 {
     assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
+    return Write(make_pair(string("txi"), hash), txindex);
 }
 
 bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
@@ -219,7 +321,7 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
     // Add to tx index
     uint256 hash = tx.GetHash();
     CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    return Write(make_pair(string("txi"), hash), txindex);
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -227,13 +329,13 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
-    return Erase(make_pair(string("tx"), hash));
+    return Erase(make_pair(string("txi"), hash));
 }
 
 bool CTxDB::ContainsTx(uint256 hash)
 {
     assert(!fClient);
-    return Exists(make_pair(string("tx"), hash));
+    return Exists(make_pair(string("txi"), hash));
 }
 
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
@@ -307,6 +409,149 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
+bool CTxDB::ReadAddressIndexFlag(bool& fIndexed)
+{
+    fIndexed = false;
+    return Read(string("fAddressIndex"), fIndexed);
+}
+
+bool CTxDB::WriteAddressIndexFlag(bool fIndexed)
+{
+    return Write(string("fAddressIndex"), fIndexed);
+}
+
+bool CTxDB::UpdateAddressIndex(const AddressIndexVector& vEntries)
+{
+    for (AddressIndexVector::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it)
+        if (!Write(make_pair(string("addr"), it->first), it->second))
+            return false;
+    return true;
+}
+
+bool CTxDB::EraseAddressIndex(const AddressIndexVector& vEntries)
+{
+    for (AddressIndexVector::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it)
+        if (!Erase(make_pair(string("addr"), it->first)))
+            return false;
+    return true;
+}
+
+bool CTxDB::UpdateAddressUnspentIndex(const AddressUnspentVector& vEntries)
+{
+    // Applied in order: an output created and spent within the same update
+    // is written and then erased
+    for (AddressUnspentVector::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it)
+    {
+        bool fOk = it->second.IsNull() ? Erase(make_pair(string("addru"), it->first))
+                                       : Write(make_pair(string("addru"), it->first), it->second);
+        if (!fOk)
+            return false;
+    }
+    return true;
+}
+
+bool CTxDB::ReadAddressIndex(unsigned char nType, const uint160& hashBytes, AddressIndexVector& vEntries,
+                             int nStart, int nEnd)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("addr"), CAddressIndexKey(nType, hashBytes, nStart, 0, 0, false));
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        leveldb::Slice slKey = iterator->key(), slValue = iterator->value();
+        CSpanReader ssKey(SER_DISK, CLIENT_VERSION, slKey.data(), slKey.data() + slKey.size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "addr")
+            break;
+        CAddressIndexKey key;
+        ssKey >> key;
+        if (key.nAddressType != nType || key.hashBytes != hashBytes || (nEnd >= 0 && key.nHeight > nEnd))
+            break;
+
+        CSpanReader ssValue(SER_DISK, CLIENT_VERSION, slValue.data(), slValue.data() + slValue.size());
+        int64_t nValue;
+        ssValue >> nValue;
+        vEntries.push_back(make_pair(key, nValue));
+    }
+    bool fOk = iterator->status().ok();
+    delete iterator;
+    return fOk;
+}
+
+bool CTxDB::ReadAddressUnspentIndex(unsigned char nType, const uint160& hashBytes, AddressUnspentVector& vEntries)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("addru"), CAddressUnspentKey(nType, hashBytes, 0, 0));
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        leveldb::Slice slKey = iterator->key(), slValue = iterator->value();
+        CSpanReader ssKey(SER_DISK, CLIENT_VERSION, slKey.data(), slKey.data() + slKey.size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "addru")
+            break;
+        CAddressUnspentKey key;
+        ssKey >> key;
+        if (key.nAddressType != nType || key.hashBytes != hashBytes)
+            break;
+
+        CSpanReader ssValue(SER_DISK, CLIENT_VERSION, slValue.data(), slValue.data() + slValue.size());
+        CAddressUnspentValue value;
+        ssValue >> value;
+        vEntries.push_back(make_pair(key, value));
+    }
+    bool fOk = iterator->status().ok();
+    delete iterator;
+    return fOk;
+}
+
+// Erase every record under one key type, in batches of 10000
+static bool WipeKeyType(leveldb::DB *pdb, const string& strKeyType, unsigned int& nErased)
+{
+    leveldb::WriteBatch batch;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << strKeyType;
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        leveldb::Slice slKey = iterator->key();
+        CSpanReader ssKey(SER_DISK, CLIENT_VERSION, slKey.data(), slKey.data() + slKey.size());
+        string strType;
+        ssKey >> strType;
+        if (strType != strKeyType)
+            break;
+        batch.Delete(slKey);
+        if (++nErased % 10000 == 0)
+        {
+            leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+            {
+                delete iterator;
+                return error("WipeKeyType() : %s", status.ToString().c_str());
+            }
+            batch.Clear();
+        }
+    }
+    delete iterator;
+
+    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok())
+        return error("WipeKeyType() : %s", status.ToString().c_str());
+    return true;
+}
+
+bool CTxDB::WipeAddressIndex()
+{
+    assert(!activeBatch);
+    unsigned int nErased = 0;
+    if (!WriteAddressIndexFlag(false) || !WipeKeyType(pdb, "addr", nErased) || !WipeKeyType(pdb, "addru", nErased))
+        return false;
+    LogPrintf("Erased %u address index records\n", nErased);
+    return true;
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -345,11 +590,11 @@ bool CTxDB::LoadBlockIndex()
     // Now read each entry.
     while (iterator->Valid())
     {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
+        // Unpack keys and values in place; the slices stay valid until the
+        // iterator moves on.
+        leveldb::Slice slKey = iterator->key(), slValue = iterator->value();
+        CSpanReader ssKey(SER_DISK, CLIENT_VERSION, slKey.data(), slKey.data() + slKey.size());
+        CSpanReader ssValue(SER_DISK, CLIENT_VERSION, slValue.data(), slValue.data() + slValue.size());
         string strType;
         ssKey >> strType;
         // Did we reach the end of the data to read?
@@ -16,6 +16,127 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Kind of destination an address index record belongs to */
+enum AddressIndexType
+{
+    ADDRESS_INDEX_KEYHASH = 1,
+    ADDRESS_INDEX_SCRIPTHASH = 2,
+};
+
+/** Key of one credit or debit of an address. The height is stored big-endian
+ * so that an address's records sort by height and can be read as a range. */
+class CAddressIndexKey
+{
+public:
+    unsigned char nAddressType;
+    uint160 hashBytes;
+    int nHeight;
+    uint256 txid;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey() { SetNull(); }
+
+    CAddressIndexKey(unsigned char nAddressTypeIn, const uint160& hashBytesIn, int nHeightIn,
+                     const uint256& txidIn, unsigned int nIndexIn, bool fSpendingIn) :
+        nAddressType(nAddressTypeIn), hashBytes(hashBytesIn), nHeight(nHeightIn),
+        txid(txidIn), nIndex(nIndexIn), fSpending(fSpendingIn) { }
+
+    void SetNull()
+    {
+        nAddressType = 0;
+        hashBytes = 0;
+        nHeight = 0;
+        txid = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        unsigned char vchHeight[4];
+        vchHeight[0] = nHeight >> 24;
+        vchHeight[1] = nHeight >> 16;
+        vchHeight[2] = nHeight >> 8;
+        vchHeight[3] = nHeight;
+        READWRITE(nAddressType);
+        READWRITE(hashBytes);
+        READWRITE(FLATDATA(vchHeight));
+        READWRITE(txid);
+        READWRITE(nIndex);
+        READWRITE(fSpending);
+        if (fRead)
+            const_cast<CAddressIndexKey*>(this)->nHeight =
+                (vchHeight[0] << 24) | (vchHeight[1] << 16) | (vchHeight[2] << 8) | vchHeight[3];
+    )
+};
+
+/** Key of an unspent output paying an address */
+class CAddressUnspentKey
+{
+public:
+    unsigned char nAddressType;
+    uint160 hashBytes;
+    uint256 txid;
+    unsigned int nIndex;
+
+    CAddressUnspentKey() : nAddressType(0), hashBytes(0), txid(0), nIndex(0) { }
+
+    CAddressUnspentKey(unsigned char nAddressTypeIn, const uint160& hashBytesIn, const uint256& txidIn, unsigned int nIndexIn) :
+        nAddressType(nAddressTypeIn), hashBytes(hashBytesIn), txid(txidIn), nIndex(nIndexIn) { }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nAddressType);
+        READWRITE(hashBytes);
+        READWRITE(txid);
+        READWRITE(nIndex);
+    )
+};
+
+/** The output itself, and the height of the block that created it. A null
+ * value in an update erases the key. */
+class CAddressUnspentValue
+{
+public:
+    int64_t nValue;
+    CScript script;
+    int nHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+
+    CAddressUnspentValue(int64_t nValueIn, const CScript& scriptIn, int nHeightIn) :
+        nValue(nValueIn), script(scriptIn), nHeight(nHeightIn) { }
+
+    void SetNull()
+    {
+        nValue = -1;
+        script.clear();
+        nHeight = 0;
+    }
+
+    bool IsNull() const { return nValue == -1; }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nHeight);
+    )
+};
+
+typedef std::vector<std::pair<CAddressIndexKey, int64_t> > AddressIndexVector;
+typedef std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > AddressUnspentVector;
+
+/** Address index records for connecting tx at nHeight; inputs holds the
+ * transactions it spends from (defined in main.cpp) */
+void GetAddressIndexConnect(const CTransaction& tx, const MapPrevTx& inputs, int nHeight,
+                            AddressIndexVector& vIndex, AddressUnspentVector& vUnspent);
+/** The records to take back out when tx is disconnected, restoring the
+ * outputs it spent at the heights in mapInputHeights */
+bool GetAddressIndexDisconnect(const CTransaction& tx, const MapPrevTx& inputs, const std::map<uint256, int>& mapInputHeights,
+                               int nHeight, AddressIndexVector& vIndex, AddressUnspentVector& vUnspent);
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -51,33 +172,50 @@ private:
     bool fReadOnly;
     int nVersion;
 
+    // Scratch buffers reused by every Read/Write/Erase/Exists on the calling
+    // thread, so the hot paths do not allocate a fresh stream per record.
+    struct CTxDBBuffers
+    {
+        std::vector<char> vchKey;
+        std::vector<char> vchValue;
+        std::string strValue;
+    };
+    static CTxDBBuffers& GetBuffers();
+
 protected:
     // Returns true and sets (value,false) if activeBatch contains the given key
     // or leaves value alone and sets deleted = true if activeBatch contains a
     // delete for it.
-    bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
+    bool ScanBatch(const leveldb::Slice &key, std::string *value, bool *deleted) const;
+
+    template<typename K>
+    static leveldb::Slice SerializeKey(const K& key, std::vector<char>& vchKey)
+    {
+        vchKey.clear();
+        CVectorWriter(SER_DISK, CLIENT_VERSION, vchKey) << key;
+        return leveldb::Slice(vchKey.data(), vchKey.size());
+    }
 
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        std::string strValue;
+        CTxDBBuffers& buffers = GetBuffers();
+        leveldb::Slice slKey = SerializeKey(key, buffers.vchKey);
+        std::string& strValue = buffers.strValue;
 
         bool readFromDb = true;
         if (activeBatch) {
             // First we must search for it in the currently pending set of
             // changes to the db. If not found in the batch, go on to read disk.
             bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
+            readFromDb = ScanBatch(slKey, &strValue, &deleted) == false;
             if (deleted) {
                 return false;
             }
         }
         if (readFromDb) {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
+                                              slKey, &strValue);
             if (!status.ok()) {
                 if (status.IsNotFound())
                     return false;
@@ -88,8 +226,7 @@ protected:
         }
         // Unserialize value
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
-                                SER_DISK, CLIENT_VERSION);
+            CSpanReader ssValue(SER_DISK, CLIENT_VERSION, strValue.data(), strValue.data() + strValue.size());
             ssValue >> value;
         }
         catch (std::exception &e) {
@@ -104,18 +241,18 @@ protected:
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(10000);
-        ssValue << value;
+        CTxDBBuffers& buffers = GetBuffers();
+        leveldb::Slice slKey = SerializeKey(key, buffers.vchKey);
+        std::vector<char>& vchValue = buffers.vchValue;
+        vchValue.clear();
+        CVectorWriter(SER_DISK, CLIENT_VERSION, vchValue) << value;
+        leveldb::Slice slValue(vchValue.data(), vchValue.size());
 
         if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
+            activeBatch->Put(slKey, slValue);
             return true;
         }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
+        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), slKey, slValue);
         if (!status.ok()) {
             printf("LevelDB write failure: %s\n", status.ToString().c_str());
             return false;
@@ -131,34 +268,30 @@ protected:
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
+        leveldb::Slice slKey = SerializeKey(key, GetBuffers().vchKey);
         if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
+            activeBatch->Delete(slKey);
             return true;
         }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
+        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), slKey);
         return (status.ok() || status.IsNotFound());
     }
 
     template<typename K>
     bool Exists(const K& key)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
-        ssKey << key;
-        std::string unused;
+        CTxDBBuffers& buffers = GetBuffers();
+        leveldb::Slice slKey = SerializeKey(key, buffers.vchKey);
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
+            if (ScanBatch(slKey, &buffers.strValue, &deleted) && !deleted) {
                 return true;
             }
         }
 
 
-        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
+        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), slKey, &buffers.strValue);
         return status.IsNotFound() == false;
     }
 
@@ -203,8 +336,23 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+
+    // Address index (-addressindex). The update functions go through the
+    // active batch like every other write; the reads scan the database
+    // directly and so do not see uncommitted changes.
+    bool ReadAddressIndexFlag(bool& fIndexed);
+    bool WriteAddressIndexFlag(bool fIndexed);
+    bool UpdateAddressIndex(const AddressIndexVector& vEntries);
+    bool EraseAddressIndex(const AddressIndexVector& vEntries);
+    bool UpdateAddressUnspentIndex(const AddressUnspentVector& vEntries);
+    // Records of heights nStart to nEnd; a negative nEnd has no upper bound
+    bool ReadAddressIndex(unsigned char nType, const uint160& hashBytes, AddressIndexVector& vEntries,
+                          int nStart = 0, int nEnd = -1);
+    bool ReadAddressUnspentIndex(unsigned char nType, const uint160& hashBytes, AddressUnspentVector& vEntries);
+    bool WipeAddressIndex();
 private:
     bool LoadBlockIndexGuts();
+    void UpgradeTxIndex();
 };
 
 
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "notifysocket.h"
 #include "txmempool.h"
 // #include "txdb-leveldb.h"
 #include "wallet.h"
@@ -176,6 +177,8 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     LogPrintf("CTxMemPool::accept() : accepted %s (poolsz %u)\n",
            hash.ToString().substr(0,10).c_str(),
            mapTx.size());
+
+    NotifyTransaction(tx);
     return true;
 }
 
@@ -185,7 +188,11 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
     {
+        LOCK(cs);
+        if (mapTx.count(hash))
+            nTotalTxSize -= ::GetSerializeSize(mapTx[hash], SER_NETWORK, PROTOCOL_VERSION);
         mapTx[hash] = tx;
+        nTotalTxSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
@@ -211,6 +218,7 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
             }
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                     mapNextTx.erase(txin.prevout);
+            nTotalTxSize -= ::GetSerializeSize(mapTx[hash], SER_NETWORK, PROTOCOL_VERSION);
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -238,6 +246,7 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    nTotalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
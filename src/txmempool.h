@@ -19,6 +19,11 @@ public:
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    CTxMemPool()
+    {
+        nTotalTxSize = 0;
+    }
+
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
     bool addUnchecked(const uint256& hash, CTransaction &tx);
@@ -34,6 +39,13 @@ public:
         return mapTx.size();
     }
 
+    /** Serialized size of all transactions in the pool */
+    uint64_t GetTotalTxSize()
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     bool exists(uint256 hash)
     {
         return (mapTx.count(hash) != 0);
@@ -43,6 +55,9 @@ public:
     {
         return mapTx[hash];
     }
+
+private:
+    uint64_t nTotalTxSize;
 };
 
 #endif // BITCOIN_TXMEMPOOL_H
@@ -11,7 +11,9 @@
 #include "base58.h"
 #include "kernel.h"
 #include "coincontrol.h"
+#include "notifysocket.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include "script.h"
 #include "spork.h"
 #include "darksend.h"
@@ -36,6 +38,24 @@ struct CompareValueOnly
     }
 };
 
+// Run func(nBegin, nEnd) over [0, nSize), split across the cores with at
+// least nMinPerThread items to a thread
+static void ParallelForRange(size_t nSize, size_t nMinPerThread, const boost::function<void (size_t, size_t)>& func)
+{
+    size_t nThreads = min((size_t)max(boost::thread::hardware_concurrency(), 1U), nSize / nMinPerThread + 1);
+    if (nThreads == 1)
+    {
+        func(0, nSize);
+        return;
+    }
+
+    boost::thread_group threadGroup;
+    size_t nPerThread = (nSize + nThreads - 1) / nThreads;
+    for (size_t nBegin = 0; nBegin < nSize; nBegin += nPerThread)
+        threadGroup.create_thread(boost::bind(func, nBegin, min(nBegin + nPerThread, nSize)));
+    threadGroup.join_all();
+}
+
 CPubKey CWallet::GenerateNewKey()
 {
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
@@ -48,17 +68,50 @@ CPubKey CWallet::GenerateNewKey()
     if (fCompressed)
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
+    return AddGeneratedKey(key);
+}
+
+CPubKey CWallet::AddGeneratedKey(const CKey& key)
+{
+    LOCK(cs_wallet);
+    CKeyMetadata meta(GetTime());
+    vector<unsigned char> vchCryptedSecret;
+    if (!WriteNewKey(key, meta, vchCryptedSecret))
+        throw std::runtime_error("CWallet::AddGeneratedKey() : AddKey failed");
+    LoadNewKey(key, meta, vchCryptedSecret);
+    return key.GetPubKey();
+}
+
+// Write a new key and its metadata to the open batch, or a handle of its own,
+// without adding it to the keystore. An encrypted wallet gets the encrypted
+// secret back in vchCryptedSecret.
+bool CWallet::WriteNewKey(const CKey& key, const CKeyMetadata& meta, vector<unsigned char>& vchCryptedSecret)
+{
+    AssertLockHeld(cs_wallet);
+
     CPubKey pubkey = key.GetPubKey();
+    if (IsCrypted() && !EncryptKey(key, vchCryptedSecret))
+        return false;
+    if (!fFileBacked)
+        return true;
+    CWalletDB* pwalletdb = pwalletdbBatch ? pwalletdbBatch : new CWalletDB(strWalletFile);
+    bool fRet = IsCrypted() ? pwalletdb->WriteCryptedKey(pubkey, vchCryptedSecret, meta) :
+                              pwalletdb->WriteKey(pubkey, key.GetPrivKey(), meta);
+    if (pwalletdb != pwalletdbBatch)
+        delete pwalletdb;
+    return fRet;
+}
 
-    // Create new metadata
-    int64_t nCreationTime = GetTime();
-    mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
-    if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
-        nTimeFirstKey = nCreationTime;
+// Add a key stored by WriteNewKey to the keystore, once it is on disk
+void CWallet::LoadNewKey(const CKey& key, const CKeyMetadata& meta, const vector<unsigned char>& vchCryptedSecret)
+{
+    AssertLockHeld(cs_wallet);
 
-    if (!AddKey(key))
-        throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
-    return key.GetPubKey();
+    LoadKeyMetadata(key.GetPubKey(), meta);
+    if (vchCryptedSecret.empty())
+        CCryptoKeyStore::AddKey(key);
+    else
+        CCryptoKeyStore::AddCryptedKey(key.GetPubKey(), vchCryptedSecret);
 }
 
 bool CWallet::AddKey(const CKey& key)
@@ -69,9 +122,14 @@ bool CWallet::AddKey(const CKey& key)
         return false;
     if (!fFileBacked)
         return true;
-    if (!IsCrypted())
+    if (IsCrypted())
+        return true;
+    {
+        LOCK(cs_wallet);
+        if (pwalletdbBatch)
+            return pwalletdbBatch->WriteKey(pubkey, key.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey, key.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
-    return true;
+    }
 }
 
 bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char> &vchCryptedSecret)
@@ -84,6 +142,8 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
         LOCK(cs_wallet);
         if (pwalletdbEncryption)
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbBatch)
+            return pwalletdbBatch->WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
         else
             return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey, vchCryptedSecret, mapKeyMetadata[vchPubKey.GetID()]);
     }
@@ -110,7 +170,333 @@ bool CWallet::AddCScript(const CScript& redeemScript)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    LOCK(cs_wallet);
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteCScript(Hash160(redeemScript.begin(), redeemScript.end()), redeemScript);
+    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript.begin(), redeemScript.end()), redeemScript);
+}
+
+bool CWallet::HaveKey(const CKeyID &address) const
+{
+    {
+        LOCK(cs_KeyStore);
+        if (mapHDKeyIndex.count(address))
+            return true;
+    }
+    return CCryptoKeyStore::HaveKey(address);
+}
+
+bool CWallet::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const
+{
+    {
+        LOCK(cs_KeyStore);
+        map<CKeyID, uint32_t>::const_iterator mi = mapHDKeyIndex.find(address);
+        if (mi != mapHDKeyIndex.end())
+        {
+            vchPubKeyOut = vHDPubKeys[mi->second];
+            return true;
+        }
+    }
+    return CCryptoKeyStore::GetPubKey(address, vchPubKeyOut);
+}
+
+void CWallet::GetKeys(set<CKeyID> &setAddress) const
+{
+    CCryptoKeyStore::GetKeys(setAddress);
+    LOCK(cs_KeyStore);
+    for (map<CKeyID, uint32_t>::const_iterator mi = mapHDKeyIndex.begin(); mi != mapHDKeyIndex.end(); ++mi)
+        setAddress.insert(mi->first);
+}
+
+bool CWallet::GetKey(const CKeyID &address, CKey& keyOut) const
+{
+    LOCK(cs_KeyStore);
+    map<CKeyID, uint32_t>::const_iterator mi = mapHDKeyIndex.find(address);
+    if (mi == mapHDKeyIndex.end())
+        return CCryptoKeyStore::GetKey(address, keyOut);
+    if (GetCachedKey(address, keyOut))
+        return true;
+
+    CSecret vchSecret;
+    if (!DeriveHDKey(mi->second, vchSecret))
+        return false;
+    CacheKey(vHDPubKeys[mi->second], vchSecret);
+    return keyOut.SetKeyPair(vchSecret, vHDPubKeys[mi->second]);
+}
+
+// Private key of child nChild of the external chain, m/0'/nChild
+bool CWallet::DeriveHDKey(uint32_t nChild, CSecret& vchSecret) const
+{
+    AssertLockHeld(cs_KeyStore);
+
+    if (extKeyHDAccount.key.IsNull())
+    {
+        CKey keyMaster;
+        if (!CCryptoKeyStore::GetKey(hdChain.masterKeyID, keyMaster))
+            return false; // locked
+        bool fCompressed;
+        CSecret vchSeed = keyMaster.GetSecret(fCompressed);
+        CExtKey extKeyMaster;
+        extKeyMaster.SetMaster(&vchSeed[0], vchSeed.size());
+        if (!extKeyMaster.Derive(extKeyHDAccount, 0x80000000))
+            return error("DeriveHDKey() : deriving the external chain failed");
+    }
+
+    CExtKey extKeyChild;
+    if (!extKeyHDAccount.Derive(extKeyChild, nChild))
+        return error("DeriveHDKey() : deriving child %u failed", nChild);
+    if (extKeyChild.key.GetPubKey() != vHDPubKeys[nChild])
+        return error("DeriveHDKey() : child %u does not match its public key", nChild);
+    bool fCompressed;
+    vchSecret = extKeyChild.key.GetSecret(fCompressed);
+    return true;
+}
+
+static void DeriveHDPubKeyRange(const CExtPubKey* pextPubKey, vector<CPubKey>* pvPubKey, uint32_t nOffset, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        CExtPubKey extPubKeyChild;
+        if (pextPubKey->Derive(extPubKeyChild, nOffset + i))
+            (*pvPubKey)[i] = extPubKeyChild.pubkey;
+    }
+}
+
+// Derive the public keys of every child up to nEnd that is not known yet.
+// A point multiplication each, so spread over the cores: a wallet that has
+// handed out many addresses does this for all of them at load.
+bool CWallet::DeriveHDPubKeys(uint32_t nEnd)
+{
+    uint32_t nBegin;
+    {
+        LOCK(cs_KeyStore);
+        nBegin = vHDPubKeys.size();
+    }
+    if (nEnd <= nBegin)
+        return true;
+    if (nEnd > 0x80000000)
+        return error("DeriveHDPubKeys() : external chain exhausted");
+
+    vector<CPubKey> vPubKey(nEnd - nBegin);
+    ParallelForRange(vPubKey.size(), 100, boost::bind(&DeriveHDPubKeyRange, &hdChain.extPubKey, &vPubKey, nBegin, _1, _2));
+
+    LOCK(cs_KeyStore);
+    for (uint32_t i = 0; i < vPubKey.size(); i++)
+    {
+        // Invalid children have odds below 1 in 2^127; not worth skipping
+        if (!vPubKey[i].IsValid())
+            return error("DeriveHDPubKeys() : deriving child %u failed", nBegin + i);
+        vHDPubKeys.push_back(vPubKey[i]);
+        mapHDKeyIndex[vPubKey[i].GetID()] = nBegin + i;
+    }
+    return true;
+}
+
+bool CWallet::WriteHDChain(const CHDChain& chain)
+{
+    if (!fFileBacked)
+        return true;
+    LOCK(cs_wallet);
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteHDChain(chain);
+    return CWalletDB(strWalletFile).WriteHDChain(chain);
+}
+
+bool CWallet::SetHDMasterKey(const CPubKey& pubkey)
+{
+    LOCK(cs_wallet);
+
+    // The keys of a seed are not stored, so a seed can never be replaced
+    if (IsHDEnabled())
+        return error("SetHDMasterKey() : wallet already has an HD seed");
+
+    CKey keyMaster;
+    if (!CCryptoKeyStore::GetKey(pubkey.GetID(), keyMaster))
+        return false;
+    bool fCompressed;
+    CSecret vchSeed = keyMaster.GetSecret(fCompressed);
+    CExtKey extKeyMaster, extKeyAccount;
+    extKeyMaster.SetMaster(&vchSeed[0], vchSeed.size());
+    if (!extKeyMaster.Derive(extKeyAccount, 0x80000000))
+        return false;
+
+    CHDChain chain;
+    chain.masterKeyID = pubkey.GetID();
+    chain.extPubKey = extKeyAccount.Neuter();
+    SetMinVersion(FEATURE_HD);
+    if (!WriteHDChain(chain))
+        return false;
+
+    // Random keys already in the pool stay in the wallet but are not handed out
+    BOOST_FOREACH(int64_t nIndex, setKeyPool)
+        KeepKey(nIndex);
+    setKeyPool.clear();
+
+    hdChain = chain;
+    return true;
+}
+
+// A transaction paying a key from the HD pool means that key, and every key
+// handed out before it, is in use: take them out of the pool so the lookahead
+// window moves past them. This is how a rescan of a restored wallet finds
+// addresses beyond the stored counter.
+void CWallet::MarkHDKeysUsed(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+
+    bool fUsed = false;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        CTxDestination address;
+        const CKeyID* pkeyID;
+        if (!ExtractDestination(txout.scriptPubKey, address) || (pkeyID = boost::get<CKeyID>(&address)) == NULL)
+            continue;
+
+        uint32_t nChild;
+        {
+            LOCK(cs_KeyStore);
+            map<CKeyID, uint32_t>::const_iterator mi = mapHDKeyIndex.find(*pkeyID);
+            if (mi == mapHDKeyIndex.end())
+                continue;
+            nChild = mi->second;
+        }
+        while (!setKeyPool.empty() && *setKeyPool.begin() <= nChild)
+        {
+            setKeyPool.erase(setKeyPool.begin());
+            fUsed = true;
+        }
+    }
+    if (fUsed)
+        TopUpKeyPool();
+}
+
+// Moves nFirstUnused past dest if it is a key of the HD chain
+void CWallet::UpdateHDFirstUnused(const CTxDestination& dest, uint32_t& nFirstUnused) const
+{
+    const CKeyID* pkeyID = boost::get<CKeyID>(&dest);
+    if (!pkeyID)
+        return;
+    LOCK(cs_KeyStore);
+    map<CKeyID, uint32_t>::const_iterator mi = mapHDKeyIndex.find(*pkeyID);
+    if (mi != mapHDKeyIndex.end() && mi->second >= nFirstUnused)
+        nFirstUnused = mi->second + 1;
+}
+
+// The HD pool is not stored. After loading it is every derived child past
+// the last one the wallet shows in use: its default key, the address book,
+// or an output of a wallet transaction. Keys handed out after that and
+// never used come out again rather than being skipped.
+void CWallet::LoadHDKeyPool()
+{
+    AssertLockHeld(cs_wallet);
+
+    uint32_t nFirstUnused = 0;
+    if (vchDefaultKey.IsValid())
+        UpdateHDFirstUnused(vchDefaultKey.GetID(), nFirstUnused);
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, string)& item, mapAddressBook)
+        UpdateHDFirstUnused(item.first, nFirstUnused);
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        BOOST_FOREACH(const CTxOut& txout, it->second.vout)
+        {
+            CTxDestination address;
+            if (ExtractDestination(txout.scriptPubKey, address))
+                UpdateHDFirstUnused(address, nFirstUnused);
+        }
+    }
+
+    setKeyPool.clear();
+    for (uint32_t i = nFirstUnused; i < hdChain.nExternalChainCounter; i++)
+        setKeyPool.insert(i);
+}
+
+// Move to a new HD seed. The children derived from the old one become
+// ordinary keys, so payments to them are still recognised and spendable,
+// but no new address comes from the old seed again. Needs the wallet
+// unlocked.
+bool CWallet::NewHDMasterKey()
+{
+    LOCK(cs_wallet);
+
+    if (!IsHDEnabled())
+        return false;
+
+    vector<CKey> vKey(hdChain.nExternalChainCounter);
+    for (uint32_t i = 0; i < vKey.size(); i++)
+    {
+        CPubKey pubkey;
+        {
+            LOCK(cs_KeyStore);
+            pubkey = vHDPubKeys[i];
+        }
+        if (!GetKey(pubkey.GetID(), vKey[i]))
+            return error("NewHDMasterKey() : deriving child %u failed", i);
+    }
+
+    // The children are as old as the seed, so a rescan still covers them
+    CKeyMetadata meta;
+    map<CKeyID, CKeyMetadata>::const_iterator mi = mapKeyMetadata.find(hdChain.masterKeyID);
+    if (mi != mapKeyMetadata.end())
+        meta = mi->second;
+    vector<vector<unsigned char> > vCryptedSecret(vKey.size());
+    {
+        CWalletBatch batch(this);
+        for (unsigned int i = 0; i < vKey.size(); i++)
+            if (!WriteNewKey(vKey[i], meta, vCryptedSecret[i]))
+                return error("NewHDMasterKey() : writing child %u failed", i);
+        if (!batch.Commit())
+            return error("NewHDMasterKey() : committing the old children failed");
+    }
+    for (unsigned int i = 0; i < vKey.size(); i++)
+        LoadNewKey(vKey[i], meta, vCryptedSecret[i]);
+
+    {
+        LOCK(cs_KeyStore);
+        vHDPubKeys.clear();
+        mapHDKeyIndex.clear();
+        extKeyHDAccount.key.Reset();
+    }
+    setKeyPool.clear();
+    hdChain.SetNull();
+    return SetHDMasterKey(GenerateNewKey());
+}
+
+bool CWallet::Lock()
+{
+    {
+        LOCK(cs_KeyStore);
+        extKeyHDAccount.key.Reset();
+    }
+    return CCryptoKeyStore::Lock();
+}
+
+// After a staking-only unlock these are the only keys that get used, so
+// decrypt them up front rather than on the staker's first kernel hit
+void CWallet::CacheStakingKeys()
+{
+    if (!IsCrypted())
+        return;
+
+    int64_t nStart = GetTimeMillis();
+    vector<COutput> vCoins;
+    set<CKeyID> setKeyIDs;
+    LOCK2(cs_main, cs_wallet);
+    AvailableCoinsMinConf(vCoins, nCoinbaseMaturity + 10);
+
+    BOOST_FOREACH(const COutput& out, vCoins)
+    {
+        CTxDestination address;
+        const CKeyID* pkeyID;
+        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address) && (pkeyID = boost::get<CKeyID>(&address)) != NULL)
+            setKeyIDs.insert(*pkeyID);
+    }
+
+    unsigned int nCached = 0;
+    CKey key;
+    BOOST_FOREACH(const CKeyID& keyID, setKeyIDs)
+        if (GetKey(keyID, key))
+            nCached++;
+    LogPrintf("CacheStakingKeys() : %u of %u staking keys cached in %dms\n", nCached, setKeyIDs.size(), GetTimeMillis() - nStart);
 }
 
 // optional setting to unlock wallet for staking only
@@ -213,6 +599,8 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
 
     if (fFileBacked)
     {
+        if (!pwalletdbIn)
+            pwalletdbIn = pwalletdbBatch;
         CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
         if (nWalletVersion > 40000)
             pwalletdb->WriteMinVersion(nWalletVersion);
@@ -302,6 +690,10 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 
         Lock();
         Unlock(strWalletPassphrase);
+        // The HD seed has been on disk unencrypted, and is in every backup
+        // made so far: new addresses come from a new one
+        if (IsHDEnabled() && !NewHDMasterKey())
+            LogPrintf("EncryptWallet() : replacing the HD seed failed\n");
         NewKeyPool();
         Lock();
 
@@ -318,6 +710,8 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
 {
     int64_t nRet = nOrderPosNext++;
+    if (!pwalletdb)
+        pwalletdb = pwalletdbBatch;
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
     } else {
@@ -326,28 +720,120 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+// The accounts an activity log entry can be listed under. For a transaction
+// this is a superset, which listtransactions narrows down: the account it was
+// sent from and the label of everything it pays, ours or not.
+void CWallet::GetOrderedItemAccounts(const TxPair& item, set<string>& setAccounts) const
 {
-    CWalletDB walletdb(strWalletFile);
+    if (item.second)
+    {
+        setAccounts.insert(item.second->strAccount);
+        return;
+    }
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    const CWalletTx* pwtx = item.first;
+    setAccounts.insert(pwtx->strFromAccount);
+    BOOST_FOREACH(const CTxOut& txout, pwtx->vout)
+    {
+        CTxDestination address;
+        map<CTxDestination, string>::const_iterator mi;
+        if (ExtractDestination(txout.scriptPubKey, address) && (mi = mapAddressBook.find(address)) != mapAddressBook.end())
+            setAccounts.insert(mi->second);
+        else
+            setAccounts.insert("");
+    }
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+void CWallet::AddToOrderIndex(const TxItems::value_type& item)
+{
+    wtxOrdered.insert(item);
+    if (!fAccountOrderedValid)
+        return;
+
+    set<string> setAccounts;
+    GetOrderedItemAccounts(item.second, setAccounts);
+    BOOST_FOREACH(const string& strAccount, setAccounts)
+        mapAccountOrdered[strAccount].insert(item);
+}
+
+void CWallet::EraseFromOrderIndex(const CWalletTx* pwtx)
+{
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
     {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        if (it->second.first == pwtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    InvalidateAccountOrdered();
+}
+
+void CWallet::InvalidateAccountOrdered()
+{
+    mapAccountOrdered.clear();
+    fAccountOrderedValid = false;
+}
+
+void CWallet::BuildOrderIndex()
+{
+    LOCK(cs_wallet);
+    wtxOrdered.clear();
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        wtxOrdered.insert(make_pair(it->second.nOrderPos, TxPair(&it->second, (CAccountingEntry*)0)));
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    InvalidateAccountOrdered();
+}
+
+const CWallet::TxItems& CWallet::GetOrderedTxItems(const string& strAccount)
+{
+    AssertLockHeld(cs_wallet);
+    if (strAccount == "*")
+        return wtxOrdered;
+
+    if (!fAccountOrderedValid)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        mapAccountOrdered.clear();
+        for (TxItems::const_iterator it = wtxOrdered.begin(); it != wtxOrdered.end(); ++it)
+        {
+            set<string> setAccounts;
+            GetOrderedItemAccounts(it->second, setAccounts);
+            BOOST_FOREACH(const string& strItemAccount, setAccounts)
+                mapAccountOrdered[strItemAccount].insert(mapAccountOrdered[strItemAccount].end(), *it);
+        }
+        fAccountOrderedValid = true;
     }
 
-    return txOrdered;
+    static const TxItems txEmpty;
+    map<string, TxItems>::const_iterator mi = mapAccountOrdered.find(strAccount);
+    return mi == mapAccountOrdered.end() ? txEmpty : mi->second;
+}
+
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
+{
+    LOCK(cs_wallet);
+    if (!WriteAccountingEntry(acentry))
+        return false;
+    LoadAccountingEntry(acentry);
+    return true;
+}
+
+bool CWallet::WriteAccountingEntry(const CAccountingEntry& acentry)
+{
+    LOCK(cs_wallet);
+    if (!fFileBacked)
+        return true;
+    return pwalletdbBatch ? pwalletdbBatch->WriteAccountingEntry(acentry) : CWalletDB(strWalletFile).WriteAccountingEntry(acentry);
+}
+
+void CWallet::LoadAccountingEntry(const CAccountingEntry& acentry)
+{
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    AddToOrderIndex(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
@@ -418,6 +904,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            AddToOrderIndex(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+            if (IsHDEnabled())
+                MarkHDKeysUsed(wtx);
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -429,9 +918,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -520,6 +1007,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
+        NotifyWalletTransaction(wtx, fInsertedNew ? CT_NEW : CT_UPDATED);
 
         // notify an external script when a wallet transaction comes in or is updated
         std::string strCmd = GetArg("-walletnotify", "");
@@ -564,8 +1052,16 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            EraseFromOrderIndex(&mi->second);
+            mapWallet.erase(mi);
+            if (pwalletdbBatch)
+                pwalletdbBatch->EraseTx(hash);
+            else
+                CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return true;
 }
@@ -844,6 +1340,9 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 
 bool CWalletTx::WriteToDisk()
 {
+    LOCK(pwallet->cs_wallet);
+    if (pwallet->pwalletdbBatch)
+        return pwallet->pwalletdbBatch->WriteTx(GetHash(), *this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
@@ -2175,24 +2674,24 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, ui
         }
 
         int64_t nTimeWeight = GetWeight((int64_t)pcoin.first->nTime, (int64_t)GetTime());
-        CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
 
-        // Weight is greater than zero
-        if (nTimeWeight > 0)
-        {
-            nWeight += bnCoinDayWeight.getuint64();
-        }
+        // Only coins with a weight greater than zero count
+        if (nTimeWeight <= 0)
+            continue;
+
+        uint256 bnCoinDayWeight = uint256(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+        nWeight += bnCoinDayWeight.Get64();
 
         // Weight is greater than zero, but the maximum value isn't reached yet
-        if (nTimeWeight > 0 && nTimeWeight < nStakeMaxAge)
+        if (nTimeWeight < nStakeMaxAge)
         {
-            nMinWeight += bnCoinDayWeight.getuint64();
+            nMinWeight += bnCoinDayWeight.Get64();
         }
 
         // Maximum weight was reached
         if (nTimeWeight == nStakeMaxAge)
         {
-            nMaxWeight += bnCoinDayWeight.getuint64();
+            nMaxWeight += bnCoinDayWeight.Get64();
         }
     }
 
@@ -2202,9 +2701,6 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, ui
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
-    CBigNum bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-
     txNew.vin.clear();
     txNew.vout.clear();
 
@@ -2482,10 +2978,8 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString().c_str());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+            // The key, the new transaction and the spent coins are written together
+            CWalletBatch batch(this);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -2505,8 +2999,9 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
-            if (fFileBacked)
-                delete pwalletdb;
+            // The transaction is in memory as sent and its coins as spent
+            if (!batch.Commit())
+                return AbortNode("CommitTransaction() : writing transaction to wallet failed");
         }
 
         // Track how many getdata requests our transaction gets
@@ -2752,6 +3247,23 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return DB_LOAD_OK;
     fFirstRunRet = false;
     DBErrors nLoadWalletRet = CWalletDB(strWalletFile,"cr+").LoadWallet(this);
+
+    if (nLoadWalletRet == DB_LOAD_OK || nLoadWalletRet == DB_NONCRITICAL_ERROR)
+    {
+        LOCK(cs_wallet);
+        laccentries.clear();
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+        BuildOrderIndex();
+
+        if (IsHDEnabled())
+        {
+            int64_t nStart = GetTimeMillis();
+            if (!DeriveHDPubKeys(hdChain.nExternalChainCounter))
+                return DB_CORRUPT;
+            LogPrintf("Derived %u HD keys in %dms\n", hdChain.nExternalChainCounter, GetTimeMillis() - nStart);
+            LoadHDKeyPool();
+        }
+    }
     if (nLoadWalletRet == DB_NEED_REWRITE)
     {
         if (CDB::Rewrite(strWalletFile, "\x04pool"))
@@ -2775,19 +3287,39 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
 bool CWallet::SetAddressBookName(const CTxDestination& address, const string& strName)
 {
     std::map<CTxDestination, std::string>::iterator mi = mapAddressBook.find(address);
+
+    // Unlabelled addresses count as the "" account, so only a change of name
+    // moves transactions between accounts
+    if (strName != (mi == mapAddressBook.end() ? "" : mi->second))
+    {
+        LOCK(cs_wallet);
+        InvalidateAccountOrdered();
+    }
     mapAddressBook[address] = strName;
     NotifyAddressBookChanged(this, address, strName, ::IsMine(*this, address), (mi == mapAddressBook.end()) ? CT_NEW : CT_UPDATED);
     if (!fFileBacked)
         return false;
+    LOCK(cs_wallet);
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteName(CBitcoinAddress(address).ToString(), strName);
     return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
 }
 
 bool CWallet::DelAddressBookName(const CTxDestination& address)
 {
+    std::map<CTxDestination, std::string>::iterator mi = mapAddressBook.find(address);
+    if (mi != mapAddressBook.end() && !mi->second.empty())
+    {
+        LOCK(cs_wallet);
+        InvalidateAccountOrdered();
+    }
     mapAddressBook.erase(address);
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address), CT_DELETED);
     if (!fFileBacked)
         return false;
+    LOCK(cs_wallet);
+    if (pwalletdbBatch)
+        return pwalletdbBatch->EraseName(CBitcoinAddress(address).ToString());
     return CWalletDB(strWalletFile).EraseName(CBitcoinAddress(address).ToString());
 }
 
@@ -2829,7 +3361,8 @@ bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
 {
     if (fFileBacked)
     {
-        if (!CWalletDB(strWalletFile).WriteDefaultKey(vchPubKey))
+        LOCK(cs_wallet);
+        if (pwalletdbBatch ? !pwalletdbBatch->WriteDefaultKey(vchPubKey) : !CWalletDB(strWalletFile).WriteDefaultKey(vchPubKey))
             return false;
     }
     vchDefaultKey = vchPubKey;
@@ -2852,36 +3385,118 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
-        BOOST_FOREACH(int64_t nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
+        {
+            CWalletBatch batch(this);
+            BOOST_FOREACH(int64_t nIndex, setKeyPool)
+                KeepKey(nIndex);
+            if (!batch.Commit())
+                return false;
+        }
         setKeyPool.clear();
 
-        if (IsLocked())
+        if (IsLocked() && !IsHDEnabled())
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        FillKeyPool(nKeys);
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
 }
 
+static void GenerateKeyRange(vector<CKey>* pvKey, bool fCompressed, size_t nBegin, size_t nEnd)
+{
+    try
+    {
+        for (size_t i = nBegin; i < nEnd; i++)
+            (*pvKey)[i].MakeNewKey(fCompressed);
+    }
+    catch (std::exception& e)
+    {
+        // Leaves the rest of the range null, which the caller checks for
+        LogPrintf("GenerateKeyRange() : %s\n", e.what());
+    }
+}
+
+// Key generation dominates the cost of filling a large keypool, so spread it
+// over the cores
+static void GenerateKeys(vector<CKey>& vKey, bool fCompressed)
+{
+    ParallelForRange(vKey.size(), 100, boost::bind(&GenerateKeyRange, &vKey, fCompressed, _1, _2));
+
+    BOOST_FOREACH(const CKey& key, vKey)
+        if (key.IsNull())
+            throw runtime_error("GenerateKeys() : key generation failed");
+}
+
+// Add nKeys new keys to the end of the keypool. Keys are generated in
+// parallel, then each chunk of KEYPOOL_BATCH_SIZE keys is written with its
+// pool entries as one database transaction. A chunk that fails to commit
+// throws without touching the keystore or the pool.
+void CWallet::FillKeyPool(unsigned int nKeys)
+{
+    AssertLockHeld(cs_wallet);
+
+    if (IsHDEnabled())
+    {
+        // Deriving the public keys is all it takes; only the counter is written
+        CHDChain chain = hdChain;
+        uint32_t nBegin = chain.nExternalChainCounter;
+        chain.nExternalChainCounter += nKeys;
+        if (!DeriveHDPubKeys(chain.nExternalChainCounter) || !WriteHDChain(chain))
+            throw runtime_error("FillKeyPool() : deriving keys failed");
+        hdChain = chain;
+        for (uint32_t i = nBegin; i < chain.nExternalChainCounter; i++)
+            setKeyPool.insert(i);
+        LogPrintf("keypool derived keys %u to %u, size=%u\n", nBegin, chain.nExternalChainCounter - 1, setKeyPool.size());
+        return;
+    }
+
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+    RandAddSeedPerfmon();
+
+    while (nKeys > 0)
+    {
+        vector<CKey> vKey(min(nKeys, KEYPOOL_BATCH_SIZE));
+        GenerateKeys(vKey, fCompressed);
+
+        int64_t nBegin = setKeyPool.empty() ? 1 : *setKeyPool.rbegin() + 1;
+        CKeyMetadata meta(GetTime());
+        vector<vector<unsigned char> > vCryptedSecret(vKey.size());
+        {
+            CWalletBatch batch(this);
+            for (unsigned int i = 0; i < vKey.size(); i++)
+            {
+                CKeyPool keypool(vKey[i].GetPubKey());
+                if (!WriteNewKey(vKey[i], meta, vCryptedSecret[i]) ||
+                    (pwalletdbBatch ? !pwalletdbBatch->WritePool(nBegin + i, keypool) : !CWalletDB(strWalletFile).WritePool(nBegin + i, keypool)))
+                    throw runtime_error("FillKeyPool() : writing generated key failed");
+            }
+            if (!batch.Commit())
+                throw runtime_error("FillKeyPool() : committing generated keys failed");
+        }
+
+        // Only keys that reached the disk go into the keystore and the pool
+        for (unsigned int i = 0; i < vKey.size(); i++)
+        {
+            LoadNewKey(vKey[i], meta, vCryptedSecret[i]);
+            setKeyPool.insert(nBegin + i);
+        }
+        nKeys -= vKey.size();
+        LogPrintf("keypool added keys %d to %d, size=%u\n", nBegin, nBegin + vKey.size() - 1, setKeyPool.size());
+    }
+}
+
 bool CWallet::TopUpKeyPool(unsigned int nSize)
 {
     {
         LOCK(cs_wallet);
 
-        if (IsLocked())
+        if (IsLocked() && !IsHDEnabled())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
-
         // Top up key pool
         unsigned int nTargetSize;
         if (nSize > 0)
@@ -2889,16 +3504,8 @@ bool CWallet::TopUpKeyPool(unsigned int nSize)
         else
             nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
-        {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
-        }
+        if (setKeyPool.size() < (nTargetSize + 1))
+            FillKeyPool(nTargetSize + 1 - setKeyPool.size());
     }
     return true;
 }
@@ -2910,18 +3517,21 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
+        if (!IsLocked() || IsHDEnabled())
             TopUpKeyPool();
 
         // Get the oldest key
         if(setKeyPool.empty())
             return;
 
-        CWalletDB walletdb(strWalletFile);
-
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
-        if (!walletdb.ReadPool(nIndex, keypool))
+        if (IsHDEnabled())
+        {
+            LOCK(cs_KeyStore);
+            keypool = CKeyPool(vHDPubKeys[nIndex]);
+        }
+        else if (pwalletdbBatch ? !pwalletdbBatch->ReadPool(nIndex, keypool) : !CWalletDB(strWalletFile).ReadPool(nIndex, keypool))
             throw runtime_error("ReserveKeyFromKeyPool() : read failed");
         if (!HaveKey(keypool.vchPubKey.GetID()))
             throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
@@ -2935,10 +3545,9 @@ int64_t CWallet::AddReserveKey(const CKeyPool& keypool)
 {
     {
         LOCK2(cs_main, cs_wallet);
-        CWalletDB walletdb(strWalletFile);
 
         int64_t nIndex = 1 + *(--setKeyPool.end());
-        if (!walletdb.WritePool(nIndex, keypool))
+        if (pwalletdbBatch ? !pwalletdbBatch->WritePool(nIndex, keypool) : !CWalletDB(strWalletFile).WritePool(nIndex, keypool))
             throw runtime_error("AddReserveKey() : writing added key failed");
         setKeyPool.insert(nIndex);
         return nIndex;
@@ -2948,11 +3557,14 @@ int64_t CWallet::AddReserveKey(const CKeyPool& keypool)
 
 void CWallet::KeepKey(int64_t nIndex)
 {
-    // Remove from key pool
-    if (fFileBacked)
+    // Remove from key pool; an HD pool has nothing on disk
+    if (fFileBacked && !IsHDEnabled())
     {
-        CWalletDB walletdb(strWalletFile);
-        walletdb.ErasePool(nIndex);
+        LOCK(cs_wallet);
+        if (pwalletdbBatch)
+            pwalletdbBatch->ErasePool(nIndex);
+        else
+            CWalletDB(strWalletFile).ErasePool(nIndex);
     }
     if(fDebug)
         LogPrintf("keypool keep %d\n", nIndex);
@@ -3236,6 +3848,44 @@ void CReserveKey::ReturnKey()
     vchPubKey = CPubKey();
 }
 
+CWalletBatch::CWalletBatch(CWallet* pwalletIn) :
+    pwallet(pwalletIn), lock(pwalletIn->cs_wallet, "pwallet->cs_wallet", __FILE__, __LINE__), fOwner(false)
+{
+    if (!pwallet->fFileBacked || pwallet->pwalletdbBatch)
+        return;
+
+    CWalletDB* pwalletdb = new CWalletDB(pwallet->strWalletFile);
+    if (!pwalletdb->TxnBegin())
+    {
+        // Writes go through their own handles as before
+        LogPrintf("CWalletBatch() : TxnBegin failed\n");
+        delete pwalletdb;
+        return;
+    }
+    pwallet->pwalletdbBatch = pwalletdb;
+    fOwner = true;
+}
+
+CWalletBatch::~CWalletBatch()
+{
+    if (!fOwner)
+        return;
+    pwallet->pwalletdbBatch->TxnAbort();
+    delete pwallet->pwalletdbBatch;
+    pwallet->pwalletdbBatch = NULL;
+}
+
+bool CWalletBatch::Commit()
+{
+    if (!fOwner)
+        return true;
+    bool fRet = pwallet->pwalletdbBatch->TxnCommit();
+    delete pwallet->pwalletdbBatch;
+    pwallet->pwalletdbBatch = NULL;
+    fOwner = false;
+    return fRet;
+}
+
 void CWallet::GetAllReserveKeys(set<CKeyID>& setAddress) const
 {
     setAddress.clear();
@@ -3246,7 +3896,12 @@ void CWallet::GetAllReserveKeys(set<CKeyID>& setAddress) const
     BOOST_FOREACH(const int64_t& id, setKeyPool)
     {
         CKeyPool keypool;
-        if (!walletdb.ReadPool(id, keypool))
+        if (IsHDEnabled())
+        {
+            LOCK(cs_KeyStore);
+            keypool = CKeyPool(vHDPubKeys[id]);
+        }
+        else if (!walletdb.ReadPool(id, keypool))
             throw runtime_error("GetAllReserveKeyHashes() : read failed");
         assert(keypool.vchPubKey.IsValid());
         CKeyID keyID = keypool.vchPubKey.GetID();
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_WALLET_H
 #define BITCOIN_WALLET_H
 
+#include <list>
 #include <string>
 #include <vector>
 
@@ -23,6 +24,10 @@
 
 extern bool fWalletUnlockStakingOnly;
 extern bool fConfChange;
+
+//! Keys generated and written to the keypool per database transaction
+static const unsigned int KEYPOOL_BATCH_SIZE = 1000;
+
 class CAccountingEntry;
 class CWalletTx;
 class CReserveKey;
@@ -36,6 +41,7 @@ enum WalletFeature
 
     FEATURE_WALLETCRYPT = 40000, // wallet encryption
     FEATURE_COMPRPUBKEY = 60000, // compressed public keys
+    FEATURE_HD = 2000500, // hierarchical deterministic key derivation (BIP32)
 
     FEATURE_LATEST = 60000
 };
@@ -106,6 +112,10 @@ private:
 public:
     mutable CCriticalSection cs_wallet;
 
+    // The open CWalletBatch, if any; wallet writes go through it while set.
+    // Only valid to the thread holding cs_wallet.
+    CWalletDB *pwalletdbBatch;
+
     bool SelectCoinsDark(int64_t nValueMin, int64_t nValueMax, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax) const;
     bool SelectCoinsByDenominations(int nDenom, int64_t nValueMin, int64_t nValueMax, std::vector<CTxIn>& setCoinsRet, vector<COutput>& vCoins, int64_t& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax);
     bool SelectCoinsDarkDenominated(int64_t nTargetValue, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet) const;
@@ -125,6 +135,10 @@ public:
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
 
+    // Null unless keys are derived from an HD seed; the keypool then holds
+    // child numbers and exists only in memory
+    CHDChain hdChain;
+
 
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
@@ -152,12 +166,21 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fAccountOrderedValid = false;
     }
 
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::multimap<int64_t, TxPair > TxItems;
+
     std::map<uint256, CWalletTx> mapWallet;
+    // Accounting entries, read from the database once at load
+    std::list<CAccountingEntry> laccentries;
+    // mapWallet and laccentries by nOrderPos, kept up to date as they grow
+    TxItems wtxOrdered;
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -206,6 +229,23 @@ public:
     bool AddCScript(const CScript& redeemScript);
     bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
 
+    // HD keys are not stored; their public keys are derived at load and the
+    // private keys on demand
+    bool HaveKey(const CKeyID &address) const;
+    bool GetKey(const CKeyID &address, CKey& keyOut) const;
+    bool GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const;
+    void GetKeys(std::set<CKeyID> &setAddress) const;
+
+    bool IsHDEnabled() const { return !hdChain.IsNull(); }
+    // Derive keys from now on from the given wallet key (m/0'/i)
+    bool SetHDMasterKey(const CPubKey& pubkey);
+
+    // Also forgets the HD account key derived since unlocking
+    bool Lock();
+
+    // Decrypt the keys holding stakeable outputs into the key cache
+    void CacheStakingKeys();
+
     bool Unlock(const SecureString& strWalletPassphrase, bool anonimizeOnly = false);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
     bool EncryptWallet(const SecureString& strWalletPassphrase);
@@ -218,14 +258,23 @@ public:
      */
     int64_t IncOrderPosNext(CWalletDB *pwalletdb = NULL);
 
-    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef std::multimap<int64_t, TxPair > TxItems;
-
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+    /** Get the wallet's activity log, oldest first
+        @param[in] strAccount  "*" for everything, or an account name for only the
+                               entries that can concern that account
+        @return ordered transactions and accounting entries
+        @note cs_wallet must be held for as long as the result is used
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    const TxItems& GetOrderedTxItems(const std::string& strAccount = "*");
+
+    /** Rebuild wtxOrdered from mapWallet and laccentries, after loading */
+    void BuildOrderIndex();
+
+    /** Write a new accounting entry and add it to the activity log */
+    bool AddAccountingEntry(const CAccountingEntry& acentry);
+    /** The two halves of AddAccountingEntry, for a CWalletBatch: write the
+        entry, and only once the batch commits, load it into memory */
+    bool WriteAccountingEntry(const CAccountingEntry& acentry);
+    void LoadAccountingEntry(const CAccountingEntry& acentry);
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn);
@@ -416,6 +465,58 @@ public:
 
     /** Show progress e.g. for rescan */
     boost::signals2::signal<void (const std::string &title, int nProgress)> ShowProgress;
+
+private:
+    // wtxOrdered split up by account, built on the first query for an account
+    // and dropped when a change to the address book moves entries between them
+    std::map<std::string, TxItems> mapAccountOrdered;
+    bool fAccountOrderedValid;
+
+    void AddToOrderIndex(const TxItems::value_type& item);
+    void EraseFromOrderIndex(const CWalletTx* pwtx);
+    void GetOrderedItemAccounts(const TxPair& item, std::set<std::string>& setAccounts) const;
+    void InvalidateAccountOrdered();
+
+    CPubKey AddGeneratedKey(const CKey& key);
+    bool WriteNewKey(const CKey& key, const CKeyMetadata& meta, std::vector<unsigned char>& vchCryptedSecret);
+    void LoadNewKey(const CKey& key, const CKeyMetadata& meta, const std::vector<unsigned char>& vchCryptedSecret);
+    void FillKeyPool(unsigned int nKeys);
+
+    // Public keys of the HD children derived so far, by child number, and
+    // the account key private children are derived from once unlocked.
+    // Guarded by cs_KeyStore.
+    std::vector<CPubKey> vHDPubKeys;
+    std::map<CKeyID, uint32_t> mapHDKeyIndex;
+    mutable CExtKey extKeyHDAccount;
+
+    bool DeriveHDPubKeys(uint32_t nEnd);
+    bool DeriveHDKey(uint32_t nChild, CSecret& vchSecret) const;
+    bool WriteHDChain(const CHDChain& chain);
+    void MarkHDKeysUsed(const CTransaction& tx);
+    void UpdateHDFirstUnused(const CTxDestination& dest, uint32_t& nFirstUnused) const;
+    void LoadHDKeyPool();
+    bool NewHDMasterKey();
+};
+
+/** Makes the wallet database writes done while it is in scope one
+ * transaction, so they reach the disk together and the database is
+ * checkpointed once rather than after every write. The batch holds cs_wallet
+ * for its whole life; a batch opened inside another joins the outer one.
+ * Writes are discarded unless Commit() is called. Callers change the wallet
+ * in memory only once Commit() succeeds, or treat its failure as fatal.
+ */
+class CWalletBatch
+{
+private:
+    CWallet* pwallet;
+    CCriticalBlock lock;
+    bool fOwner;
+
+public:
+    explicit CWalletBatch(CWallet* pwalletIn);
+    ~CWalletBatch();
+
+    bool Commit();
 };
 
 /** A key allocated from the key pool. */
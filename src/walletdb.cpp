@@ -436,6 +436,10 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         {
             ssValue >> pwallet->nOrderPosNext;
         }
+        else if (strType == "hdchain")
+        {
+            ssValue >> pwallet->hdChain;
+        }
         else if (strType == "adrenaline")
     {
         std::string sAlias;
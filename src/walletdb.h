@@ -55,6 +55,49 @@ public:
     }
 };
 
+/** The chain an HD wallet derives its keys from. The master key is an
+ * ordinary wallet key, encrypted along with the others; the extended public
+ * key of the external chain (m/0') lets addresses be derived while the
+ * wallet is locked. Every child below nExternalChainCounter may have been
+ * handed out.
+ */
+class CHDChain
+{
+public:
+    static const int CURRENT_VERSION=1;
+    int nVersion;
+    CKeyID masterKeyID;
+    CExtPubKey extPubKey;
+    uint32_t nExternalChainCounter;
+
+    CHDChain()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(masterKeyID);
+        READWRITE(extPubKey);
+        READWRITE(nExternalChainCounter);
+    )
+
+    void SetNull()
+    {
+        nVersion = CHDChain::CURRENT_VERSION;
+        masterKeyID = CKeyID();
+        extPubKey = CExtPubKey();
+        nExternalChainCounter = 0;
+    }
+
+    bool IsNull() const
+    {
+        return masterKeyID == 0;
+    }
+};
+
 class CAdrenalineNodeConfig
 {
 public:
@@ -196,6 +239,12 @@ public:
         return Write(std::string("minversion"), nVersion);
     }
 
+    bool WriteHDChain(const CHDChain& chain)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("hdchain"), chain);
+    }
+
     bool ReadAccount(const std::string& strAccount, CAccount& account);
     bool WriteAccount(const std::string& strAccount, const CAccount& account);
 private: